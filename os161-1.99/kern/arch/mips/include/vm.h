@@ -101,7 +101,6 @@
 void ram_bootstrap(void);
 paddr_t ram_stealmem(unsigned long npages);
 void ram_getsize(paddr_t *lo, paddr_t *hi);
-paddr_t coremap_stealmem(unsigned long npages);
 /*
  * TLB shootdown bits.
  *
@@ -118,4 +117,25 @@ struct tlbshootdown {
 
 #define TLBSHOOTDOWN_MAX 16
 
+/*
+ * Per-CPU TLB state, kept in struct cpu and only touched by that CPU.
+ *
+ * ASIDs are handed out from a global pool; when it runs dry a new
+ * generation starts, and each CPU flushes its TLB the first time it
+ * activates an address space from the new generation.
+ *
+ * The kernel is the only thing that writes the TLB, so it keeps a
+ * shadow of which slots are free: a stack of invalid slot numbers.
+ * When there are none, slots are replaced round-robin.
+ */
+#include <mips/tlb.h>	/* for NUM_TLB */
+
+struct cpu_tlb {
+	uint32_t ct_asid;	/* ASID currently in c0_entryhi */
+	uint32_t ct_asidgen;	/* ASID generation of the TLB contents */
+	uint8_t ct_free[NUM_TLB];	/* invalid slots */
+	unsigned ct_nfree;	/* number of entries in ct_free */
+	unsigned ct_victim;	/* next slot to replace */
+};
+
 #endif /* _MIPS_VM_H_ */
@@ -38,6 +38,7 @@
 #include "opt-A2.h"
 #include <addrspace.h>
 #include <proc.h>
+#include <copyinout.h>
 
 /*
  * System call dispatcher.
@@ -83,6 +84,11 @@ syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	int err;
+#if OPT_A2
+	off_t retval64;
+	bool retval64set = false;
+	int whence;
+#endif
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -139,6 +145,40 @@ syscall(struct trapframe *tf)
 	case SYS_execv:
 		err = sys_execv((char*)tf->tf_a0, (char**)tf->tf_a1);
 		break;
+
+	case SYS_open:
+	  err = sys_open((userptr_t)tf->tf_a0,
+			 (int)tf->tf_a1,
+			 (mode_t)tf->tf_a2,
+			 (int *)&retval);
+	  break;
+	case SYS_read:
+	  err = sys_read((int)tf->tf_a0,
+			 (userptr_t)tf->tf_a1,
+			 (unsigned int)tf->tf_a2,
+			 (int *)&retval);
+	  break;
+	case SYS_lseek:
+	  /* the 64-bit position is in a2/a3; whence is on the stack */
+	  err = copyin((const_userptr_t)(tf->tf_sp + 16),
+		       &whence, sizeof(int));
+	  if (err) {
+	    break;
+	  }
+	  err = sys_lseek((int)tf->tf_a0,
+			  ((off_t)tf->tf_a2 << 32) | (uint32_t)tf->tf_a3,
+			  whence,
+			  &retval64);
+	  retval64set = true;
+	  break;
+	case SYS_close:
+	  err = sys_close((int)tf->tf_a0);
+	  break;
+	case SYS_dup2:
+	  err = sys_dup2((int)tf->tf_a0,
+			 (int)tf->tf_a1,
+			 (int *)&retval);
+	  break;
 	#endif
 #endif // UW
 
@@ -160,6 +200,14 @@ syscall(struct trapframe *tf)
 		tf->tf_v0 = err;
 		tf->tf_a3 = 1;      /* signal an error */
 	}
+#if OPT_A2
+	else if (retval64set) {
+		/* Success; 64-bit values go in v0 (high) and v1 (low). */
+		tf->tf_v0 = (uint32_t)(retval64 >> 32);
+		tf->tf_v1 = (uint32_t)retval64;
+		tf->tf_a3 = 0;      /* signal no error */
+	}
+#endif
 	else {
 		/* Success. */
 		tf->tf_v0 = retval;
@@ -68,9 +68,19 @@ void
 cpu_machdep_init(struct cpu *c)
 {
 	vaddr_t stackpointer;
+	unsigned i;
 
 	KASSERT(c->c_number < MAXCPUS);
 
+	c->c_tlb.ct_asid = 0;
+	c->c_tlb.ct_asidgen = 0;
+	/* tlb_reset leaves every slot invalid */
+	for (i=0; i<NUM_TLB; i++) {
+		c->c_tlb.ct_free[i] = NUM_TLB - 1 - i;
+	}
+	c->c_tlb.ct_nfree = NUM_TLB;
+	c->c_tlb.ct_victim = 0;
+
 	if (c->c_curthread->t_stack == NULL) {
 		/* boot cpu; don't need to do anything here */
 	}
@@ -32,11 +32,20 @@
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
+#include <cpu.h>
 #include <proc.h>
 #include <current.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <uio.h>
+#include <vnode.h>
+#include <uw-vmstats.h>
 #include <copyinout.h>
 #include "opt-A2.h"
 #include "opt-A3.h"
@@ -44,60 +53,281 @@
 /*
  * Dumb MIPS-only "VM system" that is intended to only be just barely
  * enough to struggle off the ground.
+ *
+ * Pages are now allocated on demand: each address space has a page
+ * table, and a page is zero-filled or read from the executable the
+ * first time it is touched.
+ *
+ * Fork shares frames copy-on-write: as_copy just takes another
+ * reference to each frame, and any mapping of a frame with more than
+ * one reference is entered into the TLB read-only. Writing to it then
+ * raises VM_FAULT_READONLY, and vm_fault gives the writer its own copy.
+ *
+ * When memory runs out, user pages are paged out to swap (see swap.c),
+ * victims being picked by a clock sweep over the coremap. Each
+ * address space has a sleep lock covering its page table; pageout
+ * only ever trylocks a victim's address space, since the thread
+ * doing the pageout usually already holds its own.
+ *
+ * TLB entries are tagged with a per-address-space ASID, so switching
+ * between processes doesn't flush the TLB. ASIDs come from a global
+ * pool; when it runs out a new generation starts, and each CPU
+ * flushes once when it first activates an address space of the new
+ * generation. An address space whose mappings might be stale on some
+ * CPU (after fork) simply gets a fresh ASID.
+ *
+ * Each CPU also tracks which of its TLB slots are free (see struct
+ * cpu_tlb), so a TLB miss never has to scan the TLB: it takes a free
+ * slot if there is one and otherwise replaces slots round-robin.
  */
 
-/* under dumbvm, always have 48k of user stack */
-#define DUMBVM_STACKPAGES    12
+/*
+ * Size of the stack region. It is filled in on demand like everything
+ * else, so this costs nothing until it's used.
+ */
+#define DUMBVM_STACKPAGES    1024
 
 /*
- * Wrap rma_stealmem in a spinlock.
+ * Wrap ram_stealmem in a spinlock.
  */
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
-// A3
-static struct spinlock free_lock = SPINLOCK_INITIALIZER;
-paddr_t coremap_start;
-paddr_t ram_end;
-paddr_t ram_begin;
-unsigned int coremap_size;
-bool is_vm_booted = false;
-//
+
+/* Serializes pageouts. */
+static struct lock *vm_evict_lock;
+
+/* Other CPUs V this once they have done a shootdown for us. */
+static struct semaphore *vm_shootdown_sem;
+
+/* How many victims to try before giving up on a pageout */
+#define VM_EVICT_TRIES  64
+
+/*
+ * ASID allocation. ASID 0 is never handed out, so a CPU that has
+ * only run kernel threads has nothing matching in its TLB.
+ */
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static uint32_t asid_generation = 1;
+static uint32_t asid_next = 1;
 
 void
 vm_bootstrap(void)
 {
-	ram_getsize(&coremap_start, &ram_end);
-	coremap_size = (ram_end - coremap_start) / PAGE_SIZE;
-	for (unsigned int i = 0; i < coremap_size; i++){
-		((int *) PADDR_TO_KVADDR(coremap_start))[i] = 0;
-	}
-	unsigned int offset = (coremap_size * 4 / PAGE_SIZE ) + 1;
-	//kprintf("ram offset is %d", offset);
-	ram_begin = coremap_start + PAGE_SIZE * offset;
-	is_vm_booted = true;
+	coremap_bootstrap();
+	vmstats_init();
+
+	vm_evict_lock = lock_create("vm_evict");
+	vm_shootdown_sem = sem_create("vm_shootdown", 0);
+	if (vm_evict_lock == NULL || vm_shootdown_sem == NULL) {
+		panic("vm_bootstrap: out of memory\n");
+	}
+
+	swap_bootstrap();
 }
 
+/*
+ * Note that TLB slot I on this CPU has just been invalidated.
+ */
+static
+void
+vm_tlbfree(int i)
+{
+	struct cpu_tlb *ct = &curcpu->c_tlb;
+
+	KASSERT(ct->ct_nfree < NUM_TLB);
+	ct->ct_free[ct->ct_nfree++] = i;
+}
+
+/*
+ * Choose a TLB slot on this CPU for a new entry. If MISS, count
+ * whether it was free or had to be replaced. Call at splhigh.
+ */
+static
+int
+vm_tlbslot(bool miss)
+{
+	struct cpu_tlb *ct = &curcpu->c_tlb;
+	int i;
 
-paddr_t coremap_stealmem(unsigned long npages){
-	unsigned int valid_size = coremap_size - (unsigned int)npages + 1;
-	for (unsigned int i = 0; i < valid_size; i++){
-		int begin_offset = i;
-		int is_used = ((int*) PADDR_TO_KVADDR(coremap_start))[i];
-		if (is_used) continue;
-		unsigned long curr_page = 1;
-		while(!is_used && curr_page < npages){
-			if (i + curr_page >= coremap_size) return 0;
-			is_used = ((int*) PADDR_TO_KVADDR(coremap_start))[i + curr_page];
-			if (is_used) continue;
-			curr_page++;
+	if (ct->ct_nfree > 0) {
+		if (miss) {
+			vmstats_inc(VMSTAT_TLB_FAULT_FREE);
 		}
-		for (int j = 1; j <= (int)npages;j++){
-			((int*) PADDR_TO_KVADDR(coremap_start))[i] = j;
-			i++;
+		return ct->ct_free[--ct->ct_nfree];
+	}
+
+	if (miss) {
+		vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+	}
+	i = ct->ct_victim;
+	ct->ct_victim = (i + 1) % NUM_TLB;
+	return i;
+}
+
+/*
+ * Invalidate this CPU's TLB entry for VADDR under ASID, if there is one.
+ */
+static
+void
+vm_tlbinvalidate(vaddr_t vaddr, uint32_t asid)
+{
+	int i, spl;
+
+	spl = splhigh();
+	i = tlb_probe((vaddr & PAGE_FRAME) | (asid << TLBHI_PIDSHIFT), 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		vm_tlbfree(i);
+	}
+	tlb_setasid(curcpu->c_tlb.ct_asid);
+	splx(spl);
+}
+
+/*
+ * Throw away everything in this CPU's TLB.
+ */
+static
+void
+vm_tlbflush(void)
+{
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		curcpu->c_tlb.ct_free[i] = NUM_TLB - 1 - i;
+	}
+	curcpu->c_tlb.ct_nfree = NUM_TLB;
+	tlb_setasid(curcpu->c_tlb.ct_asid);
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+
+	splx(spl);
+}
+
+/*
+ * Remove any mapping of VADDR in AS from every CPU's TLB, and wait
+ * until that has happened. Pageouts are serialized, so each other
+ * CPU has at most one of these outstanding at a time.
+ */
+static
+void
+vm_tlbshootdown_page(struct addrspace *as, vaddr_t vaddr)
+{
+	struct tlbshootdown ts;
+	unsigned n;
+
+	KASSERT(lock_do_i_hold(vm_evict_lock));
+
+	vm_tlbinvalidate(vaddr, as->as_asid);
+
+	ts.ts_addrspace = as;
+	ts.ts_vaddr = vaddr;
+	n = ipi_tlbshootdown_broadcast(&ts);
+	while (n-- > 0) {
+		P(vm_shootdown_sem);
+	}
+}
+
+void
+vm_tlbshootdown_all(void)
+{
+	vm_tlbflush();
+	V(vm_shootdown_sem);
+}
+
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
+{
+	vm_tlbinvalidate(ts->ts_vaddr, ts->ts_addrspace->as_asid);
+	V(vm_shootdown_sem);
+}
+
+/*
+ * True if the current thread may page something out to make room:
+ * there must be swap, and we must be able to sleep. Holding a
+ * spinlock raises the IPL without changing t_curspl, so look at
+ * t_iplhigh_count, which counts both.
+ */
+static
+bool
+vm_can_evict(void)
+{
+	return swap_enabled() &&
+		vm_evict_lock != NULL &&
+		!curthread->t_in_interrupt &&
+		curthread->t_iplhigh_count == 0 &&
+		!lock_do_i_hold(vm_evict_lock);
+}
+
+/*
+ * Page out one user page. Returns 0 if a frame was freed.
+ */
+static
+int
+vm_evict(void)
+{
+	struct addrspace *vas;
+	vaddr_t vva;
+	paddr_t paddr;
+	pte_t *pte;
+	unsigned tries, slot;
+	bool locked;
+	int result;
+
+	lock_acquire(vm_evict_lock);
+
+	for (tries = 0; tries < VM_EVICT_TRIES; tries++) {
+		paddr = coremap_victim(&vas, &vva);
+		if (paddr == 0) {
+			break;
 		}
-		paddr_t addr = ram_begin + PAGE_SIZE * begin_offset;
-		return addr;
+
+		/*
+		 * The frame is busy, so its owner can't free it and
+		 * go away until we're done with it.
+		 */
+		if (lock_do_i_hold(vas->as_lock)) {
+			locked = false;
+		}
+		else if (lock_tryacquire(vas->as_lock)) {
+			locked = true;
+		}
+		else {
+			coremap_unbusy(paddr);
+			continue;
+		}
+
+		pte = pt_lookup(vas->as_pt, vva, false);
+		KASSERT(pte != NULL);
+		KASSERT((*pte & PTE_PRESENT) && (*pte & PTE_FRAME) == paddr);
+
+		result = swap_alloc(&slot);
+		if (result == 0) {
+			vm_tlbshootdown_page(vas, vva);
+			vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+			result = swap_write(slot, paddr);
+			if (result) {
+				swap_free(slot);
+			}
+		}
+		if (result == 0) {
+			*pte = PTE_MKSWAP(slot);
+		}
+
+		coremap_unbusy(paddr);
+		if (result == 0) {
+			free_kpages(PADDR_TO_KVADDR(paddr));
+		}
+		if (locked) {
+			lock_release(vas->as_lock);
+		}
+		lock_release(vm_evict_lock);
+		return result;
 	}
-	return 0;
+
+	lock_release(vm_evict_lock);
+	return ENOMEM;
 }
 
 static
@@ -105,17 +335,44 @@ paddr_t
 getppages(unsigned long npages)
 {
 	paddr_t addr;
-	
-	spinlock_acquire(&stealmem_lock);
-	if (is_vm_booted){
-		addr = coremap_stealmem(npages);
-	}	else {
-		addr = ram_stealmem(npages);
+
+	if (coremap_ready()) {
+		addr = coremap_alloc(npages);
+		while (addr == 0 && npages == 1 && vm_can_evict()) {
+			if (vm_evict()) {
+				break;
+			}
+			addr = coremap_alloc(1);
+		}
+		return addr;
 	}
+
+	spinlock_acquire(&stealmem_lock);
+	addr = ram_stealmem(npages);
 	spinlock_release(&stealmem_lock);
 	return addr;
 }
 
+/*
+ * Get a frame for the user page at VADDR in AS, paging something
+ * out if necessary. The frame comes back busy; see coremap.h.
+ */
+static
+paddr_t
+vm_getuserpage(struct addrspace *as, vaddr_t vaddr)
+{
+	paddr_t paddr;
+
+	KASSERT(lock_do_i_hold(as->as_lock));
+
+	while ((paddr = coremap_alloc_user(as, vaddr)) == 0) {
+		if (!vm_can_evict() || vm_evict() != 0) {
+			return 0;
+		}
+	}
+	return paddr;
+}
+
 /* Allocate/free some kernel-space virtual pages */
 vaddr_t 
 alloc_kpages(int npages)
@@ -131,43 +388,169 @@ alloc_kpages(int npages)
 void 
 free_kpages(vaddr_t addr)
 {
-	spinlock_acquire(&free_lock);
-	paddr_t paddr = KVADDR_TO_PADDR(addr);
-	unsigned int offset = (paddr - ram_begin) / PAGE_SIZE;
-	KASSERT(((int *) PADDR_TO_KVADDR(coremap_start))[offset] == 1);
-	((int *) PADDR_TO_KVADDR(coremap_start))[offset] = 0;
-	offset++;
-	
-	while(offset < coremap_size && ((int *) PADDR_TO_KVADDR(coremap_start))[offset] > 1){
-		((int *) PADDR_TO_KVADDR(coremap_start))[offset] = 0;
-		offset++;
+	coremap_free(KVADDR_TO_PADDR(addr));
+}
+
+/*
+ * Find the region containing VADDR, or NULL.
+ */
+static
+struct region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+	struct region *rg;
+	unsigned i;
+
+	for (i = 0; i < as->as_nregions; i++) {
+		rg = &as->as_regions[i];
+		if (vaddr >= rg->rg_vbase &&
+		    vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+			return rg;
+		}
 	}
-	spinlock_release(&free_lock);
+	return NULL;
 }
 
-void
-vm_tlbshootdown_all(void)
+/*
+ * Fill in the contents of the page at VADDR in region RG, which has
+ * been given the (fresh) frame PADDR: zeros, plus whatever part of
+ * the executable overlaps the page.
+ */
+static
+int
+as_fill_page(struct addrspace *as, struct region *rg,
+	     vaddr_t vaddr, paddr_t paddr)
 {
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	struct iovec iov;
+	struct uio ku;
+	vaddr_t start, end;
+	int result;
+
+	bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+
+	start = rg->rg_filevaddr;
+	end = rg->rg_filevaddr + rg->rg_filesize;
+	if (start < vaddr) {
+		start = vaddr;
+	}
+	if (end > vaddr + PAGE_SIZE) {
+		end = vaddr + PAGE_SIZE;
+	}
+	if (rg->rg_filesize == 0 || start >= end) {
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+		return 0;
+	}
+
+	KASSERT(as->as_vnode != NULL);
+	vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+	vmstats_inc(VMSTAT_ELF_FILE_READ);
+
+	DEBUG(DB_VM, "dumbvm: reading %u bytes of 0x%x from ELF\n",
+	      end - start, vaddr);
+
+	uio_kinit(&iov, &ku,
+		  (void *)(PADDR_TO_KVADDR(paddr) + (start - vaddr)),
+		  end - start,
+		  rg->rg_fileoffset + (start - rg->rg_filevaddr),
+		  UIO_READ);
+	result = VOP_READ(as->as_vnode, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		kprintf("dumbvm: short read on ELF page - file truncated?\n");
+		return ENOEXEC;
+	}
+	return 0;
 }
 
-void
-vm_tlbshootdown(const struct tlbshootdown *ts)
+/*
+ * Give the page behind PTE (at VADDR in AS) a private copy of its
+ * frame, if it is still shared. Returns the (possibly new) frame.
+ */
+static
+int
+vm_break_cow(struct addrspace *as, vaddr_t vaddr, pte_t *pte, paddr_t *ret)
+{
+	paddr_t oldpaddr, newpaddr;
+
+	oldpaddr = *pte & PTE_FRAME;
+	if (coremap_refcount(oldpaddr) == 1) {
+		/* Other sharers have gone away in the meantime */
+		*ret = oldpaddr;
+		return 0;
+	}
+
+	newpaddr = vm_getuserpage(as, vaddr);
+	if (newpaddr == 0) {
+		return ENOMEM;
+	}
+	memmove((void *)PADDR_TO_KVADDR(newpaddr),
+		(const void *)PADDR_TO_KVADDR(oldpaddr), PAGE_SIZE);
+	*pte = newpaddr | PTE_PRESENT;
+	coremap_unbusy(newpaddr);
+	free_kpages(PADDR_TO_KVADDR(oldpaddr));
+
+	*ret = newpaddr;
+	return 0;
+}
+
+/*
+ * Bring in the page at VADDR, whose PTE shows it isn't resident:
+ * from swap, from the executable, or as zeros.
+ */
+static
+int
+vm_pagein(struct addrspace *as, struct region *rg, vaddr_t vaddr,
+	  pte_t *pte, paddr_t *ret)
 {
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	paddr_t paddr;
+	unsigned slot;
+	int result;
+
+	paddr = vm_getuserpage(as, vaddr);
+	if (paddr == 0) {
+		return ENOMEM;
+	}
+
+	if (*pte & PTE_SWAPPED) {
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		vmstats_inc(VMSTAT_SWAP_FILE_READ);
+		slot = PTE_SLOT(*pte);
+		result = swap_read(slot, paddr);
+		if (result == 0) {
+			swap_free(slot);
+		}
+	}
+	else {
+		result = as_fill_page(as, rg, vaddr, paddr);
+	}
+
+	if (result) {
+		coremap_unbusy(paddr);
+		free_kpages(PADDR_TO_KVADDR(paddr));
+		return result;
+	}
+
+	*pte = paddr | PTE_PRESENT;
+	coremap_unbusy(paddr);
+	*ret = paddr;
+	return 0;
 }
 
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
+	struct region *rg;
+	pte_t *pte;
 	paddr_t paddr;
 	int i;
 	uint32_t ehi, elo;
 	struct addrspace *as;
 	int spl;
-	bool is_text = false;
+	int result;
+	bool writeable;
+	bool miss = false;
 
 	faultaddress &= PAGE_FRAME;
 
@@ -175,8 +558,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-		/* We always create pages read-write, so we can't get this */
-			return EFAULT;
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -203,72 +584,98 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	}
 
 	/* Assert that the address space has been set up properly. */
-	KASSERT(as->as_vbase1 != 0);
-	KASSERT(as->as_pbase1 != 0);
-	KASSERT(as->as_npages1 != 0);
-	KASSERT(as->as_vbase2 != 0);
-	KASSERT(as->as_pbase2 != 0);
-	KASSERT(as->as_npages2 != 0);
-	KASSERT(as->as_stackpbase != 0);
-	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
-	KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
-	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
-	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
-	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
-
-	vbase1 = as->as_vbase1;
-	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
-	vbase2 = as->as_vbase2;
-	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
-	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
-	stacktop = USERSTACK;
-
-	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		is_text = true;
-		paddr = (faultaddress - vbase1) + as->as_pbase1;
-	}
-	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-		paddr = (faultaddress - vbase2) + as->as_pbase2;
-	}
-	else if (faultaddress >= stackbase && faultaddress < stacktop) {
-		paddr = (faultaddress - stackbase) + as->as_stackpbase;
+	KASSERT(as->as_pt != NULL);
+
+	rg = as_find_region(as, faultaddress);
+	if (rg == NULL) {
+		return EFAULT;
 	}
-	else {
+	writeable = rg->rg_writeable || !as->as_loaded;
+
+	/*
+	 * A READONLY fault is a write to a page mapped read-only.
+	 * Either the region really is read-only, or the frame is
+	 * shared copy-on-write. It isn't a TLB miss, so it doesn't
+	 * count as a TLB fault.
+	 */
+	if (faulttype == VM_FAULT_READONLY && !writeable) {
 		return EFAULT;
 	}
 
+	lock_acquire(as->as_lock);
+
+	pte = pt_lookup(as->as_pt, faultaddress, true);
+	if (pte == NULL) {
+		result = ENOMEM;
+		goto out;
+	}
+
+	if (*pte & PTE_PRESENT) {
+		if (faulttype != VM_FAULT_READONLY) {
+			vmstats_inc(VMSTAT_TLB_FAULT);
+			miss = true;
+			vmstats_inc(VMSTAT_TLB_RELOAD);
+		}
+		if (faulttype != VM_FAULT_READ && writeable) {
+			/* On a write miss, don't wait for the READONLY fault */
+			result = vm_break_cow(as, faultaddress, pte, &paddr);
+			if (result) {
+				goto out;
+			}
+		}
+		else {
+			paddr = *pte & PTE_FRAME;
+		}
+	}
+	else {
+		/* (A READONLY fault ends up here if we lost a race with pageout) */
+		vmstats_inc(VMSTAT_TLB_FAULT);
+		miss = true;
+		result = vm_pagein(as, rg, faultaddress, pte, &paddr);
+		if (result) {
+			goto out;
+		}
+	}
+
 	/* make sure it's page-aligned */
 	KASSERT((paddr & PAGE_FRAME) == paddr);
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
+	ehi = faultaddress | (as->as_asid << TLBHI_PIDSHIFT);
+	elo = paddr | TLBLO_VALID;
+	if (coremap_touch(paddr, as, faultaddress) == 1 && writeable) {
+		elo |= TLBLO_DIRTY;
+	}
+
+	/*
+	 * Load the TLB before letting go of the address space, so
+	 * that pageout can't invalidate the page in between. The
+	 * ehi written last leaves our ASID in c0_entryhi.
+	 *
+	 * Disable interrupts on this CPU while frobbing the TLB.
+	 */
 	spl = splhigh();
+	result = 0;
 
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID) {
-			continue;
-		}
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		if (is_text && as->is_loaded){
-			elo &= ~TLBLO_DIRTY;
-		}			
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		tlb_write(ehi, elo, i);
-		splx(spl);
-		return 0;
-	}
-	#if OPT_A3
-	ehi = faultaddress;
-	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-	if (is_text && as->is_loaded){
-		elo &= ~TLBLO_DIRTY;
+	/*
+	 * Replace the existing entry if there is one: on a READONLY
+	 * fault the read-only one (unless pageout got in first), and
+	 * on a miss one this thread loaded here before it moved to
+	 * another cpu, missed there, and slept its way back. TLB
+	 * entries outlive context switches, and two for the same page
+	 * are fatal.
+	 */
+	i = tlb_probe(ehi, 0);
+	if (i < 0) {
+		i = vm_tlbslot(miss);
 	}
-	DEBUG(DB_VM, "tlb full, dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-	tlb_random(ehi, elo);
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x in slot %d\n",
+	      faultaddress, paddr, i);
+	tlb_write(ehi, elo, i);
 	splx(spl);
-	return 0;
-	#endif
+
+ out:
+	lock_release(as->as_lock);
+	return result;
 }
 
 struct addrspace *
@@ -279,15 +686,22 @@ as_create(void)
 		return NULL;
 	}
 
-	as->as_vbase1 = 0;
-	as->as_pbase1 = 0;
-	as->as_npages1 = 0;
-	as->as_vbase2 = 0;
-	as->as_pbase2 = 0;
-	as->as_npages2 = 0;
-	as->as_stackpbase = 0;
-
-	as->is_loaded = false;
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	as->as_lock = lock_create("addrspace");
+	if (as->as_lock == NULL) {
+		pt_destroy(as->as_pt);
+		kfree(as);
+		return NULL;
+	}
+	as->as_nregions = 0;
+	as->as_vnode = NULL;
+	as->as_loaded = false;
+	as->as_asid = 0;
+	as->as_asidgen = 0;
 
 	return as;
 }
@@ -295,17 +709,37 @@ as_create(void)
 void
 as_destroy(struct addrspace *as)
 {
-	free_kpages(PADDR_TO_KVADDR(as->as_pbase1));
-	free_kpages(PADDR_TO_KVADDR(as->as_pbase2));
-	free_kpages(PADDR_TO_KVADDR(as->as_stackpbase));
+	vaddr_t va;
+	pte_t *pte;
+
+	/*
+	 * Hold the lock so that pageout leaves us alone. Once all our
+	 * frames are gone nothing can lead it back here.
+	 */
+	lock_acquire(as->as_lock);
+	for (va = 0; (pte = pt_next(as->as_pt, &va)) != NULL; va += PAGE_SIZE) {
+		if (*pte & PTE_PRESENT) {
+			free_kpages(PADDR_TO_KVADDR(*pte & PTE_FRAME));
+		}
+		else if (*pte & PTE_SWAPPED) {
+			swap_free(PTE_SLOT(*pte));
+		}
+	}
+	lock_release(as->as_lock);
+	lock_destroy(as->as_lock);
+	pt_destroy(as->as_pt);
+	if (as->as_vnode != NULL) {
+		VOP_DECREF(as->as_vnode);
+	}
 	kfree(as);
 }
 
 void
 as_activate(void)
 {
-	int i, spl;
 	struct addrspace *as;
+	uint32_t gen;
+	int spl;
 
 	as = curproc_getas();
 #ifdef UW
@@ -315,11 +749,30 @@ as_activate(void)
 		return;
 	}
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	spinlock_acquire(&asid_lock);
+	if (as->as_asidgen != asid_generation) {
+		if (asid_next == NUM_ASID) {
+			/* Out of ASIDs; start over */
+			asid_generation++;
+			asid_next = 1;
+		}
+		as->as_asid = asid_next++;
+		as->as_asidgen = asid_generation;
+	}
+	gen = asid_generation;
+	spinlock_release(&asid_lock);
+
+	curcpu->c_tlb.ct_asid = as->as_asid;
+	if (curcpu->c_tlb.ct_asidgen != gen) {
+		/* TLB may hold entries for reused ASIDs */
+		vm_tlbflush();
+		curcpu->c_tlb.ct_asidgen = gen;
+	}
+	else {
+		tlb_setasid(as->as_asid);
+		vmstats_inc(VMSTAT_TLB_FLUSH_AVOIDED);
 	}
 
 	splx(spl);
@@ -331,6 +784,28 @@ as_deactivate(void)
 	/* nothing */
 }
 
+static
+int
+as_add_region(struct addrspace *as, vaddr_t vaddr, size_t npages,
+	      bool writeable)
+{
+	struct region *rg;
+
+	if (as->as_nregions == AS_MAXREGIONS) {
+		kprintf("dumbvm: Warning: too many regions\n");
+		return EUNIMP;
+	}
+
+	rg = &as->as_regions[as->as_nregions++];
+	rg->rg_vbase = vaddr;
+	rg->rg_npages = npages;
+	rg->rg_writeable = writeable;
+	rg->rg_filevaddr = 0;
+	rg->rg_fileoffset = 0;
+	rg->rg_filesize = 0;
+	return 0;
+}
+
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
@@ -346,70 +821,62 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 	npages = sz / PAGE_SIZE;
 
-	/* We don't use these - all pages are read-write */
+	/* We don't use these - everything is readable and executable */
 	(void)readable;
-	(void)writeable;
 	(void)executable;
 
-	if (as->as_vbase1 == 0) {
-		as->as_vbase1 = vaddr;
-		as->as_npages1 = npages;
-		return 0;
-	}
-
-	if (as->as_vbase2 == 0) {
-		as->as_vbase2 = vaddr;
-		as->as_npages2 = npages;
-		return 0;
-	}
-
-	/*
-	 * Support for more than two regions is not available.
-	 */
-	kprintf("dumbvm: Warning: too many regions\n");
-	return EUNIMP;
-}
-
-static
-void
-as_zero_region(paddr_t paddr, unsigned npages)
-{
-	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+	return as_add_region(as, vaddr, npages, writeable != 0);
 }
 
+#if OPT_A3
 int
-as_prepare_load(struct addrspace *as)
+as_define_filedata(struct addrspace *as, struct vnode *v,
+		   off_t offset, vaddr_t vaddr, size_t filesize)
 {
-	KASSERT(as->as_pbase1 == 0);
-	KASSERT(as->as_pbase2 == 0);
-	KASSERT(as->as_stackpbase == 0);
+	struct region *rg;
 
-	as->as_pbase1 = getppages(as->as_npages1);
-	if (as->as_pbase1 == 0) {
-		return ENOMEM;
+	if (filesize == 0) {
+		return 0;
 	}
 
-	as->as_pbase2 = getppages(as->as_npages2);
-	if (as->as_pbase2 == 0) {
-		return ENOMEM;
+	rg = as_find_region(as, vaddr);
+	if (rg == NULL ||
+	    vaddr + filesize > rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+		kprintf("dumbvm: file data outside its region\n");
+		return ENOEXEC;
 	}
 
-	as->as_stackpbase = getppages(DUMBVM_STACKPAGES);
-	if (as->as_stackpbase == 0) {
-		return ENOMEM;
+	/* All regions come from the same executable. */
+	if (as->as_vnode == NULL) {
+		VOP_INCREF(v);
+		as->as_vnode = v;
 	}
-	
-	as_zero_region(as->as_pbase1, as->as_npages1);
-	as_zero_region(as->as_pbase2, as->as_npages2);
-	as_zero_region(as->as_stackpbase, DUMBVM_STACKPAGES);
+	KASSERT(as->as_vnode == v);
 
+	rg->rg_filevaddr = vaddr;
+	rg->rg_fileoffset = offset;
+	rg->rg_filesize = filesize;
+	return 0;
+}
+#endif
+
+int
+as_prepare_load(struct addrspace *as)
+{
+	/* Nothing is allocated up front. */
+	(void)as;
 	return 0;
 }
 
 int
 as_complete_load(struct addrspace *as)
 {
-	as->is_loaded = true;
+	/*
+	 * From now on read-only regions are mapped read-only. The
+	 * caller (load_elf) activates the address space afterwards,
+	 * which drops any writable mappings made while loading.
+	 */
+	as->as_loaded = true;
 	
 	return 0;
 }
@@ -417,12 +884,17 @@ as_complete_load(struct addrspace *as)
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr, char** args, int argc)
 {
-	KASSERT(as->as_stackpbase != 0);
+	int err;
+
+	err = as_add_region(as, USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE,
+			    DUMBVM_STACKPAGES, true);
+	if (err) {
+		return err;
+	}
 	*stackptr = USERSTACK;
 	if (argc == 0){
 		return 0;	
 	}
-	int err;
 	vaddr_t *stack_args = kmalloc((argc+1) * sizeof(vaddr_t));
 	*stackptr -= 4;
 	//copy args
@@ -458,38 +930,82 @@ int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *new;
+	vaddr_t va;
+	pte_t *oldpte, *newpte;
+	paddr_t paddr;
+	int result;
 
 	new = as_create();
 	if (new==NULL) {
 		return ENOMEM;
 	}
 
-	new->as_vbase1 = old->as_vbase1;
-	new->as_npages1 = old->as_npages1;
-	new->as_vbase2 = old->as_vbase2;
-	new->as_npages2 = old->as_npages2;
-
-	/* (Mis)use as_prepare_load to allocate some physical memory. */
-	if (as_prepare_load(new)) {
-		as_destroy(new);
-		return ENOMEM;
+	memcpy(new->as_regions, old->as_regions, sizeof(old->as_regions));
+	new->as_nregions = old->as_nregions;
+	new->as_loaded = old->as_loaded;
+	if (old->as_vnode != NULL) {
+		VOP_INCREF(old->as_vnode);
+		new->as_vnode = old->as_vnode;
 	}
 
-	KASSERT(new->as_pbase1 != 0);
-	KASSERT(new->as_pbase2 != 0);
-	KASSERT(new->as_stackpbase != 0);
+	lock_acquire(old->as_lock);
+	lock_acquire(new->as_lock);
 
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase1),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase1),
-		old->as_npages1*PAGE_SIZE);
+	/*
+	 * Share the pages that are resident and copy the ones that
+	 * are swapped out; the rest will be filled in from the same
+	 * backing in the child.
+	 */
+	result = 0;
+	for (va = 0; (oldpte = pt_next(old->as_pt, &va)) != NULL;
+	     va += PAGE_SIZE) {
+		newpte = pt_lookup(new->as_pt, va, true);
+		if (newpte == NULL) {
+			result = ENOMEM;
+			break;
+		}
+		if (*oldpte & PTE_PRESENT) {
+			coremap_incref(*oldpte & PTE_FRAME);
+			*newpte = *oldpte;
+			continue;
+		}
 
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase2),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase2),
-		old->as_npages2*PAGE_SIZE);
+		KASSERT(*oldpte & PTE_SWAPPED);
+		paddr = vm_getuserpage(new, va);
+		if (paddr == 0) {
+			result = ENOMEM;
+			break;
+		}
+		result = swap_read(PTE_SLOT(*oldpte), paddr);
+		if (result) {
+			coremap_unbusy(paddr);
+			free_kpages(PADDR_TO_KVADDR(paddr));
+			break;
+		}
+		*newpte = paddr | PTE_PRESENT;
+		coremap_unbusy(paddr);
+	}
+
+	lock_release(new->as_lock);
+	lock_release(old->as_lock);
 
-	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
-		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
-		DUMBVM_STACKPAGES*PAGE_SIZE);
+	if (result) {
+		as_destroy(new);
+		return result;
+	}
+
+	/*
+	 * The parent may have writable mappings of what are now
+	 * shared frames, on any CPU it has run on. Rather than chase
+	 * them down, give it a new ASID; the old entries will never
+	 * match again.
+	 */
+	spinlock_acquire(&asid_lock);
+	old->as_asidgen = 0;
+	spinlock_release(&asid_lock);
+	if (old == curproc_getas()) {
+		as_activate();
+	}
 	
 	*ret = new;
 	return 0;
@@ -29,13 +29,24 @@
 
 /*
  * LAMEbus hard disk (lhd) driver.
+ *
+ * The hardware does one sector at a time. Callers' requests go into
+ * a queue kept in sector order, and the interrupt handler runs them:
+ * when a sector finishes it starts the next one straight away,
+ * either the next sector of the same request or, when that request
+ * is done, the next request in C-SCAN order (the first one at or
+ * past the sector just done, wrapping around to the lowest). A
+ * request that picks up where the last one left off thus follows it
+ * without a seek, as if the two had been merged. The caller sleeps
+ * until its whole request is done.
  */
 
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -59,6 +70,23 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* Most sectors to bounce through memory at once for non-kernel I/O */
+#define LHD_BOUNCESECT  8
+
+/*
+ * A request: a run of sectors to or from a kernel buffer. Lives on
+ * the stack of the thread waiting for it.
+ */
+struct lhd_req {
+	struct lhd_req *lr_next;	/* Queue link */
+	uint32_t lr_sector;		/* Next sector to do */
+	uint32_t lr_nsect;		/* Sectors left */
+	char *lr_data;			/* Where the next sector goes */
+	bool lr_write;
+	bool lr_done;			/* Finished, successfully or not */
+	int lr_result;
+};
+
 /*
  * Shortcut for reading a register.
  */
@@ -95,15 +123,109 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Start the next sector of the active request.
+ */
+static
+void
+lhd_issue(struct lhd_softc *lh)
+{
+	struct lhd_req *lr = lh->lh_active;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(lr != NULL && lr->lr_nsect > 0);
+
+	/*
+	 * Are we writing? If so, transfer the data to the on-card
+	 * buffer.
+	 */
+	if (lr->lr_write) {
+		memcpy(lh->lh_buf, lr->lr_data, LHD_SECTSIZE);
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, lr->lr_sector);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * If the disk is idle, pick the next request in C-SCAN order and
+ * start it.
+ */
+static
+void
+lhd_start(struct lhd_softc *lh)
+{
+	struct lhd_req **pp, **next;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_active != NULL || lh->lh_queue == NULL) {
+		return;
+	}
+
+	next = &lh->lh_queue;
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next) {
+		if ((*pp)->lr_sector >= lh->lh_headpos) {
+			next = pp;
+			break;
+		}
+	}
+
+	lh->lh_active = *next;
+	*next = lh->lh_active->lr_next;
+	lh->lh_active->lr_next = NULL;
+	lhd_issue(lh);
+}
+
+/*
+ * Record that a sector has completed: move the data, and either go
+ * on to the next sector or finish the request and wake its owner.
  */
 static
 void
 lhd_iodone(struct lhd_softc *lh, int err)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct lhd_req *lr;
+
+	spinlock_acquire(&lh->lh_lock);
+
+	lr = lh->lh_active;
+	if (lr == NULL) {
+		/* Spurious */
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	/*
+	 * Are we reading? If so, and if we succeeded, transfer the
+	 * data out of the on-card buffer.
+	 */
+	if (err == 0) {
+		if (!lr->lr_write) {
+			memcpy(lr->lr_data, lh->lh_buf, LHD_SECTSIZE);
+		}
+		lr->lr_data += LHD_SECTSIZE;
+		lr->lr_sector++;
+		lr->lr_nsect--;
+		lh->lh_headpos = lr->lr_sector;
+	}
+
+	if (err == 0 && lr->lr_nsect > 0) {
+		lhd_issue(lh);
+	}
+	else {
+		lr->lr_result = err;
+		lr->lr_done = true;
+		lh->lh_active = NULL;
+		wchan_wakeall(lh->lh_wchan);
+		lhd_start(lh);
+	}
+
+	spinlock_release(&lh->lh_lock);
 }
 
 /*
@@ -193,6 +315,53 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Queue a request for NSECT sectors starting at SECTOR, to or from
+ * DATA, and wait for it to finish.
+ */
+static
+int
+lhd_request(struct lhd_softc *lh, uint32_t sector, uint32_t nsect,
+	    void *data, bool write)
+{
+	struct lhd_req lr, **pp;
+
+	if (nsect == 0) {
+		return 0;
+	}
+
+	lr.lr_sector = sector;
+	lr.lr_nsect = nsect;
+	lr.lr_data = data;
+	lr.lr_write = write;
+	lr.lr_done = false;
+	lr.lr_result = 0;
+
+	spinlock_acquire(&lh->lh_lock);
+
+	/* Insert in sector order, after any others for the same sector */
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next) {
+		if ((*pp)->lr_sector > sector) {
+			break;
+		}
+	}
+	lr.lr_next = *pp;
+	*pp = &lr;
+
+	lhd_start(lh);
+
+	while (!lr.lr_done) {
+		wchan_lock(lh->lh_wchan);
+		spinlock_release(&lh->lh_lock);
+		wchan_sleep(lh->lh_wchan);
+		spinlock_acquire(&lh->lh_lock);
+	}
+
+	spinlock_release(&lh->lh_lock);
+
+	return lr.lr_result;
+}
+
 /*
  * I/O function (for both reads and writes)
  */
@@ -206,8 +375,10 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	bool write = (uio->uio_rw == UIO_WRITE);
+	struct iovec *iov;
+	char *bounce;
+	uint32_t n;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -220,59 +391,63 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	/*
+	 * A single kernel buffer (the usual case: the buffer cache
+	 * and swap) is done in one request, straight to or from the
+	 * buffer. We update the uio by hand.
+	 */
+	iov = uio->uio_iov;
+	if (uio->uio_segflg == UIO_SYSSPACE && uio->uio_iovcnt == 1 &&
+	    iov->iov_len == uio->uio_resid) {
+		result = lhd_request(lh, sector, len, iov->iov_kbase, write);
+		if (result) {
+			return result;
+		}
+		iov->iov_kbase = (char *)iov->iov_kbase + uio->uio_resid;
+		iov->iov_len = 0;
+		uio->uio_offset += uio->uio_resid;
+		uio->uio_resid = 0;
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
+	/*
+	 * Otherwise, bounce through a kernel buffer a few sectors at
+	 * a time, since uiomove may fault.
+	 */
+	bounce = kmalloc(LHD_BOUNCESECT * LHD_SECTSIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	result = 0;
+	while (len > 0) {
+		n = len < LHD_BOUNCESECT ? len : LHD_BOUNCESECT;
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		if (write) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		result = lhd_request(lh, sector, n, bounce, write);
+		if (result) {
+			break;
 		}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
+		if (!write) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
 		}
+
+		sector += n;
+		len -= n;
 	}
 
-	return 0;
+	kfree(bounce);
+	return result;
 }
 
 /*
@@ -289,17 +464,16 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
+	lh->lh_queue = NULL;
+	lh->lh_active = NULL;
+	lh->lh_headpos = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_open = lhd_open;
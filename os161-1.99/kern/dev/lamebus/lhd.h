@@ -30,6 +30,7 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
 /*
@@ -37,6 +38,8 @@
  */
 #define LHD_SECTSIZE  512
 
+struct lhd_req;	/* in lhd.c */
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +54,11 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Protects the request queue */
+	struct wchan *lh_wchan;		/* For waiting on requests */
+	struct lhd_req *lh_queue;	/* Pending requests, by sector */
+	struct lhd_req *lh_active;	/* Request in progress */
+	uint32_t lh_headpos;		/* Sector after the last one done */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -0,0 +1,254 @@
+/*
+ * SFS directory name cache.
+ *
+ * Remembers the result of looking up a name in a directory: the
+ * inode and slot it was found at, or that it isn't there (a negative
+ * entry). Entries are keyed by (directory inode, name), hashed, and
+ * recycled least recently used first once there are SFS_DC_MAX of
+ * them.
+ *
+ * sfs_dir_findname consults the cache before reading the directory,
+ * and sfs_dir_link and sfs_dir_unlink (and thus rename, which is
+ * built from them) keep it up to date, so it is never stale.
+ *
+ * Lookups happen under a shared hold of the directory's lock, so the
+ * cache has a lock of its own.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vfs.h>
+#include <sfs.h>
+
+#define SFS_DC_MAX	256	/* entries */
+#define SFS_DC_HASHSIZE	64	/* buckets; must be a power of 2 */
+
+struct sfs_dcentry {
+	struct sfs_dcentry *de_hashnext;	/* hash chain */
+	struct sfs_dcentry *de_lrunext;		/* LRU list */
+	struct sfs_dcentry *de_lruprev;
+	uint32_t de_dirino;			/* directory */
+	uint32_t de_hash;			/* hash of de_name */
+	uint32_t de_ino;			/* SFS_NOINO if negative */
+	int de_slot;				/* slot, if positive */
+	char de_name[SFS_NAMELEN];
+};
+
+struct sfs_dircache {
+	struct lock *dc_lock;
+	struct sfs_dcentry *dc_hash[SFS_DC_HASHSIZE];
+	struct sfs_dcentry *dc_lruhead;		/* least recently used */
+	struct sfs_dcentry *dc_lrutail;
+	unsigned dc_count;
+};
+
+static
+uint32_t
+sfs_dc_hashname(uint32_t dirino, const char *name)
+{
+	uint32_t h = dirino;
+
+	while (*name) {
+		h = h*33 + (unsigned char)*name++;
+	}
+	return h;
+}
+
+int
+sfs_dircache_init(struct sfs_fs *sfs)
+{
+	struct sfs_dircache *dc;
+	unsigned i;
+
+	dc = kmalloc(sizeof(struct sfs_dircache));
+	if (dc == NULL) {
+		return ENOMEM;
+	}
+	dc->dc_lock = lock_create("sfs dircache");
+	if (dc->dc_lock == NULL) {
+		kfree(dc);
+		return ENOMEM;
+	}
+	for (i=0; i<SFS_DC_HASHSIZE; i++) {
+		dc->dc_hash[i] = NULL;
+	}
+	dc->dc_lruhead = dc->dc_lrutail = NULL;
+	dc->dc_count = 0;
+
+	sfs->sfs_dircache = dc;
+	return 0;
+}
+
+void
+sfs_dircache_cleanup(struct sfs_fs *sfs)
+{
+	struct sfs_dircache *dc = sfs->sfs_dircache;
+	struct sfs_dcentry *de;
+
+	while (dc->dc_lruhead != NULL) {
+		de = dc->dc_lruhead;
+		dc->dc_lruhead = de->de_lrunext;
+		kfree(de);
+	}
+	lock_destroy(dc->dc_lock);
+	kfree(dc);
+	sfs->sfs_dircache = NULL;
+}
+
+static
+void
+sfs_dc_lruremove(struct sfs_dircache *dc, struct sfs_dcentry *de)
+{
+	if (de->de_lruprev) {
+		de->de_lruprev->de_lrunext = de->de_lrunext;
+	}
+	else {
+		dc->dc_lruhead = de->de_lrunext;
+	}
+	if (de->de_lrunext) {
+		de->de_lrunext->de_lruprev = de->de_lruprev;
+	}
+	else {
+		dc->dc_lrutail = de->de_lruprev;
+	}
+}
+
+static
+void
+sfs_dc_lruappend(struct sfs_dircache *dc, struct sfs_dcentry *de)
+{
+	de->de_lrunext = NULL;
+	de->de_lruprev = dc->dc_lrutail;
+	if (dc->dc_lrutail) {
+		dc->dc_lrutail->de_lrunext = de;
+	}
+	else {
+		dc->dc_lruhead = de;
+	}
+	dc->dc_lrutail = de;
+}
+
+static
+void
+sfs_dc_hashremove(struct sfs_dircache *dc, struct sfs_dcentry *de)
+{
+	struct sfs_dcentry **p;
+
+	p = &dc->dc_hash[de->de_hash & (SFS_DC_HASHSIZE-1)];
+	while (*p != de) {
+		KASSERT(*p != NULL);
+		p = &(*p)->de_hashnext;
+	}
+	*p = de->de_hashnext;
+}
+
+static
+struct sfs_dcentry *
+sfs_dc_find(struct sfs_dircache *dc, uint32_t dirino, uint32_t hash,
+	    const char *name)
+{
+	struct sfs_dcentry *de;
+
+	for (de = dc->dc_hash[hash & (SFS_DC_HASHSIZE-1)]; de != NULL;
+	     de = de->de_hashnext) {
+		if (de->de_hash == hash && de->de_dirino == dirino &&
+		    !strcmp(de->de_name, name)) {
+			return de;
+		}
+	}
+	return NULL;
+}
+
+bool
+sfs_dircache_lookup(struct sfs_fs *sfs, uint32_t dirino, const char *name,
+		    uint32_t *ino, int *slot)
+{
+	struct sfs_dircache *dc = sfs->sfs_dircache;
+	struct sfs_dcentry *de;
+
+	lock_acquire(dc->dc_lock);
+	de = sfs_dc_find(dc, dirino, sfs_dc_hashname(dirino, name), name);
+	if (de == NULL) {
+		lock_release(dc->dc_lock);
+		return false;
+	}
+
+	sfs_dc_lruremove(dc, de);
+	sfs_dc_lruappend(dc, de);
+
+	*ino = de->de_ino;
+	*slot = de->de_slot;
+	lock_release(dc->dc_lock);
+	return true;
+}
+
+void
+sfs_dircache_enter(struct sfs_fs *sfs, uint32_t dirino, const char *name,
+		   uint32_t ino, int slot)
+{
+	struct sfs_dircache *dc = sfs->sfs_dircache;
+	struct sfs_dcentry *de;
+	uint32_t hash;
+
+	if (strlen(name) >= SFS_NAMELEN) {
+		/* Can't be in a directory anyway */
+		return;
+	}
+
+	lock_acquire(dc->dc_lock);
+	hash = sfs_dc_hashname(dirino, name);
+	de = sfs_dc_find(dc, dirino, hash, name);
+	if (de != NULL) {
+		/* Just update it */
+		sfs_dc_lruremove(dc, de);
+	}
+	else {
+		if (dc->dc_count < SFS_DC_MAX) {
+			de = kmalloc(sizeof(struct sfs_dcentry));
+		}
+		if (de != NULL) {
+			dc->dc_count++;
+		}
+		else {
+			/* Recycle the least recently used entry */
+			de = dc->dc_lruhead;
+			if (de == NULL) {
+				lock_release(dc->dc_lock);
+				return;
+			}
+			sfs_dc_lruremove(dc, de);
+			sfs_dc_hashremove(dc, de);
+		}
+		de->de_dirino = dirino;
+		de->de_hash = hash;
+		strcpy(de->de_name, name);
+		de->de_hashnext = dc->dc_hash[hash & (SFS_DC_HASHSIZE-1)];
+		dc->dc_hash[hash & (SFS_DC_HASHSIZE-1)] = de;
+	}
+
+	de->de_ino = ino;
+	de->de_slot = slot;
+	sfs_dc_lruappend(dc, de);
+	lock_release(dc->dc_lock);
+}
+
+void
+sfs_dircache_purgedir(struct sfs_fs *sfs, uint32_t dirino)
+{
+	struct sfs_dircache *dc = sfs->sfs_dircache;
+	struct sfs_dcentry *de, *next;
+
+	lock_acquire(dc->dc_lock);
+	for (de = dc->dc_lruhead; de != NULL; de = next) {
+		next = de->de_lrunext;
+		if (de->de_dirino == dirino) {
+			sfs_dc_lruremove(dc, de);
+			sfs_dc_hashremove(dc, de);
+			kfree(de);
+			dc->dc_count--;
+		}
+	}
+	lock_release(dc->dc_lock);
+}
@@ -39,8 +39,10 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 /* Shortcuts for the size macros in kern/sfs.h */
@@ -69,15 +71,29 @@ static
 int
 sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 {
-	uint32_t j, mapsize;
-	char *bitdata;
-	int result;
+	uint32_t j, k, mapsize;
+	char *bitdata, *resdata = NULL, *buf = NULL;
+	int result = 0;
 
 	/* Number of blocks in the bitmap. */
 	mapsize = SFS_FS_BITBLOCKS(sfs);
 
 	/* Pointer to our bitmap data in memory. */
 	bitdata = bitmap_getdata(sfs->sfs_freemap);
+
+	/*
+	 * Blocks set aside for files (see sfs_balloc_file) are marked
+	 * in use in memory, so nothing else takes them, but nobody
+	 * owns them on disk; write them out as free so a crash doesn't
+	 * leak them.
+	 */
+	if (rw == UIO_WRITE) {
+		resdata = bitmap_getdata(sfs->sfs_reserved);
+		buf = kmalloc(SFS_BLOCKSIZE);
+		if (buf == NULL) {
+			return ENOMEM;
+		}
+	}
 	
 	/* For each sector in the bitmap... */
 	for (j=0; j<mapsize; j++) {
@@ -90,15 +106,20 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 			result = sfs_rblock(sfs, ptr, SFS_MAP_LOCATION+j);
 		}
 		else {
-			result = sfs_wblock(sfs, ptr, SFS_MAP_LOCATION+j);
+			for (k=0; k<SFS_BLOCKSIZE; k++) {
+				buf[k] = bitdata[j*SFS_BLOCKSIZE + k] &
+					~resdata[j*SFS_BLOCKSIZE + k];
+			}
+			result = sfs_wblock(sfs, buf, SFS_MAP_LOCATION+j);
 		}
 
 		/* If we failed, stop. */
 		if (result) {
-			return result;
+			break;
 		}
 	}
-	return 0;
+	kfree(buf);
+	return result;
 }
 
 /*
@@ -111,11 +132,10 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
-	unsigned i, num;
+	struct sfs_vnode *sv, **vns;
+	unsigned i, n;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -148,18 +168,41 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+	/*
+	 * Go over the table of loaded vnodes, syncing them. VOP_FSYNC
+	 * takes sv_lock, which comes before sfs_vnlock, so grab a
+	 * reference to each under sfs_vnlock and sync them after
+	 * letting go of it.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	vns = kmalloc((sfs->sfs_nvnodes + 1) * sizeof(struct sfs_vnode *));
+	if (vns == NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
 	}
+	n = 0;
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		for (sv = sfs->sfs_vnhash[i]; sv != NULL; sv = sv->sv_hashnext) {
+			VOP_INCREF(&sv->sv_v);
+			vns[n++] = sv;
+		}
+	}
+	KASSERT(n == sfs->sfs_nvnodes);
+	lock_release(sfs->sfs_vnlock);
+
+	for (i=0; i<n; i++) {
+		VOP_FSYNC(&vns[i]->sv_v);
+		VOP_DECREF(&vns[i]->sv_v);
+	}
+	kfree(vns);
+
+	lock_acquire(sfs->sfs_freemaplock);
 
 	/* If the free block map needs to be written, write it. */
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_mapio(sfs, UIO_WRITE);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
@@ -169,33 +212,32 @@ sfs_sync(struct fs *fs)
 	if (sfs->sfs_superdirty) {
 		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
 
-	vfs_biglock_release();
-	return 0;
+	lock_release(sfs->sfs_freemaplock);
+
+	/* Everything above only went as far as the buffer cache. */
+	return buffer_sync(sfs->sfs_device);
 }
 
 /*
  * Routine to retrieve the volume name. Filesystems can be referred
  * to by their volume name followed by a colon as well as the name
  * of the device they're mounted on.
+ *
+ * The name is fixed once mounted, so no locking is needed.
  */
 static
 const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
-
-	vfs_biglock_acquire();
-	ret = sfs->sfs_super.sp_volname;
-	vfs_biglock_release();
 
-	return ret;
+	return sfs->sfs_super.sp_volname;
 }
 
 /*
@@ -209,21 +251,32 @@ sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
 
-	vfs_biglock_acquire();
-	
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	/*
+	 * Do we have any files open? If so, can't unmount. (The VFS
+	 * layer holds the device list for write and has checked that
+	 * no vfs_getroot is under way, so nobody can start a new
+	 * lookup on us once we've looked.)
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
+	sfs_vntable_cleanup(sfs);
+	sfs_dircache_cleanup(sfs);
 	bitmap_destroy(sfs->sfs_freemap);
+	bitmap_destroy(sfs->sfs_reserved);
+	lock_destroy(sfs->sfs_freemaplock);
+
+	/* Sync wrote back our buffers; forget them */
+	buffer_drop(sfs->sfs_device);
 	
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
@@ -232,7 +285,6 @@ sfs_unmount(struct fs *fs)
 	kfree(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -257,8 +309,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	int result;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
-
 	/* We don't pass any options through mount */
 	(void)options;
 
@@ -278,23 +328,26 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		return ENXIO;
 	}
 
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	/* Allocate vnode table and name cache */
+	result = sfs_vntable_init(sfs);
+	if (result) {
 		kfree(sfs);
-		vfs_biglock_release();
-		return ENOMEM;
+		return result;
+	}
+	result = sfs_dircache_init(sfs);
+	if (result) {
+		sfs_vntable_cleanup(sfs);
+		kfree(sfs);
+		return result;
 	}
 
 	/* Set the device so we can use sfs_rblock() */
@@ -303,9 +356,9 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load superblock */
 	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_vntable_cleanup(sfs);
+		sfs_dircache_cleanup(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -316,12 +369,22 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_vntable_cleanup(sfs);
+		sfs_dircache_cleanup(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 	
+	if (sfs->sfs_super.sp_flags &
+	    ~(SFS_SUPER_EXTENTS | SFS_SUPER_DIRINDEX)) {
+		kprintf("sfs: Unknown superblock flags 0x%x\n",
+			sfs->sfs_super.sp_flags);
+		sfs_vntable_cleanup(sfs);
+		sfs_dircache_cleanup(sfs);
+		kfree(sfs);
+		return EINVAL;
+	}
+
 	if (sfs->sfs_super.sp_nblocks > dev->d_blocks) {
 		kprintf("sfs: warning - fs has %u blocks, device has %u\n",
 			sfs->sfs_super.sp_nblocks, dev->d_blocks);
@@ -333,19 +396,36 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_vntable_cleanup(sfs);
+		sfs_dircache_cleanup(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
 		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
+		sfs_vntable_cleanup(sfs);
+		sfs_dircache_cleanup(sfs);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
+	sfs->sfs_reserved = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
+	if (sfs->sfs_reserved == NULL) {
+		bitmap_destroy(sfs->sfs_freemap);
+		sfs_vntable_cleanup(sfs);
+		sfs_dircache_cleanup(sfs);
+		kfree(sfs);
+		return ENOMEM;
+	}
+	sfs->sfs_freemaplock = lock_create("sfs freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		bitmap_destroy(sfs->sfs_freemap);
+		bitmap_destroy(sfs->sfs_reserved);
+		sfs_vntable_cleanup(sfs);
+		sfs_dircache_cleanup(sfs);
+		kfree(sfs);
+		return ENOMEM;
+	}
 
 	/* Set up abstract fs calls */
 	sfs->sfs_absfs.fs_sync = sfs_sync;
@@ -361,7 +441,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -33,75 +33,135 @@
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 ////////////////////////////////////////////////////////////
 //
 // Basic block-level I/O routines
 //
+// These go through the buffer cache, so blocks written are only
+// written to disk when the buffer is evicted or the fs is synced;
+// except that sfs_rwblocks moves long runs of blocks straight to or
+// from the disk.
+//
 // Note: sfs_rblock is used to read the superblock
 // early in mount, before sfs is fully (or even mostly)
 // initialized, and so may not use anything from sfs
 // except sfs_device.
 
+/*
+ * Read or write a whole block between the buffer cache and a uio.
+ * The uio's offset is the block's offset on disk; if there's more
+ * than a block left in it, the rest is left for the caller.
+ */
 int
 sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 {
+	struct buf *b;
+	char *iobuf;
+	daddr_t block;
 	int result;
-	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
+	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
 
-	DEBUG(DB_SFS, "sfs: %s %llu\n", 
-	      uio->uio_rw == UIO_READ ? "read" : "write",
-	      uio->uio_offset / SFS_BLOCKSIZE);
+	block = uio->uio_offset / SFS_BLOCKSIZE;
 
- retry:
-	result = sfs->sfs_device->d_io(sfs->sfs_device, uio);
-	if (result == EINVAL) {
+	DEBUG(DB_SFS, "sfs: %s %u\n", 
+	      uio->uio_rw == UIO_READ ? "read" : "write", block);
+
+	if (uio->uio_rw == UIO_WRITE) {
 		/*
-		 * This means the sector we requested was out of range,
-		 * or the seek address we gave wasn't sector-aligned,
-		 * or a couple of other things that are our fault.
+		 * Copy writes in somewhere private first, so that a
+		 * fault partway through doesn't leave half a block in
+		 * the cache. (Too big for the stack.)
 		 */
-		panic("sfs: d_io returned EINVAL\n");
-	}
-	if (result == EIO) {
-		if (tries == 0) {
-			tries++;
-			kprintf("sfs: block %llu I/O error, retrying\n",
-				uio->uio_offset / SFS_BLOCKSIZE);
-			goto retry;
-		}
-		else if (tries < 10) {
-			tries++;
-			goto retry;
+		iobuf = kmalloc(SFS_BLOCKSIZE);
+		if (iobuf == NULL) {
+			return ENOMEM;
 		}
-		else {
-			kprintf("sfs: block %llu I/O error, giving up after "
-				"%d retries\n",
-				uio->uio_offset / SFS_BLOCKSIZE, tries);
+		result = uiomove(iobuf, SFS_BLOCKSIZE, uio);
+		if (result == 0) {
+			result = sfs_wblock(sfs, iobuf, block);
 		}
+		kfree(iobuf);
+		return result;
 	}
+
+	result = buffer_read(sfs->sfs_device, block, &b);
+	if (result) {
+		return result;
+	}
+	result = uiomove(buffer_map(b), SFS_BLOCKSIZE, uio);
+	buffer_release(b);
 	return result;
 }
 
+/*
+ * Read or write several consecutive whole blocks between the disk
+ * and a uio, as for sfs_rwblock. Fewer than SFS_MINDIRECT blocks go
+ * through the cache one at a time; more than that is done as a
+ * single transfer to the device.
+ */
+int
+sfs_rwblocks(struct sfs_fs *sfs, struct uio *uio)
+{
+	daddr_t block;
+	unsigned nblocks, i;
+	int result;
+
+	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
+	KASSERT(uio->uio_resid % SFS_BLOCKSIZE == 0);
+	KASSERT(uio->uio_resid > 0);
+
+	block = uio->uio_offset / SFS_BLOCKSIZE;
+	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
+
+	if (nblocks < SFS_MINDIRECT) {
+		for (i=0; i<nblocks; i++) {
+			result = sfs_rwblock(sfs, uio);
+			if (result) {
+				return result;
+			}
+		}
+		return 0;
+	}
+
+	DEBUG(DB_SFS, "sfs: %s %u-%u\n",
+	      uio->uio_rw == UIO_READ ? "read" : "write",
+	      block, block + nblocks - 1);
+
+	return buffer_directio(sfs->sfs_device, block, nblocks, uio);
+}
+
 int
 sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct buf *b;
+	int result;
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
-	return sfs_rwblock(sfs, &ku);
+	result = buffer_read(sfs->sfs_device, block, &b);
+	if (result) {
+		return result;
+	}
+	memcpy(data, buffer_map(b), SFS_BLOCKSIZE);
+	buffer_release(b);
+	return 0;
 }
 
 int
 sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block)
 {
-	struct iovec iov;
-	struct uio ku;
+	struct buf *b;
+	int result;
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
-	return sfs_rwblock(sfs, &ku);
+	result = buffer_get(sfs->sfs_device, block, &b);
+	if (result) {
+		return result;
+	}
+	memcpy(buffer_map(b), data, SFS_BLOCKSIZE);
+	buffer_mark_dirty(b);
+	buffer_release(b);
+	return 0;
 }
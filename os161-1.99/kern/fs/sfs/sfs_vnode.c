@@ -43,12 +43,35 @@
 #include <synch.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* With block mapping */
+static int sfs_dobmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
+		      uint32_t newblock, uint32_t *diskblock);
+
+/* With the vnode ops */
+static int sfs_dotruncate(struct sfs_vnode *sv, off_t len);
+
+/* With object creation */
+static int sfs_makeobj(struct sfs_fs *sfs, int type, uint32_t goal,
+		       struct sfs_vnode **ret);
+
+/* Most blocks a file takes at once when it starts a new run */
+#define SFS_PREALLOC	8
+
+/* Blocks to read ahead of a sequential reader */
+#define SFS_READAHEAD	16
+
+/* Values for sfs_bmap's DOALLOC */
+#define SFS_BMAP_LOOKUP	0	/* don't allocate */
+#define SFS_BMAP_ALLOC	1	/* allocate, and zero the new block */
+#define SFS_BMAP_NOZERO	2	/* allocate; caller will fill the block */
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
@@ -84,28 +107,182 @@ sfs_sync_inode(struct sfs_vnode *sv)
 // Space allocation
 
 /*
- * Allocate a block.
+ * Allocate a block: GOAL if it's free, otherwise the first free block
+ * after it. If ZERO is false the caller is going to overwrite the
+ * whole block, so don't bother clearing it.
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, uint32_t goal, bool zero, uint32_t *diskblock)
 {
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	result = bitmap_alloc_from(sfs->sfs_freemap, goal, diskblock);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
 	}
 
-	/* Clear block before returning it */
+	if (!zero) {
+		return 0;
+	}
+
+	/* Clear block before returning it; nobody else can have it yet */
 	return sfs_clearblock(sfs, *diskblock);
 }
 
+/*
+ * Look for LEN free blocks in a row between FROM and TO, and hand back
+ * the first. Call with sfs_freemaplock held.
+ */
+static
+bool
+sfs_findrun(struct sfs_fs *sfs, uint32_t from, uint32_t to, unsigned len,
+	    uint32_t *ret)
+{
+	uint32_t block;
+	unsigned run = 0;
+
+	for (block = from; block < to; block++) {
+		if (bitmap_isset(sfs->sfs_freemap, block)) {
+			run = 0;
+			continue;
+		}
+		if (++run == len) {
+			*ret = block + 1 - len;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Give back the unused rest of a file's preallocated run. Call with
+ * sv_lock held for write (or with the vnode otherwise to ourselves).
+ */
+static
+void
+sfs_prealloc_release(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	if (sv->sv_nprealloc == 0) {
+		return;
+	}
+
+	/* They were never in use on disk, so the freemap isn't dirtied */
+	lock_acquire(sfs->sfs_freemaplock);
+	while (sv->sv_nprealloc > 0) {
+		bitmap_unmark(sfs->sfs_freemap, sv->sv_prealloc);
+		bitmap_unmark(sfs->sfs_reserved, sv->sv_prealloc);
+		sv->sv_prealloc++;
+		sv->sv_nprealloc--;
+	}
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Allocate a block for file SV, aiming for the block after the last
+ * one it got (or after its inode, for the first), so that a file
+ * written sequentially is laid out sequentially.
+ *
+ * When a file has to start a new run, the free blocks after the new
+ * block are set aside for it too, up to SFS_PREALLOC in all; while
+ * it keeps going sequentially it takes its next block from there
+ * without searching the freemap. That keeps files written at the
+ * same time from interleaving block by block. The set-aside blocks
+ * are given back when the file stops being sequential, on the last
+ * close, and when the vnode is reclaimed. They're marked in
+ * sfs_reserved as well as the freemap, and only in memory: the
+ * freemap goes to disk without them.
+ *
+ * Each new run costs an extent-mapped file one of its SFS_NEXTENTS
+ * extents, so for those a new run starts at the first place after
+ * the goal with SFS_PREALLOC free blocks in a row, if there is one,
+ * rather than in whatever single block is free first.
+ *
+ * Call with sv_lock held for write.
+ */
+static
+int
+sfs_balloc_file(struct sfs_vnode *sv, bool zero, uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t goal, block, next, nblocks;
+	unsigned n;
+	int result;
+
+	goal = (sv->sv_lastblock != 0) ? sv->sv_lastblock + 1 : sv->sv_ino + 1;
+
+	if (sv->sv_nprealloc > 0 && sv->sv_prealloc == goal) {
+		/* Next block of the run; now it's in use on disk too */
+		block = sv->sv_prealloc;
+		sv->sv_prealloc++;
+		sv->sv_nprealloc--;
+
+		lock_acquire(sfs->sfs_freemaplock);
+		bitmap_unmark(sfs->sfs_reserved, block);
+		sfs->sfs_freemapdirty = true;
+		lock_release(sfs->sfs_freemaplock);
+	}
+	else {
+		sfs_prealloc_release(sv);
+
+		lock_acquire(sfs->sfs_freemaplock);
+		nblocks = sfs->sfs_super.sp_nblocks;
+		if ((sv->sv_i.sfi_flags & SFS_IF_EXTENTS) &&
+		    (goal >= nblocks ||
+		     bitmap_isset(sfs->sfs_freemap, goal)) &&
+		    (sfs_findrun(sfs, goal, nblocks, SFS_PREALLOC, &block) ||
+		     sfs_findrun(sfs, 0, goal, SFS_PREALLOC, &block))) {
+			bitmap_mark(sfs->sfs_freemap, block);
+		}
+		else {
+			result = bitmap_alloc_from(sfs->sfs_freemap, goal,
+						   &block);
+			if (result) {
+				lock_release(sfs->sfs_freemaplock);
+				return result;
+			}
+		}
+		if (block >= sfs->sfs_super.sp_nblocks) {
+			panic("sfs: balloc: invalid block %u\n", block);
+		}
+
+		/* Set aside as much of a run after it as is free */
+		for (n = 0; n < SFS_PREALLOC - 1; n++) {
+			next = block + 1 + n;
+			if (next >= nblocks ||
+			    bitmap_isset(sfs->sfs_freemap, next)) {
+				break;
+			}
+			bitmap_mark(sfs->sfs_freemap, next);
+			bitmap_mark(sfs->sfs_reserved, next);
+		}
+		sv->sv_prealloc = block + 1;
+		sv->sv_nprealloc = n;
+
+		sfs->sfs_freemapdirty = true;
+		lock_release(sfs->sfs_freemaplock);
+	}
+
+	sv->sv_lastblock = block;
+	*diskblock = block;
+
+	if (!zero) {
+		return 0;
+	}
+	/* Clear block before returning it; nobody else can have it yet */
+	return sfs_clearblock(sfs, block);
+}
+
 /*
  * Free a block.
  */
@@ -113,8 +290,10 @@ static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -128,6 +307,11 @@ sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
+	/*
+	 * No freemap lock: the caller holds the lock on whatever owns
+	 * the block, so its bit can't change under us, and readers of
+	 * one file shouldn't all queue up here.
+	 */
 	return bitmap_isset(sfs->sfs_freemap, diskblock);
 }
 
@@ -135,33 +319,405 @@ sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 //
 // Block mapping/inode maintenance
 
+/* File blocks mapped by one indirect, double and triple indirect block */
+#define SFS_IDSPAN1	SFS_DBPERIDB
+#define SFS_IDSPAN2	(SFS_IDSPAN1 * SFS_DBPERIDB)
+#define SFS_IDSPAN3	(SFS_IDSPAN2 * SFS_DBPERIDB)
+
+/*
+ * File blocks mapped by each entry of an indirect block at LEVEL
+ * (1 for a plain indirect block); 1 for level 0, a data block.
+ */
+static
+uint32_t
+sfs_idspan(unsigned level)
+{
+	switch (level) {
+	    case 0: return 1;
+	    case 1: return SFS_IDSPAN1;
+	    case 2: return SFS_IDSPAN2;
+	    case 3: return SFS_IDSPAN3;
+	}
+	panic("sfs: idspan: bad level %u\n", level);
+	return 0;
+}
+
+/*
+ * Each vnode keeps a copy of the last bottom-level indirect block it
+ * went through, so that sequential I/O through the indirect blocks
+ * goes down the tree once per SFS_DBPERIDB blocks rather than once
+ * per block. The copy is updated when sfs_bmap changes the block
+ * under it and dropped by truncate. Readers of a file share sv_lock
+ * and may fill it at the same time, so it has a spinlock of its own.
+ * The memory for it is only allocated for files that get that big.
+ */
+static
+bool
+sfs_idcache_lookup(struct sfs_vnode *sv, uint32_t fileblock,
+		   uint32_t *block)
+{
+	bool found = false;
+
+	spinlock_acquire(&sv->sv_idcachelock);
+	if (sv->sv_idcacheblock != 0 &&
+	    fileblock >= sv->sv_idcachebase &&
+	    fileblock - sv->sv_idcachebase < SFS_DBPERIDB) {
+		*block = sv->sv_idcache[fileblock - sv->sv_idcachebase];
+		found = true;
+	}
+	spinlock_release(&sv->sv_idcachelock);
+	return found;
+}
+
+static
+void
+sfs_idcache_fill(struct sfs_vnode *sv, uint32_t base, uint32_t idblock,
+		 const uint32_t *idbuf)
+{
+	uint32_t *mem = NULL;
+
+	if (sv->sv_idcache == NULL) {
+		/* (Someone else may beat us to it; checked again below) */
+		mem = kmalloc(SFS_BLOCKSIZE);
+		if (mem == NULL) {
+			/* It's only a cache. */
+			return;
+		}
+	}
+
+	spinlock_acquire(&sv->sv_idcachelock);
+	if (sv->sv_idcache == NULL) {
+		sv->sv_idcache = mem;
+		mem = NULL;
+	}
+	memcpy(sv->sv_idcache, idbuf, SFS_BLOCKSIZE);
+	sv->sv_idcachebase = base;
+	sv->sv_idcacheblock = idblock;
+	spinlock_release(&sv->sv_idcachelock);
+
+	if (mem != NULL) {
+		kfree(mem);
+	}
+}
+
+static
+void
+sfs_idcache_invalidate(struct sfs_vnode *sv)
+{
+	spinlock_acquire(&sv->sv_idcachelock);
+	sv->sv_idcacheblock = 0;
+	spinlock_release(&sv->sv_idcachelock);
+}
+
+/*
+ * Files made on a volume with SFS_SUPER_EXTENTS set are mapped by a
+ * list of extents in the inode instead of block pointers. The
+ * extents cover the file's blocks in order from block 0, so finding
+ * a block is a short walk down the list, and with sfs_balloc_file
+ * laying files out sequentially a big file is a few long extents.
+ * Blocks past the last extent are holes; a file can't have holes
+ * anywhere else, so writing past the end fills in the gap with
+ * zeroed blocks. A file that's too fragmented to fit in
+ * SFS_NEXTENTS extents is switched over to block pointers, which it
+ * keeps from then on.
+ */
+
+/*
+ * Find file block FILEBLOCK of extent-mapped file SV. Hands back its
+ * disk block, or 0 if it's past the end, and in *RUN how many blocks
+ * of the same extent there are from it on (0 past the end).
+ */
+static
+void
+sfs_extent_lookup(struct sfs_vnode *sv, uint32_t fileblock,
+		  uint32_t *diskblock, uint32_t *run)
+{
+	const struct sfs_extent *se;
+	uint32_t i, base = 0;
+
+	for (i=0; i<sv->sv_i.sfi_nextents; i++) {
+		se = &sv->sv_i.sfi_extents[i];
+		if (fileblock - base < se->sfe_len) {
+			*diskblock = se->sfe_start + (fileblock - base);
+			*run = se->sfe_len - (fileblock - base);
+			return;
+		}
+		base += se->sfe_len;
+	}
+	*diskblock = 0;
+	*run = 0;
+}
+
+/* Number of blocks the extents of SV map. */
+static
+uint32_t
+sfs_extent_nblocks(struct sfs_vnode *sv)
+{
+	uint32_t i, n = 0;
+
+	for (i=0; i<sv->sv_i.sfi_nextents; i++) {
+		n += sv->sv_i.sfi_extents[i].sfe_len;
+	}
+	return n;
+}
+
+/*
+ * Free the indirect blocks, but not the data blocks, of the tree
+ * under IDBLOCK at LEVEL (1 for a plain indirect block). For backing
+ * out of sfs_extent_tobmap, which only allocated the indirect blocks.
+ */
+static
+void
+sfs_freeindirect(struct sfs_fs *sfs, uint32_t idblock, unsigned level)
+{
+	struct buf *idb;
+	uint32_t *idbuf;
+	unsigned j;
+
+	if (idblock == 0) {
+		return;
+	}
+	if (buffer_read(sfs->sfs_device, idblock, &idb)) {
+		/* Can't tell what's under it; leave it for sfsck */
+		return;
+	}
+	if (level > 1) {
+		idbuf = buffer_map(idb);
+		for (j=0; j<SFS_DBPERIDB; j++) {
+			sfs_freeindirect(sfs, idbuf[j], level - 1);
+		}
+	}
+	buffer_release_and_invalidate(idb);
+	sfs_bfree(sfs, idblock);
+}
+
+/*
+ * Switch extent-mapped file SV over to block pointers, mapping the
+ * same blocks. If that fails (say, there's no room for the indirect
+ * blocks) it's left as it was.
+ */
+static
+int
+sfs_extent_tobmap(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_inode *sfi = &sv->sv_i;
+	struct sfs_extent *saved;
+	uint32_t nextents, fileblock, block, i, j;
+	int result = 0;
+
+	nextents = sfi->sfi_nextents;
+	saved = kmalloc(nextents * sizeof(struct sfs_extent));
+	if (saved == NULL) {
+		return ENOMEM;
+	}
+	memcpy(saved, sfi->sfi_extents, nextents * sizeof(struct sfs_extent));
+
+	sfi->sfi_flags &= ~SFS_IF_EXTENTS;
+	sfi->sfi_nextents = 0;
+	bzero(sfi->sfi_extents, sizeof(sfi->sfi_extents));
+	sfs_idcache_invalidate(sv);
+
+	fileblock = 0;
+	for (i=0; i<nextents && result == 0; i++) {
+		for (j=0; j<saved[i].sfe_len && result == 0; j++) {
+			result = sfs_dobmap(sv, fileblock, SFS_BMAP_ALLOC,
+					    saved[i].sfe_start + j, &block);
+			fileblock++;
+		}
+	}
+
+	if (result) {
+		sfs_freeindirect(sfs, sfi->sfi_indirect, 1);
+		sfs_freeindirect(sfs, sfi->sfi_dindirect, 2);
+		sfs_freeindirect(sfs, sfi->sfi_tindirect, 3);
+		sfi->sfi_indirect = 0;
+		sfi->sfi_dindirect = 0;
+		sfi->sfi_tindirect = 0;
+		bzero(sfi->sfi_direct, sizeof(sfi->sfi_direct));
+		sfs_idcache_invalidate(sv);
+
+		sfi->sfi_flags |= SFS_IF_EXTENTS;
+		sfi->sfi_nextents = nextents;
+		memcpy(sfi->sfi_extents, saved,
+		       nextents * sizeof(struct sfs_extent));
+	}
+	sv->sv_dirty = true;
+	kfree(saved);
+	return result;
+}
+
+/*
+ * Add a block to the end of extent-mapped file SV, growing the last
+ * extent if the new block is right after it. If it needs a new
+ * extent and there isn't one, SV is switched to block pointers, so
+ * check for that before adding any more blocks this way.
+ */
+static
+int
+sfs_extent_append(struct sfs_vnode *sv, bool zero, uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_inode *sfi = &sv->sv_i;
+	struct sfs_extent *se = NULL;
+	uint32_t block, fileblock;
+	int result;
+
+	result = sfs_balloc_file(sv, zero, &block);
+	if (result) {
+		return result;
+	}
+
+	if (sfi->sfi_nextents > 0) {
+		se = &sfi->sfi_extents[sfi->sfi_nextents - 1];
+	}
+	if (se != NULL && se->sfe_start + se->sfe_len == block) {
+		se->sfe_len++;
+	}
+	else if (sfi->sfi_nextents < SFS_NEXTENTS) {
+		se = &sfi->sfi_extents[sfi->sfi_nextents++];
+		se->sfe_start = block;
+		se->sfe_len = 1;
+	}
+	else {
+		/* Out of extents */
+		fileblock = sfs_extent_nblocks(sv);
+		result = sfs_extent_tobmap(sv);
+		if (result == 0) {
+			result = sfs_dobmap(sv, fileblock, SFS_BMAP_ALLOC,
+					    block, &block);
+		}
+		if (result) {
+			sfs_bfree(sfs, block);
+			return result;
+		}
+	}
+	sv->sv_dirty = true;
+
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * sfs_bmap for extent-mapped files.
+ */
+static
+int
+sfs_extent_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
+		uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t block, run, n;
+	int result;
+
+	sfs_extent_lookup(sv, fileblock, &block, &run);
+
+	if (block == 0 && doalloc) {
+		/* Fill in any gap up to it, then add it */
+		for (n = sfs_extent_nblocks(sv); n <= fileblock; n++) {
+			result = sfs_extent_append(sv,
+				n < fileblock || doalloc != SFS_BMAP_NOZERO,
+				&block);
+			if (result) {
+				return result;
+			}
+			if (!(sv->sv_i.sfi_flags & SFS_IF_EXTENTS)) {
+				/* Switched to block pointers; no gap needed */
+				return sfs_dobmap(sv, fileblock, doalloc, 0,
+						  diskblock);
+			}
+		}
+	}
+
+	if (block != 0 && !sfs_bused(sfs, block)) {
+		panic("sfs: Data block %u (block %u of file %u) marked free\n",
+		      block, fileblock, sv->sv_ino);
+	}
+	*diskblock = block;
+	return 0;
+}
+
+/*
+ * Truncate extent-mapped file SV to BLOCKLEN blocks, freeing the
+ * rest.
+ */
+static
+void
+sfs_extent_truncate(struct sfs_vnode *sv, uint32_t blocklen)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_inode *sfi = &sv->sv_i;
+	struct sfs_extent *se;
+	uint32_t i, j, base, keep;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	base = 0;
+	for (i=0; i<sfi->sfi_nextents; i++) {
+		se = &sfi->sfi_extents[i];
+		keep = se->sfe_len;
+		if (base + se->sfe_len > blocklen) {
+			keep = (blocklen > base) ? blocklen - base : 0;
+			for (j=keep; j<se->sfe_len; j++) {
+				bitmap_unmark(sfs->sfs_freemap,
+					      se->sfe_start + j);
+			}
+			sfs->sfs_freemapdirty = true;
+		}
+		base += se->sfe_len;
+		se->sfe_len = keep;
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	/* Drop the extents that are now empty; they're all at the end */
+	while (sfi->sfi_nextents > 0 &&
+	       sfi->sfi_extents[sfi->sfi_nextents - 1].sfe_len == 0) {
+		sfi->sfi_nextents--;
+		sfi->sfi_extents[sfi->sfi_nextents].sfe_start = 0;
+	}
+
+	/* Carry on from the new end when the file grows again */
+	if (sfi->sfi_nextents > 0) {
+		se = &sfi->sfi_extents[sfi->sfi_nextents - 1];
+		sv->sv_lastblock = se->sfe_start + se->sfe_len - 1;
+	}
+	else {
+		sv->sv_lastblock = 0;
+	}
+	sv->sv_dirty = true;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * allocated; with SFS_BMAP_NOZERO the new data block isn't cleared,
+ * because the caller is about to overwrite all of it. If NEWBLOCK
+ * isn't 0, it's an already allocated block to put there instead of
+ * allocating one (indirect blocks are still allocated as needed).
  */
 static
 int
-sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
-	 uint32_t *diskblock)
+sfs_dobmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
+	   uint32_t newblock, uint32_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *idb;
+	uint32_t *idbuf;
+	uint32_t *idslot;	/* the inode's pointer to the top block */
 	uint32_t block;
 	uint32_t idblock;
-	uint32_t idnum, idoff;
+	uint32_t idoff;
+	uint32_t relblock;	/* block number within the indirect tree */
+	uint32_t leafbase;
+	uint32_t span;
+	unsigned level;		/* 1 for indirect, 2 double, 3 triple */
+	bool zero = (doalloc != SFS_BMAP_NOZERO);
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	if (sv->sv_i.sfi_flags & SFS_IF_EXTENTS) {
+		KASSERT(newblock == 0);
+		return sfs_extent_bmap(sv, fileblock, doalloc, diskblock);
+	}
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -176,9 +732,14 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
-			if (result) {
-				return result;
+			if (newblock != 0) {
+				block = newblock;
+			}
+			else {
+				result = sfs_balloc_file(sv, zero, &block);
+				if (result) {
+					return result;
+				}
 			}
 
 			/* Remember what we allocated; mark inode dirty */
@@ -198,27 +759,40 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
+	 * It's not a direct block. The rest of the file is mapped by the
+	 * indirect block, then the double indirect, then the triple
+	 * indirect; see which one, and where in its tree the block is.
+	 * If it's in the bottom-level indirect block we looked at last,
+	 * the cached copy will do.
 	 */
+	if (sfs_idcache_lookup(sv, fileblock, &block) &&
+	    (block != 0 || !doalloc)) {
+		goto done;
+	}
 
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
-	 */
-	if (idnum > 0) {
+	relblock = fileblock - SFS_NDIRECT;
+	if (relblock < SFS_IDSPAN1) {
+		level = 1;
+		idslot = &sv->sv_i.sfi_indirect;
+	}
+	else if ((relblock -= SFS_IDSPAN1) < SFS_IDSPAN2) {
+		level = 2;
+		idslot = &sv->sv_i.sfi_dindirect;
+	}
+	else if ((relblock -= SFS_IDSPAN2) < SFS_IDSPAN3) {
+		level = 3;
+		idslot = &sv->sv_i.sfi_tindirect;
+	}
+	else {
+		/* Past the end of the triple indirect block. */
 		return EFBIG;
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
+	/* First file block mapped by the bottom-level indirect block */
+	leafbase = fileblock - relblock % SFS_DBPERIDB;
+
+	/* Get the disk block number of the top indirect block. */
+	idblock = *idslot;
 
 	if (idblock==0 && !doalloc) {
 		/*
@@ -236,50 +810,74 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * the indirect block. Thus, we need to allocate an
 		 * indirect block.
 		 */
-		result = sfs_balloc(sfs, &idblock);
+		result = sfs_balloc_file(sv, true, &idblock);
 		if (result) {
 			return result;
 		}
 
 		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+		*idslot = idblock;
 
 		/* Mark the inode dirty */
 		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
-	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	/*
+	 * Go down the tree. At each level, load the indirect block (if
+	 * we just allocated it, sfs_balloc_file zeroed it in the buffer
+	 * cache, so this doesn't go to disk) and get the next block out
+	 * of it, allocating that if need be. At the bottom level the
+	 * next block is the data block.
+	 */
+	for (; level > 0; level--) {
+		span = sfs_idspan(level - 1);
+		idoff = relblock / span;
+		relblock %= span;
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		result = buffer_read(sfs->sfs_device, idblock, &idb);
 		if (result) {
 			return result;
 		}
+		idbuf = buffer_map(idb);
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+		block = idbuf[idoff];
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
+		/* If there's no block there, allocate one */
+		if (block==0 && doalloc && level == 1 && newblock != 0) {
+			block = newblock;
+			idbuf[idoff] = block;
+			buffer_mark_dirty(idb);
 		}
+		else if (block==0 && doalloc) {
+			/* Indirect blocks always need zeroing */
+			result = sfs_balloc_file(sv, level > 1 || zero,
+						 &block);
+			if (result) {
+				buffer_release(idb);
+				return result;
+			}
+
+			/* Remember the block we allocated */
+			idbuf[idoff] = block;
+
+			/* The indirect block is now dirty */
+			buffer_mark_dirty(idb);
+		}
+
+		if (level == 1) {
+			sfs_idcache_fill(sv, leafbase, idblock, idbuf);
+		}
+		buffer_release(idb);
+
+		if (block == 0) {
+			/* A hole (and we weren't asked to fill it) */
+			*diskblock = 0;
+			return 0;
+		}
+		idblock = block;
 	}
 
+ done:
 	/* Hand back the result and return. */
 	if (block != 0 && !sfs_bused(sfs, block)) {
 		panic("sfs: Data block %u (block %u of file %u) marked free\n",
@@ -289,6 +887,14 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	return 0;
 }
 
+static
+int
+sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
+	 uint32_t *diskblock)
+{
+	return sfs_dobmap(sv, fileblock, doalloc, 0, diskblock);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
@@ -308,16 +914,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *b;
 	uint32_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -339,54 +937,120 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache and do the requested
+	 * operation into/out of it.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = buffer_read(sfs->sfs_device, diskblock, &b);
 	if (result) {
 		return result;
 	}
 
+	result = uiomove((char *)buffer_map(b) + skipstart, len, uio);
+
 	/*
-	 * If it was a write, write back the modified block.
+	 * If it was a write, the buffer now needs writing back, even
+	 * if uiomove failed partway.
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
+		buffer_mark_dirty(b);
+	}
+	buffer_release(b);
+
+	return result;
+}
+
+/*
+ * Find the disk block for whole-block I/O on file block FILEBLOCK,
+ * allocating it if we're writing and it isn't there. Also hands back
+ * in *RUN how many blocks from it on (at most MAX) are known to be
+ * consecutive on disk without looking further, which for an extent
+ * file is the rest of the extent, and in *FRESH whether the block
+ * was just allocated. For a hole, when reading, the block is 0.
+ */
+static
+int
+sfs_blockmap(struct sfs_vnode *sv, uint32_t fileblock, uint32_t max,
+	     enum uio_rw rw, uint32_t *diskblock, uint32_t *run, bool *fresh)
+{
+	int result;
+
+	*run = 1;
+	*fresh = false;
+
+	if (sv->sv_i.sfi_flags & SFS_IF_EXTENTS) {
+		sfs_extent_lookup(sv, fileblock, diskblock, run);
+		if (*diskblock == 0 && rw == UIO_READ) {
+			/* All holes from here on */
+			*run = max;
+		}
+		if (*run > max) {
+			*run = max;
+		}
+		if (*diskblock != 0 || rw == UIO_READ) {
+			return 0;
+		}
+		*run = 1;
+	}
+	else {
+		result = sfs_bmap(sv, fileblock, SFS_BMAP_LOOKUP, diskblock);
 		if (result) {
 			return result;
 		}
+		if (*diskblock != 0 || rw == UIO_READ) {
+			return 0;
+		}
 	}
 
+	/*
+	 * Allocate it. We're about to write all of it, so there's no
+	 * point zeroing it first.
+	 */
+	result = sfs_bmap(sv, fileblock, SFS_BMAP_NOZERO, diskblock);
+	if (result) {
+		return result;
+	}
+	*fresh = true;
 	return 0;
 }
 
 /*
- * Do I/O (either read or write) of a single whole block.
+ * Don't let a file show whatever was in blocks it was just given
+ * if writing them failed.
+ */
+static
+void
+sfs_clearblocks(struct sfs_fs *sfs, uint32_t block, uint32_t nblocks)
+{
+	uint32_t i;
+
+	for (i=0; i<nblocks; i++) {
+		sfs_clearblock(sfs, block + i);
+	}
+}
+
+/*
+ * Do I/O (either read or write) of NBLOCKS whole blocks. The blocks
+ * are mapped first, and each run of them that's consecutive on disk
+ * (and all just allocated, or all not) is done with one call to
+ * sfs_rwblocks, so a big transfer to a file that's laid out
+ * sequentially becomes a few big disk transfers.
  */
 static
 int
-sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
+sfs_blockio(struct sfs_vnode *sv, struct uio *uio, uint32_t nblocks)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t diskblock;
 	uint32_t fileblock;
-	int result;
-	int doalloc = (uio->uio_rw==UIO_WRITE);
+	uint32_t diskblock, run, next, nextrun;
+	bool fresh, nextfresh;
+	int result, mapresult;
 	off_t saveoff;
 	off_t diskoff;
 	off_t saveres;
@@ -394,50 +1058,159 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 
 	/* Get the block number within the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	KASSERT(uio->uio_resid >= nblocks * SFS_BLOCKSIZE);
 
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	result = sfs_blockmap(sv, fileblock, nblocks, uio->uio_rw,
+			      &diskblock, &run, &fresh);
 	if (result) {
 		return result;
 	}
 
-	if (diskblock == 0) {
+	while (1) {
 		/*
-		 * No block - fill with zeros.
-		 *
-		 * We must be reading, or sfs_bmap would have
-		 * allocated a block for us.
+		 * Add on the blocks after the run as long as they
+		 * carry on where it leaves off. The first one that
+		 * doesn't is kept for the next time around.
 		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
-	}
+		mapresult = 0;
+		next = 0;
+		nextrun = 0;
+		nextfresh = false;
+		while (run < nblocks) {
+			mapresult = sfs_blockmap(sv, fileblock + run,
+						 nblocks - run, uio->uio_rw,
+						 &next, &nextrun, &nextfresh);
+			if (mapresult) {
+				nextrun = 0;
+				break;
+			}
+			if (nextfresh != fresh ||
+			    next != (diskblock == 0 ? 0 : diskblock + run)) {
+				break;
+			}
+			run += nextrun;
+			nextrun = 0;
+		}
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+		if (diskblock == 0) {
+			/*
+			 * No blocks - fill with zeros.
+			 *
+			 * We must be reading, or sfs_blockmap would
+			 * have allocated blocks for us.
+			 */
+			KASSERT(uio->uio_rw == UIO_READ);
+			result = uiomovezeros(run * SFS_BLOCKSIZE, uio);
+		}
+		else {
+			/*
+			 * Do the I/O directly to the uio region. Save
+			 * the uio_offset and uio_resid, and substitute
+			 * ones that make sense to the device.
+			 */
+			saveoff = uio->uio_offset;
+			diskoff = (off_t)diskblock * SFS_BLOCKSIZE;
+			uio->uio_offset = diskoff;
+			saveres = uio->uio_resid;
+			diskres = run * SFS_BLOCKSIZE;
+			uio->uio_resid = diskres;
+
+			result = sfs_rwblocks(sfs, uio);
+			if (result && fresh) {
+				sfs_clearblocks(sfs, diskblock, run);
+			}
 
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
+			/*
+			 * Now, restore the original uio_offset and
+			 * uio_resid and update them by the amount of
+			 * I/O done.
+			 */
+			uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
+			uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+		}
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+		if (result) {
+			if (nextrun > 0 && nextfresh) {
+				sfs_clearblocks(sfs, next, nextrun);
+			}
+			return result;
+		}
+		if (mapresult || nextrun == 0) {
+			/* Out of space, or all done */
+			return mapresult;
+		}
 
-	return result;
+		fileblock += run;
+		nblocks -= run;
+		diskblock = next;
+		run = nextrun;
+		fresh = nextfresh;
+	}
+}
+
+/*
+ * Called after reading file blocks FIRST through LAST. If the file is
+ * being read sequentially in pieces small enough to go through the
+ * buffer cache, ask the cache to load the next SFS_READAHEAD blocks
+ * in the background, in a transfer per run of them that's
+ * consecutive on disk. This is done again when the reader gets
+ * halfway through what was read ahead, so it shouldn't ever have to
+ * wait for the disk. Big reads go straight to the disk and don't
+ * need it.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, uint32_t first, uint32_t last)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t start, end, fileblock, nfileblocks;
+	uint32_t diskblock, runstart, runlen;
+	bool sequential;
+
+	nfileblocks = DIVROUNDUP(sv->sv_i.sfi_size, SFS_BLOCKSIZE);
+
+	spinlock_acquire(&sv->sv_ralock);
+	/* (Reading the rest of a partly-read block counts, too) */
+	sequential = first == sv->sv_ranext || first + 1 == sv->sv_ranext;
+	sv->sv_ranext = last + 1;
+	if (!sequential || last - first + 1 >= SFS_MINDIRECT) {
+		sv->sv_raend = 0;
+		spinlock_release(&sv->sv_ralock);
+		return;
+	}
+	if (sv->sv_raend > last + SFS_READAHEAD / 2) {
+		/* Still well ahead */
+		spinlock_release(&sv->sv_ralock);
+		return;
+	}
+	start = (sv->sv_raend > last) ? sv->sv_raend : last + 1;
+	end = last + 1 + SFS_READAHEAD;
+	if (end > nfileblocks) {
+		end = nfileblocks;
+	}
+	sv->sv_raend = end;
+	spinlock_release(&sv->sv_ralock);
+
+	runstart = 0;
+	runlen = 0;
+	for (fileblock = start; fileblock < end; fileblock++) {
+		if (sfs_bmap(sv, fileblock, SFS_BMAP_LOOKUP, &diskblock)) {
+			break;
+		}
+		if (runlen > 0 && diskblock == runstart + runlen) {
+			runlen++;
+			continue;
+		}
+		if (runlen > 0) {
+			buffer_readahead(sfs->sfs_device, runstart, runlen);
+		}
+		/* Nothing to read for a hole */
+		runstart = diskblock;
+		runlen = (diskblock != 0) ? 1 : 0;
+	}
+	if (runlen > 0) {
+		buffer_readahead(sfs->sfs_device, runstart, runlen);
+	}
 }
 
 /*
@@ -448,9 +1221,10 @@ int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
 	uint32_t blkoff;
-	uint32_t nblocks, i;
+	uint32_t nblocks;
 	int result = 0;
 	uint32_t extraresid = 0;
+	off_t startoff = uio->uio_offset;
 
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
@@ -506,8 +1280,8 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	 */
 	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
 	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
-	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
+	if (nblocks > 0) {
+		result = sfs_blockio(sv, uio, nblocks);
 		if (result) {
 			goto out;
 		}
@@ -534,6 +1308,13 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 		sv->sv_dirty = true;
 	}
 
+	/* If reading sequentially, get the next blocks coming */
+	if (uio->uio_rw == UIO_READ && result == 0 &&
+	    uio->uio_offset > startoff) {
+		sfs_readahead(sv, startoff / SFS_BLOCKSIZE,
+			      (uio->uio_offset - 1) / SFS_BLOCKSIZE);
+	}
+
 	/* Add in any extra amount we couldn't read because of EOF */
 	uio->uio_resid += extraresid;
 
@@ -580,66 +1361,622 @@ sfs_readdir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
 }
 
 /*
- * Write (overwrite) the directory entry in slot SLOT of a directory
- * vnode.
+ * Write (overwrite) the directory entry in slot SLOT of a directory
+ * vnode.
+ */
+static
+int
+sfs_writedir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
+{
+	struct iovec iov;
+	struct uio ku;
+	off_t actualpos;
+	int result;
+
+	/* Compute the actual position in the directory. */
+	KASSERT(slot>=0);
+	actualpos = slot * sizeof(struct sfs_dir);
+
+	/* Set up a uio to do the write */ 
+	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_WRITE);
+
+	/* do it */
+	result = sfs_io(sv, &ku);
+	if (result) {
+		return result;
+	}
+
+	/* Should not end up with a partial entry! */
+	if (ku.uio_resid > 0) {
+		panic("sfs: writedir: Short write (ino %u)\n", sv->sv_ino);
+	}
+
+	/* Done */
+	return 0;
+}
+
+/*
+ * Compute the number of entries in a directory.
+ * This actually computes the number of existing slots, and does not
+ * account for empty slots.
+ */
+static
+int
+sfs_dir_nentries(struct sfs_vnode *sv)
+{
+	off_t size;
+
+	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
+
+	size = sv->sv_i.sfi_size;
+	if (size % sizeof(struct sfs_dir) != 0) {
+		panic("sfs: directory %u: Invalid size %llu\n",
+		      sv->sv_ino, size);
+	}
+
+	return size / sizeof(struct sfs_dir);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Directory index
+//
+// A directory with an index (see kern/sfs.h for the layout) is looked
+// up by reading the bucket its name hashes to and then the entries
+// that bucket points at whose hash matches, instead of every entry in
+// the directory; and a free slot for a new entry is found from the
+// hint in the header instead of by searching.
+//
+// The index is loaded as a vnode of its own the first time it's
+// wanted, and the directory keeps a reference to it in sv_dix until
+// the directory is reclaimed. The directory's sv_lock covers the
+// index as well: lookups read it with the directory shared, and only
+// link and unlink, which hold the directory exclusively, change it.
+// Setting sv_dix is the exception, since the first to want the index
+// may be a lookup, so that's under sv_idcachelock.
+//
+// The index never holds anything the directory doesn't, so if
+// updating it fails, it's thrown away and the directory searched
+// instead until it's rebuilt.
+
+/* Hash of NAME, as described in kern/sfs.h */
+static
+uint32_t
+sfs_dix_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return (h == 0) ? 1 : h;
+}
+
+/* Buckets for an index holding NENTRIES, kept at most half full */
+static
+uint32_t
+sfs_dix_nbuckets(uint32_t nentries)
+{
+	uint32_t nbuckets = 1;
+
+	while (nbuckets * SFS_DIX_NPAIRS / 2 < nentries) {
+		nbuckets *= 2;
+	}
+	return nbuckets;
+}
+
+/*
+ * Put a pair in bucket DB if there's room. If there isn't, mark it
+ * as having overflowed and return false.
+ */
+static
+bool
+sfs_dix_bucketadd(struct sfs_dixbucket *db, uint32_t hash, uint32_t slot)
+{
+	unsigned i;
+
+	if (db->dxb_count == SFS_DIX_NPAIRS) {
+		db->dxb_overflow = 1;
+		return false;
+	}
+	for (i=0; db->dxb_pairs[i].dxp_hash != 0; i++) {
+		KASSERT(i < SFS_DIX_NPAIRS);
+	}
+	db->dxb_pairs[i].dxp_hash = hash;
+	db->dxb_pairs[i].dxp_slot = slot;
+	db->dxb_count++;
+	return true;
+}
+
+/*
+ * Get SV's index vnode, loading it if need be. Hands back NULL if the
+ * directory doesn't have an index.
+ */
+static
+int
+sfs_dix_get(struct sfs_vnode *sv, struct sfs_vnode **ret)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_vnode *dix;
+	int result;
+
+	spinlock_acquire(&sv->sv_idcachelock);
+	dix = sv->sv_dix;
+	spinlock_release(&sv->sv_idcachelock);
+	if (dix != NULL || sv->sv_i.sfi_dirindex == 0) {
+		*ret = dix;
+		return 0;
+	}
+
+	result = sfs_loadvnode(sfs, sv->sv_i.sfi_dirindex, SFS_TYPE_INVAL,
+			       &dix);
+	if (result) {
+		return result;
+	}
+	if (dix->sv_i.sfi_type != SFS_TYPE_DIRINDEX) {
+		panic("sfs: directory %u: index %u has type %u\n",
+		      sv->sv_ino, dix->sv_ino, dix->sv_i.sfi_type);
+	}
+
+	spinlock_acquire(&sv->sv_idcachelock);
+	if (sv->sv_dix == NULL) {
+		sv->sv_dix = dix;
+		dix = NULL;
+	}
+	*ret = sv->sv_dix;
+	spinlock_release(&sv->sv_idcachelock);
+
+	if (dix != NULL) {
+		/* Another lookup loaded it first */
+		VOP_DECREF(&dix->sv_v);
+	}
+	return 0;
+}
+
+/*
+ * Throw SV's index away. The directory still works; it's just
+ * searched instead.
+ */
+static
+void
+sfs_dix_drop(struct sfs_vnode *sv)
+{
+	struct sfs_vnode *dix;
+
+	if (sfs_dix_get(sv, &dix)) {
+		/* Couldn't load it; leave it for sfsck */
+		dix = NULL;
+	}
+
+	sv->sv_i.sfi_dirindex = 0;
+	sv->sv_dirty = true;
+
+	if (dix != NULL) {
+		spinlock_acquire(&sv->sv_idcachelock);
+		sv->sv_dix = NULL;
+		spinlock_release(&sv->sv_idcachelock);
+
+		/* Nothing refers to it now; it's erased when reclaimed */
+		dix->sv_i.sfi_linkcount = 0;
+		dix->sv_dirty = true;
+		VOP_DECREF(&dix->sv_v);
+	}
+}
+
+/*
+ * Get a busy buffer for block FILEBLOCK of index DIX. All the index's
+ * blocks are allocated when it's built.
+ */
+static
+int
+sfs_dix_getblock(struct sfs_vnode *dix, uint32_t fileblock, struct buf **ret)
+{
+	struct sfs_fs *sfs = dix->sv_v.vn_fs->fs_data;
+	uint32_t diskblock;
+	int result;
+
+	result = sfs_bmap(dix, fileblock, SFS_BMAP_LOOKUP, &diskblock);
+	if (result) {
+		return result;
+	}
+	if (diskblock == 0) {
+		panic("sfs: directory index %u: block %u missing\n",
+		      dix->sv_ino, fileblock);
+	}
+	return buffer_read(sfs->sfs_device, diskblock, ret);
+}
+
+/* Get a busy buffer for the header of index DIX, and check it. */
+static
+int
+sfs_dix_getheader(struct sfs_vnode *dix, struct buf **ret,
+		  struct sfs_dixheader **dh)
+{
+	int result;
+
+	result = sfs_dix_getblock(dix, 0, ret);
+	if (result) {
+		return result;
+	}
+	*dh = buffer_map(*ret);
+	if ((*dh)->dxh_magic != SFS_DIX_MAGIC ||
+	    (*dh)->dxh_nbuckets == 0 ||
+	    ((*dh)->dxh_nbuckets & ((*dh)->dxh_nbuckets - 1)) != 0) {
+		panic("sfs: directory index %u: bad header\n", dix->sv_ino);
+	}
+	return 0;
+}
+
+/*
+ * Look NAME up in directory SV through its index DIX, handing back
+ * the inode number and slot, or ENOENT.
+ */
+static
+int
+sfs_dix_lookup(struct sfs_vnode *sv, struct sfs_vnode *dix,
+	       const char *name, uint32_t *ino, int *slot)
+{
+	struct buf *b;
+	struct sfs_dixheader *dh;
+	struct sfs_dixbucket *db;
+	struct sfs_dir tsd;
+	uint32_t hash, nbuckets, bucket, candidate, n;
+	unsigned i;
+	bool overflow;
+	int result;
+
+	hash = sfs_dix_hash(name);
+
+	result = sfs_dix_getheader(dix, &b, &dh);
+	if (result) {
+		return result;
+	}
+	nbuckets = dh->dxh_nbuckets;
+	buffer_release(b);
+
+	bucket = hash & (nbuckets - 1);
+	for (n=0; n<nbuckets; n++) {
+		i = 0;
+		while (1) {
+			result = sfs_dix_getblock(dix, 1 + bucket, &b);
+			if (result) {
+				return result;
+			}
+			db = buffer_map(b);
+			while (i < SFS_DIX_NPAIRS &&
+			       db->dxb_pairs[i].dxp_hash != hash) {
+				i++;
+			}
+			candidate = (i < SFS_DIX_NPAIRS) ?
+				db->dxb_pairs[i].dxp_slot : 0;
+			overflow = db->dxb_overflow != 0;
+			buffer_release(b);
+
+			if (i == SFS_DIX_NPAIRS) {
+				break;
+			}
+
+			/* Same hash; see if it's the same name */
+			if (candidate >= (uint32_t)sfs_dir_nentries(sv)) {
+				panic("sfs: directory %u: index points "
+				      "past the end\n", sv->sv_ino);
+			}
+			result = sfs_readdir(sv, &tsd, candidate);
+			if (result) {
+				return result;
+			}
+			tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+			if (tsd.sfd_ino != SFS_NOINO &&
+			    !strcmp(tsd.sfd_name, name)) {
+				*ino = tsd.sfd_ino;
+				*slot = candidate;
+				return 0;
+			}
+			i++;
+		}
+		if (!overflow) {
+			break;
+		}
+		bucket = (bucket + 1) & (nbuckets - 1);
+	}
+	return ENOENT;
+}
+
+/*
+ * Choose a slot for a new entry in SV: the first free one at or after
+ * the hint, or the end of the directory if none are free.
+ */
+static
+int
+sfs_dix_freeslot(struct sfs_vnode *sv, struct sfs_vnode *dix, int *ret)
+{
+	struct buf *b;
+	struct sfs_dixheader *dh;
+	struct sfs_dir tsd;
+	uint32_t nentries, freehint;
+	int nslots, i, result;
+
+	result = sfs_dix_getheader(dix, &b, &dh);
+	if (result) {
+		return result;
+	}
+	nentries = dh->dxh_nentries;
+	freehint = dh->dxh_freehint;
+	buffer_release(b);
+
+	nslots = sfs_dir_nentries(sv);
+	if (nentries < (uint32_t)nslots) {
+		for (i=freehint; i<nslots; i++) {
+			result = sfs_readdir(sv, &tsd, i);
+			if (result) {
+				return result;
+			}
+			if (tsd.sfd_ino == SFS_NOINO) {
+				*ret = i;
+				return 0;
+			}
+		}
+	}
+	*ret = nslots;
+	return 0;
+}
+
+/*
+ * Build a new index for SV with NBUCKETS buckets from the entries in
+ * the directory, replacing any it had. It's put together in memory
+ * and written in one go.
+ */
+static
+int
+sfs_dix_build(struct sfs_vnode *sv, uint32_t nbuckets)
+{
+	const unsigned perblock = SFS_BLOCKSIZE / sizeof(struct sfs_dir);
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_vnode *dix;
+	struct sfs_dixheader *dh;
+	struct sfs_dixbucket *buckets;
+	struct sfs_dir *sd;
+	struct iovec iov;
+	struct uio ku;
+	char *mem;
+	size_t len;
+	uint32_t nslots, slot, nentries, freehint, hash, bucket, n;
+	unsigned i, count;
+	int result;
+
+	len = (1 + nbuckets) * SFS_BLOCKSIZE;
+	mem = kmalloc(len);
+	sd = kmalloc(SFS_BLOCKSIZE);
+	if (mem == NULL || sd == NULL) {
+		kfree(mem);
+		kfree(sd);
+		return ENOMEM;
+	}
+	bzero(mem, len);
+	dh = (struct sfs_dixheader *)mem;
+	buckets = (struct sfs_dixbucket *)(mem + SFS_BLOCKSIZE);
+
+	/* Read the directory a block at a time */
+	nslots = sfs_dir_nentries(sv);
+	nentries = 0;
+	freehint = nslots;
+	for (slot=0; slot<nslots; slot+=count) {
+		count = nslots - slot < perblock ? nslots - slot : perblock;
+		uio_kinit(&iov, &ku, sd, count * sizeof(struct sfs_dir),
+			  (off_t)slot * sizeof(struct sfs_dir), UIO_READ);
+		result = sfs_io(sv, &ku);
+		if (result) {
+			goto out;
+		}
+		for (i=0; i<count; i++) {
+			if (sd[i].sfd_ino == SFS_NOINO) {
+				if (freehint == nslots) {
+					freehint = slot + i;
+				}
+				continue;
+			}
+			sd[i].sfd_name[sizeof(sd[i].sfd_name)-1] = 0;
+			hash = sfs_dix_hash(sd[i].sfd_name);
+			bucket = hash & (nbuckets - 1);
+			for (n=0; n<nbuckets; n++) {
+				if (sfs_dix_bucketadd(&buckets[bucket],
+						      hash, slot + i)) {
+					break;
+				}
+				bucket = (bucket + 1) & (nbuckets - 1);
+			}
+			if (n == nbuckets) {
+				/* Too small; the caller asked for too few */
+				result = ENOSPC;
+				goto out;
+			}
+			nentries++;
+		}
+	}
+	dh->dxh_magic = SFS_DIX_MAGIC;
+	dh->dxh_nbuckets = nbuckets;
+	dh->dxh_nentries = nentries;
+	dh->dxh_freehint = freehint;
+
+	/* Make an index inode, or empty out the old one */
+	result = sfs_dix_get(sv, &dix);
+	if (result) {
+		goto out;
+	}
+	if (dix == NULL) {
+		result = sfs_makeobj(sfs, SFS_TYPE_DIRINDEX, sv->sv_ino, &dix);
+		if (result) {
+			goto out;
+		}
+		dix->sv_i.sfi_linkcount = 1;
+		dix->sv_dirty = true;
+		sv->sv_i.sfi_dirindex = dix->sv_ino;
+		sv->sv_dirty = true;
+		spinlock_acquire(&sv->sv_idcachelock);
+		sv->sv_dix = dix;
+		spinlock_release(&sv->sv_idcachelock);
+	}
+	else {
+		result = sfs_dotruncate(dix, 0);
+		if (result) {
+			sfs_dix_drop(sv);
+			goto out;
+		}
+	}
+
+	uio_kinit(&iov, &ku, mem, len, 0, UIO_WRITE);
+	result = sfs_io(dix, &ku);
+	if (result) {
+		sfs_dix_drop(sv);
+	}
+
+ out:
+	kfree(mem);
+	kfree(sd);
+	return result;
+}
+
+/*
+ * Add NAME, just written to slot SLOT of SV, to its index DIX, and
+ * grow the index if it's now more than half full.
  */
 static
 int
-sfs_writedir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
+sfs_dix_insert(struct sfs_vnode *sv, struct sfs_vnode *dix,
+	       const char *name, uint32_t slot)
 {
-	struct iovec iov;
-	struct uio ku;
-	off_t actualpos;
+	struct buf *b;
+	struct sfs_dixheader *dh;
+	uint32_t hash, nbuckets, nentries, bucket, n;
+	bool added;
 	int result;
 
-	/* Compute the actual position in the directory. */
-	KASSERT(slot>=0);
-	actualpos = slot * sizeof(struct sfs_dir);
-
-	/* Set up a uio to do the write */ 
-	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_WRITE);
+	hash = sfs_dix_hash(name);
 
-	/* do it */
-	result = sfs_io(sv, &ku);
+	result = sfs_dix_getheader(dix, &b, &dh);
 	if (result) {
 		return result;
 	}
+	nbuckets = dh->dxh_nbuckets;
+	buffer_release(b);
 
-	/* Should not end up with a partial entry! */
-	if (ku.uio_resid > 0) {
-		panic("sfs: writedir: Short write (ino %u)\n", sv->sv_ino);
+	bucket = hash & (nbuckets - 1);
+	added = false;
+	for (n=0; n<nbuckets && !added; n++) {
+		result = sfs_dix_getblock(dix, 1 + bucket, &b);
+		if (result) {
+			return result;
+		}
+		/* (this marks the bucket overflowed if it's full) */
+		added = sfs_dix_bucketadd(buffer_map(b), hash, slot);
+		buffer_mark_dirty(b);
+		buffer_release(b);
+		bucket = (bucket + 1) & (nbuckets - 1);
+	}
+	if (!added) {
+		/* Only if there wasn't memory to grow it; give up on it */
+		return ENOSPC;
 	}
 
-	/* Done */
-	return 0;
+	result = sfs_dix_getheader(dix, &b, &dh);
+	if (result) {
+		return result;
+	}
+	nentries = ++dh->dxh_nentries;
+	/* The slot was the first free one at or after the hint */
+	if (slot >= dh->dxh_freehint) {
+		dh->dxh_freehint = slot + 1;
+	}
+	buffer_mark_dirty(b);
+	buffer_release(b);
+
+	if (nentries > nbuckets * SFS_DIX_NPAIRS / 2) {
+		result = sfs_dix_build(sv, sfs_dix_nbuckets(nentries));
+		if (result == ENOMEM) {
+			/* Leave it as it is; it still works, just fuller */
+			result = 0;
+		}
+	}
+	return result;
 }
 
 /*
- * Compute the number of entries in a directory.
- * This actually computes the number of existing slots, and does not
- * account for empty slots.
+ * Take NAME, just removed from slot SLOT of SV, out of its index DIX.
  */
 static
 int
-sfs_dir_nentries(struct sfs_vnode *sv)
+sfs_dix_remove(struct sfs_vnode *sv, struct sfs_vnode *dix,
+	       const char *name, uint32_t slot)
 {
-	off_t size;
+	struct buf *b;
+	struct sfs_dixheader *dh;
+	struct sfs_dixbucket *db;
+	uint32_t hash, nbuckets, bucket, n;
+	unsigned i;
+	bool found, overflow;
+	int result;
 
-	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
+	hash = sfs_dix_hash(name);
 
-	size = sv->sv_i.sfi_size;
-	if (size % sizeof(struct sfs_dir) != 0) {
-		panic("sfs: directory %u: Invalid size %llu\n",
-		      sv->sv_ino, size);
+	result = sfs_dix_getheader(dix, &b, &dh);
+	if (result) {
+		return result;
 	}
+	nbuckets = dh->dxh_nbuckets;
+	buffer_release(b);
 
-	return size / sizeof(struct sfs_dir);
+	bucket = hash & (nbuckets - 1);
+	found = false;
+	overflow = true;
+	for (n=0; n<nbuckets && !found && overflow; n++) {
+		result = sfs_dix_getblock(dix, 1 + bucket, &b);
+		if (result) {
+			return result;
+		}
+		db = buffer_map(b);
+		for (i=0; i<SFS_DIX_NPAIRS && !found; i++) {
+			if (db->dxb_pairs[i].dxp_hash == hash &&
+			    db->dxb_pairs[i].dxp_slot == slot) {
+				/* (dxb_overflow stays; later pairs need it) */
+				db->dxb_pairs[i].dxp_hash = 0;
+				db->dxb_pairs[i].dxp_slot = 0;
+				db->dxb_count--;
+				buffer_mark_dirty(b);
+				found = true;
+			}
+		}
+		overflow = db->dxb_overflow != 0;
+		buffer_release(b);
+		bucket = (bucket + 1) & (nbuckets - 1);
+	}
+	if (!found) {
+		panic("sfs: directory %u: slot %u not in its index\n",
+		      sv->sv_ino, slot);
+	}
+
+	result = sfs_dix_getheader(dix, &b, &dh);
+	if (result) {
+		return result;
+	}
+	dh->dxh_nentries--;
+	if (slot < dh->dxh_freehint) {
+		dh->dxh_freehint = slot;
+	}
+	buffer_mark_dirty(b);
+	buffer_release(b);
+	return 0;
 }
 
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
  * empty directory slot if one is found.
+ *
+ * The name cache answers if it can, except when an empty slot is
+ * wanted; then the index, if the directory has one and an empty slot
+ * isn't wanted. The answer from the index or from reading the
+ * directory goes into the cache.
  */
 
 static
@@ -647,10 +1984,51 @@ int
 sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		    uint32_t *ino, int *slot, int *emptyslot)
 {
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 	struct sfs_dir tsd;
 	int found = 0;
 	int nentries = sfs_dir_nentries(sv);
 	int i, result;
+	uint32_t foundino = SFS_NOINO;
+	int foundslot = -1;
+	struct sfs_vnode *dix;
+
+	if (emptyslot == NULL &&
+	    sfs_dircache_lookup(sfs, sv->sv_ino, name,
+				&foundino, &foundslot)) {
+		if (foundino == SFS_NOINO) {
+			return ENOENT;
+		}
+		if (slot != NULL) {
+			*slot = foundslot;
+		}
+		if (ino != NULL) {
+			*ino = foundino;
+		}
+		return 0;
+	}
+
+	/* Use the index if there is one (it doesn't find empty slots) */
+	result = sfs_dix_get(sv, &dix);
+	if (result) {
+		return result;
+	}
+	if (dix != NULL && emptyslot == NULL) {
+		result = sfs_dix_lookup(sv, dix, name, &foundino, &foundslot);
+		if (result && result != ENOENT) {
+			return result;
+		}
+		if (result == 0) {
+			if (slot != NULL) {
+				*slot = foundslot;
+			}
+			if (ino != NULL) {
+				*ino = foundino;
+			}
+		}
+		sfs_dircache_enter(sfs, sv->sv_ino, name, foundino, foundslot);
+		return result;
+	}
 
 	/* For each slot... */
 	for (i=0; i<nentries; i++) {
@@ -675,6 +2053,8 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 				KASSERT(found==0);
 
 				found = 1;
+				foundslot = i;
+				foundino = tsd.sfd_ino;
 				if (slot != NULL) {
 					*slot = i;
 				}
@@ -685,6 +2065,8 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		}
 	}
 
+	sfs_dircache_enter(sfs, sv->sv_ino, name, foundino, foundslot);
+
 	return found ? 0 : ENOENT;
 }
 
@@ -696,12 +2078,36 @@ static
 int
 sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 {
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_vnode *dix;
 	int emptyslot = -1;
 	int result;
 	struct sfs_dir sd;
 
-	/* Look up the name. We want to make sure it *doesn't* exist. */
-	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
+	result = sfs_dix_get(sv, &dix);
+	if (result) {
+		return result;
+	}
+	if (dix == NULL && (sfs->sfs_super.sp_flags & SFS_SUPER_DIRINDEX)) {
+		/*
+		 * Index the directory now. If that doesn't work, go on
+		 * without; it can be tried again next time.
+		 */
+		if (sfs_dix_build(sv, sfs_dix_nbuckets(sfs_dir_nentries(sv)
+							 + 1)) == 0) {
+			result = sfs_dix_get(sv, &dix);
+			if (result) {
+				return result;
+			}
+		}
+	}
+
+	/*
+	 * Look up the name. We want to make sure it *doesn't* exist.
+	 * Without an index, look for an empty slot on the way.
+	 */
+	result = sfs_dir_findname(sv, name, NULL, NULL,
+				  dix == NULL ? &emptyslot : NULL);
 	if (result!=0 && result!=ENOENT) {
 		return result;
 	}
@@ -713,6 +2119,13 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		return ENAMETOOLONG;
 	}
 
+	if (dix != NULL) {
+		result = sfs_dix_freeslot(sv, dix, &emptyslot);
+		if (result) {
+			return result;
+		}
+	}
+
 	/* If we didn't get an empty slot, add the entry at the end. */
 	if (emptyslot < 0) {
 		emptyslot = sfs_dir_nentries(sv);
@@ -729,25 +2142,57 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, &sd, emptyslot);
-	
+	result = sfs_writedir(sv, &sd, emptyslot);
+	if (result) {
+		return result;
+	}
+
+	/* Index it; if that fails, the index is no good any more */
+	if (dix != NULL && sfs_dix_insert(sv, dix, name, emptyslot)) {
+		sfs_dix_drop(sv);
+	}
+
+	/* and tell the name cache */
+	sfs_dircache_enter(sfs, sv->sv_ino, name, ino, emptyslot);
+	return 0;
 }
 
 /*
- * Unlink a name in a directory, by slot number.
+ * Unlink a name in a directory, by slot number. NAME must be the
+ * name in that slot; it's needed to update the name cache.
  */
 static
 int
-sfs_dir_unlink(struct sfs_vnode *sv, int slot)
+sfs_dir_unlink(struct sfs_vnode *sv, const char *name, int slot)
 {
+	struct sfs_vnode *dix;
 	struct sfs_dir sd;
+	int result;
+
+	result = sfs_dix_get(sv, &dix);
+	if (result) {
+		return result;
+	}
 
 	/* Initialize a suitable directory entry... */ 
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, &sd, slot);
+	result = sfs_writedir(sv, &sd, slot);
+	if (result) {
+		return result;
+	}
+
+	/* Unindex it; if that fails, the index is no good any more */
+	if (dix != NULL && sfs_dix_remove(sv, dix, name, slot)) {
+		sfs_dix_drop(sv);
+	}
+
+	/* and tell the name cache */
+	sfs_dircache_enter(sv->sv_v.vn_fs->fs_data, sv->sv_ino, name,
+			   SFS_NOINO, -1);
+	return 0;
 }
 
 /*
@@ -787,11 +2232,15 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 // Object creation
 
 /*
- * Create a new filesystem object and hand back its vnode.
+ * Create a new filesystem object and hand back its vnode. Its inode
+ * goes near GOAL, normally the directory it's going in, so that the
+ * directory, its files' inodes and (see sfs_balloc_file) their data
+ * end up close together.
  */
 static
 int
-sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+sfs_makeobj(struct sfs_fs *sfs, int type, uint32_t goal,
+	    struct sfs_vnode **ret)
 {
 	uint32_t ino;
 	int result;
@@ -801,7 +2250,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, goal, true, &ino);
 	if (result) {
 		return result;
 	}
@@ -875,6 +2324,13 @@ static
 int
 sfs_close(struct vnode *v)
 {
+	struct sfs_vnode *sv = v->vn_data;
+
+	/* Nobody's going to write it for now; give back its run. */
+	rwlock_acquire_write(sv->sv_lock);
+	sfs_prealloc_release(sv);
+	rwlock_release_write(sv->sv_lock);
+
 	/* Sync it. */
 	return VOP_FSYNC(v);
 }
@@ -890,31 +2346,40 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it. Holding sfs_vnlock keeps
+	 * sfs_loadvnode from handing it out again after we look.
 	 */
+	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
 
 		/* consume the reference VOP_DECREF gave us */
 		KASSERT(v->vn_refcount>1);
 		v->vn_refcount--;
 
-		vfs_biglock_release();
+		spinlock_release(&v->vn_countlock);
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
+
+	/*
+	 * Nobody else has the vnode, so there's no need for sv_lock
+	 * from here on.
+	 */
+
+	sfs_prealloc_release(sv);
 
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
+		result = sfs_dotruncate(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_vnlock);
 			return result;
 		}
 	}
@@ -922,37 +2387,41 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* If there are no on-disk references, discard the inode */
 	if (sv->sv_i.sfi_linkcount==0) {
+		if (sv->sv_i.sfi_type == SFS_TYPE_DIR) {
+			/* The inode number may come back as another dir */
+			sfs_dircache_purgedir(sfs, sv->sv_ino);
+		}
+		if (sv->sv_dix != NULL) {
+			/* and the index goes with it, below */
+			sv->sv_dix->sv_i.sfi_linkcount = 0;
+			sv->sv_dix->sv_dirty = true;
+		}
 		sfs_bfree(sfs, sv->sv_ino);
 	}
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	sfs_vntable_remove(sfs, sv);
 
 	VOP_CLEANUP(&sv->sv_v);
 
-	vfs_biglock_release();
+	lock_release(sfs->sfs_vnlock);
+
+	/* Let go of the index (not under sfs_vnlock; it may be reclaimed) */
+	if (sv->sv_dix != NULL) {
+		VOP_DECREF(&sv->sv_dix->sv_v);
+	}
 
 	/* Release the storage for the vnode structure itself. */
+	spinlock_cleanup(&sv->sv_idcachelock);
+	spinlock_cleanup(&sv->sv_ralock);
+	kfree(sv->sv_idcache);
+	rwlock_destroy(sv->sv_lock);
 	kfree(sv);
 
 	/* Done */
@@ -971,9 +2440,9 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	rwlock_acquire_read(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	rwlock_release_read(sv->sv_lock);
 
 	return result;
 }
@@ -990,9 +2459,9 @@ sfs_write(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 
 	return result;
 }
@@ -1033,7 +2502,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	rwlock_acquire_read(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	rwlock_release_read(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1046,6 +2517,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 
 /*
  * Return the type of the file (types as per kern/stat.h)
+ *
+ * The type never changes once the vnode is loaded, so this doesn't
+ * need sv_lock.
  */
 static
 int
@@ -1053,16 +2527,12 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1102,9 +2572,9 @@ sfs_fsync(struct vnode *v)
 	struct sfs_vnode *sv = v->vn_data;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 
 	return result;
 }
@@ -1121,35 +2591,109 @@ sfs_mmap(struct vnode *v   /* add stuff as needed */)
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Free whatever the indirect block *IDSLOT, at LEVEL (1 for a plain
+ * indirect block), maps at or past file block BLOCKLEN; BASE is the
+ * first file block it maps. If that leaves it empty, free it too and
+ * clear *IDSLOT.
  */
 static
 int
-sfs_truncate(struct vnode *v, off_t len)
+sfs_truncate_indirect(struct sfs_vnode *sv, uint32_t *idslot,
+		      unsigned level, uint32_t base, uint32_t blocklen)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *idb;
+	uint32_t *idbuf;
+	uint32_t j, span, entrybase, old;
+	int result = 0;
+	int hasnonzero, iddirty;
 
-	struct sfs_vnode *sv = v->vn_data;
+	span = sfs_idspan(level - 1);
+
+	if (*idslot == 0 || base + span * SFS_DBPERIDB <= blocklen) {
+		/* Nothing there, or all of it is before the new EOF */
+		return 0;
+	}
+
+	/* Read the indirect block */
+	result = buffer_read(sfs->sfs_device, *idslot, &idb);
+	if (result) {
+		return result;
+	}
+	idbuf = buffer_map(idb);
+
+	hasnonzero = 0;
+	iddirty = 0;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		entrybase = base + j * span;
+
+		/* Discard anything that's past the new EOF */
+		if (idbuf[j] != 0 && entrybase + span > blocklen) {
+			if (level == 1) {
+				sfs_bfree(sfs, idbuf[j]);
+				idbuf[j] = 0;
+				iddirty = 1;
+			}
+			else {
+				old = idbuf[j];
+				result = sfs_truncate_indirect(sv, &idbuf[j],
+							       level - 1,
+							       entrybase,
+							       blocklen);
+				if (idbuf[j] != old) {
+					iddirty = 1;
+				}
+				if (result) {
+					break;
+				}
+			}
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (idbuf[j]!=0) {
+			hasnonzero=1;
+		}
+	}
+
+	if (!hasnonzero && !result) {
+		/*
+		 * The whole indirect block is empty now; free it, and
+		 * don't bother writing it back.
+		 */
+		buffer_release_and_invalidate(idb);
+		sfs_bfree(sfs, *idslot);
+		*idslot = 0;
+	}
+	else {
+		if (iddirty) {
+			/* The indirect block needs writing back */
+			buffer_mark_dirty(idb);
+		}
+		buffer_release(idb);
+	}
+	return result;
+}
+
+/*
+ * Truncate a file. The caller takes care of locking.
+ */
+static
+int
+sfs_dotruncate(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
+	uint32_t i, block, base;
 	int result;
-	int hasnonzero, iddirty;
-
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
 
-	vfs_biglock_acquire();
+	if (sv->sv_i.sfi_flags & SFS_IF_EXTENTS) {
+		sfs_extent_truncate(sv, blocklen);
+		sv->sv_i.sfi_size = len;
+		sv->sv_dirty = true;
+		return 0;
+	}
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -1164,54 +2708,32 @@ sfs_truncate(struct vnode *v, off_t len)
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
+	/* Blocks may be about to go away under the cached indirect block */
+	sfs_idcache_invalidate(sv);
 
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
+	/*
+	 * Then the indirect, double indirect and triple indirect
+	 * blocks. Any of them may end up freed, so the inode is dirty
+	 * whatever happens (we're about to set the size anyway).
+	 */
+	sv->sv_dirty = true;
+	base = SFS_NDIRECT;
+	result = sfs_truncate_indirect(sv, &sv->sv_i.sfi_indirect, 1,
+				       base, blocklen);
+	if (result) {
+		return result;
+	}
+	base += SFS_IDSPAN1;
+	result = sfs_truncate_indirect(sv, &sv->sv_i.sfi_dindirect, 2,
+				       base, blocklen);
+	if (result) {
+		return result;
+	}
+	base += SFS_IDSPAN2;
+	result = sfs_truncate_indirect(sv, &sv->sv_i.sfi_tindirect, 3,
+				       base, blocklen);
+	if (result) {
+		return result;
 	}
 
 	/* Set the file size */
@@ -1220,10 +2742,26 @@ sfs_truncate(struct vnode *v, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
+/*
+ * Called for ftruncate().
+ */
+static
+int
+sfs_truncate(struct vnode *v, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	rwlock_acquire_write(sv->sv_lock);
+	result = sfs_dotruncate(sv, len);
+	rwlock_release_write(sv->sv_lock);
+
+	return result;
+}
+
 /*
  * Get the full pathname for a file. This only needs to work on directories.
  * Since we don't support subdirectories, assume it's the root directory
@@ -1259,18 +2797,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return EEXIST;
 	}
 
@@ -1278,18 +2816,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
+			rwlock_release_write(sv->sv_lock);
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
-	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
+	result = sfs_makeobj(sfs, SFS_TYPE_FILE, sv->sv_ino, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
@@ -1300,19 +2838,21 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	rwlock_acquire_write(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	rwlock_release_write(newguy->sv_lock);
 
 	*ret = &newguy->sv_v;
 	
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 	return 0;
 }
 
@@ -1331,20 +2871,32 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	/*
+	 * No hard links to directories. Besides breaking the tree,
+	 * linking a directory into itself would take its lock twice.
+	 * The type never changes, so no lock is needed to check it.
+	 */
+	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
+		return EISDIR;
+	}
+	KASSERT(f != sv);
+
+	rwlock_acquire_write(sv->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	rwlock_acquire_write(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	rwlock_release_write(f->sv_lock);
 
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 	return 0;
 }
 
@@ -1360,28 +2912,30 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
 	/* Erase its directory entry. */
-	result = sfs_dir_unlink(sv, slot);
+	result = sfs_dir_unlink(sv, name, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		rwlock_acquire_write(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		rwlock_release_write(victim->sv_lock);
 	}
 
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 	return result;
 }
 
@@ -1401,21 +2955,24 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
 
+	rwlock_acquire_write(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		rwlock_release_write(sv->sv_lock);
 		return result;
 	}
 
 	/* We don't support subdirectories */
 	KASSERT(g1->sv_i.sfi_type == SFS_TYPE_FILE);
 
+	/* Lock the file too, for its link count */
+	rwlock_acquire_write(g1->sv_lock);
+
 	/*
 	 * Link it under the new name.
 	 *
@@ -1434,7 +2991,7 @@ sfs_rename(struct vnode *d1, const char *n1,
 	g1->sv_dirty = true;
 
 	/* Unlink the old slot */
-	result = sfs_dir_unlink(sv, slot1);
+	result = sfs_dir_unlink(sv, n1, slot1);
 	if (result) {
 		goto puke_harder;
 	}
@@ -1448,16 +3005,17 @@ sfs_rename(struct vnode *d1, const char *n1,
 	g1->sv_dirty = true;
 
 	/* Let go of the reference to g1 */
+	rwlock_release_write(g1->sv_lock);
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 	return 0;
 
  puke_harder:
 	/*
 	 * Error recovery: try to undo what we already did
 	 */
-	result2 = sfs_dir_unlink(sv, slot2);
+	result2 = sfs_dir_unlink(sv, n2, slot2);
 	if (result2) {
 		kprintf("sfs: rename: %s\n", strerror(result));
 		kprintf("sfs: rename: while cleaning up: %s\n", 
@@ -1467,8 +3025,9 @@ sfs_rename(struct vnode *d1, const char *n1,
 	g1->sv_i.sfi_linkcount--;
  puke:
 	/* Let go of the reference to g1 */
+	rwlock_release_write(g1->sv_lock);
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
+	rwlock_release_write(sv->sv_lock);
 	return result;
 }
 
@@ -1486,15 +3045,13 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
+	/* Nothing here looks inside the directory, so no locking */
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +3059,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1520,22 +3076,20 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 	
+	/* Lookups in the same directory can go on at once */
+	rwlock_acquire_read(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
+	rwlock_release_read(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1651,42 +3205,41 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	lock_acquire(sfs->sfs_vnlock);
 
+	/* Look in the vnodes table */
+	sv = sfs_vntable_find(sfs, ino);
+	if (sv != NULL) {
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
 			panic("sfs: Found inode %u in unallocated block\n",
 			      sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* May only be set when creating new objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+		/* May only be set when creating new objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			VOP_INCREF(&sv->sv_v);
-			*ret = sv;
-			return 0;
-		}
+		VOP_INCREF(&sv->sv_v);
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	sv->sv_lock = rwlock_create("sfs vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -1699,7 +3252,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Read the block the inode is in */
 	result = sfs_rblock(sfs, &sv->sv_i, ino);
 	if (result) {
+		rwlock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
@@ -1714,9 +3269,18 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	if (forcetype != SFS_TYPE_INVAL) {
 		KASSERT(sv->sv_i.sfi_type == SFS_TYPE_INVAL);
 		sv->sv_i.sfi_type = forcetype;
+		if (sfs->sfs_super.sp_flags & SFS_SUPER_EXTENTS) {
+			sv->sv_i.sfi_flags = SFS_IF_EXTENTS;
+		}
 		sv->sv_dirty = true;
 	}
 
+	if ((sv->sv_i.sfi_flags & SFS_IF_EXTENTS) &&
+	    sv->sv_i.sfi_nextents > SFS_NEXTENTS) {
+		panic("sfs: loadvnode: Inode %u has %u extents\n",
+		      ino, sv->sv_i.sfi_nextents);
+	}
+
 	/*
 	 * Choose the function table based on the object type.
 	 */
@@ -1727,6 +3291,10 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	    case SFS_TYPE_DIR:
 		ops = &sfs_dirops;
 		break;
+	    case SFS_TYPE_DIRINDEX:
+		/* Only ever used through its directory */
+		ops = &sfs_fileops;
+		break;
 	    default: 
 		panic("sfs: loadvnode: Invalid inode type "
 		      "(inode %u, type %u)\n",
@@ -1736,20 +3304,38 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		rwlock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
+	sv->sv_hashnext = NULL;
+	sv->sv_lastblock = 0;
+	if ((sv->sv_i.sfi_flags & SFS_IF_EXTENTS) &&
+	    sv->sv_i.sfi_nextents > 0) {
+		/* Grow the last extent if we can */
+		const struct sfs_extent *se =
+			&sv->sv_i.sfi_extents[sv->sv_i.sfi_nextents - 1];
+		sv->sv_lastblock = se->sfe_start + se->sfe_len - 1;
+	}
+	sv->sv_prealloc = 0;
+	sv->sv_nprealloc = 0;
+	spinlock_init(&sv->sv_idcachelock);
+	sv->sv_idcache = NULL;
+	sv->sv_idcachebase = 0;
+	sv->sv_idcacheblock = 0;
+	spinlock_init(&sv->sv_ralock);
+	sv->sv_ranext = 0;
+	sv->sv_raend = 0;
+	sv->sv_dix = NULL;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
-		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
-		return result;
-	}
+	sfs_vntable_add(sfs, sv);
+
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
@@ -1767,14 +3353,10 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
@@ -0,0 +1,152 @@
+/*
+ * SFS table of loaded vnodes.
+ *
+ * Resident vnodes are kept in a hash table on inode number, chained
+ * through sv_hashnext, so that finding an already-loaded vnode
+ * doesn't depend on how many others are loaded. The table doubles
+ * whenever the chains get long; if there's no memory to grow it, it
+ * just stays as it is.
+ *
+ * Protected by sfs_vnlock, which is made and destroyed along with
+ * the table.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <vfs.h>
+#include <sfs.h>
+
+/* Starting size; must be a power of 2 */
+#define SFS_VNHASH_INITSIZE  32
+
+static
+unsigned
+sfs_vnhash(struct sfs_fs *sfs, uint32_t ino)
+{
+	return ino & (sfs->sfs_vnhashsize - 1);
+}
+
+int
+sfs_vntable_init(struct sfs_fs *sfs)
+{
+	unsigned i;
+
+	sfs->sfs_vnlock = lock_create("sfs vnodes");
+	if (sfs->sfs_vnlock == NULL) {
+		return ENOMEM;
+	}
+	sfs->sfs_vnhash = kmalloc(SFS_VNHASH_INITSIZE *
+				  sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vnhash == NULL) {
+		lock_destroy(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	for (i=0; i<SFS_VNHASH_INITSIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+	sfs->sfs_vnhashsize = SFS_VNHASH_INITSIZE;
+	sfs->sfs_nvnodes = 0;
+	return 0;
+}
+
+void
+sfs_vntable_cleanup(struct sfs_fs *sfs)
+{
+	KASSERT(sfs->sfs_nvnodes == 0);
+	kfree(sfs->sfs_vnhash);
+	sfs->sfs_vnhash = NULL;
+	lock_destroy(sfs->sfs_vnlock);
+	sfs->sfs_vnlock = NULL;
+}
+
+struct sfs_vnode *
+sfs_vntable_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (sv = sfs->sfs_vnhash[sfs_vnhash(sfs, ino)]; sv != NULL;
+	     sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Double the number of buckets.
+ */
+static
+void
+sfs_vntable_grow(struct sfs_fs *sfs)
+{
+	struct sfs_vnode **oldhash, *sv;
+	unsigned oldsize, i, h;
+
+	oldhash = sfs->sfs_vnhash;
+	oldsize = sfs->sfs_vnhashsize;
+
+	sfs->sfs_vnhash = kmalloc(oldsize * 2 * sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vnhash == NULL) {
+		/* Oh well; the chains will just be longer */
+		sfs->sfs_vnhash = oldhash;
+		return;
+	}
+	sfs->sfs_vnhashsize = oldsize * 2;
+	for (i=0; i<sfs->sfs_vnhashsize; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
+
+	for (i=0; i<oldsize; i++) {
+		while (oldhash[i] != NULL) {
+			sv = oldhash[i];
+			oldhash[i] = sv->sv_hashnext;
+			h = sfs_vnhash(sfs, sv->sv_ino);
+			sv->sv_hashnext = sfs->sfs_vnhash[h];
+			sfs->sfs_vnhash[h] = sv;
+		}
+	}
+	kfree(oldhash);
+}
+
+void
+sfs_vntable_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned h;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(sfs_vntable_find(sfs, sv->sv_ino) == NULL);
+
+	if (sfs->sfs_nvnodes >= 2 * sfs->sfs_vnhashsize) {
+		sfs_vntable_grow(sfs);
+	}
+
+	h = sfs_vnhash(sfs, sv->sv_ino);
+	sv->sv_hashnext = sfs->sfs_vnhash[h];
+	sfs->sfs_vnhash[h] = sv;
+	sfs->sfs_nvnodes++;
+}
+
+void
+sfs_vntable_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **p;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (p = &sfs->sfs_vnhash[sfs_vnhash(sfs, sv->sv_ino)]; *p != sv;
+	     p = &(*p)->sv_hashnext) {
+		if (*p == NULL) {
+			panic("sfs: reclaim vnode %u not in vnode pool\n",
+			      sv->sv_ino);
+		}
+	}
+	*p = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+	KASSERT(sfs->sfs_nvnodes > 0);
+	sfs->sfs_nvnodes--;
+}
@@ -37,7 +37,10 @@
 
 #include <vm.h>
 #include <opt-A2.h>
+#include <opt-A3.h>
 struct vnode;
+struct lock;
+struct pagetable;
 
 
 /* 
@@ -47,15 +50,33 @@ struct vnode;
  * You write this.
  */
 
+/*
+ * A region is a page-aligned range of the address space. Pages are
+ * filled in on first touch: the part of a page that overlaps the
+ * region's file data [rg_filevaddr, rg_filevaddr+rg_filesize) is read
+ * from the executable at rg_fileoffset onwards, the rest is zeroed.
+ */
+struct region {
+  vaddr_t rg_vbase;
+  size_t rg_npages;
+  bool rg_writeable;
+  vaddr_t rg_filevaddr;
+  off_t rg_fileoffset;
+  size_t rg_filesize;
+};
+
+/* ELF segments (text, rodata, data) plus the stack */
+#define AS_MAXREGIONS 4
+
 struct addrspace {
-  vaddr_t as_vbase1;
-  paddr_t as_pbase1;
-  size_t as_npages1;
-  vaddr_t as_vbase2;
-  paddr_t as_pbase2;
-  size_t as_npages2;
-  paddr_t as_stackpbase;
-  bool is_loaded;
+  struct region as_regions[AS_MAXREGIONS];
+  unsigned as_nregions;
+  struct pagetable *as_pt;
+  struct lock *as_lock;       /* covers as_pt and the pages in it */
+  struct vnode *as_vnode;     /* executable backing the regions */
+  bool as_loaded;             /* read-only regions are now enforced */
+  uint32_t as_asid;           /* TLB address space ID... */
+  uint32_t as_asidgen;        /* ...valid in this generation (0: none) */
 };
 
 /*
@@ -92,6 +113,10 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_filedata - note that part of a region previously set
+ *                up with as_define_region is backed by the executable
+ *                V, so its pages can be read in on demand.
  */
 
 struct addrspace *as_create(void);
@@ -110,6 +135,11 @@ int               as_complete_load(struct addrspace *as);
 #if OPT_A2
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr, char** args, int argc);
 #endif
+#if OPT_A3
+int               as_define_filedata(struct addrspace *as, struct vnode *v,
+                                     off_t offset, vaddr_t vaddr,
+                                     size_t filesize);
+#endif
 
 /*
  * Functions in loadelf.c
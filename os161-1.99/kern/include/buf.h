@@ -0,0 +1,112 @@
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * Buffer cache.
+ *
+ * Disk blocks are cached in memory keyed by (device, block number).
+ * Filesystems get a buffer, use its data in place, mark it dirty if
+ * they changed it, and release it. Dirty buffers are written back
+ * when they are evicted (least recently used first) or when the
+ * filesystem is synced, not when they are released.
+ *
+ * A buffer that has been handed out is busy: nobody else can get it,
+ * and it won't be evicted, until it is released. Don't hold more
+ * than one busy buffer of the same block.
+ *
+ * All buffers are the same size, BUF_BLOCKSIZE; devices with a
+ * different block size can't be cached.
+ *
+ * Filesystems that can tell a file is being read sequentially ask for
+ * the blocks they expect to want next with buffer_readahead; these
+ * are loaded in the background. Writing back a dirty buffer also
+ * writes dirty buffers for the blocks next to it in the same
+ * transfer.
+ */
+
+struct device;
+struct buf;
+struct uio;
+
+#define BUF_BLOCKSIZE	512
+
+/* Statistics, for the bc menu command. */
+struct buf_stats {
+	unsigned bs_nbufs;		/* buffers allocated */
+	unsigned bs_hits;		/* lookups found in the cache */
+	unsigned bs_misses;		/* lookups that weren't */
+	unsigned bs_reads;		/* blocks read from disk */
+	unsigned bs_writes;		/* blocks written to disk */
+	unsigned bs_evictions;		/* buffers reused for another block */
+	unsigned bs_directios;		/* transfers that bypassed the cache */
+	unsigned bs_directblocks;	/* blocks they moved */
+	unsigned bs_rablocks;		/* blocks read ahead */
+	unsigned bs_rahits;		/* of those, looked up afterwards */
+	unsigned bs_rawasted;		/* of those, evicted unused */
+	unsigned bs_clusters;		/* writes of more than one block */
+	unsigned bs_clusterblocks;	/* blocks they wrote */
+};
+
+/* Set up the cache. Called from vfs_bootstrap. */
+void buffer_bootstrap(void);
+
+/*
+ * Get a busy buffer for BLOCK on DEV. buffer_read makes sure it
+ * holds the block's contents; buffer_get doesn't bother if it isn't
+ * already cached, for when the caller is about to overwrite all of
+ * it.
+ */
+int buffer_read(struct device *dev, daddr_t block, struct buf **ret);
+int buffer_get(struct device *dev, daddr_t block, struct buf **ret);
+
+/* The buffer's BUF_BLOCKSIZE bytes of data. */
+void *buffer_map(struct buf *b);
+
+/* Note that the buffer's data has been changed. */
+void buffer_mark_dirty(struct buf *b);
+
+/*
+ * Give a buffer back. buffer_release_and_invalidate also throws its
+ * contents away, for when the caller failed partway through filling
+ * a buffer from buffer_get.
+ */
+void buffer_release(struct buf *b);
+void buffer_release_and_invalidate(struct buf *b);
+
+/*
+ * Transfer NBLOCKS consecutive blocks of DEV, starting at BLOCK,
+ * straight between the disk and UIO in one device request, for
+ * transfers too big to be worth caching. UIO's offset and residue
+ * must match. Dirty cached copies of the blocks are written back
+ * first for a read, and cached copies are thrown away for a write,
+ * so the cache and the disk agree afterwards. The caller must keep
+ * everyone else off the blocks until it's done.
+ */
+int buffer_directio(struct device *dev, daddr_t block, unsigned nblocks,
+		    struct uio *uio);
+
+/*
+ * Ask for NBLOCKS consecutive blocks of DEV starting at BLOCK to be
+ * loaded into the cache in the background. Only a hint: blocks that
+ * are already cached are skipped, and the request may be dropped if
+ * the cache is busy.
+ */
+void buffer_readahead(struct device *dev, daddr_t block, unsigned nblocks);
+
+/*
+ * Turn readahead and clustered writes on or off (they start on), so
+ * their effect can be measured. Returns the old setting.
+ */
+bool buffer_set_clustering(bool on);
+
+/* Write back all dirty buffers for DEV. */
+int buffer_sync(struct device *dev);
+
+/* Forget all (clean) buffers for DEV, e.g. at unmount. */
+void buffer_drop(struct device *dev);
+
+/* Fetch / print statistics. */
+void buffer_getstats(struct buf_stats *bs);
+void buffer_printstats(void);
+
+#endif /* _BUF_H_ */
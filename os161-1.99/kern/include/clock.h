@@ -43,6 +43,7 @@
  *
  * gettime() may be used to fetch the current time of day.
  * getinterval() computes the time from time1 to time2.
+ * interval_msecs() gives the same in milliseconds, but never 0.
  *
  * XXX we have struct timespec now, let's use it.
  */
@@ -66,6 +67,8 @@ void gettime(time_t *seconds, uint32_t *nanoseconds);
 void getinterval(time_t secs1, uint32_t nsecs,
                  time_t secs2, uint32_t nsecs2,
                  time_t *rsecs, uint32_t *rnsecs);
+uint32_t interval_msecs(time_t secs1, uint32_t nsecs1,
+                        time_t secs2, uint32_t nsecs2);
 
 /*
  * clocksleep() suspends execution for the requested number of seconds,
@@ -0,0 +1,105 @@
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Physical frame allocator (coremap).
+ *
+ * All physical memory left over after the kernel image and anything
+ * ram_stealmem handed out during early boot is managed as a binary
+ * buddy system. Free memory sits on per-order free lists of naturally
+ * aligned blocks of 2^order frames; each frame has a small descriptor
+ * in the coremap array, which itself lives just below the managed
+ * range.
+ *
+ * Allocations are rounded up to a power of two internally, but the
+ * unused tail of the block is given straight back to the free lists,
+ * so an allocation of N pages only ever holds N frames. Freeing
+ * coalesces with free buddies as far as possible.
+ *
+ * Allocations are reference counted so that frames can be shared
+ * copy-on-write between address spaces: coremap_free only releases
+ * the frames when the last reference goes away.
+ *
+ * User pages additionally record the address space and vaddr they
+ * are mapped at, so that the pageout code can pick victims with a
+ * clock sweep over the coremap and find the PTE to update. Frames
+ * with more than one sharer are never picked.
+ *
+ * Kernel pages can carry one pointer for the kernel heap's use, so
+ * that kfree can get from a block's page to its bookkeeping without
+ * searching.
+ *
+ * Everything is protected by a single spinlock.
+ */
+
+#include <machine/vm.h>
+
+struct addrspace;
+
+/* Largest block the allocator will hand out: 2^COREMAP_MAXORDER frames */
+#define COREMAP_MAXORDER  11
+
+/* Snapshot of allocator state, for the benchmarks and the kh menu. */
+struct coremap_stats {
+	unsigned cs_nframes;		/* frames under management */
+	unsigned cs_nfree;		/* frames currently free */
+	unsigned cs_largest;		/* frames in the largest free block */
+	unsigned cs_nblocks[COREMAP_MAXORDER+1]; /* free blocks per order */
+};
+
+/* Take over physical memory from ram.c. Called from vm_bootstrap. */
+void coremap_bootstrap(void);
+
+/* True once coremap_bootstrap has run. */
+bool coremap_ready(void);
+
+/* Allocate NPAGES physically contiguous frames; returns 0 if none. */
+paddr_t coremap_alloc(unsigned long npages);
+
+/*
+ * Drop a reference to an allocation made by coremap_alloc, by its
+ * first frame; the frames are freed with the last reference.
+ */
+void coremap_free(paddr_t paddr);
+
+/* Add a reference to an allocation / get its current count. */
+void coremap_incref(paddr_t paddr);
+unsigned coremap_refcount(paddr_t paddr);
+
+/*
+ * Attach KDATA to the allocation starting at PADDR, or get it back.
+ * It's NULL until set. coremap_getkdata takes no lock, so it's only
+ * good for frames the caller knows will stay allocated; it returns
+ * false for memory the coremap doesn't manage (stolen in early boot).
+ */
+void coremap_setkdata(paddr_t paddr, void *kdata);
+bool coremap_getkdata(paddr_t paddr, void **kdata);
+
+/*
+ * Allocate a frame for the user page at VADDR in AS. It comes back
+ * marked busy, so it won't be chosen for eviction until the caller
+ * has filled it in and called coremap_unbusy.
+ */
+paddr_t coremap_alloc_user(struct addrspace *as, vaddr_t vaddr);
+void coremap_unbusy(paddr_t paddr);
+
+/*
+ * Note that user frame PADDR has been entered into the TLB at VADDR
+ * in AS. Returns the reference count; if it is 1, AS is recorded as
+ * the owner.
+ */
+unsigned coremap_touch(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+
+/*
+ * Choose a user page to evict. Returns its frame, marked busy, and
+ * its owner in AS and VADDR; returns 0 if there is no candidate.
+ * The caller either evicts and frees the page, or calls
+ * coremap_unbusy to put it back.
+ */
+paddr_t coremap_victim(struct addrspace **as, vaddr_t *vaddr);
+
+/* Fetch / print allocator statistics. */
+void coremap_getstats(struct coremap_stats *cs);
+void coremap_printstats(void);
+
+#endif /* _COREMAP_H_ */
@@ -36,6 +36,13 @@
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
+/*
+ * Number of scheduler priority levels (run queues per cpu). Level 0
+ * is the highest priority. See the scheduler notes in thread.c.
+ */
+#define SCHED_NLEVELS	3
+
+
 /*
  * Per-cpu structure
  *
@@ -60,13 +67,17 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_idleclocks;		/* hardclock() calls while idle */
+	unsigned c_steals;		/* Threads taken from other cpus */
+	struct cpu_tlb c_tlb;		/* MD TLB state */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NLEVELS]; /* Run queues by priority */
+	unsigned c_runcount;		/* Threads on all the run queues */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -152,6 +163,8 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_broadcast sends it to all CPUs except the current
+ * one, and returns how many that was.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -166,6 +179,7 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping);
 
 void interprocessor_interrupt(void);
 
@@ -40,6 +40,7 @@
 #define SFS_BLOCKSIZE     512           /* size of our blocks */
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
+#define SFS_NEXTENTS      52            /* # of extents in inode */
 #define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SB_LOCATION    0            /* block the superblock lives in */
@@ -47,6 +48,10 @@
 #define SFS_MAP_LOCATION   2            /* 1st block of the freemap */
 #define SFS_NOINO          0            /* inode # for free dir entry */
 
+/* Inodes have one double and one triple indirect block (for sfsck) */
+#define HAS_DIDIRECT
+#define HAS_TIDIRECT
+
 /* Number of bits in a block */
 #define SFS_BLOCKBITS (SFS_BLOCKSIZE * CHAR_BIT)
 
@@ -63,6 +68,14 @@
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
 #define SFS_TYPE_FILE     1
 #define SFS_TYPE_DIR      2
+#define SFS_TYPE_DIRINDEX 3       /* A directory's hash index */
+
+/* Flags for sp_flags */
+#define SFS_SUPER_EXTENTS 0x1     /* new files get extent inodes */
+#define SFS_SUPER_DIRINDEX 0x2    /* directories get hash indexes */
+
+/* Flags for sfi_flags */
+#define SFS_IF_EXTENTS    0x1     /* mapped by sfi_extents */
 
 /*
  * On-disk superblock
@@ -71,7 +84,19 @@ struct sfs_super {
 	uint32_t sp_magic;		/* Magic number, should be SFS_MAGIC */
 	uint32_t sp_nblocks;			/* Number of blocks in fs */
 	char sp_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];
+	uint32_t sp_flags;			/* SFS_SUPER_* above */
+	uint32_t reserved[117];
+};
+
+/*
+ * A run of consecutive disk blocks. In an inode with SFS_IF_EXTENTS
+ * set, the extents in use map the file's blocks in order starting
+ * from block 0, there are no holes before the end of the last one,
+ * and the block pointers are unused (0).
+ */
+struct sfs_extent {
+	uint32_t sfe_start;			/* First disk block */
+	uint32_t sfe_len;			/* Number of blocks */
 };
 
 /*
@@ -83,7 +108,13 @@ struct sfs_inode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_flags;			/* SFS_IF_* above */
+	uint32_t sfi_nextents;			/* # of extents in use */
+	struct sfs_extent sfi_extents[SFS_NEXTENTS];	/* Extents */
+	uint32_t sfi_dirindex;			/* Index inode (dirs); 0 if none */
+	uint32_t sfi_waste[128-8-SFS_NDIRECT-2*SFS_NEXTENTS]; /* set to 0 */
 };
 
 /*
@@ -94,5 +125,44 @@ struct sfs_dir {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/*
+ * Directory hash index. A directory whose inode has sfi_dirindex set
+ * has a second inode, of type SFS_TYPE_DIRINDEX, whose contents are
+ * a header block followed by dxh_nbuckets bucket blocks. Each entry
+ * in use in the directory has one pair in the index giving the hash
+ * of its name and its slot. The pair goes in bucket (hash mod
+ * nbuckets), or if that's full, the next bucket that isn't (wrapping
+ * around); a bucket that has been full has dxb_overflow set, which
+ * tells lookups to go on to the next one. The index is kept no more
+ * than half full, and rebuilt bigger when it would be.
+ *
+ * The hash of a name is 32-bit FNV-1a over its bytes, except that 0
+ * becomes 1: pairs with a hash of 0 are empty.
+ *
+ * Everything in the index can be worked out again from the directory,
+ * so if in doubt sfsck rebuilds it.
+ */
+#define SFS_DIX_MAGIC     0x0d1c7a55    /* for dxh_magic */
+#define SFS_DIX_NPAIRS    63            /* pairs in a bucket */
+
+struct sfs_dixheader {
+	uint32_t dxh_magic;			/* SFS_DIX_MAGIC */
+	uint32_t dxh_nbuckets;			/* a power of 2 */
+	uint32_t dxh_nentries;			/* pairs in use */
+	uint32_t dxh_freehint;			/* slots below this are in use */
+	uint32_t dxh_waste[124];		/* set to 0 */
+};
+
+struct sfs_dixpair {
+	uint32_t dxp_hash;			/* hash of the name; 0 if free */
+	uint32_t dxp_slot;			/* slot of the entry */
+};
+
+struct sfs_dixbucket {
+	uint32_t dxb_overflow;			/* nonzero if it has been full */
+	uint32_t dxb_count;			/* pairs in use */
+	struct sfs_dixpair dxb_pairs[SFS_DIX_NPAIRS];
+};
+
 
 #endif /* _KERN_SFS_H_ */
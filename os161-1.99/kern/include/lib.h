@@ -126,6 +126,8 @@ uint32_t random(void);
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
+void kheap_printcachestats(void);
+size_t kheap_getused(void);
 
 /*
  * C string functions. 
@@ -0,0 +1,74 @@
+#ifndef _OPENFILE_H_
+#define _OPENFILE_H_
+
+/*
+ * Open files and per-process file descriptor tables.
+ *
+ * An open file is what open() creates: a vnode plus the access mode
+ * and the seek position. File descriptors refer to open files; dup2
+ * and fork make more descriptors for the same open file, which then
+ * share the seek position. Open files are refcounted and closed when
+ * the last descriptor goes away.
+ *
+ * A descriptor table belongs to one process, and only that process's
+ * thread ever looks at it (fork copies the parent's table from the
+ * parent's thread), so it has no lock: looking up a descriptor is
+ * just a bounds check and an array index. Open files can be shared
+ * between processes, so they do have locks.
+ */
+
+#include <limits.h>
+#include <spinlock.h>
+
+struct vnode;
+struct lock;
+
+struct openfile {
+	struct vnode *of_vnode;
+	int of_accmode;			/* O_RDONLY, O_WRONLY or O_RDWR */
+	struct lock *of_lock;		/* for of_offset */
+	off_t of_offset;		/* seek position */
+	struct spinlock of_countlock;	/* for of_refcount */
+	unsigned of_refcount;
+};
+
+/*
+ * Open PATH with open(2) FLAGS and MODE. (PATH is destroyed, as by
+ * vfs_open.) The new open file has one reference.
+ */
+int openfile_open(char *path, int flags, mode_t mode,
+		  struct openfile **ret);
+void openfile_incref(struct openfile *of);
+void openfile_decref(struct openfile *of);
+
+struct filetable {
+	struct openfile *ft_files[OPEN_MAX];
+};
+
+/*
+ * create - make an empty table.
+ * destroy - drop every descriptor and free the table.
+ * copy - make a new table with the same descriptors, for fork.
+ * get - find the open file for FD; EBADF if there isn't one. Doesn't
+ *       add a reference.
+ * place - put OF in the lowest free descriptor; EMFILE if full.
+ *       Takes over the caller's reference.
+ * placeat - put OF in descriptor FD, handing back what was there
+ *       before (or NULL) in OLDRET for the caller to drop. Takes over
+ *       the caller's reference.
+ * remove - empty descriptor FD, handing back its open file for the
+ *       caller to drop; EBADF if it was empty.
+ */
+struct filetable *filetable_create(void);
+void filetable_destroy(struct filetable *ft);
+int filetable_copy(struct filetable *src, struct filetable **ret);
+int filetable_get(struct filetable *ft, int fd, struct openfile **ret);
+int filetable_place(struct filetable *ft, struct openfile *of, int *fd);
+int filetable_placeat(struct filetable *ft, struct openfile *of, int fd,
+		      struct openfile **oldret);
+int filetable_remove(struct filetable *ft, int fd, struct openfile **ret);
+
+/* Set up descriptors 0, 1 and 2 on the console. */
+int filetable_stdio(struct filetable *ft);
+
+#endif /* _OPENFILE_H_ */
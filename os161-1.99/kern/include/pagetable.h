@@ -0,0 +1,59 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Per-address-space page table.
+ *
+ * Two levels, MIPS-style split of the user half of the address
+ * space: the top 10 bits of a vaddr index the directory, the next 10
+ * bits index a one-page table of 1024 PTEs. Second-level tables are
+ * only allocated when something in their 4MB range is touched, so a
+ * sparse address space costs next to nothing.
+ *
+ * A PTE holds the physical frame in its upper bits and flags in the
+ * low 12 bits; for a page that has been paged out, the upper bits
+ * hold the swap slot instead. A PTE of 0 means "never touched": the
+ * page is filled from the region's backing (ELF file or zeros) on
+ * first fault.
+ */
+
+#include <machine/vm.h>
+
+typedef uint32_t pte_t;
+
+#define PTE_FRAME	PAGE_FRAME	/* physical frame of the page */
+#define PTE_PRESENT	0x001		/* frame is valid */
+#define PTE_SWAPPED	0x002		/* page is in swap */
+
+#define PTE_SLOT(pte)		((pte) >> 12)
+#define PTE_MKSWAP(slot)	(((pte_t)(slot) << 12) | PTE_SWAPPED)
+
+/* Directory covers the user half of the address space (2GB). */
+#define PT_L1_SHIFT	22
+#define PT_L1_ENTRIES	(USERSPACETOP >> PT_L1_SHIFT)
+#define PT_L2_ENTRIES	(PAGE_SIZE / sizeof(pte_t))
+
+struct pagetable {
+	pte_t *pt_dir[PT_L1_ENTRIES];
+};
+
+struct pagetable *pt_create(void);
+
+/* Free the table structure. Mapped frames are the caller's problem. */
+void pt_destroy(struct pagetable *pt);
+
+/*
+ * Find the PTE for VADDR. If CREATE is set, allocate the second-level
+ * table if needed; returns NULL if that fails or, without CREATE, if
+ * there is no second-level table.
+ */
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+
+/*
+ * Iterate over nonzero PTEs: returns the first one at or above
+ * *VADDR and updates *VADDR to its address, or NULL when done.
+ * Advance *VADDR by PAGE_SIZE between calls.
+ */
+pte_t *pt_next(struct pagetable *pt, vaddr_t *vaddr);
+
+#endif /* _PAGETABLE_H_ */
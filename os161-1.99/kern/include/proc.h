@@ -42,6 +42,9 @@
 
 struct addrspace;
 struct vnode;
+#if OPT_A2
+struct filetable;
+#endif
 #ifdef UW
 struct semaphore;
 #endif // UW
@@ -79,6 +82,9 @@ struct proc {
 	struct cv* p_cv;
 	bool is_alive;
 	int exit_code;
+
+	/* file descriptors; NULL for kproc and once the process exits */
+	struct filetable *p_filetable;
 	
 
 #endif
@@ -102,6 +108,11 @@ void proc_bootstrap(void);
 /* Create a fresh process for use by runprogram(). */
 struct proc *proc_create_runprogram(const char *name);
 
+#if OPT_A2
+/* Same, for fork: fails with ENPROC if the process table is full. */
+int proc_create_child(const char *name, struct proc **ret);
+#endif
+
 /* Destroy a process. */
 void proc_destroy(struct proc *proc);
 
@@ -117,9 +128,37 @@ struct addrspace *curproc_getas(void);
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *curproc_setas(struct addrspace *);
 
+#if OPT_A2
+/*
+ * Find PARENT's child with pid PID. Fails with ESRCH if there's no
+ * such process and ECHILD if it isn't PARENT's. Only the parent
+ * reaps a child, so the child stays valid while the parent uses it.
+ */
+int proc_getchild(struct proc *parent, pid_t pid, struct proc **ret);
+#endif
+
 bool proc_check_alive(struct proc *proc);
 
-void proc_set_dead(struct proc* proc, int exitcode);
+#if OPT_A2
+/*
+ * Exit handling:
+ *
+ * proc_set_dead - Record that PROC exited with EXITCODE and wake its
+ *     parent. Returns true if PROC has no parent, in which case the
+ *     caller must destroy it; otherwise it's a zombie until the parent
+ *     reaps it, and may already be gone when this returns.
+ * proc_orphan_children - At PROC's exit, destroy its zombie children
+ *     and orphan the rest so they destroy themselves when they exit.
+ * proc_reap - Destroy CHILD, a zombie child of PROC.
+ * proc_getstats - Get the number of live and zombie processes.
+ * proc_printstats - Print them.
+ */
+bool proc_set_dead(struct proc* proc, int exitcode);
+void proc_orphan_children(struct proc* proc);
+void proc_reap(struct proc* proc, struct proc* child);
+void proc_getstats(unsigned *live, unsigned *zombies);
+void proc_printstats(void);
+#endif
 
 
 #endif /* _PROC_H_ */
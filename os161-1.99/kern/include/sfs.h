@@ -41,6 +41,7 @@
  */
 #include <fs.h>
 #include <vnode.h>
+#include <spinlock.h>
 
 /*
  * Get on-disk structures and constants that are made available to 
@@ -48,11 +49,37 @@
  */
 #include <kern/sfs.h>
 
+struct lock;
+struct rwlock;
+struct sfs_dircache;	/* in sfs_dircache.c */
+
+/*
+ * Locking: sv_lock covers sv_i, sv_dirty and the allocation hints,
+ * and for a directory its contents; readers of the file (or lookups
+ * in the directory) share it. sfs_vnlock covers the vnode table and
+ * the decision to reclaim. sfs_freemaplock covers the freemap,
+ * sfs_reserved and the superblock. Take them in that order, directory
+ * before file; the name cache and the buffer cache have their own
+ * locks and come last. vfs_biglock isn't used.
+ */
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct sfs_vnode *sv_hashnext;  /* chain in sfs_vnhash */
+	struct rwlock *sv_lock;         /* lock for sv_i and the data */
+	uint32_t sv_lastblock;          /* block last allocated to us */
+	uint32_t sv_prealloc;           /* next block of our reserved run */
+	unsigned sv_nprealloc;          /* blocks left in the run */
+	struct spinlock sv_idcachelock; /* lock for sv_idcache*, sv_dix */
+	uint32_t *sv_idcache;           /* copy of an indirect block */
+	uint32_t sv_idcachebase;        /* first file block it maps */
+	uint32_t sv_idcacheblock;       /* its disk block; 0 if none */
+	struct spinlock sv_ralock;      /* lock for sv_ranext, sv_raend */
+	uint32_t sv_ranext;             /* file block a sequential read wants */
+	uint32_t sv_raend;              /* end of what's been read ahead */
+	struct sfs_vnode *sv_dix;       /* dir's index, once loaded */
 };
 
 struct sfs_fs {
@@ -60,8 +87,14 @@ struct sfs_fs {
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct lock *sfs_vnlock;        /* lock for the vnode table */
+	struct sfs_vnode **sfs_vnhash;  /* vnodes loaded into memory */
+	unsigned sfs_vnhashsize;        /* buckets in sfs_vnhash */
+	unsigned sfs_nvnodes;           /* vnodes in sfs_vnhash */
+	struct sfs_dircache *sfs_dircache; /* directory name cache */
+	struct lock *sfs_freemaplock;   /* lock for freemap and super */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
+	struct bitmap *sfs_reserved;    /* of those, ones only set aside */
 	bool sfs_freemapdirty;          /* true if freemap modified */
 };
 
@@ -79,13 +112,40 @@ int sfs_mount(const char *device);
 #define SFSUIO(iov, uio, ptr, block, rw) \
     uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
 
+/*
+ * Runs of fewer blocks than this go through the buffer cache (where
+ * readahead can help them); longer ones go straight to the disk.
+ */
+#define SFS_MINDIRECT	8
+
 /* Convenience functions for block I/O */
 int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
+int sfs_rwblocks(struct sfs_fs *sfs, struct uio *uio);
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
+/* Table of loaded vnodes, hashed by inode number (sfs_vntable.c) */
+int sfs_vntable_init(struct sfs_fs *sfs);
+void sfs_vntable_cleanup(struct sfs_fs *sfs);
+struct sfs_vnode *sfs_vntable_find(struct sfs_fs *sfs, uint32_t ino);
+void sfs_vntable_add(struct sfs_fs *sfs, struct sfs_vnode *sv);
+void sfs_vntable_remove(struct sfs_fs *sfs, struct sfs_vnode *sv);
+
+/*
+ * Directory name cache (sfs_dircache.c). Lookup returns true if the
+ * answer is cached, with *INO set to SFS_NOINO if the name is known
+ * not to exist. Enter with INO of SFS_NOINO for a negative entry.
+ */
+int sfs_dircache_init(struct sfs_fs *sfs);
+void sfs_dircache_cleanup(struct sfs_fs *sfs);
+bool sfs_dircache_lookup(struct sfs_fs *sfs, uint32_t dirino,
+			 const char *name, uint32_t *ino, int *slot);
+void sfs_dircache_enter(struct sfs_fs *sfs, uint32_t dirino,
+			const char *name, uint32_t ino, int slot);
+void sfs_dircache_purgedir(struct sfs_fs *sfs, uint32_t dirino);
+
 
 #endif /* _SFS_H_ */
@@ -0,0 +1,27 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space.
+ *
+ * User pages are paged out to the raw disk device lhd1 (lhd1raw:),
+ * one page per slot. Free slots are tracked with a bitmap. If there
+ * is no swap device, swap_bootstrap says so and paging out is
+ * disabled; everything else still works until memory runs out.
+ */
+
+/* Open the swap device. Called from vm_bootstrap. */
+void swap_bootstrap(void);
+
+/* True if there is a swap device to page out to. */
+bool swap_enabled(void);
+
+/* Allocate / release a swap slot. swap_alloc returns ENOSPC if full. */
+int swap_alloc(unsigned *slot);
+void swap_free(unsigned slot);
+
+/* Copy the page at PADDR to / from a swap slot. Callers keep the vmstats. */
+int swap_write(unsigned slot, paddr_t paddr);
+int swap_read(unsigned slot, paddr_t paddr);
+
+#endif /* _SWAP_H_ */
@@ -69,18 +69,25 @@ void V(struct semaphore *);
  * When the lock is created, no thread should be holding it. Likewise,
  * when the lock is destroyed, no thread should be holding it.
  *
+ * The lock is adaptive: a thread that finds it held spins as long as
+ * the holder is running on another cpu, since then it'll likely be
+ * released soon, and sleeps otherwise.
+ *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
  */
 struct lock {
         char *lk_name;
-        bool held;
-        struct thread* owner;
+        volatile bool held;
+        struct thread * volatile owner;
         struct spinlock lk_spinlock;
         struct wchan *lk_wchan;
 
-        // add what you need here
-        // (don't forget to mark things volatile as needed)
+        /* contention statistics, protected by lk_spinlock */
+        unsigned lk_acquires;           /* times acquired */
+        unsigned lk_contended;          /* ...when someone else held it */
+        unsigned lk_spins;              /* spin-loop iterations waiting */
+        unsigned lk_sleeps;             /* times a waiter slept */
 };
 
 struct lock *lock_create(const char *name);
@@ -90,16 +97,101 @@ void lock_acquire(struct lock *);
  * Operations:
  *    lock_acquire - Get the lock. Only one thread can hold the lock at the
  *                   same time.
+ *    lock_tryacquire - Get the lock if nobody holds it; never sleeps.
+ *                   Returns true if the lock was acquired.
  *    lock_release - Free the lock. Only the thread holding the lock may do
  *                   this.
  *    lock_do_i_hold - Return true if the current thread holds the lock; 
  *                   false otherwise.
+ *    lock_printstats - Print the lock's contention statistics.
  *
  * These operations must be atomic. You get to write them.
  */
+bool lock_tryacquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 void lock_destroy(struct lock *);
+void lock_printstats(struct lock *);
+
+
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or one writer.
+ * Writers are favored: once a writer is waiting, new readers wait
+ * behind it, so a steady stream of readers can't starve writers.
+ * Not recursive, in either mode.
+ */
+struct rwlock {
+        char *rw_name;
+        struct spinlock rw_spinlock;
+        struct wchan *rw_rwchan;        /* readers wait here */
+        struct wchan *rw_wwchan;        /* writers wait here */
+        unsigned rw_readers;            /* readers holding it */
+        unsigned rw_waitingwriters;     /* writers waiting for it */
+        struct thread *rw_writer;       /* writer holding it, or NULL */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading.
+ *    rwlock_release_read  - Give up a read hold.
+ *    rwlock_acquire_write - Get the lock for writing, once no one
+ *                           else holds it in either mode.
+ *    rwlock_release_write - Give up the write hold. Only the thread
+ *                           holding it may do this.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+
+
+/*
+ * Sequence lock.
+ *
+ * For small, hot, rarely written data. Readers take no lock: they
+ * note the sequence number, copy the data out, and try again if a
+ * write was in progress or happened meanwhile. Writers serialize on a
+ * spinlock and bump the sequence number before and after, so it's odd
+ * while a write is in progress. A reader can thus see a torn copy
+ * before throwing it away, so the data must be safe to read at any
+ * time (no pointers to chase). Writers can't sleep; readers never
+ * hold up writers.
+ *
+ * Embedded rather than allocated, like a spinlock.
+ */
+struct seqlock {
+        struct spinlock sl_lock;        /* serializes writers */
+        volatile unsigned sl_seq;       /* odd while writing */
+};
+
+void seqlock_init(struct seqlock *);
+void seqlock_cleanup(struct seqlock *);
+
+/*
+ * Operations:
+ *    seqlock_write_begin - Start changing the data.
+ *    seqlock_write_end   - Done changing it.
+ *    seqlock_read_begin  - Start reading; returns the sequence number
+ *                          to pass to seqlock_read_retry.
+ *    seqlock_read_retry  - After copying the data, returns true if
+ *                          the copy may be inconsistent and the read
+ *                          should be done over.
+ *
+ * Usage:
+ *    do {
+ *        seq = seqlock_read_begin(&sl);
+ *        copy = data;
+ *    } while (seqlock_read_retry(&sl, seq));
+ */
+void seqlock_write_begin(struct seqlock *);
+void seqlock_write_end(struct seqlock *);
+unsigned seqlock_read_begin(struct seqlock *);
+bool seqlock_read_retry(struct seqlock *, unsigned seq);
 
 
 /*
@@ -57,9 +57,14 @@ int queuetest(int, char **);
 int threadtest(int, char **);
 int threadtest2(int, char **);
 int threadtest3(int, char **);
+int schedbench(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int lockbench(int, char **);
+int rwtest(int, char **);
+int seqtest(int, char **);
+int rwbench(int, char **);
 
 #ifdef UW
 /* Another thread and synchronization test */
@@ -74,11 +79,21 @@ int readstress(int, char **);
 int writestress(int, char **);
 int writestress2(int, char **);
 int createstress(int, char **);
+int vnodestress(int, char **);
+int readbench(int, char **);
+int layoutbench(int, char **);
+int bigiobench(int, char **);
+int rabench(int, char **);
+int dirbench(int, char **);
+int mountrace(int, char **);
 int printfile(int, char **);
 
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
+int mallocbench(int, char **);
+int coremapbench(int, char **);
+int diskbench(int, char **);
 int nettest(int, char **);
 
 #if OPT_A2
@@ -83,6 +83,8 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	unsigned t_priority;		/* Run queue level; 0 is highest */
+	unsigned t_ticks;		/* Hardclocks used at this level */
 
 	/*
 	 * Interrupt state fields.
@@ -163,10 +165,17 @@ void thread_yield(void);
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Charge a hardclock tick to the current thread, and yield if it has
+ * used up its time slice or a higher-priority thread is waiting.
+ * Called from the timer interrupt.
  */
-void thread_consider_migration(void);
+void thread_timeslice(void);
+
+/*
+ * Print per-cpu scheduling statistics: hardclocks, how many of them
+ * found the cpu idle, and how many threads it has stolen from others.
+ */
+void thread_printstats(void);
 
 
 #endif /* _THREAD_H_ */
@@ -120,6 +120,49 @@ bitmap_alloc(struct bitmap *b, unsigned *index)
         return ENOSPC;
 }
 
+int
+bitmap_alloc_from(struct bitmap *b, unsigned start, unsigned *index)
+{
+        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+        unsigned ix, i, bit;
+        WORD_TYPE mask;
+
+        if (start >= b->nbits) {
+                start = 0;
+        }
+
+        /* Bits at and after START in START's own word */
+        ix = start / BITS_PER_WORD;
+        for (bit = start;
+             bit < (ix+1)*BITS_PER_WORD && bit < b->nbits; bit++) {
+                mask = ((WORD_TYPE)1) << (bit % BITS_PER_WORD);
+                if ((b->v[ix] & mask)==0) {
+                        b->v[ix] |= mask;
+                        *index = bit;
+                        return 0;
+                }
+        }
+
+        /* Then whole words, skipping full ones, wrapping around */
+        for (i=1; i<=maxix; i++) {
+                ix = (start / BITS_PER_WORD + i) % maxix;
+                if (b->v[ix]==WORD_ALLBITS) {
+                        continue;
+                }
+                for (bit = 0; bit < BITS_PER_WORD; bit++) {
+                        mask = ((WORD_TYPE)1) << bit;
+                        if ((b->v[ix] & mask)==0) {
+                                b->v[ix] |= mask;
+                                *index = (ix*BITS_PER_WORD)+bit;
+                                KASSERT(*index < b->nbits);
+                                return 0;
+                        }
+                }
+                KASSERT(0);
+        }
+        return ENOSPC;
+}
+
 static
 inline
 void
@@ -43,6 +43,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <proc.h>
 #include <current.h>
 #include <addrspace.h>
@@ -52,6 +53,10 @@
 #include <kern/fcntl.h>  
 #include "opt-A2.h"
 #include <kern/wait.h>
+#if OPT_A2
+#include <limits.h>
+#include <openfile.h>
+#endif
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
@@ -64,6 +69,10 @@ struct proc *kproc;
 /* count of the number of processes, excluding kproc */
 
 static volatile unsigned int proc_count;
+#if OPT_A2
+/* how many of those have exited but not been reaped */
+static volatile unsigned int proc_zombies;
+#endif
 /* provides mutual exclusion for proc_count */
 /* it would be better to use a lock here, but we use a semaphore because locks are not implemented in the base kernel */ 
 static struct semaphore *proc_count_mutex;
@@ -71,9 +80,132 @@ static struct semaphore *proc_count_mutex;
 struct semaphore *no_proc_sem;   
 #endif  // UW
 
-//#if OPT_A2
-volatile pid_t pid_cnt;
-//#endif
+#if OPT_A2
+/*
+ * Process table: maps pids to processes.
+ *
+ * A pid names a slot in the table, (pid - PID_MIN) % PROCTABLE_SIZE,
+ * so looking one up is a single array access. Each time a slot is
+ * reused it hands out a pid PROCTABLE_SIZE higher than last time
+ * (wrapping before PID_MAX), and free slots are reused in FIFO order,
+ * so a pid isn't handed out again until a long time after its
+ * process has been reaped.
+ */
+#define PROCTABLE_SIZE	512
+
+static struct spinlock proctable_lock;
+static struct proc *proctable[PROCTABLE_SIZE];
+static pid_t proctable_nextpid[PROCTABLE_SIZE];	/* next pid for each slot */
+static int proctable_link[PROCTABLE_SIZE];	/* free list links */
+static int proctable_freehead;			/* -1 if the table is full */
+static int proctable_freetail;
+
+static
+void
+proctable_bootstrap(void)
+{
+	int i;
+
+	spinlock_init(&proctable_lock);
+	for (i = 0; i < PROCTABLE_SIZE; i++) {
+		proctable[i] = NULL;
+		proctable_nextpid[i] = PID_MIN + i;
+		proctable_link[i] = i + 1;
+	}
+	proctable_link[PROCTABLE_SIZE - 1] = -1;
+	proctable_freehead = 0;
+	proctable_freetail = PROCTABLE_SIZE - 1;
+}
+
+/*
+ * Give PROC a pid and enter it in the table.
+ */
+static
+int
+proctable_add(struct proc *proc)
+{
+	int slot;
+
+	spinlock_acquire(&proctable_lock);
+	slot = proctable_freehead;
+	if (slot < 0) {
+		spinlock_release(&proctable_lock);
+		return ENPROC;
+	}
+	proctable_freehead = proctable_link[slot];
+	if (proctable_freehead < 0) {
+		proctable_freetail = -1;
+	}
+
+	KASSERT(proctable[slot] == NULL);
+	proctable[slot] = proc;
+	proc->pid = proctable_nextpid[slot];
+	if (proctable_nextpid[slot] > PID_MAX - PROCTABLE_SIZE) {
+		proctable_nextpid[slot] = PID_MIN + slot;
+	}
+	else {
+		proctable_nextpid[slot] += PROCTABLE_SIZE;
+	}
+	spinlock_release(&proctable_lock);
+	return 0;
+}
+
+/*
+ * Take PROC out of the table, freeing its pid.
+ */
+static
+void
+proctable_remove(struct proc *proc)
+{
+	int slot;
+
+	slot = (proc->pid - PID_MIN) % PROCTABLE_SIZE;
+
+	spinlock_acquire(&proctable_lock);
+	KASSERT(proctable[slot] == proc);
+	proctable[slot] = NULL;
+	proctable_link[slot] = -1;
+	if (proctable_freetail < 0) {
+		proctable_freehead = slot;
+	}
+	else {
+		proctable_link[proctable_freetail] = slot;
+	}
+	proctable_freetail = slot;
+	spinlock_release(&proctable_lock);
+}
+
+int
+proc_getchild(struct proc *parent, pid_t pid, struct proc **ret)
+{
+	struct proc *proc;
+	int result = 0;
+
+	if (pid < PID_MIN || pid > PID_MAX) {
+		return ESRCH;
+	}
+
+	/*
+	 * Check the parent while holding the table lock: a process is
+	 * taken out of the table before it's freed, so it can't vanish
+	 * under us even if it isn't ours.
+	 */
+	spinlock_acquire(&proctable_lock);
+	proc = proctable[(pid - PID_MIN) % PROCTABLE_SIZE];
+	if (proc == NULL || proc->pid != pid) {
+		result = ESRCH;
+	}
+	else if (proc->parent != parent) {
+		result = ECHILD;
+	}
+	spinlock_release(&proctable_lock);
+
+	if (result == 0) {
+		*ret = proc;
+	}
+	return result;
+}
+#endif
 
 
 
@@ -134,6 +266,8 @@ proc_create(const char *name)
 		return NULL;
 	}
 	proc->parent = NULL;
+	proc->pid = 0;
+	proc->p_filetable = NULL;
 #endif
 
 	return proc;
@@ -156,6 +290,9 @@ proc_destroy(struct proc *proc)
 
 	KASSERT(proc != NULL);
 	KASSERT(proc != kproc);
+#if OPT_A2
+	bool zombie;
+#endif
 
 	/*
 	 * We don't take p_lock in here because we must have the only
@@ -197,15 +334,19 @@ proc_destroy(struct proc *proc)
 #endif // UW
 
 #if OPT_A2
-    for (unsigned int i = 0 ; i < array_num(proc->children); i++){
-       struct proc *child = (struct proc *)array_get(proc->children, i);
-       lock_acquire(child->p_thread_lock);
-       child->parent = NULL;
-       lock_release(child->p_thread_lock);
-    }
+	zombie = !proc->is_alive;
+	if (proc->pid != 0) {
+		proctable_remove(proc);
+	}
+
+	if (proc->p_filetable) {
+		filetable_destroy(proc->p_filetable);
+		proc->p_filetable = NULL;
+	}
 
+	/* children were reaped or orphaned by proc_orphan_children */
+	KASSERT(array_num(proc->children) == 0);
 	lock_destroy(proc->p_thread_lock);
-	array_setsize(proc->children, 0);
 	array_destroy(proc->children);
 	cv_destroy(proc->p_cv);
 	proc->is_alive = false;
@@ -226,6 +367,12 @@ proc_destroy(struct proc *proc)
 	P(proc_count_mutex); 
 	KASSERT(proc_count > 0);
 	proc_count--;
+#if OPT_A2
+	if (zombie) {
+		KASSERT(proc_zombies > 0);
+		proc_zombies--;
+	}
+#endif
 	/* signal the kernel menu thread if the process count has reached zero */
 	if (proc_count == 0) {
 	  V(no_proc_sem);
@@ -250,6 +397,9 @@ proc_bootstrap(void)
   }
 #ifdef UW
   proc_count = 0;
+#if OPT_A2
+  proc_zombies = 0;
+#endif
   proc_count_mutex = sem_create("proc_count_mutex",1);
   if (proc_count_mutex == NULL) {
     panic("could not create proc_count_mutex semaphore\n");
@@ -260,28 +410,31 @@ proc_bootstrap(void)
   }
 #endif // UW 
 #if OPT_A2
-	pid_cnt = (pid_t)100;
+	proctable_bootstrap();
 #endif
 }
 
 /*
- * Create a fresh proc for use by runprogram.
- *
- * It will have no address space and will inherit the current
- * process's (that is, the kernel menu's) current directory.
+ * Common code for proc_create_runprogram and proc_create_child. On
+ * failure sets *ERR: ENPROC if the process table is full, otherwise
+ * ENOMEM.
  */
+static
 struct proc *
-proc_create_runprogram(const char *name)
+proc_docreate(const char *name, int *err)
 {
 	struct proc *proc;
+#if defined(UW) && !OPT_A2
 	char *console_path;
+#endif
 
 	proc = proc_create(name);
 	if (proc == NULL) {
+		*err = ENOMEM;
 		return NULL;
 	}
 
-#ifdef UW
+#if defined(UW) && !OPT_A2
 	/* open the console - this should always succeed */
 	console_path = kstrdup("con:");
 	if (console_path == NULL) {
@@ -316,14 +469,6 @@ proc_create_runprogram(const char *name)
 	spinlock_release(&curproc->p_lock);
 #endif // UW
 
-#if OPT_A2
-	//assign pid
-	P(proc_count_mutex); 
-	proc->pid = pid_cnt;
-	pid_cnt++;
-	V(proc_count_mutex);
-	
-#endif
 
 #ifdef UW
 	/* increment the count of processes */
@@ -334,11 +479,58 @@ proc_create_runprogram(const char *name)
 	V(proc_count_mutex);
 #endif // UW
 
+#if OPT_A2
+	/*
+	 * This comes after the process is counted so that proc_destroy
+	 * can undo everything.
+	 */
+	*err = proctable_add(proc);
+	if (*err) {
+		proc_destroy(proc);
+		return NULL;
+	}
+
+	/*
+	 * Start with no descriptors; runprogram opens the console on
+	 * 0, 1 and 2, and fork copies the parent's table instead.
+	 */
+	proc->p_filetable = filetable_create();
+	if (proc->p_filetable == NULL) {
+		proc_destroy(proc);
+		*err = ENOMEM;
+		return NULL;
+	}
+#endif
 
 
 	return proc;
 }
 
+/*
+ * Create a fresh proc for use by runprogram.
+ *
+ * It will have no address space and will inherit the current
+ * process's (that is, the kernel menu's) current directory.
+ */
+struct proc *
+proc_create_runprogram(const char *name)
+{
+	int err;
+
+	return proc_docreate(name, &err);
+}
+
+#if OPT_A2
+int
+proc_create_child(const char *name, struct proc **ret)
+{
+	int err;
+
+	*ret = proc_docreate(name, &err);
+	return (*ret == NULL) ? err : 0;
+}
+#endif
+
 /*
  * Add a thread to a process. Either the thread or the process might
  * or might not be current.
@@ -440,13 +632,75 @@ bool proc_check_alive(struct proc* proc){
 	return ret;
 }
 
-void proc_set_dead(struct proc* proc, int exitcode){
+bool proc_set_dead(struct proc* proc, int exitcode){
 	KASSERT(proc);
+	bool orphan;
 	lock_acquire(proc->p_thread_lock);
-	proc->is_alive = false;
-	proc->exit_code = exitcode;
-	cv_signal(proc->p_cv, proc->p_thread_lock);
+	orphan = (proc->parent == NULL);
+	if (!orphan) {
+		/* count it before the parent can see it and reap it */
+		P(proc_count_mutex);
+		proc_zombies++;
+		V(proc_count_mutex);
+
+		proc->is_alive = false;
+		proc->exit_code = exitcode;
+		cv_signal(proc->p_cv, proc->p_thread_lock);
+	}
 	lock_release(proc->p_thread_lock);
+	/* if we weren't an orphan, our parent may have reaped us by now */
+	return orphan;
+}
+
+void proc_orphan_children(struct proc* proc){
+	KASSERT(proc);
+	for (unsigned int i = 0 ; i < array_num(proc->children); i++){
+		struct proc *child = (struct proc *)array_get(proc->children, i);
+		bool dead;
+		lock_acquire(child->p_thread_lock);
+		dead = !child->is_alive;
+		if (!dead) {
+			/* it'll see this when it exits and free itself */
+			child->parent = NULL;
+		}
+		lock_release(child->p_thread_lock);
+		if (dead) {
+			proc_destroy(child);
+		}
+	}
+	array_setsize(proc->children, 0);
+}
+
+void proc_reap(struct proc* proc, struct proc* child){
+	KASSERT(proc);
+	KASSERT(child->parent == proc);
+	unsigned int num = array_num(proc->children);
+	for (unsigned int i = 0 ; i < num; i++){
+		if (array_get(proc->children, i) == child) {
+			/* order doesn't matter; move the last one here */
+			array_set(proc->children, i,
+				  array_get(proc->children, num - 1));
+			array_setsize(proc->children, num - 1);
+			proc_destroy(child);
+			return;
+		}
+	}
+	panic("proc_reap: %s is not a child of %s\n",
+	      child->p_name, proc->p_name);
+}
+
+void proc_getstats(unsigned *live, unsigned *zombies){
+	P(proc_count_mutex);
+	*live = proc_count - proc_zombies;
+	*zombies = proc_zombies;
+	V(proc_count_mutex);
+}
+
+void proc_printstats(void){
+	unsigned int live, zombies;
+
+	proc_getstats(&live, &zombies);
+	kprintf("Processes: %u live, %u zombie\n", live, zombies);
 }
 #endif
 
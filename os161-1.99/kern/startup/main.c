@@ -49,6 +49,8 @@
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <uw-vmstats.h>
+#include "opt-A3.h"
 #include "autoconf.h"  // for pseudoconfig
 
 
@@ -151,6 +153,10 @@ shutdown(void)
 	vfs_clearcurdir();
 	vfs_unmountall();
 
+#if OPT_A3
+	vmstats_print();
+#endif
+
 	thread_shutdown();
 
 	splhigh();
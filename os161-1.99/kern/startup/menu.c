@@ -39,6 +39,8 @@
 #include <proc.h>
 #include <synch.h>
 #include <vfs.h>
+#include <coremap.h>
+#include <buf.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
@@ -68,6 +70,24 @@ getinterval(time_t s1, uint32_t ns1, time_t s2, uint32_t ns2,
 	*rs = s2 - s1;
 }
 
+/*
+ * The time from time1 to time2 in milliseconds, rounded up to 1 so
+ * it's safe to divide by.
+ */
+uint32_t
+interval_msecs(time_t s1, uint32_t ns1, time_t s2, uint32_t ns2)
+{
+	time_t rs;
+	uint32_t rns, msecs;
+
+	getinterval(s1, ns1, s2, ns2, &rs, &rns);
+	msecs = rs * 1000 + rns / 1000000;
+	if (msecs == 0) {
+		msecs = 1;
+	}
+	return msecs;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Command menu functions 
@@ -194,6 +214,78 @@ cmd_prog(int nargs, char **args)
 	return common_prog(nargs, args);
 }
 
+#if OPT_A2
+/*
+ * Command for checking that a userlevel program leaves nothing
+ * behind. It's run twice: once to warm up the caches it touches, and
+ * once for real, after which the heap, physical memory in use and
+ * the zombie count mustn't be any bigger than after the first run.
+ * Thread stacks are freed lazily, so allow a little slack.
+ */
+#define LK_HEAPSLACK	1024	/* bytes */
+#define LK_FRAMESLACK	4	/* frames */
+
+struct lk_snapshot {
+	size_t heap;
+	unsigned frames;
+	unsigned zombies;
+};
+
+static
+void
+lk_snapshot(struct lk_snapshot *ls)
+{
+	struct coremap_stats cs;
+	unsigned live;
+
+	ls->heap = kheap_getused();
+	coremap_getstats(&cs);
+	ls->frames = cs.cs_nframes - cs.cs_nfree;
+	proc_getstats(&live, &ls->zombies);
+}
+
+static
+int
+cmd_leakcheck(int nargs, char **args)
+{
+	struct lk_snapshot before, after;
+	int result;
+
+	if (nargs < 2) {
+		kprintf("Usage: lk program [arguments]\n");
+		return EINVAL;
+	}
+
+	/* drop the leading "lk" */
+	args++;
+	nargs--;
+
+	result = common_prog(nargs, args);
+	if (result) {
+		return result;
+	}
+	lk_snapshot(&before);
+	result = common_prog(nargs, args);
+	if (result) {
+		return result;
+	}
+	lk_snapshot(&after);
+
+	kprintf("lk: heap %lu -> %lu bytes, %u -> %u frames, "
+		"%u -> %u zombies\n",
+		(unsigned long)before.heap, (unsigned long)after.heap,
+		before.frames, after.frames, before.zombies, after.zombies);
+	if (after.heap > before.heap + LK_HEAPSLACK ||
+	    after.frames > before.frames + LK_FRAMESLACK ||
+	    after.zombies > before.zombies) {
+		kprintf("lk: %s leaks\n", args[0]);
+		return EINVAL;
+	}
+	kprintf("lk: %s leaves nothing behind\n", args[0]);
+	return 0;
+}
+#endif
+
 /*
  * Command for starting the system shell.
  */
@@ -406,10 +498,68 @@ cmd_kheapstats(int nargs, char **args)
 	(void)args;
 
 	kheap_printstats();
+	coremap_printstats();
+#if OPT_A2
+	proc_printstats();
+#endif
 	
 	return 0;
 }
 
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	buffer_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for turning readahead and clustered writes on and off.
+ */
+static
+int
+cmd_readahead(int nargs, char **args)
+{
+	bool on;
+
+	if (nargs == 1) {
+		on = buffer_set_clustering(true);
+		buffer_set_clustering(on);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "on")) {
+		buffer_set_clustering(true);
+		on = true;
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		buffer_set_clustering(false);
+		on = false;
+	}
+	else {
+		kprintf("Usage: ra [on|off]\n");
+		return EINVAL;
+	}
+	kprintf("Readahead and clustered writes are %s\n", on ? "on" : "off");
+
+	return 0;
+}
+
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printstats();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -442,6 +592,9 @@ showmenu(const char *name, const char *x[])
 static const char *opsmenu[] = {
 	"[s]       Shell                     ",
 	"[p]       Other program             ",
+#if OPT_A2
+	"[lk]      Check program for leaks   ",
+#endif
 	"[mount]   Mount a filesystem        ",
 	"[unmount] Unmount a filesystem      ",
 	"[bootfs]  Set \"boot\" filesystem     ",
@@ -471,15 +624,23 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km3] Coremap benchmark             ",
+	"[km4] kmalloc all-cpu stress test   ",
+	"[dk]  Disk throughput benchmark     ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
+	"[tt4] Scheduler latency bench       ",
 #if OPT_NET
 	"[net] Network test                  ",
 #endif
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
+	"[sy4] Lock benchmark        (1)     ",
+	"[sy5] RW lock test          (1)     ",
+	"[sy6] Seqlock test                  ",
+	"[sy7] RW lock read bench    (1)     ",
 #ifdef UW
 	"[uw1] UW lock test          (1)     ",
 	"[uw2] UW vmstats test       (3)     ",
@@ -489,6 +650,13 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS create stress      (4)     ",
+	"[fs6] FS vnode table stress (4)     ",
+	"[fs7] FS read scaling bench (4)     ",
+	"[fs8] FS layout benchmark   (4)     ",
+	"[fs9] FS big transfer bench (4)     ",
+	"[fs10] FS readahead bench   (4)     ",
+	"[fs11] FS big dir bench     (4)     ",
+	"[fs12] FS mount/lookup race (4)     ",
 	NULL
 };
 
@@ -520,6 +688,9 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[bc] Buffer cache stats             ",
+	"[ra] Readahead on/off               ",
+	"[ss] Scheduler stats                ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -553,6 +724,9 @@ static struct {
 	/* operations */
 	{ "s",		cmd_shell },
 	{ "p",		cmd_prog },
+#if OPT_A2
+	{ "lk",		cmd_leakcheck },
+#endif
 	{ "mount",	cmd_mount },
 	{ "unmount",	cmd_unmount },
 	{ "bootfs",	cmd_bootfs },
@@ -577,23 +751,34 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "bc",		cmd_bufstats },
+	{ "ra",		cmd_readahead },
+	{ "ss",		cmd_schedstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km3",	coremapbench },
+	{ "km4",	mallocbench },
+	{ "dk",		diskbench },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
 	{ "tt1",	threadtest },
 	{ "tt2",	threadtest2 },
 	{ "tt3",	threadtest3 },
+	{ "tt4",	schedbench },
 	{ "sy1",	semtest },
 
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	lockbench },
+	{ "sy5",	rwtest },
+	{ "sy6",	seqtest },
+	{ "sy7",	rwbench },
 #ifdef UW
 	{ "uw1",	uwlocktest1 },
 	{ "uw2",	uwvmstatstest },
@@ -605,6 +790,15 @@ static struct {
 	{ "fs3",	writestress },
 	{ "fs4",	writestress2 },
 	{ "fs5",	createstress },
+	{ "fs6",	vnodestress },
+	{ "fs7",	readbench },
+	{ "fs8",	layoutbench },
+	{ "fs9",	bigiobench },
+	{ "fs10",	rabench },
+	{ "fs11",	dirbench },
+#if OPT_SFS
+	{ "fs12",	mountrace },
+#endif
 
 	{ NULL, NULL }
 };
@@ -8,6 +8,221 @@
 #include <vfs.h>
 #include <current.h>
 #include <proc.h>
+#include "opt-A2.h"
+#if OPT_A2
+#include <limits.h>
+#include <kern/fcntl.h>
+#include <kern/seek.h>
+#include <kern/stat.h>
+#include <copyinout.h>
+#include <synch.h>
+#include <openfile.h>
+#endif
+
+#if OPT_A2
+
+/*
+ * File system calls. Descriptors are looked up in the current
+ * process's file table without locking (see openfile.h); the open
+ * file's lock serializes I/O and seeks so that processes sharing it
+ * after fork or dup2 see a consistent seek position.
+ */
+
+int
+sys_open(userptr_t upath, int flags, mode_t mode, int *retval)
+{
+  struct openfile *of;
+  char *path;
+  int fd;
+  int result;
+
+  path = kmalloc(PATH_MAX);
+  if (path == NULL) {
+    return ENOMEM;
+  }
+  result = copyinstr(upath, path, PATH_MAX, NULL);
+  if (result) {
+    kfree(path);
+    return result;
+  }
+
+  result = openfile_open(path, flags, mode, &of);
+  kfree(path);
+  if (result) {
+    return result;
+  }
+
+  result = filetable_place(curproc->p_filetable, of, &fd);
+  if (result) {
+    openfile_decref(of);
+    return result;
+  }
+  *retval = fd;
+  return 0;
+}
+
+/*
+ * Common code for read and write.
+ */
+static
+int
+sys_rw(int fdesc, userptr_t ubuf, unsigned int nbytes, enum uio_rw rw, int *retval)
+{
+  struct openfile *of;
+  struct iovec iov;
+  struct uio u;
+  int result;
+
+  result = filetable_get(curproc->p_filetable, fdesc, &of);
+  if (result) {
+    return result;
+  }
+  if (of->of_accmode == (rw == UIO_READ ? O_WRONLY : O_RDONLY)) {
+    return EBADF;
+  }
+
+  lock_acquire(of->of_lock);
+
+  /* set up a uio structure to refer to the user program's buffer (ubuf) */
+  iov.iov_ubase = ubuf;
+  iov.iov_len = nbytes;
+  u.uio_iov = &iov;
+  u.uio_iovcnt = 1;
+  u.uio_offset = of->of_offset;
+  u.uio_resid = nbytes;
+  u.uio_segflg = UIO_USERSPACE;
+  u.uio_rw = rw;
+  u.uio_space = curproc->p_addrspace;
+
+  if (rw == UIO_READ) {
+    result = VOP_READ(of->of_vnode, &u);
+  }
+  else {
+    result = VOP_WRITE(of->of_vnode, &u);
+  }
+  if (result == 0) {
+    of->of_offset = u.uio_offset;
+  }
+
+  lock_release(of->of_lock);
+  if (result) {
+    return result;
+  }
+
+  /* pass back the number of bytes actually transferred */
+  *retval = nbytes - u.uio_resid;
+  KASSERT(*retval >= 0);
+  return 0;
+}
+
+int
+sys_read(int fdesc, userptr_t ubuf, unsigned int nbytes, int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: read(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+  return sys_rw(fdesc, ubuf, nbytes, UIO_READ, retval);
+}
+
+int
+sys_write(int fdesc, userptr_t ubuf, unsigned int nbytes, int *retval)
+{
+  DEBUG(DB_SYSCALL,"Syscall: write(%d,%x,%d)\n",fdesc,(unsigned int)ubuf,nbytes);
+  return sys_rw(fdesc, ubuf, nbytes, UIO_WRITE, retval);
+}
+
+int
+sys_lseek(int fdesc, off_t pos, int whence, off_t *retval)
+{
+  struct openfile *of;
+  struct stat st;
+  off_t newpos;
+  int result;
+
+  result = filetable_get(curproc->p_filetable, fdesc, &of);
+  if (result) {
+    return result;
+  }
+
+  lock_acquire(of->of_lock);
+  switch (whence) {
+  case SEEK_SET:
+    newpos = pos;
+    break;
+  case SEEK_CUR:
+    newpos = of->of_offset + pos;
+    break;
+  case SEEK_END:
+    result = VOP_STAT(of->of_vnode, &st);
+    if (result) {
+      lock_release(of->of_lock);
+      return result;
+    }
+    newpos = st.st_size + pos;
+    break;
+  default:
+    lock_release(of->of_lock);
+    return EINVAL;
+  }
+  if (newpos < 0) {
+    lock_release(of->of_lock);
+    return EINVAL;
+  }
+
+  /* the console and other devices refuse with ESPIPE */
+  result = VOP_TRYSEEK(of->of_vnode, newpos);
+  if (result) {
+    lock_release(of->of_lock);
+    return result;
+  }
+  of->of_offset = newpos;
+  lock_release(of->of_lock);
+
+  *retval = newpos;
+  return 0;
+}
+
+int
+sys_close(int fdesc)
+{
+  struct openfile *of;
+  int result;
+
+  result = filetable_remove(curproc->p_filetable, fdesc, &of);
+  if (result) {
+    return result;
+  }
+  openfile_decref(of);
+  return 0;
+}
+
+int
+sys_dup2(int oldfd, int newfd, int *retval)
+{
+  struct openfile *of, *old;
+  int result;
+
+  result = filetable_get(curproc->p_filetable, oldfd, &of);
+  if (result) {
+    return result;
+  }
+  if (newfd < 0 || newfd >= OPEN_MAX) {
+    return EBADF;
+  }
+  if (oldfd == newfd) {
+    *retval = newfd;
+    return 0;
+  }
+
+  openfile_incref(of);
+  result = filetable_placeat(curproc->p_filetable, of, newfd, &old);
+  KASSERT(result == 0);
+  if (old != NULL) {
+    openfile_decref(old);
+  }
+  *retval = newfd;
+  return 0;
+}
+
+#else // OPT_A2
 
 /* handler for write() system call                  */
 /*
@@ -58,3 +273,5 @@ sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval)
   KASSERT(*retval >= 0);
   return 0;
 }
+
+#endif // OPT_A2
@@ -59,7 +59,9 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include "opt-A3.h"
 
+#if !OPT_A3
 /*
  * Load a segment at virtual address VADDR. The segment in memory
  * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
@@ -144,6 +146,7 @@ load_segment(struct addrspace *as, struct vnode *v,
 	
 	return result;
 }
+#endif /* !OPT_A3 */
 
 /*
  * Load an ELF executable user program into the current address space.
@@ -251,6 +254,22 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		if (result) {
 			return result;
 		}
+
+#if OPT_A3
+		/*
+		 * Don't read anything now; the VM system pages the
+		 * segment in from V as it is touched.
+		 */
+		if (ph.p_filesz > ph.p_memsz) {
+			kprintf("ELF: warning: segment filesize > segment memsize\n");
+			ph.p_filesz = ph.p_memsz;
+		}
+		result = as_define_filedata(as, v, ph.p_offset, ph.p_vaddr,
+					    ph.p_filesz);
+		if (result) {
+			return result;
+		}
+#endif
 	}
 
 	result = as_prepare_load(as);
@@ -258,6 +277,8 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return result;
 	}
 
+#if !OPT_A3
+
 	/*
 	 * Now actually load each segment.
 	 */
@@ -295,6 +316,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return result;
 		}
 	}
+#endif /* !OPT_A3 */
 
 	result = as_complete_load(as);
 	
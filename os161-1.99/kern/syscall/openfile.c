@@ -0,0 +1,210 @@
+/*
+ * Open files and file descriptor tables. See openfile.h.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <synch.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <openfile.h>
+
+////////////////////////////////////////////////////////////
+// Open files
+
+int
+openfile_open(char *path, int flags, mode_t mode, struct openfile **ret)
+{
+	struct openfile *of;
+	int result;
+
+	switch (flags & O_ACCMODE) {
+	    case O_RDONLY:
+	    case O_WRONLY:
+	    case O_RDWR:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	of = kmalloc(sizeof(struct openfile));
+	if (of == NULL) {
+		return ENOMEM;
+	}
+	of->of_lock = lock_create("openfile");
+	if (of->of_lock == NULL) {
+		kfree(of);
+		return ENOMEM;
+	}
+
+	result = vfs_open(path, flags, mode, &of->of_vnode);
+	if (result) {
+		lock_destroy(of->of_lock);
+		kfree(of);
+		return result;
+	}
+
+	of->of_accmode = flags & O_ACCMODE;
+	of->of_offset = 0;
+	spinlock_init(&of->of_countlock);
+	of->of_refcount = 1;
+
+	*ret = of;
+	return 0;
+}
+
+void
+openfile_incref(struct openfile *of)
+{
+	spinlock_acquire(&of->of_countlock);
+	of->of_refcount++;
+	spinlock_release(&of->of_countlock);
+}
+
+void
+openfile_decref(struct openfile *of)
+{
+	bool destroy;
+
+	spinlock_acquire(&of->of_countlock);
+	KASSERT(of->of_refcount > 0);
+	of->of_refcount--;
+	destroy = (of->of_refcount == 0);
+	spinlock_release(&of->of_countlock);
+
+	if (destroy) {
+		vfs_close(of->of_vnode);
+		spinlock_cleanup(&of->of_countlock);
+		lock_destroy(of->of_lock);
+		kfree(of);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Descriptor tables
+
+struct filetable *
+filetable_create(void)
+{
+	struct filetable *ft;
+	int fd;
+
+	ft = kmalloc(sizeof(struct filetable));
+	if (ft == NULL) {
+		return NULL;
+	}
+	for (fd = 0; fd < OPEN_MAX; fd++) {
+		ft->ft_files[fd] = NULL;
+	}
+	return ft;
+}
+
+void
+filetable_destroy(struct filetable *ft)
+{
+	int fd;
+
+	for (fd = 0; fd < OPEN_MAX; fd++) {
+		if (ft->ft_files[fd] != NULL) {
+			openfile_decref(ft->ft_files[fd]);
+			ft->ft_files[fd] = NULL;
+		}
+	}
+	kfree(ft);
+}
+
+int
+filetable_copy(struct filetable *src, struct filetable **ret)
+{
+	struct filetable *ft;
+	int fd;
+
+	ft = filetable_create();
+	if (ft == NULL) {
+		return ENOMEM;
+	}
+	for (fd = 0; fd < OPEN_MAX; fd++) {
+		if (src->ft_files[fd] != NULL) {
+			openfile_incref(src->ft_files[fd]);
+			ft->ft_files[fd] = src->ft_files[fd];
+		}
+	}
+	*ret = ft;
+	return 0;
+}
+
+int
+filetable_get(struct filetable *ft, int fd, struct openfile **ret)
+{
+	if (fd < 0 || fd >= OPEN_MAX || ft->ft_files[fd] == NULL) {
+		return EBADF;
+	}
+	*ret = ft->ft_files[fd];
+	return 0;
+}
+
+int
+filetable_place(struct filetable *ft, struct openfile *of, int *fd)
+{
+	int i;
+
+	for (i = 0; i < OPEN_MAX; i++) {
+		if (ft->ft_files[i] == NULL) {
+			ft->ft_files[i] = of;
+			*fd = i;
+			return 0;
+		}
+	}
+	return EMFILE;
+}
+
+int
+filetable_placeat(struct filetable *ft, struct openfile *of, int fd,
+		  struct openfile **oldret)
+{
+	if (fd < 0 || fd >= OPEN_MAX) {
+		return EBADF;
+	}
+	*oldret = ft->ft_files[fd];
+	ft->ft_files[fd] = of;
+	return 0;
+}
+
+int
+filetable_remove(struct filetable *ft, int fd, struct openfile **ret)
+{
+	int result;
+
+	result = filetable_get(ft, fd, ret);
+	if (result) {
+		return result;
+	}
+	ft->ft_files[fd] = NULL;
+	return 0;
+}
+
+int
+filetable_stdio(struct filetable *ft)
+{
+	static const int modes[3] = { O_RDONLY, O_WRONLY, O_WRONLY };
+	struct openfile *of, *old;
+	char path[5];
+	int fd, result;
+
+	for (fd = 0; fd < 3; fd++) {
+		/* vfs_open destroys the path it's given */
+		strcpy(path, "con:");
+		result = openfile_open(path, modes[fd], 0, &of);
+		if (result) {
+			return result;
+		}
+		result = filetable_placeat(ft, of, fd, &old);
+		KASSERT(result == 0);
+		if (old != NULL) {
+			openfile_decref(old);
+		}
+	}
+	return 0;
+}
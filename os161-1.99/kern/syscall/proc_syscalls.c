@@ -15,6 +15,7 @@
 #include <vfs.h>
 #include <kern/fcntl.h>
 #include <mips/types.h>
+#include <openfile.h>
 
 #if OPT_A2
 //clean up a kernel arg arr
@@ -151,25 +152,8 @@ void sys__exit(int exitcode) {
   struct addrspace *as;
   struct proc *p = curproc;
   
-  bool can_delete = false;
-  
-  for (unsigned int i = 0 ; i < array_num(p->children); i++){
-    struct proc *child = (struct proc *)array_get(p->children, i);
-    if (!proc_check_alive(child)){
-      proc_destroy(child);
-      array_remove(p->children, i);
-      i--;
-    }
-  }
-
-  // a proc can only delete itself when its parent is NULL or dead
-  lock_acquire(p->p_thread_lock);
-  if (!p->parent || !p->parent->is_alive){
-    can_delete = true;
-  }
-  lock_release(p->p_thread_lock);
-
-  
+  // free zombie children; the rest free themselves when they exit
+  proc_orphan_children(p);
 
   KASSERT(curproc->p_addrspace != NULL);
   as_deactivate();
@@ -183,16 +167,19 @@ void sys__exit(int exitcode) {
   as = curproc_setas(NULL);
   as_destroy(as);
 
+  /* close files now rather than when the parent reaps us */
+  filetable_destroy(p->p_filetable);
+  p->p_filetable = NULL;
+
   /* detach this thread from its process */
   /* note: curproc cannot be used after this call */
   proc_remthread(curthread);
 
+  /* an orphan frees itself; otherwise the parent reaps us in waitpid */
   /* if this is the last user process in the system, proc_destroy()
      will wake up the kernel menu thread */
-  if (can_delete){
+  if (proc_set_dead(p, exitcode)){
     proc_destroy(p);
-  } else {
-    proc_set_dead(p, exitcode);
   }
   
   
@@ -227,29 +214,25 @@ sys_waitpid(pid_t pid,
   int exitstatus;
   int result;
 
-  bool pid_is_children = false;
-  //check children's pid
-  for (unsigned int i = 0; i < array_num(curproc->children); i++){
-    struct proc* child = array_get(curproc->children, i);
-    if (child->pid == pid){
-      pid_is_children = true;
-      lock_acquire(child->p_thread_lock);
-      //wait for the child to exit
-      while (child->is_alive){
-        cv_wait(child->p_cv, child->p_thread_lock);
-      }
-      exitstatus = _MKWAIT_EXIT(child->exit_code);
-      lock_release(child->p_thread_lock);
-      break;
-    }
-  }
-  
-  //if not found, return err
-  if (!pid_is_children){
+  //find the child by pid
+  struct proc* child;
+  result = proc_getchild(curproc, pid, &child);
+  if (result){
     *retval=-1;
-    return (ESRCH);
+    return (result);
   }
 
+  lock_acquire(child->p_thread_lock);
+  //wait for the child to exit
+  while (child->is_alive){
+    cv_wait(child->p_cv, child->p_thread_lock);
+  }
+  exitstatus = _MKWAIT_EXIT(child->exit_code);
+  lock_release(child->p_thread_lock);
+
+  //free the child right away rather than when we exit
+  proc_reap(curproc, child);
+
 
 
   
@@ -267,15 +250,16 @@ sys_waitpid(pid_t pid,
 
 int sys_fork(struct trapframe* tf, pid_t* retval){
   //step1 create child proc
-  struct proc* child = proc_create_runprogram("child");
-  if (!child) {
+  struct proc* child;
+  int error = proc_create_child("child", &child);
+  if (error) {
     *retval = (pid_t)-1;
-    return ENOMEM;
+    return error;
   }
 
   //step2 create as and copy
   struct addrspace* as = NULL;
-  int error = as_copy(curproc_getas(), &as);
+  error = as_copy(curproc_getas(), &as);
   if (error){
     proc_destroy(child);
     *retval = (pid_t)-1;
@@ -285,10 +269,21 @@ int sys_fork(struct trapframe* tf, pid_t* retval){
   child->p_addrspace = as;
   spinlock_release(&child->p_lock);
 
+  //the child shares the parent's open files, seek positions and all
+  filetable_destroy(child->p_filetable);
+  error = filetable_copy(curproc->p_filetable, &child->p_filetable);
+  if (error){
+    child->p_filetable = NULL;
+    proc_destroy(child);
+    *retval = (pid_t)-1;
+    return error;
+  }
+
   //step4 create a thread
   struct trapframe* parent_tf = kmalloc(sizeof(struct trapframe));
   if (!parent_tf) {
     *retval = (pid_t)-1;
+    proc_destroy(child);
     return ENOMEM;
   }
   spinlock_acquire(&curproc->p_lock);
@@ -300,6 +295,7 @@ int sys_fork(struct trapframe* tf, pid_t* retval){
   spinlock_release(&curproc->p_lock);
   if (error){
     *retval = (pid_t)-1;
+    kfree(parent_tf);
     proc_destroy(child);
     return error;
   }
@@ -313,12 +309,16 @@ int sys_fork(struct trapframe* tf, pid_t* retval){
 
   if (error){
     *retval = (pid_t)-1;
+    kfree(parent_tf);
+    proc_destroy(child);
     return error;
   }
 
   error = thread_fork("thread_c", child, enter_forked_process, (void *)parent_tf, 0);
   if (error){
     *retval = (pid_t)-1;
+    kfree(parent_tf);
+    array_remove(curproc->children, idx);
     proc_destroy(child);
     return error;
   }
@@ -45,6 +45,9 @@
 #include <syscall.h>
 #include <test.h>
 #include "opt-A2.h"
+#if OPT_A2
+#include <openfile.h>
+#endif
 /*
  * Load program "progname" and start running it in usermode.
  * Does not return except on error.
@@ -60,6 +63,12 @@ runprogram(char *progname,char**args, int argc)
 	vaddr_t entrypoint, stackptr;
 	int result;
 
+	/* Set up stdin, stdout and stderr. */
+	result = filetable_stdio(curproc->p_filetable);
+	if (result) {
+		return result;
+	}
+
 	/* Open the file. */
 	result = vfs_open(progname, O_RDONLY, 0, &v);
 	if (result) {
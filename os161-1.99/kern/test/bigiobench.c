@@ -0,0 +1,175 @@
+/*
+ * Filesystem big transfer benchmark.
+ *
+ * Writes a file sequentially in large chunks, syncs it, and reads it
+ * back the same way, reporting the throughput of each and how many
+ * transfers the buffer cache made to the disk for them. When the
+ * filesystem can map a whole chunk to a run of consecutive blocks
+ * (as on a volume made with mksfs -e) each chunk should take one or
+ * two transfers rather than one per block.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <clock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <buf.h>
+#include <test.h>
+
+#define BB_CHUNKSIZE	(32*1024)
+#define BB_NCHUNKS	16		/* 512K in all */
+
+static char bb_name[32];
+
+/* Disk transfers so far, whether through the cache or not */
+static
+unsigned
+bb_transfers(void)
+{
+	struct buf_stats bs;
+
+	buffer_getstats(&bs);
+	return bs.bs_reads + bs.bs_writes + bs.bs_directios;
+}
+
+static
+void
+bb_report(const char *what, unsigned transfers,
+	  time_t secs1, uint32_t nsecs1, time_t secs2, uint32_t nsecs2)
+{
+	time_t secs;
+	uint32_t nsecs, msecs, kbytes;
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	msecs = interval_msecs(secs1, nsecs1, secs2, nsecs2);
+	kbytes = BB_NCHUNKS * BB_CHUNKSIZE / 1024;
+	kprintf("%s %u KB in %lu.%09lu seconds: %u KB/sec, "
+		"%u disk transfers\n", what, kbytes, (unsigned long)secs,
+		(unsigned long)nsecs, kbytes * 1000 / msecs, transfers);
+}
+
+/*
+ * Write or read back the whole file, a chunk at a time. Each chunk
+ * is filled with its own number.
+ */
+static
+int
+bb_pass(char *buf, enum uio_rw rw)
+{
+	struct vnode *v;
+	struct iovec iov;
+	struct uio ku;
+	char name[32];
+	unsigned i, j;
+	int result;
+
+	/* vfs_open destroys the path it's given, so work on a copy */
+	strcpy(name, bb_name);
+	result = vfs_open(name, rw == UIO_WRITE ?
+			  O_WRONLY|O_CREAT|O_TRUNC : O_RDONLY, 0664, &v);
+	if (result) {
+		return result;
+	}
+
+	for (i = 0; i < BB_NCHUNKS && !result; i++) {
+		if (rw == UIO_WRITE) {
+			for (j = 0; j < BB_CHUNKSIZE; j++) {
+				buf[j] = (char)i;
+			}
+		}
+		uio_kinit(&iov, &ku, buf, BB_CHUNKSIZE,
+			  (off_t)i * BB_CHUNKSIZE, rw);
+		result = (rw == UIO_READ) ? VOP_READ(v, &ku) :
+			VOP_WRITE(v, &ku);
+		if (result == 0 && ku.uio_resid != 0) {
+			result = EIO;
+		}
+		if (result == 0 && rw == UIO_READ) {
+			for (j = 0; j < BB_CHUNKSIZE; j++) {
+				if (buf[j] != (char)i) {
+					kprintf("bigiobench: chunk %u is "
+						"wrong\n", i);
+					result = EIO;
+					break;
+				}
+			}
+		}
+	}
+	vfs_close(v);
+	return result;
+}
+
+int
+bigiobench(int nargs, char **args)
+{
+	char *fs, *buf;
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2;
+	unsigned transfers;
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: fs9 filesystem:\n");
+		return EINVAL;
+	}
+	fs = args[1];
+	/* Allow (but do not require) colon after device name */
+	if (fs[strlen(fs)-1]==':') {
+		fs[strlen(fs)-1] = 0;
+	}
+	snprintf(bb_name, sizeof(bb_name), "%s:bigiobench", fs);
+
+	buf = kmalloc(BB_CHUNKSIZE);
+	if (buf == NULL) {
+		panic("bigiobench: out of memory\n");
+	}
+
+	kprintf("*** Starting fs big transfer benchmark on %s: "
+		"(%u KB chunks)\n", fs, BB_CHUNKSIZE / 1024);
+
+	/* Start from a clean cache, so we only count our own writes */
+	result = vfs_sync();
+	if (result) {
+		goto out;
+	}
+
+	transfers = bb_transfers();
+	gettime(&secs1, &nsecs1);
+	result = bb_pass(buf, UIO_WRITE);
+	if (result == 0) {
+		result = vfs_sync();
+	}
+	gettime(&secs2, &nsecs2);
+	if (result) {
+		kprintf("bigiobench: write: %s\n", strerror(result));
+		goto out;
+	}
+	bb_report("Wrote", bb_transfers() - transfers,
+		  secs1, nsecs1, secs2, nsecs2);
+
+	transfers = bb_transfers();
+	gettime(&secs1, &nsecs1);
+	result = bb_pass(buf, UIO_READ);
+	gettime(&secs2, &nsecs2);
+	if (result) {
+		kprintf("bigiobench: read: %s\n", strerror(result));
+		goto out;
+	}
+	bb_report("Read", bb_transfers() - transfers,
+		  secs1, nsecs1, secs2, nsecs2);
+
+ out:
+	strcpy(buf, bb_name);
+	vfs_remove(buf);
+	kfree(buf);
+	if (result) {
+		kprintf("*** Test failed\n");
+		return result;
+	}
+	kprintf("*** fs big transfer benchmark done\n");
+	return 0;
+}
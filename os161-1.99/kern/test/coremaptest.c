@@ -0,0 +1,81 @@
+/*
+ * Benchmark for the physical frame allocator (coremap).
+ *
+ * Keeps a window of live allocations of mixed sizes and replaces a
+ * random one on every iteration, which is roughly what a mix of
+ * fork/exec/exit does to physical memory. Reports the allocation
+ * rate and how fragmented free memory is afterwards.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <vm.h>
+#include <coremap.h>
+#include <test.h>
+
+#define CMT_NITERS    20000
+#define CMT_WINDOW    64	/* live allocations */
+#define CMT_MAXPAGES  8		/* largest allocation, in pages */
+
+static vaddr_t cmt_live[CMT_WINDOW];
+
+int
+coremapbench(int nargs, char **args)
+{
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	unsigned i, slot, npages, nallocs, nfailed;
+	uint32_t msecs;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting coremap benchmark...\n");
+	coremap_printstats();
+
+	for (i = 0; i < CMT_WINDOW; i++) {
+		cmt_live[i] = 0;
+	}
+	nallocs = nfailed = 0;
+
+	gettime(&secs1, &nsecs1);
+	for (i = 0; i < CMT_NITERS; i++) {
+		slot = random() % CMT_WINDOW;
+		if (cmt_live[slot] != 0) {
+			free_kpages(cmt_live[slot]);
+		}
+		npages = 1 + random() % CMT_MAXPAGES;
+		cmt_live[slot] = alloc_kpages(npages);
+		if (cmt_live[slot] == 0) {
+			nfailed++;
+		}
+		else {
+			nallocs++;
+		}
+	}
+	gettime(&secs2, &nsecs2);
+
+	kprintf("With %u allocations live:\n", CMT_WINDOW);
+	coremap_printstats();
+
+	for (i = 0; i < CMT_WINDOW; i++) {
+		if (cmt_live[i] != 0) {
+			free_kpages(cmt_live[i]);
+			cmt_live[i] = 0;
+		}
+	}
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	msecs = interval_msecs(secs1, nsecs1, secs2, nsecs2);
+
+	kprintf("%u allocations (%u failed) in %lu.%09lu seconds\n",
+		nallocs, nfailed, (unsigned long)secs, (unsigned long)nsecs);
+	kprintf("%u allocations/sec\n",
+		(nallocs * 1000) / msecs);
+	kprintf("After freeing everything:\n");
+	coremap_printstats();
+	kprintf("coremap benchmark done.\n");
+
+	return 0;
+}
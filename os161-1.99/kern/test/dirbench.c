@@ -0,0 +1,164 @@
+/*
+ * Big directory benchmark.
+ *
+ * Creates a lot of files in one directory, a batch at a time, then
+ * opens each of them again and removes them all, reporting how long
+ * each batch and pass took. Without a directory index, each create
+ * has to look through every entry made before it, so each batch
+ * takes longer than the last; with one (on a volume made with
+ * mksfs -i), the batches should all take about the same time.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <clock.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <test.h>
+
+#define DB_DEFFILES	5000
+#define DB_BATCH	1000
+
+static
+void
+db_name(char *buf, size_t len, const char *fs, unsigned num)
+{
+	snprintf(buf, len, "%s:dirbench.%u", fs, num);
+}
+
+static
+void
+db_report(const char *what, unsigned first, unsigned last,
+	  time_t secs1, uint32_t nsecs1, time_t secs2, uint32_t nsecs2)
+{
+	time_t secs;
+	uint32_t nsecs, msecs;
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	msecs = interval_msecs(secs1, nsecs1, secs2, nsecs2);
+	kprintf("%s files %u-%u: %lu.%09lu seconds (%u per second)\n",
+		what, first, last, (unsigned long)secs, (unsigned long)nsecs,
+		(last - first + 1) * 1000 / msecs);
+}
+
+/*
+ * Create (or, with CREATE false, just open) files FIRST through LAST.
+ */
+static
+int
+db_open(const char *fs, unsigned first, unsigned last, bool create)
+{
+	struct vnode *v;
+	char name[32];
+	unsigned i;
+	int result;
+
+	for (i = first; i <= last; i++) {
+		db_name(name, sizeof(name), fs, i);
+		result = vfs_open(name, create ? O_WRONLY|O_CREAT|O_EXCL :
+				  O_RDONLY, 0664, &v);
+		if (result) {
+			kprintf("dirbench: %s file %u: %s\n",
+				create ? "create" : "open", i,
+				strerror(result));
+			return result;
+		}
+		vfs_close(v);
+	}
+	return 0;
+}
+
+/* Remove files 0 through N-1, whether or not they're there */
+static
+int
+db_remove(const char *fs, unsigned n)
+{
+	char name[32];
+	unsigned i;
+	int result, ret = 0;
+
+	for (i = 0; i < n; i++) {
+		db_name(name, sizeof(name), fs, i);
+		result = vfs_remove(name);
+		if (result && result != ENOENT && ret == 0) {
+			kprintf("dirbench: remove file %u: %s\n", i,
+				strerror(result));
+			ret = result;
+		}
+	}
+	return ret;
+}
+
+int
+dirbench(int nargs, char **args)
+{
+	char *fs;
+	unsigned nfiles, first, last;
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2;
+	int result, rmresult;
+
+	if (nargs != 2 && nargs != 3) {
+		kprintf("Usage: fs11 filesystem: [nfiles]\n");
+		return EINVAL;
+	}
+	fs = args[1];
+	/* Allow (but do not require) colon after device name */
+	if (fs[strlen(fs)-1]==':') {
+		fs[strlen(fs)-1] = 0;
+	}
+	nfiles = (nargs == 3) ? (unsigned)atoi(args[2]) : DB_DEFFILES;
+	if (nfiles < 1) {
+		kprintf("dirbench: at least one file, please\n");
+		return EINVAL;
+	}
+
+	kprintf("*** Starting big directory benchmark on %s: (%u files)\n",
+		fs, nfiles);
+
+	result = 0;
+	for (first = 0; first < nfiles && result == 0; first += DB_BATCH) {
+		last = first + DB_BATCH - 1;
+		if (last >= nfiles) {
+			last = nfiles - 1;
+		}
+		gettime(&secs1, &nsecs1);
+		result = db_open(fs, first, last, true);
+		gettime(&secs2, &nsecs2);
+		if (result == 0) {
+			db_report("Created", first, last,
+				  secs1, nsecs1, secs2, nsecs2);
+		}
+	}
+
+	if (result == 0) {
+		gettime(&secs1, &nsecs1);
+		result = db_open(fs, 0, nfiles - 1, false);
+		gettime(&secs2, &nsecs2);
+		if (result == 0) {
+			db_report("Opened", 0, nfiles - 1,
+				  secs1, nsecs1, secs2, nsecs2);
+		}
+	}
+
+	/* Clean up even if something failed */
+	gettime(&secs1, &nsecs1);
+	rmresult = db_remove(fs, nfiles);
+	gettime(&secs2, &nsecs2);
+	if (result == 0 && rmresult == 0) {
+		db_report("Removed", 0, nfiles - 1,
+			  secs1, nsecs1, secs2, nsecs2);
+	}
+	if (result == 0) {
+		result = rmresult;
+	}
+
+	if (result) {
+		kprintf("*** Test failed\n");
+		return result;
+	}
+	kprintf("*** Big directory benchmark done\n");
+	return 0;
+}
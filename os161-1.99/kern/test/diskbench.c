@@ -0,0 +1,172 @@
+/*
+ * Disk throughput benchmark.
+ *
+ * Several threads read a raw disk device at once, first each reading
+ * its own stretch of the disk sequentially, then each reading
+ * sectors at random. Reports the throughput of each phase; with the
+ * disk's request queue the sequential phase should approach the
+ * single-thread streaming rate, and the random phase should beat
+ * plain first-come first-served seeking.
+ *
+ * Only reads, so it is safe on a disk with a mounted filesystem.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <test.h>
+
+#define DB_NTHREADS	4
+#define DB_SECTSIZE	512
+#define DB_CHUNK	8	/* sectors per sequential read */
+#define DB_NSEQ		256	/* sectors per thread, sequential */
+#define DB_NRAND	64	/* sectors per thread, random */
+
+static struct semaphore *db_sem;
+static struct vnode *db_vn;
+static uint32_t db_nsect;
+static bool db_random;
+
+static
+int
+db_read(void *buf, size_t len, uint32_t sector)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	uio_kinit(&iov, &ku, buf, len, (off_t)sector * DB_SECTSIZE, UIO_READ);
+	return VOP_READ(db_vn, &ku);
+}
+
+static
+void
+db_thread(void *buf, unsigned long num)
+{
+	uint32_t start, i;
+	int result = 0;
+
+	if (db_random) {
+		for (i = 0; i < DB_NRAND && !result; i++) {
+			result = db_read(buf, DB_SECTSIZE,
+					 random() % db_nsect);
+		}
+	}
+	else {
+		/* Spread the threads over the disk */
+		start = num * (db_nsect / DB_NTHREADS);
+		for (i = 0; i < DB_NSEQ && !result; i += DB_CHUNK) {
+			result = db_read(buf, DB_CHUNK * DB_SECTSIZE,
+					 start + i);
+		}
+	}
+	if (result) {
+		kprintf("diskbench: thread %lu: %s\n", num, strerror(result));
+	}
+	V(db_sem);
+}
+
+/*
+ * Run one phase and print its throughput.
+ */
+static
+void
+db_phase(const char *name, bool dorandom, char **bufs, unsigned nsect)
+{
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	uint32_t msecs;
+	unsigned i;
+	int result;
+
+	db_random = dorandom;
+
+	gettime(&secs1, &nsecs1);
+	for (i = 0; i < DB_NTHREADS; i++) {
+		result = thread_fork("diskbench", NULL, db_thread, bufs[i], i);
+		if (result) {
+			panic("diskbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i = 0; i < DB_NTHREADS; i++) {
+		P(db_sem);
+	}
+	gettime(&secs2, &nsecs2);
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	msecs = interval_msecs(secs1, nsecs1, secs2, nsecs2);
+
+	kprintf("%s: %u sectors in %lu.%09lu seconds, %u KB/sec\n",
+		name, nsect, (unsigned long)secs, (unsigned long)nsecs,
+		(nsect * DB_SECTSIZE / 1024) * 1000 / msecs);
+}
+
+int
+diskbench(int nargs, char **args)
+{
+	char path[32];
+	char *bufs[DB_NTHREADS];
+	struct stat st;
+	unsigned i;
+	int result;
+
+	/* vfs_open destroys the path it's given, so work on a copy */
+	strcpy(path, "lhd0raw:");
+	if (nargs == 2) {
+		snprintf(path, sizeof(path), "%s", args[1]);
+	}
+	else if (nargs > 2) {
+		kprintf("Usage: dk [device]\n");
+		return EINVAL;
+	}
+
+	kprintf("Starting disk benchmark on %s...\n", path);
+
+	result = vfs_open(path, O_RDONLY, 0, &db_vn);
+	if (result) {
+		kprintf("diskbench: %s\n", strerror(result));
+		return result;
+	}
+	result = VOP_STAT(db_vn, &st);
+	if (result) {
+		vfs_close(db_vn);
+		return result;
+	}
+	db_nsect = st.st_size / DB_SECTSIZE;
+	if (db_nsect < DB_NTHREADS * DB_NSEQ) {
+		kprintf("diskbench: disk too small\n");
+		vfs_close(db_vn);
+		return EINVAL;
+	}
+
+	db_sem = sem_create("diskbench", 0);
+	if (db_sem == NULL) {
+		vfs_close(db_vn);
+		return ENOMEM;
+	}
+	for (i = 0; i < DB_NTHREADS; i++) {
+		bufs[i] = kmalloc(DB_CHUNK * DB_SECTSIZE);
+		if (bufs[i] == NULL) {
+			panic("diskbench: out of memory\n");
+		}
+	}
+	db_phase("sequential", false, bufs, DB_NTHREADS * DB_NSEQ);
+	db_phase("random", true, bufs, DB_NTHREADS * DB_NRAND);
+
+	for (i = 0; i < DB_NTHREADS; i++) {
+		kfree(bufs[i]);
+	}
+	sem_destroy(db_sem);
+	vfs_close(db_vn);
+
+	kprintf("disk benchmark done.\n");
+	return 0;
+}
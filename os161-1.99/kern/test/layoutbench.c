@@ -0,0 +1,214 @@
+/*
+ * Filesystem layout benchmark.
+ *
+ * Several threads write a file each at the same time, a block at a
+ * time, yielding in between so that their writes interleave the way
+ * concurrent writers' do (fs3 and fs4 are the same idea). Then the
+ * files are read back one after another, a block at a time, and the
+ * read throughput reported. The files are together too big for the
+ * buffer cache, so the reads go to the disk, and how fast they go
+ * depends on how well the filesystem kept each file's blocks together
+ * while they were being written.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <test.h>
+
+#define LB_DEFTHREADS	4
+#define LB_MAXTHREADS	8
+#define LB_BLOCKSIZE	512
+#define LB_FILEBLOCKS	128	/* 64K per file */
+
+static struct semaphore *lb_sem;
+static const char *lb_fs;
+static bool lb_failed;		/* only ever set, so no lock needed */
+
+static
+int
+lb_open(unsigned long num, int flags, struct vnode **ret)
+{
+	char name[32];
+
+	/* vfs_open destroys the path it's given, so make it each time */
+	snprintf(name, sizeof(name), "%s:layout%lu", lb_fs, num);
+	return vfs_open(name, flags, 0664, ret);
+}
+
+static
+void
+lb_remove(unsigned long num)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), "%s:layout%lu", lb_fs, num);
+	vfs_remove(name);
+}
+
+static
+int
+lb_io(struct vnode *v, char *buf, unsigned i, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	uio_kinit(&iov, &ku, buf, LB_BLOCKSIZE, (off_t)i * LB_BLOCKSIZE, rw);
+	result = (rw == UIO_READ) ? VOP_READ(v, &ku) : VOP_WRITE(v, &ku);
+	if (result == 0 && ku.uio_resid != 0) {
+		result = EIO;
+	}
+	return result;
+}
+
+static
+void
+lb_writer(void *buf, unsigned long num)
+{
+	struct vnode *v;
+	char *p = buf;
+	unsigned i, j;
+	int result;
+
+	result = lb_open(num, O_WRONLY|O_CREAT|O_TRUNC, &v);
+	if (result == 0) {
+		for (i = 0; i < LB_FILEBLOCKS && !result; i++) {
+			for (j = 0; j < LB_BLOCKSIZE; j++) {
+				p[j] = (char)(num + i);
+			}
+			result = lb_io(v, buf, i, UIO_WRITE);
+			thread_yield();
+		}
+		vfs_close(v);
+	}
+	if (result) {
+		kprintf("layoutbench: writer %lu: %s\n", num,
+			strerror(result));
+		lb_failed = true;
+	}
+	V(lb_sem);
+}
+
+static
+int
+lb_read(unsigned long num, char *buf)
+{
+	struct vnode *v;
+	unsigned i;
+	int result;
+
+	result = lb_open(num, O_RDONLY, &v);
+	if (result) {
+		return result;
+	}
+	for (i = 0; i < LB_FILEBLOCKS && !result; i++) {
+		result = lb_io(v, buf, i, UIO_READ);
+		if (result == 0 && (buf[0] != (char)(num + i) ||
+				    buf[LB_BLOCKSIZE-1] != (char)(num + i))) {
+			kprintf("layoutbench: file %lu block %u is wrong\n",
+				num, i);
+			result = EIO;
+		}
+	}
+	vfs_close(v);
+	return result;
+}
+
+int
+layoutbench(int nargs, char **args)
+{
+	char *fs;
+	char *bufs[LB_MAXTHREADS];
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	uint32_t msecs, kbytes;
+	unsigned nthreads, i;
+	int result = 0;
+
+	if (nargs != 2 && nargs != 3) {
+		kprintf("Usage: fs8 filesystem: [nthreads]\n");
+		return EINVAL;
+	}
+	fs = args[1];
+	/* Allow (but do not require) colon after device name */
+	if (fs[strlen(fs)-1]==':') {
+		fs[strlen(fs)-1] = 0;
+	}
+	nthreads = (nargs == 3) ? (unsigned)atoi(args[2]) : LB_DEFTHREADS;
+	if (nthreads < 1 || nthreads > LB_MAXTHREADS) {
+		kprintf("layoutbench: 1 to %d threads\n", LB_MAXTHREADS);
+		return EINVAL;
+	}
+	lb_fs = fs;
+
+	for (i = 0; i < nthreads; i++) {
+		bufs[i] = kmalloc(LB_BLOCKSIZE);
+		if (bufs[i] == NULL) {
+			panic("layoutbench: out of memory\n");
+		}
+	}
+	lb_sem = sem_create("layoutbench", 0);
+	if (lb_sem == NULL) {
+		panic("layoutbench: out of memory\n");
+	}
+
+	kprintf("*** Starting fs layout benchmark on %s: (%u writers)\n",
+		fs, nthreads);
+
+	lb_failed = false;
+	for (i = 0; i < nthreads; i++) {
+		result = thread_fork("layoutbench", NULL, lb_writer, bufs[i],
+				     i);
+		if (result) {
+			panic("layoutbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		P(lb_sem);
+	}
+	result = lb_failed ? EIO : vfs_sync();
+	if (result) {
+		goto out;
+	}
+
+	gettime(&secs1, &nsecs1);
+	for (i = 0; i < nthreads && !result; i++) {
+		result = lb_read(i, bufs[0]);
+	}
+	gettime(&secs2, &nsecs2);
+	if (result) {
+		kprintf("layoutbench: read: %s\n", strerror(result));
+		goto out;
+	}
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	msecs = interval_msecs(secs1, nsecs1, secs2, nsecs2);
+	kbytes = nthreads * LB_FILEBLOCKS * LB_BLOCKSIZE / 1024;
+	kprintf("Read back %u KB in %lu.%09lu seconds: %u KB/sec\n",
+		kbytes, (unsigned long)secs, (unsigned long)nsecs,
+		kbytes * 1000 / msecs);
+
+ out:
+	for (i = 0; i < nthreads; i++) {
+		lb_remove(i);
+	}
+	sem_destroy(lb_sem);
+	for (i = 0; i < nthreads; i++) {
+		kfree(bufs[i]);
+	}
+	if (result) {
+		kprintf("*** Test failed\n");
+		return result;
+	}
+	kprintf("*** fs layout benchmark done\n");
+	return 0;
+}
@@ -31,7 +31,10 @@
  * Test code for kmalloc.
  */
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
 #include <thread.h>
 #include <synch.h>
 #include <test.h>
@@ -137,3 +140,162 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * mallocbench hammers the small-object allocator from as many threads
+ * as there are cpus (or more), so that every cpu is allocating and
+ * freeing at once. Each thread keeps a window of live blocks of
+ * assorted sizes, and now and then swaps one with a block another
+ * thread left behind, so blocks are also freed on a different cpu
+ * from the one that allocated them. Each block records its own size
+ * at both ends, and that's checked before it's freed.
+ */
+
+#define MB_DEFTHREADS	8
+#define MB_MAXTHREADS	32
+#define MB_NLOOPS	4000
+#define MB_WINDOW	32
+#define MB_SWAPEVERY	16
+#define MB_MAXSIZE	2000	/* keep under a page, in the subpage allocator */
+
+static struct spinlock mb_swaplock = SPINLOCK_INITIALIZER;
+static uint32_t *mb_swapblock;		/* protected by mb_swaplock */
+static bool mb_failed;			/* only ever set, so no lock needed */
+
+static
+uint32_t *
+mb_alloc(unsigned size)
+{
+	uint32_t *p;
+
+	p = kmalloc(size);
+	if (p != NULL) {
+		p[0] = size;
+		((char *)p)[size-1] = (char)size;
+	}
+	return p;
+}
+
+static
+void
+mb_free(unsigned long num, uint32_t *p)
+{
+	unsigned size = p[0];
+
+	if (size < sizeof(uint32_t) || size > MB_MAXSIZE ||
+	    ((char *)p)[size-1] != (char)size) {
+		kprintf("thread %lu: block %p was overwritten\n", num, p);
+		mb_failed = true;
+		/* don't kfree it; it may not be a block at all any more */
+		return;
+	}
+	kfree(p);
+}
+
+static
+void
+mb_thread(void *sm, unsigned long num)
+{
+	struct semaphore *sem = sm;
+	uint32_t *window[MB_WINDOW];
+	uint32_t *tmp;
+	unsigned i, slot, size;
+
+	for (i=0; i<MB_WINDOW; i++) {
+		window[i] = NULL;
+	}
+
+	for (i=0; i<MB_NLOOPS && !mb_failed; i++) {
+		slot = i % MB_WINDOW;
+		if (window[slot] != NULL) {
+			mb_free(num, window[slot]);
+		}
+		/* sizes spread over all the size classes */
+		size = sizeof(uint32_t) + (i * 37 + num * 101) %
+			(MB_MAXSIZE - sizeof(uint32_t) + 1);
+		window[slot] = mb_alloc(size);
+		if (window[slot] == NULL) {
+			kprintf("thread %lu: kmalloc returned NULL\n", num);
+			mb_failed = true;
+			break;
+		}
+		if (i % MB_SWAPEVERY == 0) {
+			spinlock_acquire(&mb_swaplock);
+			tmp = mb_swapblock;
+			mb_swapblock = window[slot];
+			spinlock_release(&mb_swaplock);
+			window[slot] = tmp;
+		}
+	}
+
+	for (i=0; i<MB_WINDOW; i++) {
+		if (window[i] != NULL) {
+			mb_free(num, window[i]);
+		}
+	}
+	V(sem);
+}
+
+int
+mallocbench(int nargs, char **args)
+{
+	struct semaphore *sem;
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs, msecs, nops;
+	unsigned nthreads, i;
+	int result;
+
+	if (nargs > 2) {
+		kprintf("Usage: km4 [nthreads]\n");
+		return EINVAL;
+	}
+	nthreads = (nargs == 2) ? (unsigned)atoi(args[1]) : MB_DEFTHREADS;
+	if (nthreads < 1 || nthreads > MB_MAXTHREADS) {
+		kprintf("mallocbench: 1 to %d threads\n", MB_MAXTHREADS);
+		return EINVAL;
+	}
+
+	sem = sem_create("mallocbench", 0);
+	if (sem == NULL) {
+		panic("mallocbench: sem_create failed\n");
+	}
+	mb_swapblock = NULL;
+	mb_failed = false;
+
+	kprintf("Starting kmalloc all-cpu stress test (%u threads)...\n",
+		nthreads);
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("mallocbench", NULL, mb_thread, sem, i);
+		if (result) {
+			panic("mallocbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(sem);
+	}
+	gettime(&secs2, &nsecs2);
+
+	if (mb_swapblock != NULL) {
+		mb_free(0, mb_swapblock);
+		mb_swapblock = NULL;
+	}
+	sem_destroy(sem);
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	msecs = interval_msecs(secs1, nsecs1, secs2, nsecs2);
+	nops = nthreads * MB_NLOOPS;
+	kprintf("%u kmalloc/kfree pairs in %lu.%09lu seconds: %u per second\n",
+		nops, (unsigned long)secs, (unsigned long)nsecs,
+		nops * 1000 / msecs);
+	kheap_printcachestats();
+
+	if (mb_failed) {
+		kprintf("kmalloc all-cpu stress test FAILED\n");
+		return EINVAL;
+	}
+	kprintf("kmalloc all-cpu stress test done\n");
+	return 0;
+}
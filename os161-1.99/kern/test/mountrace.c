@@ -0,0 +1,140 @@
+/*
+ * Mount/lookup race test.
+ *
+ * Threads keep looking up the roots of emu0: and of an SFS device
+ * while the test thread mounts and unmounts the SFS over and over.
+ * Getting a root reads the device list, and unmounting changes it
+ * holding the vfs biglock, which emufs also takes to get its root;
+ * if the two ever take those locks in opposite orders this hangs.
+ *
+ * The device must have an SFS on it and not be mounted.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <sfs.h>
+#include <test.h>
+
+#define MR_NTHREADS	4
+#define MR_NCYCLES	50
+
+static const char *mr_dev;
+static volatile bool mr_done;
+static volatile bool mr_failed;		/* only ever set, so no lock needed */
+static unsigned long mr_lookups[MR_NTHREADS];
+static struct semaphore *mr_exited;
+
+static
+void
+mr_thread(void *junk, unsigned long num)
+{
+	char path[32];
+	struct vnode *v;
+	int result;
+
+	(void)junk;
+
+	while (!mr_done) {
+		/* vfs_lookup destroys the path it's given */
+		if (mr_lookups[num] % 2 == 0) {
+			strcpy(path, "emu0:");
+		}
+		else {
+			snprintf(path, sizeof(path), "%s:", mr_dev);
+		}
+		result = vfs_lookup(path, &v);
+		if (result == 0) {
+			VOP_DECREF(v);
+		}
+		else if (result != ENXIO) {
+			/* ENXIO just means the sfs isn't mounted right now */
+			kprintf("mountrace: thread %lu: lookup: %s\n",
+				num, strerror(result));
+			mr_failed = true;
+			break;
+		}
+		mr_lookups[num]++;
+	}
+	V(mr_exited);
+}
+
+int
+mountrace(int nargs, char **args)
+{
+	char *dev;
+	unsigned long lookups;
+	unsigned i, busy;
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: fs12 device:\n");
+		return EINVAL;
+	}
+	dev = args[1];
+	/* Allow (but do not require) colon after device name */
+	if (dev[strlen(dev)-1]==':') {
+		dev[strlen(dev)-1] = 0;
+	}
+
+	mr_exited = sem_create("mr_exited", 0);
+	if (mr_exited == NULL) {
+		panic("mountrace: sem_create failed\n");
+	}
+	mr_dev = dev;
+	mr_done = false;
+	mr_failed = false;
+
+	kprintf("Starting mount/lookup race test on %s:...\n", dev);
+	for (i=0; i<MR_NTHREADS; i++) {
+		mr_lookups[i] = 0;
+		result = thread_fork("mountrace", NULL, mr_thread, NULL, i);
+		if (result) {
+			panic("mountrace: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	busy = 0;
+	for (i=0; i<MR_NCYCLES && !mr_failed; i++) {
+		result = sfs_mount(dev);
+		if (result) {
+			kprintf("mountrace: mount: %s\n", strerror(result));
+			mr_failed = true;
+			break;
+		}
+		/* a lookup holding the root keeps the fs busy; retry */
+		while ((result = vfs_unmount(dev)) == EBUSY) {
+			busy++;
+			thread_yield();
+		}
+		if (result) {
+			kprintf("mountrace: unmount: %s\n", strerror(result));
+			mr_failed = true;
+			break;
+		}
+	}
+
+	mr_done = true;
+	for (i=0; i<MR_NTHREADS; i++) {
+		P(mr_exited);
+	}
+	sem_destroy(mr_exited);
+
+	lookups = 0;
+	for (i=0; i<MR_NTHREADS; i++) {
+		lookups += mr_lookups[i];
+	}
+	kprintf("%lu lookups, %u unmounts retried while busy\n",
+		lookups, busy);
+	if (mr_failed) {
+		kprintf("mountrace: FAILED\n");
+		return EINVAL;
+	}
+	kprintf("Mount/lookup race test done.\n");
+	return 0;
+}
@@ -0,0 +1,188 @@
+/*
+ * Filesystem readahead benchmark.
+ *
+ * Writes a file bigger than the buffer cache, then reads it back
+ * the way cat does, in small pieces, first with readahead and
+ * clustered writes turned off and then with them on, reporting the
+ * throughput of each pass, how many of its lookups the buffer cache
+ * could answer, and how much of what was read ahead got used.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <clock.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <buf.h>
+#include <test.h>
+
+#define RB_FILESIZE	(256*1024)	/* four times the cache */
+#define RB_WCHUNK	(32*1024)
+#define RB_RCHUNK	1024		/* what cat uses */
+
+static char rb_name[32];
+
+/* Fill or check a piece of the file: each word holds its offset */
+static
+int
+rb_pattern(char *buf, size_t len, off_t pos, bool check)
+{
+	uint32_t *words = (uint32_t *)buf;
+	size_t i;
+
+	for (i = 0; i < len / sizeof(uint32_t); i++) {
+		if (!check) {
+			words[i] = pos + i * sizeof(uint32_t);
+		}
+		else if (words[i] != pos + i * sizeof(uint32_t)) {
+			kprintf("rabench: wrong data at offset %lu\n",
+				(unsigned long)(pos + i * sizeof(uint32_t)));
+			return EIO;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write or read back the whole file, CHUNK bytes at a time.
+ */
+static
+int
+rb_pass(char *buf, size_t chunk, enum uio_rw rw)
+{
+	struct vnode *v;
+	struct iovec iov;
+	struct uio ku;
+	char name[32];
+	off_t pos;
+	int result;
+
+	/* vfs_open destroys the path it's given, so work on a copy */
+	strcpy(name, rb_name);
+	result = vfs_open(name, rw == UIO_WRITE ?
+			  O_WRONLY|O_CREAT|O_TRUNC : O_RDONLY, 0664, &v);
+	if (result) {
+		return result;
+	}
+
+	for (pos = 0; pos < RB_FILESIZE && !result; pos += chunk) {
+		if (rw == UIO_WRITE) {
+			rb_pattern(buf, chunk, pos, false);
+		}
+		uio_kinit(&iov, &ku, buf, chunk, pos, rw);
+		result = (rw == UIO_READ) ? VOP_READ(v, &ku) :
+			VOP_WRITE(v, &ku);
+		if (result == 0 && ku.uio_resid != 0) {
+			result = EIO;
+		}
+		if (result == 0 && rw == UIO_READ) {
+			result = rb_pattern(buf, chunk, pos, true);
+		}
+	}
+	vfs_close(v);
+	return result;
+}
+
+/*
+ * Read the file back with readahead on or off, and report.
+ */
+static
+int
+rb_readpass(char *buf, bool readahead)
+{
+	struct buf_stats bs1, bs2;
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs, msecs;
+	unsigned hits, lookups;
+	int result;
+
+	buffer_set_clustering(readahead);
+
+	buffer_getstats(&bs1);
+	gettime(&secs1, &nsecs1);
+	result = rb_pass(buf, RB_RCHUNK, UIO_READ);
+	gettime(&secs2, &nsecs2);
+	buffer_getstats(&bs2);
+	if (result) {
+		kprintf("rabench: read: %s\n", strerror(result));
+		return result;
+	}
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	msecs = interval_msecs(secs1, nsecs1, secs2, nsecs2);
+	hits = bs2.bs_hits - bs1.bs_hits;
+	lookups = hits + bs2.bs_misses - bs1.bs_misses;
+	kprintf("Readahead %s: %u KB in %lu.%09lu seconds: %u KB/sec\n",
+		readahead ? "on " : "off", RB_FILESIZE / 1024,
+		(unsigned long)secs, (unsigned long)nsecs,
+		RB_FILESIZE / 1024 * 1000 / msecs);
+	kprintf("    %u of %u cache lookups hit (%u%%); "
+		"%u blocks read ahead, %u used\n",
+		hits, lookups, lookups ? hits * 100 / lookups : 0,
+		bs2.bs_rablocks - bs1.bs_rablocks,
+		bs2.bs_rahits - bs1.bs_rahits);
+	return 0;
+}
+
+int
+rabench(int nargs, char **args)
+{
+	char *fs, *buf;
+	bool old;
+	int result;
+
+	if (nargs != 2) {
+		kprintf("Usage: fs10 filesystem:\n");
+		return EINVAL;
+	}
+	fs = args[1];
+	/* Allow (but do not require) colon after device name */
+	if (fs[strlen(fs)-1]==':') {
+		fs[strlen(fs)-1] = 0;
+	}
+	snprintf(rb_name, sizeof(rb_name), "%s:rabench", fs);
+
+	buf = kmalloc(RB_WCHUNK);
+	if (buf == NULL) {
+		panic("rabench: out of memory\n");
+	}
+
+	kprintf("*** Starting fs readahead benchmark on %s: "
+		"(%u KB file, %u byte reads)\n", fs, RB_FILESIZE / 1024,
+		RB_RCHUNK);
+
+	old = buffer_set_clustering(true);
+	result = rb_pass(buf, RB_WCHUNK, UIO_WRITE);
+	if (result == 0) {
+		result = vfs_sync();
+	}
+	if (result) {
+		kprintf("rabench: write: %s\n", strerror(result));
+		goto out;
+	}
+
+	/*
+	 * The file is too big for the cache, so by the time each pass
+	 * gets to a block the previous pass has been pushed out of the
+	 * cache and every block has to come from the disk.
+	 */
+	result = rb_readpass(buf, false);
+	if (result == 0) {
+		result = rb_readpass(buf, true);
+	}
+
+ out:
+	buffer_set_clustering(old);
+	strcpy(buf, rb_name);
+	vfs_remove(buf);
+	kfree(buf);
+	if (result) {
+		kprintf("*** Test failed\n");
+		return result;
+	}
+	kprintf("*** fs readahead benchmark done\n");
+	return 0;
+}
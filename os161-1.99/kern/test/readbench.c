@@ -0,0 +1,193 @@
+/*
+ * Filesystem read scaling benchmark.
+ *
+ * Like fs2 (readstress), several threads read the same file at once,
+ * but the file is small enough to stay in the buffer cache and each
+ * thread reopens and rereads it many times, so the time goes into
+ * lookup and the filesystem's locking rather than the disk. Reports
+ * aggregate throughput.
+ *
+ * To see how it scales, run it under sys161 configurations with 1,
+ * 2 and 4 CPUs; with readers sharing the vnode locks, throughput
+ * should rise with the number of CPUs instead of staying flat.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <test.h>
+
+#define RB_DEFTHREADS	4
+#define RB_MAXTHREADS	16
+#define RB_BLOCKSIZE	512
+#define RB_FILEBLOCKS	32	/* file size in blocks; fits in the cache */
+#define RB_NPASSES	64	/* times each thread reads the file */
+
+static struct semaphore *rb_sem;
+static char rb_name[32];
+static bool rb_failed;		/* only ever set, so no lock needed */
+
+static
+int
+rb_open(int flags, struct vnode **ret)
+{
+	char name[32];
+
+	/* vfs_open destroys the path it's given, so work on a copy */
+	strcpy(name, rb_name);
+	return vfs_open(name, flags, 0664, ret);
+}
+
+/*
+ * Do I/O on the whole file, a block at a time.
+ */
+static
+int
+rb_io(struct vnode *v, char *buf, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	unsigned i;
+	int result;
+
+	for (i = 0; i < RB_FILEBLOCKS; i++) {
+		uio_kinit(&iov, &ku, buf, RB_BLOCKSIZE,
+			  (off_t)i * RB_BLOCKSIZE, rw);
+		result = (rw == UIO_READ) ? VOP_READ(v, &ku) :
+			VOP_WRITE(v, &ku);
+		if (result) {
+			return result;
+		}
+		if (ku.uio_resid != 0) {
+			return EIO;
+		}
+	}
+	return 0;
+}
+
+static
+void
+rb_thread(void *buf, unsigned long num)
+{
+	struct vnode *v;
+	unsigned i;
+	int result = 0;
+
+	for (i = 0; i < RB_NPASSES && !result; i++) {
+		result = rb_open(O_RDONLY, &v);
+		if (result) {
+			break;
+		}
+		result = rb_io(v, buf, UIO_READ);
+		vfs_close(v);
+	}
+	if (result) {
+		kprintf("readbench: thread %lu: %s\n", num, strerror(result));
+		rb_failed = true;
+	}
+	V(rb_sem);
+}
+
+int
+readbench(int nargs, char **args)
+{
+	char *fs;
+	char *bufs[RB_MAXTHREADS];
+	struct vnode *v;
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	uint32_t msecs, kbytes;
+	unsigned nthreads, i;
+	int result;
+
+	if (nargs != 2 && nargs != 3) {
+		kprintf("Usage: fs7 filesystem: [nthreads]\n");
+		return EINVAL;
+	}
+	fs = args[1];
+	/* Allow (but do not require) colon after device name */
+	if (fs[strlen(fs)-1]==':') {
+		fs[strlen(fs)-1] = 0;
+	}
+	nthreads = (nargs == 3) ? (unsigned)atoi(args[2]) : RB_DEFTHREADS;
+	if (nthreads < 1 || nthreads > RB_MAXTHREADS) {
+		kprintf("readbench: 1 to %d threads\n", RB_MAXTHREADS);
+		return EINVAL;
+	}
+	snprintf(rb_name, sizeof(rb_name), "%s:readbench", fs);
+
+	for (i = 0; i < nthreads; i++) {
+		bufs[i] = kmalloc(RB_BLOCKSIZE);
+		if (bufs[i] == NULL) {
+			panic("readbench: out of memory\n");
+		}
+	}
+	rb_sem = sem_create("readbench", 0);
+	if (rb_sem == NULL) {
+		panic("readbench: out of memory\n");
+	}
+
+	kprintf("*** Starting fs read benchmark on %s: (%u threads)\n",
+		fs, nthreads);
+
+	/* Make the file */
+	result = rb_open(O_WRONLY|O_CREAT|O_TRUNC, &v);
+	if (result) {
+		kprintf("readbench: create: %s\n", strerror(result));
+		goto out;
+	}
+	bzero(bufs[0], RB_BLOCKSIZE);
+	result = rb_io(v, bufs[0], UIO_WRITE);
+	vfs_close(v);
+	if (result) {
+		kprintf("readbench: write: %s\n", strerror(result));
+		goto out;
+	}
+
+	rb_failed = false;
+	gettime(&secs1, &nsecs1);
+	for (i = 0; i < nthreads; i++) {
+		result = thread_fork("readbench", NULL, rb_thread, bufs[i], i);
+		if (result) {
+			panic("readbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i = 0; i < nthreads; i++) {
+		P(rb_sem);
+	}
+	gettime(&secs2, &nsecs2);
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	msecs = interval_msecs(secs1, nsecs1, secs2, nsecs2);
+	kbytes = nthreads * RB_NPASSES * RB_FILEBLOCKS * RB_BLOCKSIZE / 1024;
+
+	kprintf("%u threads read %u KB in %lu.%09lu seconds: %u KB/sec\n",
+		nthreads, kbytes, (unsigned long)secs, (unsigned long)nsecs,
+		kbytes * 1000 / msecs);
+	result = rb_failed ? EIO : 0;
+
+	strcpy(bufs[0], rb_name);
+	if (vfs_remove(bufs[0])) {
+		kprintf("readbench: could not remove %s\n", rb_name);
+	}
+
+ out:
+	sem_destroy(rb_sem);
+	for (i = 0; i < nthreads; i++) {
+		kfree(bufs[i]);
+	}
+	if (result) {
+		kprintf("*** Test failed\n");
+		return result;
+	}
+	kprintf("*** fs read benchmark done\n");
+	return 0;
+}
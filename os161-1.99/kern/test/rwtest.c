@@ -0,0 +1,423 @@
+/*
+ * Tests for reader-writer locks and sequence locks, and a read-mostly
+ * benchmark comparing a reader-writer lock with a plain lock.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <synch.h>
+#include <test.h>
+
+#define RWNTHREADS	16
+#define RWNLOOPS	60
+#define SEQNLOOPS	2000
+#define BENCHNLOOPS	2000
+#define BENCHDEFTHREADS	8
+#define BENCHNVALS	32
+#define BENCHWRITEEVERY	100	/* one write per this many operations */
+
+static struct semaphore *rwdonesem;
+static bool rwfailed;		/* only ever set, so no lock needed */
+
+static
+void
+rwfail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: Mismatch on %s\n", num, msg);
+	rwfailed = true;
+}
+
+static
+void
+rwinit(void)
+{
+	rwdonesem = sem_create("rwdonesem", 0);
+	if (rwdonesem == NULL) {
+		panic("rwtest: sem_create failed\n");
+	}
+	rwfailed = false;
+}
+
+static
+void
+rwdone(unsigned nthreads)
+{
+	unsigned i;
+
+	for (i=0; i<nthreads; i++) {
+		P(rwdonesem);
+	}
+	sem_destroy(rwdonesem);
+	rwdonesem = NULL;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock test.
+//
+// Writers set three values to match each other, yielding in between;
+// readers check that they always see them matching. Both check that
+// no writer is ever in at the same time as anyone else. Readers also
+// yield while holding the lock, so that if the lock lets readers in
+// together, some will overlap.
+
+static struct rwlock *testrw;
+static struct spinlock rwcountlock;	/* for the counts */
+static unsigned rwreaders, rwwriters, rwmaxreaders;
+static volatile unsigned long rwval1, rwval2, rwval3;
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	int i;
+	bool writer;
+
+	(void)junk;
+
+	for (i=0; i<RWNLOOPS; i++) {
+		writer = ((num + i) % 4) == 0;
+		if (writer) {
+			rwlock_acquire_write(testrw);
+			spinlock_acquire(&rwcountlock);
+			rwwriters++;
+			if (rwwriters != 1 || rwreaders != 0) {
+				rwfail(num, "writer exclusion");
+			}
+			spinlock_release(&rwcountlock);
+
+			rwval1 = num;
+			thread_yield();
+			rwval2 = num;
+			thread_yield();
+			rwval3 = num;
+
+			spinlock_acquire(&rwcountlock);
+			rwwriters--;
+			spinlock_release(&rwcountlock);
+			rwlock_release_write(testrw);
+		}
+		else {
+			rwlock_acquire_read(testrw);
+			spinlock_acquire(&rwcountlock);
+			rwreaders++;
+			if (rwwriters != 0) {
+				rwfail(num, "reader/writer exclusion");
+			}
+			if (rwreaders > rwmaxreaders) {
+				rwmaxreaders = rwreaders;
+			}
+			spinlock_release(&rwcountlock);
+
+			if (rwval1 != rwval2 || rwval2 != rwval3) {
+				rwfail(num, "values");
+			}
+			thread_yield();
+			if (rwval1 != rwval2 || rwval2 != rwval3) {
+				rwfail(num, "values after yield");
+			}
+
+			spinlock_acquire(&rwcountlock);
+			rwreaders--;
+			spinlock_release(&rwcountlock);
+			rwlock_release_read(testrw);
+		}
+	}
+	V(rwdonesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	unsigned i;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	rwinit();
+	testrw = rwlock_create("testrw");
+	if (testrw == NULL) {
+		panic("rwtest: rwlock_create failed\n");
+	}
+	spinlock_init(&rwcountlock);
+	rwreaders = rwwriters = rwmaxreaders = 0;
+	rwval1 = rwval2 = rwval3 = 0;
+
+	kprintf("Starting rwlock test...\n");
+	for (i=0; i<RWNTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	rwdone(RWNTHREADS);
+
+	kprintf("At most %u readers held the lock at once\n", rwmaxreaders);
+	if (rwmaxreaders < 2) {
+		rwfail(0, "readers never shared the lock");
+	}
+
+	spinlock_cleanup(&rwcountlock);
+	rwlock_destroy(testrw);
+	if (rwfailed) {
+		kprintf("rwlock test FAILED\n");
+		return EINVAL;
+	}
+	kprintf("rwlock test done.\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Sequence lock test.
+//
+// One writer keeps updating a pair of values that are supposed to
+// agree, dawdling between the two stores; readers check that every
+// copy they accept agrees, and count how often they had to retry.
+
+static struct seqlock testseq;
+static volatile unsigned long seqval1, seqval2;
+static volatile bool seqwriterdone;
+static unsigned seqretries;		/* updated under rwcountlock */
+
+static
+void
+seqwriterthread(void *junk, unsigned long num)
+{
+	unsigned long i;
+	volatile int j;
+
+	(void)junk;
+	(void)num;
+
+	for (i=1; i<=SEQNLOOPS; i++) {
+		seqlock_write_begin(&testseq);
+		seqval1 = i;
+		for (j=0; j<50; j++);
+		seqval2 = i * 3;
+		seqlock_write_end(&testseq);
+	}
+	seqwriterdone = true;
+	V(rwdonesem);
+}
+
+static
+void
+seqreaderthread(void *junk, unsigned long num)
+{
+	unsigned seq, retries;
+	unsigned long v1, v2;
+
+	(void)junk;
+
+	retries = 0;
+	while (!seqwriterdone) {
+		seq = seqlock_read_begin(&testseq);
+		v1 = seqval1;
+		v2 = seqval2;
+		if (seqlock_read_retry(&testseq, seq)) {
+			retries++;
+			continue;
+		}
+		if (v2 != v1 * 3) {
+			rwfail(num, "seqlock values");
+		}
+	}
+
+	spinlock_acquire(&rwcountlock);
+	seqretries += retries;
+	spinlock_release(&rwcountlock);
+	V(rwdonesem);
+}
+
+int
+seqtest(int nargs, char **args)
+{
+	unsigned i, nreaders = 4;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	rwinit();
+	seqlock_init(&testseq);
+	spinlock_init(&rwcountlock);
+	seqval1 = seqval2 = 0;
+	seqwriterdone = false;
+	seqretries = 0;
+
+	kprintf("Starting seqlock test...\n");
+	for (i=0; i<nreaders; i++) {
+		result = thread_fork("seqtest reader", NULL, seqreaderthread,
+				     NULL, i);
+		if (result) {
+			panic("seqtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	result = thread_fork("seqtest writer", NULL, seqwriterthread, NULL,
+			     nreaders);
+	if (result) {
+		panic("seqtest: thread_fork failed: %s\n", strerror(result));
+	}
+	rwdone(nreaders + 1);
+
+	kprintf("Readers retried %u times\n", seqretries);
+
+	spinlock_cleanup(&rwcountlock);
+	seqlock_cleanup(&testseq);
+	if (rwfailed) {
+		kprintf("seqlock test FAILED\n");
+		return EINVAL;
+	}
+	kprintf("seqlock test done.\n");
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Read-mostly benchmark.
+//
+// Threads look through a small table, changing it once every
+// BENCHWRITEEVERY times, first under a reader-writer lock and then
+// under a plain lock. Run it under sys161 configurations with
+// different numbers of CPUs: with the reader-writer lock throughput
+// should grow with the CPUs, with the plain lock it can't.
+
+static struct rwlock *benchrw;
+static struct lock *benchlk;
+static bool benchuserw;
+static volatile unsigned long benchvals[BENCHNVALS];
+
+static
+void
+rwbenchthread(void *junk, unsigned long num)
+{
+	unsigned i, j;
+	unsigned long sum;
+	bool write;
+
+	(void)junk;
+
+	for (i=0; i<BENCHNLOOPS; i++) {
+		write = ((i + num) % BENCHWRITEEVERY) == 0;
+		if (benchuserw) {
+			if (write) {
+				rwlock_acquire_write(benchrw);
+			}
+			else {
+				rwlock_acquire_read(benchrw);
+			}
+		}
+		else {
+			lock_acquire(benchlk);
+		}
+
+		if (write) {
+			for (j=0; j<BENCHNVALS; j++) {
+				benchvals[j]++;
+			}
+		}
+		else {
+			sum = 0;
+			for (j=0; j<BENCHNVALS; j++) {
+				sum += benchvals[j];
+			}
+			if (sum != benchvals[0] * BENCHNVALS) {
+				rwfail(num, "table");
+			}
+		}
+
+		if (benchuserw) {
+			if (write) {
+				rwlock_release_write(benchrw);
+			}
+			else {
+				rwlock_release_read(benchrw);
+			}
+		}
+		else {
+			lock_release(benchlk);
+		}
+	}
+	V(rwdonesem);
+}
+
+static
+void
+rwbenchrun(unsigned nthreads, bool userw)
+{
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs, msecs, nops;
+	unsigned i;
+	int result;
+
+	rwinit();
+	benchuserw = userw;
+	for (i=0; i<BENCHNVALS; i++) {
+		benchvals[i] = 0;
+	}
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("rwbench", NULL, rwbenchthread, NULL, i);
+		if (result) {
+			panic("rwbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	rwdone(nthreads);
+	gettime(&secs2, &nsecs2);
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	msecs = interval_msecs(secs1, nsecs1, secs2, nsecs2);
+	nops = nthreads * BENCHNLOOPS;
+	kprintf("%s: %u operations in %lu.%09lu seconds: %u per second\n",
+		userw ? "rwlock" : "lock", nops, (unsigned long)secs,
+		(unsigned long)nsecs, nops * 1000 / msecs);
+}
+
+int
+rwbench(int nargs, char **args)
+{
+	unsigned nthreads;
+	bool failed;
+
+	if (nargs > 2) {
+		kprintf("Usage: sy7 [nthreads]\n");
+		return EINVAL;
+	}
+	nthreads = (nargs == 2) ? (unsigned)atoi(args[1]) : BENCHDEFTHREADS;
+	if (nthreads < 1 || nthreads > RWNTHREADS) {
+		kprintf("rwbench: 1 to %d threads\n", RWNTHREADS);
+		return EINVAL;
+	}
+
+	benchrw = rwlock_create("benchrw");
+	benchlk = lock_create("benchlk");
+	if (benchrw == NULL || benchlk == NULL) {
+		panic("rwbench: out of memory\n");
+	}
+
+	kprintf("Starting read-mostly lock benchmark (%u threads, "
+		"1 write in %d)...\n", nthreads, BENCHWRITEEVERY);
+	rwbenchrun(nthreads, true);
+	failed = rwfailed;
+	rwbenchrun(nthreads, false);
+	failed = failed || rwfailed;
+
+	rwlock_destroy(benchrw);
+	lock_destroy(benchlk);
+	if (failed) {
+		kprintf("rwlock benchmark FAILED\n");
+		return EINVAL;
+	}
+	kprintf("Read-mostly lock benchmark done.\n");
+	return 0;
+}
@@ -0,0 +1,142 @@
+/*
+ * Scheduler latency benchmark.
+ *
+ * Stands in for "how long does the shell take to respond while hogs
+ * are running": several CPU-bound threads spin, and meanwhile the
+ * test thread repeatedly wakes up a responder thread that does
+ * nothing but sleep and wake, measuring how long the responder takes
+ * to get the CPU after being woken. With plain round-robin that's
+ * roughly a time slice per hog; a scheduler that favors threads that
+ * sleep should keep it well under a tick.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <synch.h>
+#include <thread.h>
+#include <test.h>
+
+#define SB_DEFHOGS	4
+#define SB_MAXHOGS	16
+#define SB_NPINGS	50
+
+static struct semaphore *sb_ping;	/* wakes the responder */
+static struct semaphore *sb_pong;	/* responder has measured */
+static struct semaphore *sb_exited;	/* a thread has finished */
+static volatile bool sb_done;		/* tells the hogs to stop */
+
+/* when the responder was woken; set by the test thread */
+static time_t sb_wokesecs;
+static uint32_t sb_wokensecs;
+
+/* results, kept by the responder */
+static uint32_t sb_totalusecs;
+static uint32_t sb_maxusecs;
+
+static
+void
+sb_hog(void *junk, unsigned long num)
+{
+	volatile unsigned long spins = 0;
+
+	(void)junk;
+	(void)num;
+
+	while (!sb_done) {
+		spins++;
+	}
+	V(sb_exited);
+}
+
+static
+void
+sb_responder(void *junk, unsigned long num)
+{
+	time_t secs, dsecs;
+	uint32_t nsecs, dnsecs, usecs;
+	unsigned i;
+
+	(void)junk;
+	(void)num;
+
+	for (i = 0; i < SB_NPINGS; i++) {
+		P(sb_ping);
+		gettime(&secs, &nsecs);
+		getinterval(sb_wokesecs, sb_wokensecs, secs, nsecs,
+			    &dsecs, &dnsecs);
+		usecs = dsecs * 1000000 + dnsecs / 1000;
+		sb_totalusecs += usecs;
+		if (usecs > sb_maxusecs) {
+			sb_maxusecs = usecs;
+		}
+		V(sb_pong);
+	}
+	V(sb_exited);
+}
+
+int
+schedbench(int nargs, char **args)
+{
+	unsigned nhogs, i;
+	int result;
+
+	if (nargs > 2) {
+		kprintf("Usage: tt4 [nhogs]\n");
+		return EINVAL;
+	}
+	nhogs = (nargs == 2) ? (unsigned)atoi(args[1]) : SB_DEFHOGS;
+	if (nhogs > SB_MAXHOGS) {
+		kprintf("schedbench: at most %d hogs\n", SB_MAXHOGS);
+		return EINVAL;
+	}
+
+	sb_ping = sem_create("sb_ping", 0);
+	sb_pong = sem_create("sb_pong", 0);
+	sb_exited = sem_create("sb_exited", 0);
+	if (sb_ping == NULL || sb_pong == NULL || sb_exited == NULL) {
+		panic("schedbench: sem_create failed\n");
+	}
+	sb_done = false;
+	sb_totalusecs = 0;
+	sb_maxusecs = 0;
+
+	kprintf("Starting scheduler latency bench (%u hogs)...\n", nhogs);
+
+	for (i = 0; i < nhogs; i++) {
+		result = thread_fork("schedbench hog", NULL, sb_hog, NULL, i);
+		if (result) {
+			panic("schedbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	result = thread_fork("schedbench responder", NULL, sb_responder,
+			     NULL, 0);
+	if (result) {
+		panic("schedbench: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+
+	for (i = 0; i < SB_NPINGS; i++) {
+		/* sleep a tick, like a user thinking between commands */
+		clocknap(1);
+		gettime(&sb_wokesecs, &sb_wokensecs);
+		V(sb_ping);
+		P(sb_pong);
+	}
+
+	sb_done = true;
+	for (i = 0; i < nhogs + 1; i++) {
+		P(sb_exited);
+	}
+
+	kprintf("Wakeup latency over %d wakeups: avg %u usec, max %u usec\n",
+		SB_NPINGS, sb_totalusecs / SB_NPINGS, sb_maxusecs);
+	kprintf("Scheduler latency bench done.\n");
+
+	sem_destroy(sb_ping);
+	sem_destroy(sb_pong);
+	sem_destroy(sb_exited);
+	return 0;
+}
@@ -32,6 +32,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <clock.h>
 #include <thread.h>
@@ -347,3 +348,100 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Lock throughput benchmark.
+ *
+ * Like the lock test, but with short critical sections and many more
+ * of them, and timed. Run it under sys161 configurations with
+ * different numbers of CPUs to see how the lock copes with
+ * contention; the lock's statistics show how often waiters spun on a
+ * running holder versus went to sleep.
+ */
+
+#define NBENCHLOOPS	2000
+#define BENCHDEFTHREADS	8
+
+static struct lock *benchlock;
+static struct semaphore *benchdone;
+static volatile unsigned long benchcount;
+
+static
+void
+lockbenchthread(void *junk, unsigned long num)
+{
+	int i;
+	volatile int j;
+
+	(void)junk;
+	(void)num;
+
+	for (i=0; i<NBENCHLOOPS; i++) {
+		lock_acquire(benchlock);
+		benchcount++;
+		for (j=0; j<20; j++);
+		lock_release(benchlock);
+	}
+	V(benchdone);
+}
+
+int
+lockbench(int nargs, char **args)
+{
+	unsigned nthreads, i;
+	int result;
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs, msecs;
+
+	if (nargs > 2) {
+		kprintf("Usage: sy4 [nthreads]\n");
+		return EINVAL;
+	}
+	nthreads = (nargs == 2) ? (unsigned)atoi(args[1]) : BENCHDEFTHREADS;
+	if (nthreads < 1 || nthreads > NTHREADS) {
+		kprintf("lockbench: 1 to %d threads\n", NTHREADS);
+		return EINVAL;
+	}
+
+	benchlock = lock_create("benchlock");
+	benchdone = sem_create("benchdone", 0);
+	if (benchlock == NULL || benchdone == NULL) {
+		panic("lockbench: out of memory\n");
+	}
+	benchcount = 0;
+
+	kprintf("Starting lock benchmark (%u threads)...\n", nthreads);
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("lockbench", NULL, lockbenchthread,
+				     NULL, i);
+		if (result) {
+			panic("lockbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<nthreads; i++) {
+		P(benchdone);
+	}
+	gettime(&secs2, &nsecs2);
+
+	if (benchcount != nthreads * NBENCHLOOPS) {
+		kprintf("lockbench: count is %lu, should be %u\n",
+			benchcount, nthreads * NBENCHLOOPS);
+		panic("lockbench: lock failed\n");
+	}
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	msecs = interval_msecs(secs1, nsecs1, secs2, nsecs2);
+	kprintf("%lu acquires in %lu.%09lu seconds: %u per second\n",
+		benchcount, (unsigned long)secs, (unsigned long)nsecs,
+		(unsigned)(benchcount * 1000 / msecs));
+	lock_printstats(benchlock);
+
+	lock_destroy(benchlock);
+	sem_destroy(benchdone);
+	kprintf("Lock benchmark done.\n");
+
+	return 0;
+}
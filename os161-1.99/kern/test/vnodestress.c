@@ -0,0 +1,140 @@
+/*
+ * Vnode table stress test / benchmark.
+ *
+ * Creates a large number of files and keeps them all open, so that
+ * the filesystem has that many vnodes resident. Every so often, it
+ * times reopening a few files that were created first (so they sit
+ * at the front of the directory and finding the name is cheap). The
+ * time per open should stay flat as the number of resident vnodes
+ * grows.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <clock.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <test.h>
+
+#define VS_DEFFILES	1024	/* files to create */
+#define VS_STEP		128	/* files created between measurements */
+#define VS_NPROBES	8	/* files reopened to measure */
+#define VS_NOPENS	512	/* opens per measurement */
+
+static
+void
+vs_makename(char *buf, size_t len, const char *fs, unsigned n)
+{
+	snprintf(buf, len, "%s:vs%05u", fs, n);
+}
+
+static
+int
+vs_open(const char *fs, unsigned n, int flags, struct vnode **ret)
+{
+	char name[32];
+
+	vs_makename(name, sizeof(name), fs, n);
+	return vfs_open(name, flags, 0664, ret);
+}
+
+/*
+ * Reopen the probe files VS_NOPENS times and print the average time
+ * per open.
+ */
+static
+int
+vs_measure(const char *fs, unsigned nresident)
+{
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	uint32_t usecs;
+	struct vnode *v;
+	unsigned i;
+	int result;
+
+	gettime(&secs1, &nsecs1);
+	for (i = 0; i < VS_NOPENS; i++) {
+		result = vs_open(fs, i % VS_NPROBES, O_RDONLY, &v);
+		if (result) {
+			return result;
+		}
+		vfs_close(v);
+	}
+	gettime(&secs2, &nsecs2);
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	usecs = secs * 1000000 + nsecs / 1000;
+
+	kprintf("%6u vnodes resident: %u usec/open\n",
+		nresident, usecs / VS_NOPENS);
+	return 0;
+}
+
+int
+vnodestress(int nargs, char **args)
+{
+	char *fs;
+	char name[32];
+	struct vnode **vns;
+	unsigned nfiles, n, i;
+	int result;
+
+	if (nargs != 2 && nargs != 3) {
+		kprintf("Usage: fs6 filesystem: [nfiles]\n");
+		return EINVAL;
+	}
+	fs = args[1];
+	/* Allow (but do not require) colon after device name */
+	if (fs[strlen(fs)-1]==':') {
+		fs[strlen(fs)-1] = 0;
+	}
+	nfiles = (nargs == 3) ? (unsigned)atoi(args[2]) : VS_DEFFILES;
+	if (nfiles < VS_NPROBES) {
+		nfiles = VS_NPROBES;
+	}
+
+	vns = kmalloc(nfiles * sizeof(struct vnode *));
+	if (vns == NULL) {
+		return ENOMEM;
+	}
+
+	kprintf("*** Starting vnode table stress test on %s: (%u files)\n",
+		fs, nfiles);
+
+	result = 0;
+	for (n = 0; n < nfiles; n++) {
+		result = vs_open(fs, n, O_WRONLY|O_CREAT|O_EXCL, &vns[n]);
+		if (result) {
+			kprintf("vs%05u: create: %s\n", n, strerror(result));
+			break;
+		}
+		if ((n + 1) % VS_STEP == 0 || n + 1 == nfiles) {
+			result = vs_measure(fs, n + 1);
+			if (result) {
+				kprintf("reopen: %s\n", strerror(result));
+				n++;
+				break;
+			}
+		}
+	}
+
+	/* n files were created */
+	for (i = 0; i < n; i++) {
+		vfs_close(vns[i]);
+		vs_makename(name, sizeof(name), fs, i);
+		if (vfs_remove(name)) {
+			kprintf("vs%05u: could not remove\n", i);
+		}
+	}
+	kfree(vns);
+
+	if (result) {
+		kprintf("*** Test failed\n");
+		return result;
+	}
+	kprintf("*** vnode table stress test done\n");
+	return 0;
+}
@@ -37,6 +37,7 @@
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
+#include <cpu.h>
 #include <current.h>
 #include <synch.h>
 #include "opt-A2.h"
@@ -181,6 +182,11 @@ lock_create(const char *name)
     //init curr info
     lock->held = false;
     lock->owner = NULL;
+
+    lock->lk_acquires = 0;
+    lock->lk_contended = 0;
+    lock->lk_spins = 0;
+    lock->lk_sleeps = 0;
     
     return lock;
 }
@@ -199,14 +205,54 @@ lock_destroy(struct lock *lock)
         
 }
 
+/* Spin iterations between checks on whether the holder is running. */
+#define LOCK_SPINBATCH 100
+
+/*
+ * Is the lock's holder running on some other cpu right now? If so
+ * it'll likely let go soon, and it's cheaper to spin than to sleep.
+ * Called with lk_spinlock held, so the holder can't release the lock
+ * (and possibly exit) while we look at it.
+ */
+static
+bool
+lock_owner_running(struct lock *lock)
+{
+    struct thread *owner = lock->owner;
+
+    return owner != NULL && owner->t_state == S_RUN &&
+        owner->t_cpu != curcpu->c_self &&
+        owner->t_cpu->c_curthread == owner;
+}
+
 void
 lock_acquire(struct lock *lock)
 {
+    unsigned spins;
+
     KASSERT(lock);
     KASSERT(!lock_do_i_hold(lock));
     
     spinlock_acquire(&lock->lk_spinlock);
+    if (lock->held) {
+        lock->lk_contended++;
+    }
     while(lock->held){
+        if (lock_owner_running(lock)) {
+            /*
+             * Spin without the spinlock, so the holder can get
+             * it to release the lock, until the lock comes free
+             * or we should check on the holder again.
+             */
+            spinlock_release(&lock->lk_spinlock);
+            for (spins = 0; spins < LOCK_SPINBATCH && lock->held; spins++) {
+                /* nothing */
+            }
+            spinlock_acquire(&lock->lk_spinlock);
+            lock->lk_spins += spins;
+            continue;
+        }
+        lock->lk_sleeps++;
         wchan_lock(lock->lk_wchan);
         spinlock_release(&lock->lk_spinlock);
         wchan_sleep(lock->lk_wchan);
@@ -214,10 +260,29 @@ lock_acquire(struct lock *lock)
     }
     lock->held = true;
     lock->owner = curthread;
+    lock->lk_acquires++;
     spinlock_release(&lock->lk_spinlock);
 
 }
 
+bool
+lock_tryacquire(struct lock *lock)
+{
+    KASSERT(lock);
+    KASSERT(!lock_do_i_hold(lock));
+
+    bool ret = false;
+    spinlock_acquire(&lock->lk_spinlock);
+    if (!lock->held) {
+        lock->held = true;
+        lock->owner = curthread;
+        lock->lk_acquires++;
+        ret = true;
+    }
+    spinlock_release(&lock->lk_spinlock);
+    return ret;
+}
+
 void
 lock_release(struct lock *lock)
 {
@@ -244,6 +309,206 @@ lock_do_i_hold(struct lock *lock)
     return ret; // dummy until code gets written
 }
 
+void
+lock_printstats(struct lock *lock)
+{
+    unsigned acquires, contended, spins, sleeps;
+
+    KASSERT(lock);
+
+    spinlock_acquire(&lock->lk_spinlock);
+    acquires = lock->lk_acquires;
+    contended = lock->lk_contended;
+    spins = lock->lk_spins;
+    sleeps = lock->lk_sleeps;
+    spinlock_release(&lock->lk_spinlock);
+
+    kprintf("%s: %u acquires, %u contended, %u spins, %u sleeps\n",
+        lock->lk_name, acquires, contended, spins, sleeps);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+    struct rwlock *rw;
+
+    rw = kmalloc(sizeof(struct rwlock));
+    if (rw == NULL) {
+        return NULL;
+    }
+
+    rw->rw_name = kstrdup(name);
+    if (rw->rw_name == NULL) {
+        kfree(rw);
+        return NULL;
+    }
+
+    rw->rw_rwchan = wchan_create(rw->rw_name);
+    if (rw->rw_rwchan == NULL) {
+        kfree(rw->rw_name);
+        kfree(rw);
+        return NULL;
+    }
+    rw->rw_wwchan = wchan_create(rw->rw_name);
+    if (rw->rw_wwchan == NULL) {
+        wchan_destroy(rw->rw_rwchan);
+        kfree(rw->rw_name);
+        kfree(rw);
+        return NULL;
+    }
+
+    spinlock_init(&rw->rw_spinlock);
+    rw->rw_readers = 0;
+    rw->rw_waitingwriters = 0;
+    rw->rw_writer = NULL;
+
+    return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+    KASSERT(rw);
+    KASSERT(rw->rw_readers == 0);
+    KASSERT(rw->rw_writer == NULL);
+
+    spinlock_cleanup(&rw->rw_spinlock);
+    wchan_destroy(rw->rw_wwchan);
+    wchan_destroy(rw->rw_rwchan);
+    kfree(rw->rw_name);
+    kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+    KASSERT(rw);
+    KASSERT(curthread->t_in_interrupt == false);
+
+    spinlock_acquire(&rw->rw_spinlock);
+    /* Stay out of the way of waiting writers */
+    while (rw->rw_writer != NULL || rw->rw_waitingwriters > 0) {
+        KASSERT(rw->rw_writer != curthread);
+        wchan_lock(rw->rw_rwchan);
+        spinlock_release(&rw->rw_spinlock);
+        wchan_sleep(rw->rw_rwchan);
+        spinlock_acquire(&rw->rw_spinlock);
+    }
+    rw->rw_readers++;
+    spinlock_release(&rw->rw_spinlock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+    KASSERT(rw);
+
+    spinlock_acquire(&rw->rw_spinlock);
+    KASSERT(rw->rw_readers > 0);
+    rw->rw_readers--;
+    if (rw->rw_readers == 0 && rw->rw_waitingwriters > 0) {
+        wchan_wakeone(rw->rw_wwchan);
+    }
+    spinlock_release(&rw->rw_spinlock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+    KASSERT(rw);
+    KASSERT(curthread->t_in_interrupt == false);
+
+    spinlock_acquire(&rw->rw_spinlock);
+    KASSERT(rw->rw_writer != curthread);
+    rw->rw_waitingwriters++;
+    while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+        wchan_lock(rw->rw_wwchan);
+        spinlock_release(&rw->rw_spinlock);
+        wchan_sleep(rw->rw_wwchan);
+        spinlock_acquire(&rw->rw_spinlock);
+    }
+    rw->rw_waitingwriters--;
+    rw->rw_writer = curthread;
+    spinlock_release(&rw->rw_spinlock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+    KASSERT(rw);
+
+    spinlock_acquire(&rw->rw_spinlock);
+    KASSERT(rw->rw_writer == curthread);
+    rw->rw_writer = NULL;
+    /* Hand off to the next writer if there is one, else to all readers */
+    if (rw->rw_waitingwriters > 0) {
+        wchan_wakeone(rw->rw_wwchan);
+    }
+    else {
+        wchan_wakeall(rw->rw_rwchan);
+    }
+    spinlock_release(&rw->rw_spinlock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Sequence lock.
+//
+// System/161 doesn't reorder memory accesses, so making the sequence
+// number volatile is all the ordering we need.
+
+void
+seqlock_init(struct seqlock *sl)
+{
+    spinlock_init(&sl->sl_lock);
+    sl->sl_seq = 0;
+}
+
+void
+seqlock_cleanup(struct seqlock *sl)
+{
+    KASSERT((sl->sl_seq & 1) == 0);
+    spinlock_cleanup(&sl->sl_lock);
+}
+
+void
+seqlock_write_begin(struct seqlock *sl)
+{
+    spinlock_acquire(&sl->sl_lock);
+    sl->sl_seq++;
+    KASSERT((sl->sl_seq & 1) == 1);
+}
+
+void
+seqlock_write_end(struct seqlock *sl)
+{
+    KASSERT(spinlock_do_i_hold(&sl->sl_lock));
+    sl->sl_seq++;
+    spinlock_release(&sl->sl_lock);
+}
+
+unsigned
+seqlock_read_begin(struct seqlock *sl)
+{
+    unsigned seq;
+
+    /* Writers hold a spinlock and so are brief; just wait them out */
+    do {
+        seq = sl->sl_seq;
+    } while (seq & 1);
+    return seq;
+}
+
+bool
+seqlock_read_retry(struct seqlock *sl, unsigned seq)
+{
+    return sl->sl_seq != seq;
+}
+
 ////////////////////////////////////////////////////////////
 //
 // CV
@@ -50,6 +50,7 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <clock.h>
 
 #include "opt-synchprobs.h"
 
@@ -57,6 +58,17 @@
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/*
+ * Scheduler parameters; see the scheduler notes below.
+ *
+ * SCHED_QUANTUM is the time slice, in hardclocks, at each level.
+ * SCHED_BOOST_HARDCLOCKS is how often everything gets moved back up
+ * to the top level; it should be a multiple of SCHEDULE_HARDCLOCKS in
+ * clock.c, since that's how often schedule() runs.
+ */
+#define SCHED_QUANTUM(level)	(1U << (level))	/* 1, 2, 4, ... */
+#define SCHED_BOOST_HARDCLOCKS	HZ		/* once a second */
+
 /* Wait channel. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -72,6 +84,8 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+static bool thread_steal(void);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -143,6 +157,8 @@ thread_create(const char *name)
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -167,6 +183,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -180,9 +197,14 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_idleclocks = 0;
+	c->c_steals = 0;
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
+	c->c_runcount = 0;
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
@@ -289,6 +311,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -303,9 +327,12 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = NULL;
-	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		curcpu->c_runqueue[i].tl_count = 0;
+		curcpu->c_runqueue[i].tl_head.tln_next = NULL;
+		curcpu->c_runqueue[i].tl_tail.tln_prev = NULL;
+	}
+	curcpu->c_runcount = 0;
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -426,6 +453,57 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Run queue operations. The caller must hold the cpu's run queue
+ * lock. A thread goes on the queue for its priority level; threads
+ * come off the highest-priority nonempty queue first.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(t->t_priority < SCHED_NLEVELS);
+	threadlist_addtail(&c->c_runqueue[t->t_priority], t);
+	c->c_runcount++;
+}
+
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		t = threadlist_remhead(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take the thread that would run last, for giving away to another cpu.
+ */
+static
+struct thread *
+runqueue_remtail(struct cpu *c)
+{
+	struct thread *t;
+	unsigned i;
+
+	for (i=SCHED_NLEVELS; i-- > 0; ) {
+		t = threadlist_remtail(&c->c_runqueue[i]);
+		if (t != NULL) {
+			c->c_runcount--;
+			return t;
+		}
+	}
+	return NULL;
+}
+
 /*
  * Make a thread runnable.
  *
@@ -450,7 +528,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -574,7 +652,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
 	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	if (newstate == S_READY && curcpu->c_runcount == 0) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -632,10 +710,12 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+		next = runqueue_remhead(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!thread_steal()) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
@@ -822,139 +902,196 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Each cpu has SCHED_NLEVELS
+ * run queues, and the highest-priority (lowest-numbered) nonempty one
+ * runs first, round-robin within the level. New threads start at the
+ * top. A thread that uses up its time slice at a level drops to the
+ * next one down, where slices are longer; a thread that sleeps (on a
+ * lock, on I/O, waiting for the console) and is woken moves back up a
+ * level. So CPU-bound threads sink and interactive ones stay near the
+ * top and get the CPU promptly when they wake.
+ *
+ * Ticks used at a level are kept across sleeps, so a thread can't
+ * stay at the top by sleeping just before its slice runs out. To keep
+ * the threads at the bottom from starving, schedule() periodically
+ * moves everything back to the top.
  */
 
+/*
+ * Called from hardclock() on every tick.
+ */
+void
+thread_timeslice(void)
+{
+	struct thread *cur;
+	bool preempt;
+	unsigned i;
+
+	/* The timer interrupted the idle loop; nothing to charge. */
+	if (curcpu->c_isidle) {
+		curcpu->c_idleclocks++;
+		return;
+	}
+
+	cur = curthread;
+	cur->t_ticks++;
+	if (cur->t_ticks >= SCHED_QUANTUM(cur->t_priority)) {
+		/* Used up its slice: demote it and let someone else go. */
+		if (cur->t_priority < SCHED_NLEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		thread_yield();
+		return;
+	}
+
+	/* Otherwise, only give way to a higher-priority thread. */
+	preempt = false;
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=0; i<cur->t_priority; i++) {
+		if (!threadlist_isempty(&curcpu->c_runqueue[i])) {
+			preempt = true;
+			break;
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+	if (preempt) {
+		thread_yield();
+	}
+}
+
+/*
+ * Move a thread that's just been woken up a level.
+ */
+static
+void
+thread_wakeboost(struct thread *t)
+{
+	if (t->t_priority > 0) {
+		t->t_priority--;
+		t->t_ticks = 0;
+	}
+}
+
+/*
+ * This is called periodically from hardclock(). Every
+ * SCHED_BOOST_HARDCLOCKS, it moves every thread on this cpu back to
+ * the top level so none starve.
+ */
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *t;
+	unsigned i;
+
+	if ((curcpu->c_hardclocks % SCHED_BOOST_HARDCLOCKS) != 0) {
+		return;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	for (i=1; i<SCHED_NLEVELS; i++) {
+		while ((t = threadlist_remhead(&curcpu->c_runqueue[i])) != NULL) {
+			t->t_priority = 0;
+			t->t_ticks = 0;
+			threadlist_addtail(&curcpu->c_runqueue[0], t);
+		}
+	}
+	if (!curcpu->c_isidle) {
+		curthread->t_priority = 0;
+		curthread->t_ticks = 0;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
 }
 
 /*
- * Thread migration.
+ * Work stealing.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * Rather than busy cpus periodically pushing threads to others, a cpu
+ * that runs out of work pulls some before it idles: it picks the cpu
+ * with the longest run queue and takes the thread from there that
+ * would have run last. The queue lengths are read without locking, so
+ * the choice may be a little stale; that's harmless, and it means a
+ * steal attempt only ever locks the one run queue it takes from. An
+ * idle cpu is woken by every hardclock, so it keeps trying once a
+ * tick until there's something to take.
  *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
+ * Migrating threads isn't free because of cache affinity, but
+ * System/161 doesn't (yet) model such cache effects, so an idle cpu
+ * steals whenever there's anything to steal.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * Called from thread_switch with interrupts off and *without* our
+ * own run queue lock (taking it while holding another cpu's would
+ * risk deadlock against a cpu stealing from us). Returns true if it
+ * put a thread on our run queue.
  */
-void
-thread_consider_migration(void)
+static
+bool
+thread_steal(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
+	struct cpu *c, *victim;
 	struct thread *t;
+	unsigned i, numcpus, best;
 
-	my_count = total_count = 0;
+	victim = NULL;
+	best = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+		if (c != curcpu->c_self && c->c_runcount > best) {
+			victim = c;
+			best = c->c_runcount;
 		}
-		spinlock_release(&c->c_runqueue_lock);
+	}
+	if (victim == NULL) {
+		return false;
 	}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = runqueue_remtail(victim);
+	if (t != NULL && t == victim->c_curthread) {
+		/*
+		 * A thread can be on a run queue and still be its cpu's
+		 * curthread if it went to sleep, the cpu went idle, and
+		 * it was woken before the cpu switched away from it.
+		 * Its stack is still in use, so leave it alone.
+		 */
+		runqueue_add(victim, t);
+		t = NULL;
 	}
+	if (t != NULL) {
+		t->t_cpu = curcpu->c_self;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	if (t == NULL) {
+		return false;
 	}
-	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u\n",
+	      t->t_name, victim->c_number, curcpu->c_number);
+	curcpu->c_steals++;
 
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
-		}
-		spinlock_release(&c->c_runqueue_lock);
-	}
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	runqueue_add(curcpu, t);
+	spinlock_release(&curcpu->c_runqueue_lock);
+	return true;
+}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
-	}
+/*
+ * Print per-cpu scheduling statistics.
+ */
+void
+thread_printstats(void)
+{
+	unsigned i;
+	struct cpu *c;
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		kprintf("cpu%u: %u hardclocks, %u idle, %u threads stolen\n",
+			c->c_number, c->c_hardclocks, c->c_idleclocks,
+			c->c_steals);
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -1050,6 +1187,7 @@ wchan_wakeone(struct wchan *wc)
 		return;
 	}
 
+	thread_wakeboost(target);
 	thread_make_runnable(target, false);
 }
 
@@ -1084,6 +1222,7 @@ wchan_wakeall(struct wchan *wc)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
+		thread_wakeboost(target);
 		thread_make_runnable(target, false);
 	}
 
@@ -1162,6 +1301,23 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+unsigned
+ipi_tlbshootdown_broadcast(const struct tlbshootdown *mapping)
+{
+	unsigned i, n;
+	struct cpu *c;
+
+	n = 0;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self) {
+			ipi_tlbshootdown(c, mapping);
+			n++;
+		}
+	}
+	return n;
+}
+
 void
 interprocessor_interrupt(void)
 {
@@ -0,0 +1,924 @@
+/*
+ * Buffer cache. See buf.h.
+ *
+ * Buffers are allocated on demand up to BUF_MAXBUFS and never freed.
+ * Cached buffers are found through a hash table on (device, block);
+ * every buffer is also on a single LRU list, least recently used at
+ * the head, which is where eviction looks first.
+ *
+ * One sleep lock covers the hash table, the LRU list, the stats and
+ * the flags of buffers that aren't busy. The data of a busy buffer
+ * belongs to whoever has it, so they can use it without the lock.
+ * Disk I/O is done on busy buffers with the lock released, so that
+ * hits don't wait behind misses and several misses can be queued at
+ * the disk at once. Big transfers can skip the cache altogether
+ * (buffer_directio).
+ *
+ * Readahead requests are queued for a thread of our own, which loads
+ * each run of blocks with one disk transfer. When a dirty buffer is
+ * written back, dirty buffers for the blocks either side of it go in
+ * the same transfer. Both can be turned off to see what they're worth.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <synch.h>
+#include <thread.h>
+#include <device.h>
+#include <buf.h>
+
+#define BUF_MAXBUFS	128
+#define BUF_HASHSIZE	64	/* must be a power of 2 */
+#define BUF_MAXCLUSTER	16	/* most blocks read ahead or written at once */
+#define BUF_RAQUEUE	8	/* most readahead requests waiting */
+
+struct buf {
+	struct buf *b_hashnext;		/* hash chain */
+	struct buf *b_lrunext;		/* LRU list */
+	struct buf *b_lruprev;
+	struct device *b_dev;		/* NULL if not in the hash */
+	daddr_t b_block;
+	void *b_data;
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* b_data is newer than the disk */
+	bool b_busy;			/* handed out */
+	bool b_readahead;		/* read ahead, not looked up since */
+};
+
+/* A readahead request */
+struct buf_rareq {
+	struct device *rr_dev;
+	daddr_t rr_block;
+	unsigned rr_nblocks;
+};
+
+static struct lock *buf_lock;
+static struct cv *buf_cv;		/* signalled when a buffer is released */
+static struct buf *buf_hash[BUF_HASHSIZE];
+static struct buf *buf_lruhead, *buf_lrutail;
+static struct buf_stats buf_stats;
+
+/* Readahead queue; also under buf_lock */
+static struct cv *buf_racv;		/* signalled when a request is queued */
+static struct buf_rareq buf_raqueue[BUF_RAQUEUE];
+static unsigned buf_rafirst, buf_racount;
+static struct device *buf_radev;	/* device being read ahead from */
+static bool buf_rathread;		/* readahead thread started */
+static bool buf_clustering = true;	/* readahead and clustered writes */
+
+void
+buffer_bootstrap(void)
+{
+	buf_lock = lock_create("buffer cache");
+	buf_cv = cv_create("buffer cache");
+	buf_racv = cv_create("readahead");
+	if (buf_lock == NULL || buf_cv == NULL || buf_racv == NULL) {
+		panic("buffer_bootstrap: out of memory\n");
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Hash table and LRU list
+
+static
+unsigned
+buf_hashfunc(struct device *dev, daddr_t block)
+{
+	return (block + dev->d_devnumber * 37) & (BUF_HASHSIZE - 1);
+}
+
+static
+struct buf *
+buf_lookup(struct device *dev, daddr_t block)
+{
+	struct buf *b;
+
+	for (b = buf_hash[buf_hashfunc(dev, block)]; b; b = b->b_hashnext) {
+		if (b->b_dev == dev && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buf_hashinsert(struct buf *b, struct device *dev, daddr_t block)
+{
+	unsigned h;
+
+	KASSERT(b->b_dev == NULL);
+	b->b_dev = dev;
+	b->b_block = block;
+	h = buf_hashfunc(dev, block);
+	b->b_hashnext = buf_hash[h];
+	buf_hash[h] = b;
+}
+
+static
+void
+buf_hashremove(struct buf *b)
+{
+	struct buf **p;
+
+	if (b->b_dev == NULL) {
+		return;
+	}
+	for (p = &buf_hash[buf_hashfunc(b->b_dev, b->b_block)];
+	     *p != b; p = &(*p)->b_hashnext) {
+		KASSERT(*p != NULL);
+	}
+	*p = b->b_hashnext;
+	b->b_hashnext = NULL;
+	b->b_dev = NULL;
+	b->b_valid = false;
+	if (b->b_readahead) {
+		buf_stats.bs_rawasted++;
+		b->b_readahead = false;
+	}
+}
+
+static
+void
+buf_lruremove(struct buf *b)
+{
+	if (b->b_lruprev) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		buf_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		buf_lrutail = b->b_lruprev;
+	}
+	b->b_lrunext = b->b_lruprev = NULL;
+}
+
+/* Put B at the most recently used end. */
+static
+void
+buf_lruappend(struct buf *b)
+{
+	b->b_lruprev = buf_lrutail;
+	b->b_lrunext = NULL;
+	if (buf_lrutail) {
+		buf_lrutail->b_lrunext = b;
+	}
+	else {
+		buf_lruhead = b;
+	}
+	buf_lrutail = b;
+}
+
+/* Put B at the least recently used end. */
+static
+void
+buf_lruprepend(struct buf *b)
+{
+	b->b_lrunext = buf_lruhead;
+	b->b_lruprev = NULL;
+	if (buf_lruhead) {
+		buf_lruhead->b_lruprev = b;
+	}
+	else {
+		buf_lrutail = b;
+	}
+	buf_lruhead = b;
+}
+
+////////////////////////////////////////////////////////////
+// I/O
+
+/*
+ * Read or write a buffer's block. Called with buf_lock held, and B
+ * busy; drops the lock while the I/O is in progress.
+ */
+static
+int
+buf_io(struct buf *b, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+	int tries = 0;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(b->b_busy);
+	KASSERT(b->b_dev != NULL);
+
+	lock_release(buf_lock);
+
+ retry:
+	uio_kinit(&iov, &ku, b->b_data, BUF_BLOCKSIZE,
+		  (off_t)b->b_block * BUF_BLOCKSIZE, rw);
+	result = b->b_dev->d_io(b->b_dev, &ku);
+	if (result == EINVAL) {
+		/*
+		 * This means the sector we requested was out of range,
+		 * or the seek address we gave wasn't sector-aligned,
+		 * or a couple of other things that are our fault.
+		 */
+		panic("buf: d_io returned EINVAL\n");
+	}
+	if (result == EIO) {
+		if (tries == 0) {
+			tries++;
+			kprintf("buf: block %u I/O error, retrying\n",
+				b->b_block);
+			goto retry;
+		}
+		else if (tries < 10) {
+			tries++;
+			goto retry;
+		}
+		else {
+			kprintf("buf: block %u I/O error, giving up after "
+				"%d retries\n", b->b_block, tries);
+		}
+	}
+
+	lock_acquire(buf_lock);
+	if (result) {
+		return result;
+	}
+
+	if (rw == UIO_READ) {
+		buf_stats.bs_reads++;
+	}
+	else {
+		buf_stats.bs_writes++;
+	}
+	return 0;
+}
+
+/* Can B go along with a write of a buffer next to it? */
+static
+bool
+buf_clusterable(struct buf *b)
+{
+	return b != NULL && !b->b_busy && b->b_dirty && b->b_valid;
+}
+
+/*
+ * Write back dirty buffer B, which we have busy, and mark it clean.
+ * With clustering on, the dirty buffers for the blocks either side of
+ * it that nobody has busy go in the same transfer, up to
+ * BUF_MAXCLUSTER blocks in all, and come back clean too. Called with
+ * buf_lock held; drops it while the I/O is in progress.
+ */
+static
+int
+buf_writeback(struct buf *b)
+{
+	struct buf *cl[BUF_MAXCLUSTER];
+	struct iovec iov;
+	struct uio ku;
+	daddr_t first;
+	unsigned n, i;
+	char *data;
+	int result;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+	KASSERT(b->b_busy);
+	KASSERT(b->b_dirty);
+
+	/* Take the dirty neighbours before it, then after it */
+	n = 1;
+	first = b->b_block;
+	while (buf_clustering && n < BUF_MAXCLUSTER && first > 0 &&
+	       buf_clusterable(buf_lookup(b->b_dev, first - 1))) {
+		first--;
+		buf_lookup(b->b_dev, first)->b_busy = true;
+		n++;
+	}
+	while (buf_clustering && n < BUF_MAXCLUSTER &&
+	       buf_clusterable(buf_lookup(b->b_dev, first + n))) {
+		buf_lookup(b->b_dev, first + n)->b_busy = true;
+		n++;
+	}
+
+	data = NULL;
+	if (n > 1) {
+		data = kmalloc(n * BUF_BLOCKSIZE);
+	}
+	if (data == NULL) {
+		/* Just B, then */
+		for (i = 0; i < n; i++) {
+			if (first + i != b->b_block) {
+				buf_lookup(b->b_dev, first + i)->b_busy = false;
+			}
+		}
+		if (n > 1) {
+			cv_broadcast(buf_cv, buf_lock);
+		}
+		result = buf_io(b, UIO_WRITE);
+		if (result == 0) {
+			b->b_dirty = false;
+		}
+		return result;
+	}
+
+	for (i = 0; i < n; i++) {
+		cl[i] = buf_lookup(b->b_dev, first + i);
+		KASSERT(cl[i] != NULL && cl[i]->b_busy);
+		memcpy(data + i * BUF_BLOCKSIZE, cl[i]->b_data, BUF_BLOCKSIZE);
+	}
+
+	lock_release(buf_lock);
+	uio_kinit(&iov, &ku, data, n * BUF_BLOCKSIZE,
+		  (off_t)first * BUF_BLOCKSIZE, UIO_WRITE);
+	result = b->b_dev->d_io(b->b_dev, &ku);
+	lock_acquire(buf_lock);
+	kfree(data);
+
+	for (i = 0; i < n; i++) {
+		if (result == 0) {
+			cl[i]->b_dirty = false;
+		}
+		if (cl[i] != b) {
+			cl[i]->b_busy = false;
+		}
+	}
+	cv_broadcast(buf_cv, buf_lock);
+
+	if (result) {
+		/* Try B by itself, with buf_io's retries */
+		result = buf_io(b, UIO_WRITE);
+		if (result == 0) {
+			b->b_dirty = false;
+		}
+		return result;
+	}
+
+	buf_stats.bs_writes += n;
+	buf_stats.bs_clusters++;
+	buf_stats.bs_clusterblocks += n;
+	return 0;
+}
+
+/*
+ * Find a buffer to put a new block in: a new one if we're still
+ * allowed to make more, otherwise the least recently used one that
+ * isn't busy, written back first if need be. It comes back busy and
+ * out of the hash table.
+ */
+static
+int
+buf_getfree(struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	if (buf_stats.bs_nbufs < BUF_MAXBUFS) {
+		b = kmalloc(sizeof(struct buf));
+		if (b != NULL) {
+			b->b_data = kmalloc(BUF_BLOCKSIZE);
+			if (b->b_data == NULL) {
+				kfree(b);
+				b = NULL;
+			}
+		}
+		if (b != NULL) {
+			b->b_hashnext = NULL;
+			b->b_dev = NULL;
+			b->b_block = 0;
+			b->b_valid = false;
+			b->b_dirty = false;
+			b->b_busy = true;
+			b->b_readahead = false;
+			buf_lruappend(b);
+			buf_stats.bs_nbufs++;
+			*ret = b;
+			return 0;
+		}
+		/* out of memory; make do with what we have */
+	}
+
+	while (1) {
+		for (b = buf_lruhead; b != NULL; b = b->b_lrunext) {
+			if (!b->b_busy) {
+				break;
+			}
+		}
+		if (b != NULL) {
+			break;
+		}
+		if (buf_stats.bs_nbufs == 0) {
+			return ENOMEM;
+		}
+		cv_wait(buf_cv, buf_lock);
+	}
+
+	b->b_busy = true;
+	if (b->b_dirty) {
+		result = buf_writeback(b);
+		if (result) {
+			b->b_busy = false;
+			cv_broadcast(buf_cv, buf_lock);
+			return result;
+		}
+	}
+	if (b->b_dev != NULL) {
+		buf_hashremove(b);
+		buf_stats.bs_evictions++;
+	}
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Common code for buffer_read and buffer_get.
+ */
+static
+int
+buf_find(struct device *dev, daddr_t block, bool doread, struct buf **ret)
+{
+	struct buf *b;
+	bool found = false;
+	int result;
+
+	KASSERT(dev->d_blocksize == BUF_BLOCKSIZE);
+
+	lock_acquire(buf_lock);
+
+	while (1) {
+		b = buf_lookup(dev, block);
+		if (b != NULL) {
+			if (!b->b_busy) {
+				found = true;
+				break;
+			}
+			cv_wait(buf_cv, buf_lock);
+			continue;
+		}
+
+		result = buf_getfree(&b);
+		if (result) {
+			lock_release(buf_lock);
+			return result;
+		}
+		if (buf_lookup(dev, block) != NULL) {
+			/* Someone else loaded it while we waited */
+			b->b_busy = false;
+			buf_lruremove(b);
+			buf_lruprepend(b);
+			cv_broadcast(buf_cv, buf_lock);
+			continue;
+		}
+		buf_hashinsert(b, dev, block);
+		break;
+	}
+
+	/* Ours now; anyone else who wants it will wait */
+	b->b_busy = true;
+
+	if (found && (b->b_valid || !doread)) {
+		buf_stats.bs_hits++;
+	}
+	else {
+		buf_stats.bs_misses++;
+	}
+	if (b->b_readahead) {
+		buf_stats.bs_rahits++;
+		b->b_readahead = false;
+	}
+
+	if (doread && !b->b_valid) {
+		result = buf_io(b, UIO_READ);
+		if (result) {
+			buf_hashremove(b);
+			b->b_busy = false;
+			cv_broadcast(buf_cv, buf_lock);
+			lock_release(buf_lock);
+			return result;
+		}
+		b->b_valid = true;
+	}
+
+	buf_lruremove(b);
+	buf_lruappend(b);
+
+	lock_release(buf_lock);
+	*ret = b;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Readahead
+
+/* Is there a buffer buf_getfree can hand out without waiting? */
+static
+bool
+buf_anyfree(void)
+{
+	struct buf *b;
+
+	if (buf_stats.bs_nbufs < BUF_MAXBUFS) {
+		return true;
+	}
+	for (b = buf_lruhead; b != NULL; b = b->b_lrunext) {
+		if (!b->b_busy) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Carry out a readahead request: load the blocks from the first one
+ * that isn't cached up to the next one that is, in one transfer.
+ * Gives up quietly if there aren't buffers to spare or anything goes
+ * wrong; it was only a guess.
+ */
+static
+void
+buf_raload(struct buf_rareq *rr)
+{
+	struct buf *cl[BUF_MAXCLUSTER];
+	struct iovec iov;
+	struct uio ku;
+	struct device *dev = rr->rr_dev;
+	daddr_t first = rr->rr_block;
+	unsigned n, i, max;
+	char *data;
+	int result;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	max = rr->rr_nblocks;
+	while (max > 0 && buf_lookup(dev, first) != NULL) {
+		first++;
+		max--;
+	}
+	if (max > BUF_MAXCLUSTER) {
+		max = BUF_MAXCLUSTER;
+	}
+
+	n = 0;
+	while (n < max && buf_lookup(dev, first + n) == NULL &&
+	       buf_anyfree()) {
+		if (buf_getfree(&cl[n])) {
+			break;
+		}
+		if (buf_lookup(dev, first + n) != NULL) {
+			/* Loaded while buf_getfree was writing back */
+			cl[n]->b_busy = false;
+			buf_lruremove(cl[n]);
+			buf_lruprepend(cl[n]);
+			cv_broadcast(buf_cv, buf_lock);
+			break;
+		}
+		buf_hashinsert(cl[n], dev, first + n);
+		n++;
+	}
+	if (n == 0) {
+		return;
+	}
+
+	lock_release(buf_lock);
+	data = kmalloc(n * BUF_BLOCKSIZE);
+	if (data == NULL) {
+		result = ENOMEM;
+	}
+	else {
+		uio_kinit(&iov, &ku, data, n * BUF_BLOCKSIZE,
+			  (off_t)first * BUF_BLOCKSIZE, UIO_READ);
+		result = dev->d_io(dev, &ku);
+	}
+	lock_acquire(buf_lock);
+
+	for (i = 0; i < n; i++) {
+		if (result) {
+			buf_hashremove(cl[i]);
+		}
+		else {
+			memcpy(cl[i]->b_data, data + i * BUF_BLOCKSIZE,
+			       BUF_BLOCKSIZE);
+			cl[i]->b_valid = true;
+			cl[i]->b_readahead = true;
+			buf_lruremove(cl[i]);
+			buf_lruappend(cl[i]);
+		}
+		cl[i]->b_busy = false;
+	}
+	cv_broadcast(buf_cv, buf_lock);
+	if (data != NULL) {
+		kfree(data);
+	}
+	if (result == 0) {
+		buf_stats.bs_reads += n;
+		buf_stats.bs_rablocks += n;
+	}
+}
+
+/*
+ * Throw away queued readahead requests for any of NBLOCKS blocks of
+ * DEV starting at BLOCK, or for all of DEV if NBLOCKS is 0.
+ */
+static
+void
+buf_racancel(struct device *dev, daddr_t block, unsigned nblocks)
+{
+	struct buf_rareq *rr;
+	unsigned i, n;
+
+	KASSERT(lock_do_i_hold(buf_lock));
+
+	n = buf_racount;
+	buf_racount = 0;
+	for (i = 0; i < n; i++) {
+		rr = &buf_raqueue[(buf_rafirst + i) % BUF_RAQUEUE];
+		if (rr->rr_dev == dev &&
+		    (nblocks == 0 ||
+		     (rr->rr_block < block + nblocks &&
+		      rr->rr_block + rr->rr_nblocks > block))) {
+			continue;
+		}
+		/* keep it (never moves it later in the queue) */
+		buf_raqueue[(buf_rafirst + buf_racount) % BUF_RAQUEUE] = *rr;
+		buf_racount++;
+	}
+}
+
+/*
+ * The readahead thread: takes requests off the queue one at a time.
+ */
+static
+void
+buf_rathreadfn(void *junk, unsigned long num)
+{
+	struct buf_rareq rr;
+
+	(void)junk;
+	(void)num;
+
+	lock_acquire(buf_lock);
+	while (1) {
+		while (buf_racount == 0) {
+			cv_wait(buf_racv, buf_lock);
+		}
+		rr = buf_raqueue[buf_rafirst];
+		buf_rafirst = (buf_rafirst + 1) % BUF_RAQUEUE;
+		buf_racount--;
+
+		/* buffer_drop waits while we're working on its device */
+		buf_radev = rr.rr_dev;
+		buf_raload(&rr);
+		buf_radev = NULL;
+		cv_broadcast(buf_cv, buf_lock);
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+int
+buffer_read(struct device *dev, daddr_t block, struct buf **ret)
+{
+	return buf_find(dev, block, true, ret);
+}
+
+int
+buffer_get(struct device *dev, daddr_t block, struct buf **ret)
+{
+	return buf_find(dev, block, false, ret);
+}
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	b->b_dirty = true;
+	b->b_valid = true;
+}
+
+void
+buffer_release(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_busy);
+	b->b_busy = false;
+	cv_broadcast(buf_cv, buf_lock);
+	lock_release(buf_lock);
+}
+
+void
+buffer_release_and_invalidate(struct buf *b)
+{
+	lock_acquire(buf_lock);
+	KASSERT(b->b_busy);
+	buf_hashremove(b);
+	b->b_dirty = false;
+	b->b_busy = false;
+	/* reuse it first */
+	buf_lruremove(b);
+	buf_lruprepend(b);
+	cv_broadcast(buf_cv, buf_lock);
+	lock_release(buf_lock);
+}
+
+int
+buffer_directio(struct device *dev, daddr_t block, unsigned nblocks,
+		struct uio *uio)
+{
+	struct buf *b;
+	unsigned i;
+	int result;
+
+	KASSERT(dev->d_blocksize == BUF_BLOCKSIZE);
+	KASSERT(uio->uio_offset == (off_t)block * BUF_BLOCKSIZE);
+	KASSERT(uio->uio_resid == nblocks * BUF_BLOCKSIZE);
+
+	lock_acquire(buf_lock);
+	if (uio->uio_rw == UIO_WRITE) {
+		/* Don't let readahead bring back the old contents */
+		buf_racancel(dev, block, nblocks);
+	}
+	i = 0;
+	while (i < nblocks) {
+		b = buf_lookup(dev, block + i);
+		if (b == NULL) {
+			i++;
+			continue;
+		}
+		if (b->b_busy) {
+			/* being written back, most likely; look again */
+			cv_wait(buf_cv, buf_lock);
+			continue;
+		}
+		if (uio->uio_rw == UIO_WRITE) {
+			/* about to be overwritten on disk */
+			buf_hashremove(b);
+			b->b_dirty = false;
+			buf_lruremove(b);
+			buf_lruprepend(b);
+		}
+		else if (b->b_dirty) {
+			b->b_busy = true;
+			result = buf_writeback(b);
+			b->b_busy = false;
+			cv_broadcast(buf_cv, buf_lock);
+			if (result) {
+				lock_release(buf_lock);
+				return result;
+			}
+		}
+		i++;
+	}
+	buf_stats.bs_directios++;
+	buf_stats.bs_directblocks += nblocks;
+	lock_release(buf_lock);
+
+	result = dev->d_io(dev, uio);
+	if (result == EINVAL) {
+		/* As in buf_io, this is our fault, not the disk's. */
+		panic("buf: d_io returned EINVAL\n");
+	}
+	return result;
+}
+
+void
+buffer_readahead(struct device *dev, daddr_t block, unsigned nblocks)
+{
+	struct buf_rareq *rr;
+	int result;
+
+	KASSERT(dev->d_blocksize == BUF_BLOCKSIZE);
+
+	lock_acquire(buf_lock);
+	if (!buf_clustering || buf_racount == BUF_RAQUEUE) {
+		/* Not wanted, or it wouldn't get done in time anyway */
+		lock_release(buf_lock);
+		return;
+	}
+	if (!buf_rathread) {
+		result = thread_fork("readahead", NULL, buf_rathreadfn,
+				     NULL, 0);
+		if (result) {
+			lock_release(buf_lock);
+			return;
+		}
+		buf_rathread = true;
+	}
+	rr = &buf_raqueue[(buf_rafirst + buf_racount) % BUF_RAQUEUE];
+	rr->rr_dev = dev;
+	rr->rr_block = block;
+	rr->rr_nblocks = nblocks;
+	buf_racount++;
+	cv_signal(buf_racv, buf_lock);
+	lock_release(buf_lock);
+}
+
+bool
+buffer_set_clustering(bool on)
+{
+	bool old;
+
+	lock_acquire(buf_lock);
+	old = buf_clustering;
+	buf_clustering = on;
+	lock_release(buf_lock);
+	return old;
+}
+
+int
+buffer_sync(struct device *dev)
+{
+	struct buf *b;
+	int result;
+
+	lock_acquire(buf_lock);
+ again:
+	for (b = buf_lruhead; b != NULL; b = b->b_lrunext) {
+		if (b->b_dev != dev || !b->b_dirty) {
+			continue;
+		}
+		if (b->b_busy) {
+			/* the list may change while we wait */
+			cv_wait(buf_cv, buf_lock);
+			goto again;
+		}
+		b->b_busy = true;
+		result = buf_writeback(b);
+		b->b_busy = false;
+		cv_broadcast(buf_cv, buf_lock);
+		if (result) {
+			lock_release(buf_lock);
+			return result;
+		}
+		/* and the list may have changed during the write */
+		goto again;
+	}
+	lock_release(buf_lock);
+	return 0;
+}
+
+void
+buffer_drop(struct device *dev)
+{
+	struct buf *b;
+
+	lock_acquire(buf_lock);
+
+	/* Forget any readahead for it, and wait out any in progress */
+	buf_racancel(dev, 0, 0);
+	while (buf_radev == dev) {
+		cv_wait(buf_cv, buf_lock);
+	}
+
+	for (b = buf_lruhead; b != NULL; b = b->b_lrunext) {
+		if (b->b_dev == dev) {
+			KASSERT(!b->b_busy);
+			KASSERT(!b->b_dirty);
+			buf_hashremove(b);
+		}
+	}
+	lock_release(buf_lock);
+}
+
+void
+buffer_getstats(struct buf_stats *bs)
+{
+	lock_acquire(buf_lock);
+	*bs = buf_stats;
+	lock_release(buf_lock);
+}
+
+void
+buffer_printstats(void)
+{
+	struct buf_stats bs;
+	unsigned lookups;
+
+	buffer_getstats(&bs);
+	lookups = bs.bs_hits + bs.bs_misses;
+
+	kprintf("Buffer cache: %u buffers of %u bytes (max %u)\n",
+		bs.bs_nbufs, BUF_BLOCKSIZE, BUF_MAXBUFS);
+	kprintf("  %u lookups: %u hits, %u misses (%u%% hits)\n",
+		lookups, bs.bs_hits, bs.bs_misses,
+		lookups ? bs.bs_hits * 100 / lookups : 0);
+	kprintf("  %u disk reads, %u disk writes, %u evictions\n",
+		bs.bs_reads, bs.bs_writes, bs.bs_evictions);
+	kprintf("  %u uncached transfers of %u blocks in all\n",
+		bs.bs_directios, bs.bs_directblocks);
+	kprintf("  %u blocks read ahead: %u used, %u wasted (%u%% used)\n",
+		bs.bs_rablocks, bs.bs_rahits, bs.bs_rawasted,
+		bs.bs_rablocks ? bs.bs_rahits * 100 / bs.bs_rablocks : 0);
+	kprintf("  %u clustered writes of %u blocks in all\n",
+		bs.bs_clusters, bs.bs_clusterblocks);
+}
@@ -38,11 +38,13 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <array.h>
+#include <spinlock.h>
 #include <synch.h>
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <buf.h>
 
 /*
  * Structure for a single named device.
@@ -60,6 +62,10 @@
  * kd_fs      - Filesystem object mounted on, or associated with, this
  *              device. NULL if there is no filesystem. 
  *
+ * kd_fsrefs  - Number of vfs_getroot calls getting the root of kd_fs
+ *              right now. The fs can't be unmounted while it's
+ *              nonzero.
+ *
  * A filesystem can be associated with a device without having been
  * mounted if the device was created that way. In this case,
  * kd_rawname is NULL (prohibiting mount/unmount), and, as there is
@@ -80,6 +86,7 @@ struct knowndev {
 	struct device *kd_device;
 	struct vnode *kd_vnode;
 	struct fs *kd_fs;
+	unsigned kd_fsrefs;
 };
 
 DECLARRAY(knowndev);
@@ -87,6 +94,21 @@ DEFARRAY(knowndev, /*no inline*/);
 
 static struct knowndevarray *knowndevs;
 
+/*
+ * Protects knowndevs and the kd_fs fields. Path lookups read the
+ * device list all the time and it almost never changes, so readers
+ * share it. Changes are made with vfs_biglock held as well, so code
+ * already holding the biglock can read the list without this lock.
+ *
+ * The biglock comes first: nothing may wait for the biglock (which
+ * filesystem operations such as FSOP_GETROOT on emufs can do) while
+ * holding this lock.
+ */
+static struct rwlock *knowndevs_lock;
+
+/* Protects kd_fsrefs, which readers of the device list change */
+static struct spinlock knowndevs_reflock;
+
 /* The big lock for all FS ops. Remove for filesystem assignment. */
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
@@ -103,12 +125,20 @@ vfs_bootstrap(void)
 		panic("vfs: Could not create knowndevs array\n");
 	}
 
+	knowndevs_lock = rwlock_create("knowndevs");
+	if (knowndevs_lock==NULL) {
+		panic("vfs: Could not create knowndevs lock\n");
+	}
+	spinlock_init(&knowndevs_reflock);
+
 	vfs_biglock = lock_create("vfs_biglock");
 	if (vfs_biglock==NULL) {
 		panic("vfs: Could not create vfs big lock\n");
 	}
 	vfs_biglock_depth = 0;
 
+	buffer_bootstrap();
+
 	devnull_create();
 }
 
@@ -154,7 +184,7 @@ vfs_sync(void)
 	struct knowndev *dev;
 	unsigned i, num;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_read(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -164,7 +194,7 @@ vfs_sync(void)
 		}
 	}
 
-	vfs_biglock_release();
+	rwlock_release_read(knowndevs_lock);
 
 	return 0;
 }
@@ -177,9 +207,10 @@ int
 vfs_getroot(const char *devname, struct vnode **result)
 {
 	struct knowndev *kd;
+	struct fs *fs;
 	unsigned i, num;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	rwlock_acquire_read(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -200,13 +231,30 @@ vfs_getroot(const char *devname, struct vnode **result)
 
 			if (!strcmp(kd->kd_name, devname) ||
 			    (volname!=NULL && !strcmp(volname, devname))) {
-				*result = FSOP_GETROOT(kd->kd_fs);
+				/*
+				 * Getting the root may need the biglock,
+				 * so don't do it holding the device list;
+				 * kd_fsrefs keeps the fs mounted instead.
+				 */
+				fs = kd->kd_fs;
+				spinlock_acquire(&knowndevs_reflock);
+				kd->kd_fsrefs++;
+				spinlock_release(&knowndevs_reflock);
+				rwlock_release_read(knowndevs_lock);
+
+				*result = FSOP_GETROOT(fs);
+
+				spinlock_acquire(&knowndevs_reflock);
+				KASSERT(kd->kd_fsrefs > 0);
+				kd->kd_fsrefs--;
+				spinlock_release(&knowndevs_reflock);
 				return 0;
 			}
 		}
 		else {
 			if (kd->kd_rawname!=NULL &&
 			    !strcmp(kd->kd_name, devname)) {
+				rwlock_release_read(knowndevs_lock);
 				return ENXIO;
 			}
 		}
@@ -222,6 +270,7 @@ vfs_getroot(const char *devname, struct vnode **result)
 			KASSERT(kd->kd_device != NULL);
 			VOP_INCREF(kd->kd_vnode);
 			*result = kd->kd_vnode;
+			rwlock_release_read(knowndevs_lock);
 			return 0;
 		}
 
@@ -233,6 +282,7 @@ vfs_getroot(const char *devname, struct vnode **result)
 			KASSERT(kd->kd_device != NULL);
 			VOP_INCREF(kd->kd_vnode);
 			*result = kd->kd_vnode;
+			rwlock_release_read(knowndevs_lock);
 			return 0;
 		}
 
@@ -247,6 +297,7 @@ vfs_getroot(const char *devname, struct vnode **result)
 	 * If we got here, the device specified by devname doesn't exist.
 	 */
 
+	rwlock_release_read(knowndevs_lock);
 	return ENODEV;
 }
 
@@ -261,7 +312,7 @@ vfs_getdevname(struct fs *fs)
 
 	KASSERT(fs != NULL);
 
-	KASSERT(vfs_biglock_do_i_hold());
+	rwlock_acquire_read(knowndevs_lock);
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -274,10 +325,12 @@ vfs_getdevname(struct fs *fs)
 			 * the fs cannot go away, and the device can't
 			 * go away until the fs goes away.
 			 */
+			rwlock_release_read(knowndevs_lock);
 			return kd->kd_name;
 		}
 	}
 
+	rwlock_release_read(knowndevs_lock);
 	return NULL;
 }
 
@@ -406,6 +459,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	kd->kd_device = dev;
 	kd->kd_vnode = vnode;
 	kd->kd_fs = fs;
+	kd->kd_fsrefs = 0;
 
 	if (fs!=NULL) {
 		volname = FSOP_GETVOLNAME(fs);
@@ -416,7 +470,9 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		return EEXIST;
 	}
 
+	rwlock_acquire_write(knowndevs_lock);
 	result = knowndevarray_add(knowndevs, kd, &index);
+	rwlock_release_write(knowndevs_lock);
 
 	if (result == 0 && dev != NULL) {
 		/* use index+1 as the device number, so 0 is reserved */
@@ -470,7 +526,7 @@ vfs_addfs(const char *devname, struct fs *fs)
 
 /*
  * Look for a mountable device named DEVNAME.
- * Should already hold knowndevs_lock.
+ * Should already hold vfs_biglock.
  */
 static
 int
@@ -537,7 +593,9 @@ vfs_mount(const char *devname, void *data,
 
 	KASSERT(fs != NULL);
 
+	rwlock_acquire_write(knowndevs_lock);
 	kd->kd_fs = fs;
+	rwlock_release_write(knowndevs_lock);
 
 	volname = FSOP_GETVOLNAME(fs);
 	kprintf("vfs: Mounted %s: on %s\n",
@@ -547,6 +605,22 @@ vfs_mount(const char *devname, void *data,
 	return 0;
 }
 
+/*
+ * Check if a vfs_getroot call is still getting the root of KD's fs.
+ * Call with knowndevs_lock held for write, so no more can start.
+ */
+static
+bool
+fsrefs_busy(struct knowndev *kd)
+{
+	bool busy;
+
+	spinlock_acquire(&knowndevs_reflock);
+	busy = kd->kd_fsrefs > 0;
+	spinlock_release(&knowndevs_reflock);
+	return busy;
+}
+
 /*
  * Unmount a filesystem/device by name.
  * First calls FSOP_SYNC on the filesystem; then calls FSOP_UNMOUNT.
@@ -576,8 +650,11 @@ vfs_unmount(const char *devname)
 		goto fail;
 	}
 
-	result = FSOP_UNMOUNT(kd->kd_fs);
+	/* Keep lookups from starting on the fs while it goes away */
+	rwlock_acquire_write(knowndevs_lock);
+	result = fsrefs_busy(kd) ? EBUSY : FSOP_UNMOUNT(kd->kd_fs);
 	if (result) {
+		rwlock_release_write(knowndevs_lock);
 		goto fail;
 	}
 
@@ -585,6 +662,7 @@ vfs_unmount(const char *devname)
 
 	/* now drop the filesystem */
 	kd->kd_fs = NULL;
+	rwlock_release_write(knowndevs_lock);
 
 	KASSERT(result==0);
 
@@ -633,13 +711,16 @@ vfs_unmountall(void)
 			}
 		}
 
-		result = FSOP_UNMOUNT(dev->kd_fs);
+		rwlock_acquire_write(knowndevs_lock);
+		result = fsrefs_busy(dev) ? EBUSY : FSOP_UNMOUNT(dev->kd_fs);
 		if (result == EBUSY) {
+			rwlock_release_write(knowndevs_lock);
 			kprintf("vfs: Cannot unmount %s: (busy)\n", 
 				dev->kd_name);
 			continue;
 		}
 		if (result) {
+			rwlock_release_write(knowndevs_lock);
 			kprintf("vfs: Warning: unmount failed for %s:"
 				" %s, already synced, dropping...\n",
 				dev->kd_name, strerror(result));
@@ -648,6 +729,7 @@ vfs_unmountall(void)
 
 		/* now drop the filesystem */
 		dev->kd_fs = NULL;
+		rwlock_release_write(knowndevs_lock);
 	}
 
 	vfs_biglock_release();
@@ -133,8 +133,6 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	struct vnode *vn;
 	int result;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/*
 	 * Locate the first colon or slash.
 	 */
@@ -188,11 +186,15 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	KASSERT(colon==0 || slash==0);
 
 	if (path[0]=='/') {
+		/* vfs_biglock covers bootfs_vnode */
+		vfs_biglock_acquire();
 		if (bootfs_vnode==NULL) {
+			vfs_biglock_release();
 			return ENOENT;
 		}
 		VOP_INCREF(bootfs_vnode);
 		*startvn = bootfs_vnode;
+		vfs_biglock_release();
 	}
 	else {
 		KASSERT(path[0]==':');
@@ -226,6 +228,10 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 /*
  * Name-to-vnode translation.
  * (In BSD, both of these are subsumed by namei().)
+ *
+ * The device list has its own lock and vfs_biglock is only needed
+ * for bootfs_vnode, so lookups on different paths don't serialize;
+ * the filesystem does its own locking for the lookup proper.
  */
 
 int
@@ -235,11 +241,8 @@ vfs_lookparent(char *path, struct vnode **retval,
 	struct vnode *startvn;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -256,8 +259,6 @@ vfs_lookparent(char *path, struct vnode **retval,
 	}
 
 	VOP_DECREF(startvn);
-
-	vfs_biglock_release();
 	return result;
 }
 
@@ -267,23 +268,18 @@ vfs_lookup(char *path, struct vnode **retval)
 	struct vnode *startvn;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
 	result = VOP_LOOKUP(startvn, path, retval);
 
 	VOP_DECREF(startvn);
-	vfs_biglock_release();
 	return result;
 }
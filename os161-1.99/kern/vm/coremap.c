@@ -0,0 +1,542 @@
+/*
+ * Physical frame allocator: a binary buddy system over the coremap.
+ * See coremap.h for the overview.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <vm.h>
+#include <coremap.h>
+
+/*
+ * Per-frame descriptor.
+ *
+ * Only the first frame of a block (free or allocated) carries
+ * meaningful order/npages information; the other frames of the
+ * block have cme_flags == 0.
+ */
+struct coremap_entry {
+	uint32_t cme_next;		/* free list links (frame numbers) */
+	uint32_t cme_prev;
+	uint16_t cme_npages;		/* size of allocation, if CME_ALLOC */
+	uint16_t cme_refcount;		/* sharers, if CME_ALLOC */
+	uint8_t cme_order;		/* order of free block, if CME_FREE */
+	uint8_t cme_flags;
+	struct addrspace *cme_as;	/* owner, if CME_USER */
+	vaddr_t cme_vaddr;		/* where it's mapped, if CME_USER */
+	void *cme_kdata;		/* kernel heap's, if CME_ALLOC */
+};
+
+#define CME_FREE	0x01	/* first frame of a free block */
+#define CME_ALLOC	0x02	/* first frame of an allocation */
+#define CME_USER	0x04	/* user page with a known owner; evictable */
+#define CME_BUSY	0x08	/* being filled or evicted; hands off */
+#define CME_REF		0x10	/* mapped since the clock last came by */
+
+/* End-of-list marker for the free lists. */
+#define CM_NONE  0xffffffff
+
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+static struct coremap_entry *coremap;	/* descriptor array */
+static paddr_t cm_base;			/* paddr of frame 0 */
+static uint32_t cm_nframes;		/* number of managed frames */
+static uint32_t cm_nfree;		/* number of free frames */
+static bool cm_ready = false;
+static uint32_t cm_clockhand;		/* next frame for the clock to look at */
+
+/* Heads of the per-order free lists, and their lengths. */
+static uint32_t cm_freelist[COREMAP_MAXORDER+1];
+static unsigned cm_freecount[COREMAP_MAXORDER+1];
+
+////////////////////////////////////////////////////////////
+//
+// Free list maintenance
+
+static
+void
+cm_list_add(uint32_t frame, unsigned order)
+{
+	struct coremap_entry *e = &coremap[frame];
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	e->cme_flags = CME_FREE;
+	e->cme_order = order;
+	e->cme_prev = CM_NONE;
+	e->cme_next = cm_freelist[order];
+	if (e->cme_next != CM_NONE) {
+		coremap[e->cme_next].cme_prev = frame;
+	}
+	cm_freelist[order] = frame;
+	cm_freecount[order]++;
+}
+
+static
+void
+cm_list_remove(uint32_t frame, unsigned order)
+{
+	struct coremap_entry *e = &coremap[frame];
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT(e->cme_flags == CME_FREE && e->cme_order == order);
+
+	if (e->cme_prev != CM_NONE) {
+		coremap[e->cme_prev].cme_next = e->cme_next;
+	}
+	else {
+		cm_freelist[order] = e->cme_next;
+	}
+	if (e->cme_next != CM_NONE) {
+		coremap[e->cme_next].cme_prev = e->cme_prev;
+	}
+	e->cme_flags = 0;
+	cm_freecount[order]--;
+}
+
+/*
+ * Take a free block of exactly ORDER, splitting a larger one if
+ * necessary. Returns CM_NONE if nothing big enough is free.
+ */
+static
+uint32_t
+cm_take(unsigned order)
+{
+	unsigned o;
+	uint32_t frame;
+
+	for (o = order; o <= COREMAP_MAXORDER; o++) {
+		if (cm_freelist[o] != CM_NONE) {
+			break;
+		}
+	}
+	if (o > COREMAP_MAXORDER) {
+		return CM_NONE;
+	}
+
+	frame = cm_freelist[o];
+	cm_list_remove(frame, o);
+
+	/* Split, handing the upper halves back as we go down. */
+	while (o > order) {
+		o--;
+		cm_list_add(frame + (1U << o), o);
+	}
+
+	cm_nfree -= 1U << order;
+	return frame;
+}
+
+/*
+ * Return the naturally aligned block FRAME of ORDER to the free
+ * lists, merging with its buddy for as long as the buddy is free.
+ */
+static
+void
+cm_give(uint32_t frame, unsigned order)
+{
+	uint32_t buddy;
+
+	KASSERT((frame & ((1U << order) - 1)) == 0);
+	cm_nfree += 1U << order;
+
+	while (order < COREMAP_MAXORDER) {
+		buddy = frame ^ (1U << order);
+		if (buddy >= cm_nframes ||
+		    coremap[buddy].cme_flags != CME_FREE ||
+		    coremap[buddy].cme_order != order) {
+			break;
+		}
+		cm_list_remove(buddy, order);
+		frame &= ~(1U << order);
+		order++;
+	}
+	cm_list_add(frame, order);
+}
+
+/*
+ * Free an arbitrary run of frames by splitting it into the largest
+ * naturally aligned blocks that fit.
+ */
+static
+void
+cm_give_range(uint32_t frame, uint32_t n)
+{
+	unsigned o;
+
+	while (n > 0) {
+		o = 0;
+		while (o < COREMAP_MAXORDER &&
+		       (frame & ((2U << o) - 1)) == 0 &&
+		       (2U << o) <= n) {
+			o++;
+		}
+		cm_give(frame, o);
+		frame += 1U << o;
+		n -= 1U << o;
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+void
+coremap_bootstrap(void)
+{
+	paddr_t first, last;
+	uint32_t total, cmpages, i;
+	unsigned o;
+
+	ram_getsize(&first, &last);
+	KASSERT((first & PAGE_FRAME) == first);
+
+	/*
+	 * The descriptor array goes at the bottom of free memory;
+	 * the frames after it are what we manage.
+	 */
+	total = (last - first) / PAGE_SIZE;
+	cmpages = DIVROUNDUP(total * sizeof(struct coremap_entry), PAGE_SIZE);
+	KASSERT(cmpages < total);
+
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(first);
+	cm_base = first + cmpages * PAGE_SIZE;
+	cm_nframes = total - cmpages;
+	cm_nfree = 0;
+
+	spinlock_acquire(&coremap_lock);
+	for (o = 0; o <= COREMAP_MAXORDER; o++) {
+		cm_freelist[o] = CM_NONE;
+		cm_freecount[o] = 0;
+	}
+	for (i = 0; i < cm_nframes; i++) {
+		coremap[i].cme_next = CM_NONE;
+		coremap[i].cme_prev = CM_NONE;
+		coremap[i].cme_npages = 0;
+		coremap[i].cme_refcount = 0;
+		coremap[i].cme_order = 0;
+		coremap[i].cme_flags = 0;
+		coremap[i].cme_as = NULL;
+		coremap[i].cme_vaddr = 0;
+		coremap[i].cme_kdata = NULL;
+	}
+	cm_clockhand = 0;
+	cm_give_range(0, cm_nframes);
+	cm_ready = true;
+	spinlock_release(&coremap_lock);
+
+	kprintf("coremap: %u frames (%u pages of descriptors)\n",
+		cm_nframes, cmpages);
+}
+
+bool
+coremap_ready(void)
+{
+	return cm_ready;
+}
+
+paddr_t
+coremap_alloc(unsigned long npages)
+{
+	unsigned order;
+	uint32_t frame;
+
+	KASSERT(npages > 0);
+
+	order = 0;
+	while ((1UL << order) < npages) {
+		order++;
+	}
+	if (order > COREMAP_MAXORDER) {
+		return 0;
+	}
+
+	spinlock_acquire(&coremap_lock);
+
+	frame = cm_take(order);
+	if (frame == CM_NONE) {
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+
+	/* Give back the part of the block we don't need. */
+	if ((1UL << order) > npages) {
+		cm_give_range(frame + npages, (1U << order) - npages);
+	}
+
+	coremap[frame].cme_flags = CME_ALLOC;
+	coremap[frame].cme_npages = npages;
+	coremap[frame].cme_refcount = 1;
+	coremap[frame].cme_kdata = NULL;
+
+	spinlock_release(&coremap_lock);
+
+	return cm_base + frame * PAGE_SIZE;
+}
+
+/*
+ * Look up the descriptor of the allocation starting at PADDR.
+ */
+static
+struct coremap_entry *
+cm_entry(paddr_t paddr)
+{
+	uint32_t frame;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+	KASSERT(paddr >= cm_base);
+
+	frame = (paddr - cm_base) / PAGE_SIZE;
+	KASSERT(frame < cm_nframes);
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	if ((coremap[frame].cme_flags & CME_ALLOC) == 0) {
+		panic("coremap: 0x%x is not an allocated block\n", paddr);
+	}
+	return &coremap[frame];
+}
+
+void
+coremap_free(paddr_t paddr)
+{
+	struct coremap_entry *e;
+	uint32_t npages;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	if (paddr < cm_base) {
+		/*
+		 * Stolen with ram_stealmem before the coremap was
+		 * set up. There's no record of it; leak it.
+		 */
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+
+	e = cm_entry(paddr);
+	while (e->cme_flags & CME_BUSY) {
+		/*
+		 * The pageout code has picked this user page as a
+		 * victim and is about to find out that it can't lock
+		 * our address space. Let it back off.
+		 */
+		spinlock_release(&coremap_lock);
+		thread_yield();
+		spinlock_acquire(&coremap_lock);
+	}
+	KASSERT(e->cme_refcount > 0);
+	e->cme_refcount--;
+	if (e->cme_refcount > 0) {
+		/* Still shared */
+		spinlock_release(&coremap_lock);
+		return;
+	}
+
+	npages = e->cme_npages;
+	e->cme_flags = 0;
+	e->cme_npages = 0;
+	e->cme_as = NULL;
+	e->cme_kdata = NULL;
+	cm_give_range((paddr - cm_base) / PAGE_SIZE, npages);
+
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_incref(paddr_t paddr)
+{
+	struct coremap_entry *e;
+
+	spinlock_acquire(&coremap_lock);
+	e = cm_entry(paddr);
+	KASSERT(e->cme_refcount > 0 && e->cme_refcount < 0xffff);
+	e->cme_refcount++;
+	/*
+	 * Shared frames aren't evicted, and once the sharing ends we
+	 * don't know which sharer is left until it touches the page.
+	 */
+	e->cme_flags &= ~CME_USER;
+	e->cme_as = NULL;
+	spinlock_release(&coremap_lock);
+}
+
+unsigned
+coremap_refcount(paddr_t paddr)
+{
+	unsigned ret;
+
+	spinlock_acquire(&coremap_lock);
+	ret = cm_entry(paddr)->cme_refcount;
+	spinlock_release(&coremap_lock);
+	return ret;
+}
+
+void
+coremap_setkdata(paddr_t paddr, void *kdata)
+{
+	if (paddr < cm_base) {
+		/* Stolen before we were set up; nowhere to put it. */
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	cm_entry(paddr)->cme_kdata = kdata;
+	spinlock_release(&coremap_lock);
+}
+
+bool
+coremap_getkdata(paddr_t paddr, void **kdata)
+{
+	uint32_t frame;
+
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	/* Before coremap_bootstrap cm_nframes is 0, so this fails. */
+	if (paddr < cm_base) {
+		return false;
+	}
+	frame = (paddr - cm_base) / PAGE_SIZE;
+	if (frame >= cm_nframes) {
+		return false;
+	}
+	*kdata = coremap[frame].cme_kdata;
+	return true;
+}
+
+paddr_t
+coremap_alloc_user(struct addrspace *as, vaddr_t vaddr)
+{
+	paddr_t paddr;
+	struct coremap_entry *e;
+
+	paddr = coremap_alloc(1);
+	if (paddr == 0) {
+		return 0;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	e = cm_entry(paddr);
+	e->cme_flags |= CME_USER | CME_BUSY | CME_REF;
+	e->cme_as = as;
+	e->cme_vaddr = vaddr;
+	spinlock_release(&coremap_lock);
+
+	return paddr;
+}
+
+void
+coremap_unbusy(paddr_t paddr)
+{
+	struct coremap_entry *e;
+
+	spinlock_acquire(&coremap_lock);
+	e = cm_entry(paddr);
+	KASSERT(e->cme_flags & CME_BUSY);
+	e->cme_flags &= ~CME_BUSY;
+	spinlock_release(&coremap_lock);
+}
+
+unsigned
+coremap_touch(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *e;
+	unsigned ret;
+
+	spinlock_acquire(&coremap_lock);
+	e = cm_entry(paddr);
+	ret = e->cme_refcount;
+	if (ret == 1) {
+		e->cme_flags |= CME_USER;
+		e->cme_as = as;
+		e->cme_vaddr = vaddr;
+	}
+	e->cme_flags |= CME_REF;
+	spinlock_release(&coremap_lock);
+
+	return ret;
+}
+
+/*
+ * Second-chance clock over the user pages. A page whose reference
+ * bit is set has it cleared and is passed over once. The bit is only
+ * set when a page is entered into the TLB, so this approximates LRU
+ * at TLB-miss granularity.
+ */
+paddr_t
+coremap_victim(struct addrspace **as, vaddr_t *vaddr)
+{
+	struct coremap_entry *e;
+	uint32_t n;
+
+	spinlock_acquire(&coremap_lock);
+	for (n = 0; n < 2 * cm_nframes; n++) {
+		e = &coremap[cm_clockhand];
+		if (++cm_clockhand == cm_nframes) {
+			cm_clockhand = 0;
+		}
+
+		if ((e->cme_flags & (CME_ALLOC|CME_USER|CME_BUSY))
+		    != (CME_ALLOC|CME_USER) || e->cme_refcount != 1) {
+			continue;
+		}
+		if (e->cme_flags & CME_REF) {
+			e->cme_flags &= ~CME_REF;
+			continue;
+		}
+
+		e->cme_flags |= CME_BUSY;
+		*as = e->cme_as;
+		*vaddr = e->cme_vaddr;
+		spinlock_release(&coremap_lock);
+		return cm_base + (e - coremap) * PAGE_SIZE;
+	}
+	spinlock_release(&coremap_lock);
+	return 0;
+}
+
+void
+coremap_getstats(struct coremap_stats *cs)
+{
+	unsigned o;
+
+	spinlock_acquire(&coremap_lock);
+	cs->cs_nframes = cm_nframes;
+	cs->cs_nfree = cm_nfree;
+	cs->cs_largest = 0;
+	for (o = 0; o <= COREMAP_MAXORDER; o++) {
+		cs->cs_nblocks[o] = cm_freecount[o];
+		if (cm_freecount[o] > 0) {
+			cs->cs_largest = 1U << o;
+		}
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Print the free block counts per order and the external
+ * fragmentation, i.e. the share of free memory that is not part of
+ * the largest free block.
+ */
+void
+coremap_printstats(void)
+{
+	struct coremap_stats cs;
+	unsigned o;
+
+	coremap_getstats(&cs);
+
+	kprintf("Coremap: %u/%u frames free, largest free block %u frames\n",
+		cs.cs_nfree, cs.cs_nframes, cs.cs_largest);
+	kprintf("   free blocks by order:");
+	for (o = 0; o <= COREMAP_MAXORDER; o++) {
+		kprintf(" %u", cs.cs_nblocks[o]);
+	}
+	kprintf("\n");
+	if (cs.cs_nfree > 0) {
+		kprintf("   fragmentation: %u%%\n",
+			100 - (100 * cs.cs_largest) / cs.cs_nfree);
+	}
+}
@@ -30,7 +30,11 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <coremap.h>
 
 /*
  * Kernel malloc.
@@ -111,6 +115,9 @@ struct pageref {
 
 #define INVALID_OFFSET   (0xffff)
 
+/* Most blocks a per-cpu magazine (see below) holds */
+#define MAG_MAXSIZE      16
+
 #define PR_PAGEADDR(pr)  ((pr)->pageaddr_and_blocktype & PAGE_FRAME)
 #define PR_BLOCKTYPE(pr) ((pr)->pageaddr_and_blocktype & ~PAGE_FRAME)
 #define MKPAB(pa, blk)   (((pa)&PAGE_FRAME) | ((blk) & ~PAGE_FRAME))
@@ -118,48 +125,97 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
+ * Pagerefs live in pages of their own, which are allocated as needed
+ * and never given back (they come to about 1/256 of the heap they
+ * describe). Each such page has a bitmap of which of its pagerefs are
+ * in use and a count of free ones, so full pages are skipped in one
+ * step and a free slot is found a word of the bitmap at a time.
  *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * The pageref pages come from alloc_kpages, which means the kernel
+ * heap's bookkeeping can't itself be kmalloc'd; it also means we have
+ * to drop the lock to get a new one (see subpage_kmalloc).
+ */
+
+#define PAGEREFS_PER_PAGE ((PAGE_SIZE - 64) / sizeof(struct pageref))
+#define INUSE_WORDS       DIVROUNDUP(PAGEREFS_PER_PAGE, 32)
+
+struct pagerefpage {
+	struct pagerefpage *next;
+	unsigned nfree;
+	uint32_t inuse[INUSE_WORDS];
+	struct pageref refs[PAGEREFS_PER_PAGE];
+};
+
+static struct pagerefpage *pagerefpages;
+static unsigned npagerefs;	/* total, in all the pagerefpages */
+
+/*
+ * Index of the lowest clear bit in WORD, which must have one.
  */
+static
+unsigned
+ffz32(uint32_t word)
+{
+	unsigned bit = 0;
+
+	KASSERT(word != 0xffffffff);
+	word = ~word;
+	if ((word & 0xffff) == 0) { word >>= 16; bit += 16; }
+	if ((word & 0xff) == 0) { word >>= 8; bit += 8; }
+	if ((word & 0xf) == 0) { word >>= 4; bit += 4; }
+	if ((word & 0x3) == 0) { word >>= 2; bit += 2; }
+	if ((word & 0x1) == 0) { bit += 1; }
+	return bit;
+}
+
+/*
+ * Turn the page at PAGE into a page of free pagerefs.
+ */
+static
+void
+addpagerefpage(vaddr_t page)
+{
+	struct pagerefpage *prp;
+	unsigned i;
 
-#define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
+	COMPILE_ASSERT(sizeof(struct pagerefpage) <= PAGE_SIZE);
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+	prp = (struct pagerefpage *)page;
+	prp->nfree = PAGEREFS_PER_PAGE;
+	for (i=0; i<INUSE_WORDS; i++) {
+		prp->inuse[i] = 0;
+	}
+	/* mark the bits past the end of refs[] as in use */
+	for (i=PAGEREFS_PER_PAGE; i<INUSE_WORDS*32; i++) {
+		prp->inuse[i/32] |= ((uint32_t)1) << (i%32);
+	}
+	prp->next = pagerefpages;
+	pagerefpages = prp;
+	npagerefs += PAGEREFS_PER_PAGE;
+}
 
 static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
+	struct pagerefpage *prp;
+	unsigned i, j;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
+	for (prp = pagerefpages; prp != NULL; prp = prp->next) {
+		if (prp->nfree == 0) {
 			continue;
 		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
+		for (i=0; i<INUSE_WORDS; i++) {
+			if (prp->inuse[i] == 0xffffffff) {
+				/* full */
+				continue;
 			}
+			j = ffz32(prp->inuse[i]);
+			prp->inuse[i] |= ((uint32_t)1) << j;
+			prp->nfree--;
+			return &prp->refs[i*32 + j];
 		}
-		KASSERT(0);
+		panic("kmalloc: pageref page %p has a bad free count\n", prp);
 	}
 
 	/* ran out */
@@ -170,15 +226,19 @@ static
 void
 freepageref(struct pageref *p)
 {
+	struct pagerefpage *prp;
 	size_t i, j;
 	uint32_t k;
 
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
+	/* pagerefpages are whole pages, so this finds the one P is on */
+	prp = (struct pagerefpage *)((vaddr_t)p & PAGE_FRAME);
+	j = p - prp->refs;
+	KASSERT(j < PAGEREFS_PER_PAGE);  /* note: j is unsigned */
 	i = j/32;
 	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+	KASSERT((prp->inuse[i] & k) != 0);
+	prp->inuse[i] &= ~k;
+	prp->nfree++;
 }
 
 ////////////////////////////////////////
@@ -189,10 +249,10 @@ static struct pageref *allbase;
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the whole thing. The pages and their freelists
+ * are the global depot; most allocations and frees never get here,
+ * because they're satisfied from the per-cpu magazines below, which
+ * come to the depot only to refill or drain in batches.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -260,14 +320,14 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(sc < npagerefs);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(ac < npagerefs);
 		ac++;
 	}
 
@@ -338,13 +398,16 @@ kheap_printstats(void)
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
-	kprintf("Subpage allocator status:\n");
+	kprintf("Subpage allocator status (room for %u pages):\n",
+		npagerefs);
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		dumpsubpage(pr);
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	kheap_printcachestats();
 }
 
 ////////////////////////////////////////
@@ -392,6 +455,68 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Take a block off the freelist of page PR, which must have one.
+ * Call with the lock held.
+ */
+static
+void *
+subpage_takeblock(struct pageref *pr)
+{
+	vaddr_t prpage, fla;
+	struct freelist *fl;
+	void *retptr;
+
+	KASSERT(pr->nfree > 0);
+	KASSERT(pr->freelist_offset < PAGE_SIZE);
+	prpage = PR_PAGEADDR(pr);
+	fla = prpage + pr->freelist_offset;
+	fl = (struct freelist *)fla;
+
+	retptr = fl;
+	fl = fl->next;
+	pr->nfree--;
+
+	if (fl != NULL) {
+		KASSERT(pr->nfree > 0);
+		fla = (vaddr_t)fl;
+		KASSERT(fla - prpage < PAGE_SIZE);
+		pr->freelist_offset = fla - prpage;
+	}
+	else {
+		KASSERT(pr->nfree == 0);
+		pr->freelist_offset = INVALID_OFFSET;
+	}
+	return retptr;
+}
+
+/*
+ * Take up to MAX blocks of type BLKTYPE from pages we already have,
+ * without getting any new pages. Returns how many it got.
+ */
+static
+unsigned
+subpage_getblocks(unsigned blktype, void **blocks, unsigned max)
+{
+	struct pageref *pr;
+	unsigned n = 0;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+
+	for (pr = sizebases[blktype]; pr != NULL && n < max;
+	     pr = pr->next_samesize) {
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		while (pr->nfree > 0 && n < max) {
+			blocks[n++] = subpage_takeblock(pr);
+		}
+	}
+
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+	return n;
+}
+
 static
 void *
 subpage_kmalloc(size_t sz)
@@ -402,6 +527,7 @@ subpage_kmalloc(size_t sz)
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
 	void *retptr;		// our result
+	vaddr_t refpage;	// new page of pagerefs, if we need one
 
 	volatile int i;
 
@@ -423,25 +549,7 @@ subpage_kmalloc(size_t sz)
 
 		doalloc: /* comes here after getting a whole fresh page */
 
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
-
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
-
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+			retptr = subpage_takeblock(pr);
 
 			checksubpages();
 
@@ -470,14 +578,29 @@ subpage_kmalloc(size_t sz)
 
 	pr = allocpageref();
 	if (pr==NULL) {
-		/* Couldn't allocate accounting space for the new page. */
+		/*
+		 * Out of pagerefs; get another page of them. Again
+		 * this has to be done without the spinlock, so someone
+		 * else may have added one meanwhile, but there's no
+		 * harm in having two.
+		 */
 		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+		refpage = alloc_kpages(1);
+		if (refpage==0) {
+			/* Couldn't allocate accounting space for the new page. */
+			free_kpages(prpage);
+			kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
+			return NULL;
+		}
+		spinlock_acquire(&kmalloc_spinlock);
+		addpagerefpage(refpage);
+		pr = allocpageref();
+		KASSERT(pr != NULL);
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
+	/* so kfree can find pr from a block without searching */
+	coremap_setkdata(KVADDR_TO_PADDR(prpage), pr);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
 
 	/*
@@ -508,63 +631,116 @@ subpage_kmalloc(size_t sz)
 	goto doalloc;
 }
 
+/*
+ * Check that PTRADDR is a proper block on page PR and return its
+ * block type.
+ */
 static
 int
-subpage_kfree(void *ptr)
+subpage_checkblock(struct pageref *pr, vaddr_t ptraddr)
 {
 	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
-	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 
-	ptraddr = (vaddr_t)ptr;
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
 
-	spinlock_acquire(&kmalloc_spinlock);
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
 
-	checksubpages();
+	offset = ptraddr - prpage;
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
+	/* Check for proper positioning and alignment */
+	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n",
+		      (void *)ptraddr);
+	}
+	return blktype;
+}
 
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
+/*
+ * Find the pageref for the page PTRADDR is on, or NULL if it isn't one
+ * of ours, from the coremap. Returns false if the coremap doesn't know
+ * the page, in which case the caller has to search allbase.
+ *
+ * This needs no lock as long as PTRADDR is an allocated block (or not
+ * a subpage block at all): its page can't be freed, or its pageref
+ * changed, until the block is freed.
+ */
+static
+bool
+subpage_fastlookup(vaddr_t ptraddr, struct pageref **ret)
+{
+	void *kdata;
 
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
+	if (!coremap_getkdata(KVADDR_TO_PADDR(ptraddr & PAGE_FRAME),
+			      &kdata)) {
+		return false;
+	}
+	*ret = kdata;
+	return true;
+}
+
+/*
+ * Find the page PTRADDR is on. Returns its block type and pageref, or
+ * -1 if it isn't one of ours. Call with the lock held.
+ */
+static
+int
+subpage_lookup(vaddr_t ptraddr, struct pageref **ret)
+{
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+
+	if (!subpage_fastlookup(ptraddr, &pr)) {
+		/*
+		 * A page stolen during boot, before there was a
+		 * coremap; only those have to be searched for.
+		 */
+		for (pr = allbase; pr; pr = pr->next_all) {
+			prpage = PR_PAGEADDR(pr);
+			checksubpage(pr);
+			if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+				break;
+			}
 		}
 	}
 
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
-	offset = ptraddr - prpage;
+	*ret = pr;
+	return subpage_checkblock(pr, ptraddr);
+}
 
-	/* Check for proper positioning and alignment */
-	if (offset >= PAGE_SIZE || offset % sizes[blktype] != 0) {
-		panic("kfree: subpage free of invalid addr %p\n", ptr);
-	}
+/*
+ * Put the block at PTRADDR back on the freelist of its page PR. If
+ * that frees the whole page, take the page off the lists and return
+ * its address, which the caller must give to free_kpages after
+ * releasing the lock; otherwise return 0. Call with the lock held.
+ */
+static
+vaddr_t
+subpage_putblock(struct pageref *pr, vaddr_t ptraddr)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	struct freelist *fl;	// free list entry
+	vaddr_t offset;		// offset into page
 
-	/*
-	 * Clear the block to 0xdeadbeef to make it easier to detect
-	 * uses of dangling pointers.
-	 */
-	fill_deadbeef(ptr, sizes[blktype]);
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+	offset = ptraddr - prpage;
 
 	/*
 	 * We probably ought to check for free twice by seeing if the block
 	 * is already on the free list. But that's expensive, so we don't.
 	 */
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
+	fl = (struct freelist *)ptraddr;
 	if (pr->freelist_offset == INVALID_OFFSET) {
 		fl->next = NULL;
 	} else {
@@ -578,12 +754,99 @@ subpage_kfree(void *ptr)
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+		return prpage;
 	}
-	else {
+	return 0;
+}
+
+/*
+ * Give N blocks back to their pages, taking the lock once.
+ */
+static
+void
+subpage_putblocks(void **blocks, unsigned n)
+{
+	struct pageref *pr;
+	vaddr_t freepages[MAG_MAXSIZE];
+	unsigned i, nfreepages = 0;
+	int blktype;
+
+	KASSERT(n <= MAG_MAXSIZE);
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+
+	for (i=0; i<n; i++) {
+		blktype = subpage_lookup((vaddr_t)blocks[i], &pr);
+		KASSERT(blktype >= 0);
+		freepages[nfreepages] = subpage_putblock(pr,
+							 (vaddr_t)blocks[i]);
+		if (freepages[nfreepages] != 0) {
+			nfreepages++;
+		}
+	}
+
+	checksubpages();
+	/* Call free_kpages without kmalloc_spinlock. */
+	spinlock_release(&kmalloc_spinlock);
+
+	for (i=0; i<nfreepages; i++) {
+		free_kpages(freepages[i]);
+	}
+}
+
+/*
+ * Return the block type of PTR, or -1 if it isn't a subpage block.
+ */
+static
+int
+subpage_blocktype(void *ptr)
+{
+	struct pageref *pr;
+	int blktype;
+
+	if (subpage_fastlookup((vaddr_t)ptr, &pr)) {
+		if (pr == NULL) {
+			return -1;
+		}
+		return subpage_checkblock(pr, (vaddr_t)ptr);
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	blktype = subpage_lookup((vaddr_t)ptr, &pr);
+	spinlock_release(&kmalloc_spinlock);
+	return blktype;
+}
+
+static
+int
+subpage_kfree(void *ptr)
+{
+	int blktype;		// index into sizes[] that we're using
+	struct pageref *pr;	// pageref for page we're freeing in
+	vaddr_t freepage;	// page to release, if any
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+	blktype = subpage_lookup((vaddr_t)ptr, &pr);
+	if (blktype < 0) {
 		spinlock_release(&kmalloc_spinlock);
+		return -1;
+	}
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
+	 */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	freepage = subpage_putblock(pr, (vaddr_t)ptr);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	spinlock_release(&kmalloc_spinlock);
+	if (freepage != 0) {
+		free_kpages(freepage);
 	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
@@ -595,6 +858,216 @@ subpage_kfree(void *ptr)
 	return 0;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Per-cpu magazines.
+//
+// Each cpu keeps, for each block size, a small stack (magazine) of
+// free blocks that it allocates from and frees to with only its
+// interrupts turned off: nobody else touches it, and with interrupts
+// off we can neither be preempted (and maybe moved to another cpu)
+// nor have an interrupt handler kmalloc in the middle of us. When a
+// magazine is empty it's refilled with half a magazine's worth of
+// blocks from the depot in one go; when it's full, half of it is
+// drained back the same way. So the depot lock is taken once per
+// several operations, and a cpu that keeps allocating and freeing the
+// same sizes mostly doesn't take it at all.
+//
+// Finding which magazine a block goes back to is also lock-free,
+// through the coremap (see subpage_fastlookup).
+//
+// A block in a magazine still counts as allocated as far as its page
+// is concerned, so magazines keep pages around; for the big sizes the
+// magazines are kept small so as not to hoard too much.
+//
+// Until there's a curcpu, early in boot, everything goes straight to
+// the depot.
+//
+
+#define KM_MAXCPUS	32	/* LAMEbus can't have more than this */
+
+/* Magazine size for block type BLKTYPE: at most one page's worth */
+#define MAG_SIZE(blktype) \
+	(PAGE_SIZE / sizes[blktype] < MAG_MAXSIZE ? \
+	 PAGE_SIZE / sizes[blktype] : MAG_MAXSIZE)
+#define MAG_BATCH(blktype) (MAG_SIZE(blktype) / 2)
+
+struct magazine {
+	unsigned m_count;
+	void *m_blocks[MAG_MAXSIZE];
+};
+
+struct kmcache {
+	struct magazine kc_mags[NSIZES];
+	unsigned kc_allocs;		/* kmallocs on this cpu */
+	unsigned kc_allochits;		/* ... that didn't go to the depot */
+	unsigned kc_frees;		/* kfrees on this cpu */
+	unsigned kc_freehits;		/* ... that didn't go to the depot */
+};
+
+static struct kmcache kmcaches[KM_MAXCPUS];
+
+/*
+ * Get the current cpu's cache. Call with interrupts off.
+ */
+static
+struct kmcache *
+kmcache_get(void)
+{
+	KASSERT(curcpu->c_number < KM_MAXCPUS);
+	return &kmcaches[curcpu->c_number];
+}
+
+static
+void *
+kmcache_alloc(size_t sz)
+{
+	unsigned blktype;
+	struct kmcache *kc;
+	struct magazine *m;
+	void *ptr;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return subpage_kmalloc(sz);
+	}
+
+	blktype = blocktype(sz);
+
+	spl = splhigh();
+	kc = kmcache_get();
+	m = &kc->kc_mags[blktype];
+	kc->kc_allocs++;
+
+	if (m->m_count > 0) {
+		kc->kc_allochits++;
+	}
+	else {
+		m->m_count = subpage_getblocks(blktype, m->m_blocks,
+					       MAG_BATCH(blktype));
+		if (m->m_count == 0) {
+			/* The depot has none either; get a new page. */
+			splx(spl);
+			return subpage_kmalloc(sz);
+		}
+	}
+
+	ptr = m->m_blocks[--m->m_count];
+	splx(spl);
+	return ptr;
+}
+
+static
+void
+kmcache_free(void *ptr, int blktype)
+{
+	struct kmcache *kc;
+	struct magazine *m;
+	unsigned batch;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		subpage_kfree(ptr);
+		return;
+	}
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
+	 */
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	spl = splhigh();
+	kc = kmcache_get();
+	m = &kc->kc_mags[blktype];
+	kc->kc_frees++;
+
+	if (m->m_count < MAG_SIZE(blktype)) {
+		kc->kc_freehits++;
+	}
+	else {
+		batch = MAG_BATCH(blktype);
+		m->m_count -= batch;
+		subpage_putblocks(&m->m_blocks[m->m_count], batch);
+	}
+
+	m->m_blocks[m->m_count++] = ptr;
+	splx(spl);
+}
+
+/*
+ * HITS as a percentage of TOTAL, without overflowing.
+ */
+static
+unsigned
+kmcache_percent(unsigned hits, unsigned total)
+{
+	if (total == 0) {
+		return 0;
+	}
+	if (total > 0xffffffff / 100) {
+		return hits / (total / 100);
+	}
+	return hits * 100 / total;
+}
+
+void
+kheap_printcachestats(void)
+{
+	struct kmcache *kc;
+	unsigned i, j, ncached;
+
+	kprintf("Per-cpu kmalloc magazines:\n");
+	for (i=0; i<KM_MAXCPUS; i++) {
+		kc = &kmcaches[i];
+		if (kc->kc_allocs == 0 && kc->kc_frees == 0) {
+			continue;
+		}
+		ncached = 0;
+		for (j=0; j<NSIZES; j++) {
+			ncached += kc->kc_mags[j].m_count;
+		}
+		kprintf("cpu%u: kmalloc %u (%u%% hits), kfree %u (%u%% hits), "
+			"%u blocks cached\n", i,
+			kc->kc_allocs, kmcache_percent(kc->kc_allochits,
+						       kc->kc_allocs),
+			kc->kc_frees, kmcache_percent(kc->kc_freehits,
+						      kc->kc_frees),
+			ncached);
+	}
+}
+
+/*
+ * Bytes of subpage blocks handed out by kmalloc and not yet freed:
+ * those in use in the depot's pages, less those sitting in the
+ * magazines. Other cpus' magazines are read without stopping them,
+ * so it's only exact when the system is quiet.
+ */
+size_t
+kheap_getused(void)
+{
+	struct pageref *pr;
+	unsigned blktype, i, j;
+	size_t used, cached;
+
+	used = 0;
+	spinlock_acquire(&kmalloc_spinlock);
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		blktype = PR_BLOCKTYPE(pr);
+		used += (PAGE_SIZE / sizes[blktype] - pr->nfree) *
+			sizes[blktype];
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	cached = 0;
+	for (i=0; i<KM_MAXCPUS; i++) {
+		for (j=0; j<NSIZES; j++) {
+			cached += kmcaches[i].kc_mags[j].m_count * sizes[j];
+		}
+	}
+	return used > cached ? used - cached : 0;
+}
+
 //
 ////////////////////////////////////////////////////////////
 
@@ -615,20 +1088,27 @@ kmalloc(size_t sz)
 		return (void *)address;
 	}
 
-	return subpage_kmalloc(sz);
+	return kmcache_alloc(sz);
 }
 
 void
 kfree(void *ptr)
 {
+	int blktype;
+
 	/*
 	 * Try subpage first; if that fails, assume it's a big allocation.
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+	blktype = subpage_blocktype(ptr);
+	if (blktype < 0) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
+	else {
+		kmcache_free(ptr, blktype);
+	}
 }
 
@@ -0,0 +1,87 @@
+/*
+ * Two-level page tables. See pagetable.h.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <pagetable.h>
+
+#define PT_L1_INDEX(va)  ((va) >> PT_L1_SHIFT)
+#define PT_L2_INDEX(va)  (((va) >> 12) & (PT_L2_ENTRIES - 1))
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(struct pagetable));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i = 0; i < PT_L1_ENTRIES; i++) {
+		pt->pt_dir[i] = NULL;
+	}
+	return pt;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned i;
+
+	for (i = 0; i < PT_L1_ENTRIES; i++) {
+		if (pt->pt_dir[i] != NULL) {
+			kfree(pt->pt_dir[i]);
+		}
+	}
+	kfree(pt);
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	pte_t *l2;
+	unsigned i;
+
+	KASSERT(vaddr < USERSPACETOP);
+
+	l2 = pt->pt_dir[PT_L1_INDEX(vaddr)];
+	if (l2 == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		l2 = kmalloc(PAGE_SIZE);
+		if (l2 == NULL) {
+			return NULL;
+		}
+		for (i = 0; i < PT_L2_ENTRIES; i++) {
+			l2[i] = 0;
+		}
+		pt->pt_dir[PT_L1_INDEX(vaddr)] = l2;
+	}
+	return &l2[PT_L2_INDEX(vaddr)];
+}
+
+pte_t *
+pt_next(struct pagetable *pt, vaddr_t *vaddr)
+{
+	unsigned i, j;
+	pte_t *l2;
+
+	i = PT_L1_INDEX(*vaddr);
+	j = PT_L2_INDEX(*vaddr);
+	for (; i < PT_L1_ENTRIES; i++, j = 0) {
+		l2 = pt->pt_dir[i];
+		if (l2 == NULL) {
+			continue;
+		}
+		for (; j < PT_L2_ENTRIES; j++) {
+			if (l2[j] != 0) {
+				*vaddr = (i << PT_L1_SHIFT) | (j << 12);
+				return &l2[j];
+			}
+		}
+	}
+	return NULL;
+}
@@ -66,8 +66,10 @@ dumpsb(void)
 		errx(1, "Not an sfs filesystem");
 	}
 	sp.sp_volname[sizeof(sp.sp_volname)-1] = 0;
-	printf("Volume name: %-40s  %u blocks\n", sp.sp_volname, 
-	       SWAPL(sp.sp_nblocks));
+	printf("Volume name: %-40s  %u blocks%s%s\n", sp.sp_volname, 
+	       SWAPL(sp.sp_nblocks),
+	       (SWAPL(sp.sp_flags) & SFS_SUPER_EXTENTS) ? ", extents" : "",
+	       (SWAPL(sp.sp_flags) & SFS_SUPER_DIRINDEX) ? ", dirindex" : "");
 
 	return SWAPL(sp.sp_nblocks);
 }
@@ -95,16 +97,104 @@ dodirblock(uint32_t block)
 	}
 }
 
+/*
+ * Dump the directory blocks under indirect block IBLOCK, which is
+ * LEVEL levels above the data (1 for a plain indirect block).
+ */
+static
+void
+dodirindirect(uint32_t iblock, int level, uint32_t *nblocks)
+{
+	uint32_t ib[SFS_DBPERIDB];
+	uint32_t block;
+	int i;
+
+	diskread(&ib, iblock);
+	for (i=0; i<SFS_DBPERIDB; i++) {
+		block = SWAPL(ib[i]);
+		if (block == 0) {
+			continue;
+		}
+		if (level > 1) {
+			dodirindirect(block, level-1, nblocks);
+		}
+		else {
+			dodirblock(block);
+			(*nblocks)++;
+		}
+	}
+}
+
+/*
+ * Print a directory index's header. The buckets are just hashes, so
+ * only say how full they are.
+ */
+static
+void
+dumpdirindex(uint32_t ino)
+{
+	struct sfs_inode sfi;
+	struct sfs_dixheader dh;
+	struct sfs_dixbucket db;
+	uint32_t block, i;
+
+	diskread(&sfi, ino);
+	if (SWAPS(sfi.sfi_type) != SFS_TYPE_DIRINDEX) {
+		warnx("Warning: directory index %u has wrong type", ino);
+		return;
+	}
+	/* The header and buckets are the first blocks of the index */
+	if (SWAPL(sfi.sfi_flags) & SFS_IF_EXTENTS) {
+		block = SWAPL(sfi.sfi_extents[0].sfe_start);
+	}
+	else {
+		block = SWAPL(sfi.sfi_direct[0]);
+	}
+	diskread(&dh, block);
+	if (SWAPL(dh.dxh_magic) != SFS_DIX_MAGIC) {
+		warnx("Warning: directory index %u has bad magic", ino);
+		return;
+	}
+	printf("Directory index %u: %u buckets, %u entries, free hint %u\n",
+	       ino, SWAPL(dh.dxh_nbuckets), SWAPL(dh.dxh_nentries),
+	       SWAPL(dh.dxh_freehint));
+
+	/* Only direct blocks or the first extent are easy to follow here */
+	for (i=0; i<SWAPL(dh.dxh_nbuckets); i++) {
+		if (SWAPL(sfi.sfi_flags) & SFS_IF_EXTENTS) {
+			if (1+i >= SWAPL(sfi.sfi_extents[0].sfe_len)) {
+				break;
+			}
+			block = SWAPL(sfi.sfi_extents[0].sfe_start) + 1 + i;
+		}
+		else {
+			if (1+i >= SFS_NDIRECT) {
+				break;
+			}
+			block = SWAPL(sfi.sfi_direct[1+i]);
+		}
+		diskread(&db, block);
+		printf("    [bucket %u: %u pairs%s]\n", i, SWAPL(db.dxb_count),
+		       SWAPL(db.dxb_overflow) ? ", overflowed" : "");
+	}
+	if (i < SWAPL(dh.dxh_nbuckets)) {
+		printf("    [%u more buckets not shown]\n",
+		       SWAPL(dh.dxh_nbuckets) - i);
+	}
+}
+
 static
 void
 dumpdir(uint32_t ino)
 {
 	struct sfs_inode sfi;
-	uint32_t ib[SFS_DBPERIDB];
 	int nentries, i;
-	uint32_t block, nblocks=0;
+	uint32_t block, nblocks=0, nextents, start, len, j;
 
 	diskread(&sfi, ino);
+	if (SWAPL(sfi.sfi_dirindex)) {
+		dumpdirindex(SWAPL(sfi.sfi_dirindex));
+	}
 
 	nentries = SWAPL(sfi.sfi_size) / sizeof(struct sfs_dir);
 	if (SWAPL(sfi.sfi_size) % sizeof(struct sfs_dir) != 0) {
@@ -112,6 +202,26 @@ dumpdir(uint32_t ino)
 	}
 	printf("Directory %u: %d entries\n", ino, nentries);
 
+	if (SWAPL(sfi.sfi_flags) & SFS_IF_EXTENTS) {
+		nextents = SWAPL(sfi.sfi_nextents);
+		if (nextents > SFS_NEXTENTS) {
+			warnx("Warning: too many extents");
+			nextents = SFS_NEXTENTS;
+		}
+		for (i=0; i<(int)nextents; i++) {
+			start = SWAPL(sfi.sfi_extents[i].sfe_start);
+			len = SWAPL(sfi.sfi_extents[i].sfe_len);
+			printf("    [extent %d: %u blocks at %u]\n",
+			       i, len, start);
+			for (j=0; j<len; j++) {
+				dodirblock(start + j);
+				nblocks++;
+			}
+		}
+		printf("    %u blocks in directory\n", nblocks);
+		return;
+	}
+
 	for (i=0; i<SFS_NDIRECT; i++) {
 		block = SWAPL(sfi.sfi_direct[i]);
 		if (block) {
@@ -120,14 +230,13 @@ dumpdir(uint32_t ino)
 		}
 	}
 	if (SWAPL(sfi.sfi_indirect)) {
-		diskread(&ib, SWAPL(sfi.sfi_indirect));
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			block = SWAPL(ib[i]);
-			if (block) {
-				dodirblock(block);
-				nblocks++;
-			}
-		}
+		dodirindirect(SWAPL(sfi.sfi_indirect), 1, &nblocks);
+	}
+	if (SWAPL(sfi.sfi_dindirect)) {
+		dodirindirect(SWAPL(sfi.sfi_dindirect), 2, &nblocks);
+	}
+	if (SWAPL(sfi.sfi_tindirect)) {
+		dodirindirect(SWAPL(sfi.sfi_tindirect), 3, &nblocks);
 	}
 	printf("    %u blocks in directory\n", nblocks);
 }
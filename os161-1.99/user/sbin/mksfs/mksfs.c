@@ -64,11 +64,13 @@ check(void)
 	assert(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
+	assert(sizeof(struct sfs_dixheader)==SFS_BLOCKSIZE);
+	assert(sizeof(struct sfs_dixbucket)==SFS_BLOCKSIZE);
 }
 
 static
 void
-writesuper(const char *volname, uint32_t nblocks)
+writesuper(const char *volname, uint32_t nblocks, uint32_t flags)
 {
 	struct sfs_super sp;
 
@@ -81,13 +83,25 @@ writesuper(const char *volname, uint32_t nblocks)
 	sp.sp_magic = SWAPL(SFS_MAGIC);
 	sp.sp_nblocks = SWAPL(nblocks);
 	strcpy(sp.sp_volname, volname);
+	sp.sp_flags = SWAPL(flags);
 
 	diskwrite(&sp, SFS_SB_LOCATION);
 }
 
+/*
+ * Where the root directory's index goes: its inode in the first block
+ * after the freemap, then its header and its one bucket.
+ */
+static
+uint32_t
+dirindexlocation(uint32_t fsblocks)
+{
+	return SFS_MAP_LOCATION + SFS_BITBLOCKS(fsblocks);
+}
+
 static
 void
-writerootdir(void)
+writerootdir(uint32_t flags, uint32_t fsblocks)
 {
 	struct sfs_inode sfi;
 
@@ -96,10 +110,55 @@ writerootdir(void)
 	sfi.sfi_size = SWAPL(0);
 	sfi.sfi_type = SWAPS(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAPS(1);
+	if (flags & SFS_SUPER_EXTENTS) {
+		sfi.sfi_flags = SWAPL(SFS_IF_EXTENTS);
+	}
+	if (flags & SFS_SUPER_DIRINDEX) {
+		sfi.sfi_dirindex = SWAPL(dirindexlocation(fsblocks));
+	}
 
 	diskwrite(&sfi, SFS_ROOT_LOCATION);
 }
 
+/*
+ * Write an empty index for the (empty) root directory: one bucket.
+ */
+static
+void
+writedirindex(uint32_t flags, uint32_t fsblocks)
+{
+	struct sfs_inode sfi;
+	struct sfs_dixheader dh;
+	struct sfs_dixbucket db;
+	uint32_t ino = dirindexlocation(fsblocks);
+
+	bzero((void *)&sfi, sizeof(sfi));
+	sfi.sfi_size = SWAPL(2*SFS_BLOCKSIZE);
+	sfi.sfi_type = SWAPS(SFS_TYPE_DIRINDEX);
+	sfi.sfi_linkcount = SWAPS(1);
+	if (flags & SFS_SUPER_EXTENTS) {
+		sfi.sfi_flags = SWAPL(SFS_IF_EXTENTS);
+		sfi.sfi_nextents = SWAPL(1);
+		sfi.sfi_extents[0].sfe_start = SWAPL(ino+1);
+		sfi.sfi_extents[0].sfe_len = SWAPL(2);
+	}
+	else {
+		sfi.sfi_direct[0] = SWAPL(ino+1);
+		sfi.sfi_direct[1] = SWAPL(ino+2);
+	}
+	diskwrite(&sfi, ino);
+
+	bzero((void *)&dh, sizeof(dh));
+	dh.dxh_magic = SWAPL(SFS_DIX_MAGIC);
+	dh.dxh_nbuckets = SWAPL(1);
+	dh.dxh_nentries = SWAPL(0);
+	dh.dxh_freehint = SWAPL(0);
+	diskwrite(&dh, ino+1);
+
+	bzero((void *)&db, sizeof(db));
+	diskwrite(&db, ino+2);
+}
+
 static char bitbuf[MAXBITBLOCKS*SFS_BLOCKSIZE];
 
 static
@@ -115,7 +174,7 @@ doallocbit(uint32_t bit)
 
 static
 void
-writebitmap(uint32_t fsblocks)
+writebitmap(uint32_t fsblocks, uint32_t flags)
 {
 
 	uint32_t nbits = SFS_BITMAPSIZE(fsblocks);
@@ -133,6 +192,11 @@ writebitmap(uint32_t fsblocks)
 	for (i=0; i<nblocks; i++) {
 		doallocbit(SFS_MAP_LOCATION+i);
 	}
+	if (flags & SFS_SUPER_DIRINDEX) {
+		for (i=0; i<3; i++) {
+			doallocbit(dirindexlocation(fsblocks)+i);
+		}
+	}
 	for (i=fsblocks; i<nbits; i++) {
 		doallocbit(i);
 	}
@@ -146,15 +210,33 @@ writebitmap(uint32_t fsblocks)
 int
 main(int argc, char **argv)
 {
-	uint32_t size, blocksize;
+	uint32_t size, blocksize, flags = 0;
 	char *volname, *s;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	/*
+	 * -e: map files with extents instead of block pointers
+	 * -i: give directories hash indexes
+	 */
+	while (argc > 1 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-e")) {
+			flags |= SFS_SUPER_EXTENTS;
+		}
+		else if (!strcmp(argv[1], "-i")) {
+			flags |= SFS_SUPER_DIRINDEX;
+		}
+		else {
+			break;
+		}
+		argc--;
+		argv++;
+	}
+
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		errx(1, "Usage: mksfs [-e] [-i] device/diskfile volume-name");
 	}
 
 	check();
@@ -185,9 +267,16 @@ main(int argc, char **argv)
 	}
 	size = diskblocks();
 
-	writesuper(volname, size);
-	writerootdir();
-	writebitmap(size);
+	if ((flags & SFS_SUPER_DIRINDEX) && dirindexlocation(size)+3 > size) {
+		errx(1, "Device too small for a directory index");
+	}
+
+	writesuper(volname, size, flags);
+	writerootdir(flags, size);
+	if (flags & SFS_SUPER_DIRINDEX) {
+		writedirindex(flags, size);
+	}
+	writebitmap(size, flags);
 
 	closedisk();
 
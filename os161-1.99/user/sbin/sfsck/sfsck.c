@@ -83,6 +83,7 @@ swapsb(struct sfs_super *sp)
 {
 	sp->sp_magic = SWAPL(sp->sp_magic);
 	sp->sp_nblocks = SWAPL(sp->sp_nblocks);
+	sp->sp_flags = SWAPL(sp->sp_flags);
 }
 
 static
@@ -126,6 +127,16 @@ swapinode(struct sfs_inode *sfi)
 	sfi->sfi_tindirect = SWAPL(sfi->sfi_tindirect);
 #endif
 #endif
+
+	sfi->sfi_flags = SWAPL(sfi->sfi_flags);
+	sfi->sfi_nextents = SWAPL(sfi->sfi_nextents);
+	for (i=0; i<SFS_NEXTENTS; i++) {
+		sfi->sfi_extents[i].sfe_start =
+			SWAPL(sfi->sfi_extents[i].sfe_start);
+		sfi->sfi_extents[i].sfe_len =
+			SWAPL(sfi->sfi_extents[i].sfe_len);
+	}
+	sfi->sfi_dirindex = SWAPL(sfi->sfi_dirindex);
 }
 
 static
@@ -145,6 +156,30 @@ swapindir(uint32_t *entries)
 	}
 }
 
+static
+void
+swapdixheader(struct sfs_dixheader *dh)
+{
+	dh->dxh_magic = SWAPL(dh->dxh_magic);
+	dh->dxh_nbuckets = SWAPL(dh->dxh_nbuckets);
+	dh->dxh_nentries = SWAPL(dh->dxh_nentries);
+	dh->dxh_freehint = SWAPL(dh->dxh_freehint);
+}
+
+static
+void
+swapdixbucket(struct sfs_dixbucket *db)
+{
+	int i;
+
+	db->dxb_overflow = SWAPL(db->dxb_overflow);
+	db->dxb_count = SWAPL(db->dxb_count);
+	for (i=0; i<SFS_DIX_NPAIRS; i++) {
+		db->dxb_pairs[i].dxp_hash = SWAPL(db->dxb_pairs[i].dxp_hash);
+		db->dxb_pairs[i].dxp_slot = SWAPL(db->dxb_pairs[i].dxp_slot);
+	}
+}
+
 static
 void
 swapbits(uint8_t *bits)
@@ -521,6 +556,10 @@ check_sb(void)
 	if (sp.sp_magic != SFS_MAGIC) {
 		errx(EXIT_UNRECOV, "Not an sfs filesystem");
 	}
+	if (sp.sp_flags & ~(SFS_SUPER_EXTENTS | SFS_SUPER_DIRINDEX)) {
+		errx(EXIT_UNRECOV, "Unknown superblock flags 0x%lx",
+		     (unsigned long) sp.sp_flags);
+	}
 
 	assert(nblocks==0);
 	assert(bitblocks==0);
@@ -631,6 +670,119 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 	}
 }
 
+/*
+ * check_inode_blocks for an inode mapped by extents. Returns nonzero
+ * if the inode was modified.
+ */
+static
+int
+check_inode_extents(uint32_t ino, struct sfs_inode *sfi, int isdir)
+{
+	struct sfs_extent *se;
+	uint32_t size, fileblocks, base, keep, badcount, i, j;
+	int ichanged = 0, haspointers = 0;
+
+	/* The block pointers aren't used */
+	for (i=0; i<SFS_NDIRECT; i++) {
+		if (sfi->sfi_direct[i] != 0) {
+			haspointers = 1;
+			sfi->sfi_direct[i] = 0;
+		}
+	}
+	if (sfi->sfi_indirect != 0 || sfi->sfi_dindirect != 0 ||
+	    sfi->sfi_tindirect != 0) {
+		haspointers = 1;
+		sfi->sfi_indirect = 0;
+		sfi->sfi_dindirect = 0;
+		sfi->sfi_tindirect = 0;
+	}
+	if (haspointers) {
+		warnx("Inode %lu: block pointers in extent-mapped inode "
+		      "(cleared)", (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		ichanged = 1;
+	}
+
+	if (sfi->sfi_nextents > SFS_NEXTENTS) {
+		warnx("Inode %lu: %lu extents (only %d used)",
+		      (unsigned long) ino, (unsigned long) sfi->sfi_nextents,
+		      SFS_NEXTENTS);
+		setbadness(EXIT_RECOV);
+		sfi->sfi_nextents = SFS_NEXTENTS;
+		ichanged = 1;
+	}
+
+	/*
+	 * The extents map the file in order, so a bad one loses the
+	 * ones after it too; their blocks get freed with any others
+	 * nobody turns out to be using.
+	 */
+	for (i=0; i<sfi->sfi_nextents; i++) {
+		se = &sfi->sfi_extents[i];
+		if (se->sfe_start == 0 || se->sfe_len == 0 ||
+		    se->sfe_start >= nblocks ||
+		    se->sfe_len > nblocks - se->sfe_start) {
+			warnx("Inode %lu: invalid extent %lu (%lu blocks at "
+			      "%lu; dropped with the ones after it)",
+			      (unsigned long) ino, (unsigned long) i,
+			      (unsigned long) se->sfe_len,
+			      (unsigned long) se->sfe_start);
+			setbadness(EXIT_RECOV);
+			sfi->sfi_nextents = i;
+			ichanged = 1;
+			break;
+		}
+	}
+
+	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
+	fileblocks = size/SFS_BLOCKSIZE;
+
+	badcount = 0;
+	base = 0;
+	for (i=0; i<sfi->sfi_nextents; i++) {
+		se = &sfi->sfi_extents[i];
+		keep = se->sfe_len;
+		if (base + se->sfe_len > fileblocks) {
+			keep = (fileblocks > base) ? fileblocks - base : 0;
+		}
+		for (j=0; j<se->sfe_len; j++) {
+			if (j < keep) {
+				bitmap_mark(se->sfe_start + j,
+					    isdir ? B_DIRDATA : B_DATA, ino);
+			}
+			else {
+				badcount++;
+				bitmap_mark(se->sfe_start + j, B_TOFREE, 0);
+			}
+		}
+		base += se->sfe_len;
+		se->sfe_len = keep;
+	}
+
+	/* Extents past EOF are now empty; drop them */
+	while (sfi->sfi_nextents > 0 &&
+	       sfi->sfi_extents[sfi->sfi_nextents-1].sfe_len == 0) {
+		sfi->sfi_nextents--;
+	}
+	for (i=sfi->sfi_nextents; i<SFS_NEXTENTS; i++) {
+		se = &sfi->sfi_extents[i];
+		if (se->sfe_start != 0 || se->sfe_len != 0) {
+			se->sfe_start = 0;
+			se->sfe_len = 0;
+			ichanged = 1;
+		}
+	}
+
+	if (badcount > 0) {
+		warnx("Inode %lu: %lu blocks after EOF (freed)", 
+		     (unsigned long) ino, (unsigned long) badcount);
+		setbadness(EXIT_RECOV);
+		ichanged = 1;
+	}
+
+	return ichanged;
+}
+
 /* returns nonzero if inode modified */
 static
 int
@@ -638,6 +790,15 @@ check_inode_blocks(uint32_t ino, struct sfs_inode *sfi, int isdir)
 {
 	uint32_t size, block, nblocks, badcount;
 
+	if (sfi->sfi_flags & ~SFS_IF_EXTENTS) {
+		warnx("Inode %lu: unknown flags 0x%lx (NOT FIXED)",
+		      (unsigned long) ino, (unsigned long) sfi->sfi_flags);
+		setbadness(EXIT_UNRECOV);
+	}
+	if (sfi->sfi_flags & SFS_IF_EXTENTS) {
+		return check_inode_extents(ino, sfi, isdir);
+	}
+
 	badcount = 0;
 
 	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
@@ -766,21 +927,33 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 #endif
 #endif
 
-#define BMAP_DMAX   BMAP_ND
-#define BMAP_IMAX   (BMAP_DMAX+SFS_DBPERIDB*BMAP_NI)
-#define BMAP_IIMAX  (BMAP_IMAX+SFS_DBPERIDB*BMAP_NII)
-#define BMAP_IIIMAX (BMAP_IIMAX+SFS_DBPERIDB*BMAP_NIII)
-
 #define BMAP_DSIZE	1
 #define BMAP_ISIZE	(BMAP_DSIZE*SFS_DBPERIDB)
 #define BMAP_IISIZE	(BMAP_ISIZE*SFS_DBPERIDB)
 #define BMAP_IIISIZE	(BMAP_IISIZE*SFS_DBPERIDB)
 
+/* Each indirect block of a level maps that level's SIZE blocks */
+#define BMAP_DMAX   BMAP_ND
+#define BMAP_IMAX   (BMAP_DMAX+BMAP_ISIZE*BMAP_NI)
+#define BMAP_IIMAX  (BMAP_IMAX+BMAP_IISIZE*BMAP_NII)
+#define BMAP_IIIMAX (BMAP_IIMAX+BMAP_IIISIZE*BMAP_NIII)
+
 static
 uint32_t
 dobmap(const struct sfs_inode *sfi, uint32_t fileblock)
 {
-	uint32_t iblock, offset;
+	uint32_t iblock, offset, i;
+
+	if (sfi->sfi_flags & SFS_IF_EXTENTS) {
+		for (i=0; i<sfi->sfi_nextents; i++) {
+			if (fileblock < sfi->sfi_extents[i].sfe_len) {
+				return sfi->sfi_extents[i].sfe_start +
+					fileblock;
+			}
+			fileblock -= sfi->sfi_extents[i].sfe_len;
+		}
+		return 0;
+	}
 
 	if (fileblock < BMAP_DMAX) {
 		return BMAP_D(sfi, fileblock);
@@ -803,13 +976,14 @@ dobmap(const struct sfs_inode *sfi, uint32_t fileblock)
 	return 0;
 }
 
+/* returns the number of blocks missing from the directory */
 static
-void
+unsigned
 dirread(struct sfs_inode *sfi, struct sfs_dir *d, unsigned nd)
 {
 	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
-	unsigned i, j;
+	unsigned i, j, nholes = 0;
 
 	for (i=0; i<nblocks; i++) {
 		uint32_t block = dobmap(sfi, i);
@@ -822,8 +996,10 @@ dirread(struct sfs_inode *sfi, struct sfs_dir *d, unsigned nd)
 		else {
 			warnx("Warning: sparse directory found");
 			bzero(d + i*atonce, SFS_BLOCKSIZE);
+			nholes++;
 		}
 	}
+	return nholes;
 }
 
 static
@@ -966,6 +1142,305 @@ check_dir_entry(const char *pathsofar, uint32_t index, struct sfs_dir *sfd)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Directory indexes. These must hash and place names the same way the
+ * kernel does (sfs_dix_hash and sfs_dix_bucketadd in sfs_vnode.c).
+ */
+
+static
+uint32_t
+dix_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return (h == 0) ? 1 : h;
+}
+
+/* returns 0 on success; marks the bucket overflowed if it's full */
+static
+int
+dix_bucketadd(struct sfs_dixbucket *db, uint32_t hash, uint32_t slot)
+{
+	unsigned i;
+
+	if (db->dxb_count == SFS_DIX_NPAIRS) {
+		db->dxb_overflow = 1;
+		return -1;
+	}
+	for (i=0; db->dxb_pairs[i].dxp_hash != 0; i++) {
+		assert(i < SFS_DIX_NPAIRS);
+	}
+	db->dxb_pairs[i].dxp_hash = hash;
+	db->dxb_pairs[i].dxp_slot = slot;
+	db->dxb_count++;
+	return 0;
+}
+
+/*
+ * Check the buckets of an index against the directory entries D.
+ * Returns NULL if they agree, or what's wrong.
+ */
+static
+const char *
+dix_checkbuckets(const struct sfs_dixheader *dh, struct sfs_dixbucket *buckets,
+		 struct sfs_dir *d, uint32_t nd)
+{
+	struct sfs_dixpair *dp;
+	uint8_t *seen;
+	uint32_t nbuckets = dh->dxh_nbuckets;
+	uint32_t nentries, count, b, i, j;
+	const char *why = NULL;
+
+	seen = domalloc(nd+1);
+	bzero(seen, nd+1);
+
+	nentries = 0;
+	for (i=0; i<nbuckets && why==NULL; i++) {
+		count = 0;
+		for (j=0; j<SFS_DIX_NPAIRS && why==NULL; j++) {
+			dp = &buckets[i].dxb_pairs[j];
+			if (dp->dxp_hash == 0) {
+				continue;
+			}
+			count++;
+			if (dp->dxp_slot >= nd ||
+			    d[dp->dxp_slot].sfd_ino == SFS_NOINO ||
+			    dix_hash(d[dp->dxp_slot].sfd_name) !=
+			    dp->dxp_hash) {
+				why = "refers to the wrong entries";
+				break;
+			}
+			if (seen[dp->dxp_slot]) {
+				why = "has duplicate entries";
+				break;
+			}
+			seen[dp->dxp_slot] = 1;
+			nentries++;
+
+			/* lookups must get here from the pair's own bucket */
+			for (b = dp->dxp_hash & (nbuckets-1); b != i;
+			     b = (b + 1) & (nbuckets-1)) {
+				if (!buckets[b].dxb_overflow) {
+					why = "has misplaced entries";
+					break;
+				}
+			}
+		}
+		if (why == NULL && count != buckets[i].dxb_count) {
+			why = "has wrong bucket counts";
+		}
+	}
+
+	for (i=0; i<nd && why==NULL; i++) {
+		if (d[i].sfd_ino != SFS_NOINO && !seen[i]) {
+			why = "is missing entries";
+		}
+	}
+	if (why == NULL && nentries != dh->dxh_nentries) {
+		why = "has the wrong entry count";
+	}
+	if (why == NULL) {
+		if (dh->dxh_freehint > nd) {
+			why = "has a bad free slot hint";
+		}
+		for (i=0; i<dh->dxh_freehint && why==NULL; i++) {
+			if (d[i].sfd_ino == SFS_NOINO) {
+				why = "has a bad free slot hint";
+			}
+		}
+	}
+
+	free(seen);
+	return why;
+}
+
+/*
+ * Fill in a fresh index with NBUCKETS buckets for the entries in D.
+ * Returns 0 on success, or -1 if they don't fit.
+ */
+static
+int
+dix_build(struct sfs_dixheader *dh, struct sfs_dixbucket *buckets,
+	  uint32_t nbuckets, struct sfs_dir *d, uint32_t nd)
+{
+	uint32_t hash, bucket, i, n;
+
+	bzero(dh, sizeof(*dh));
+	bzero(buckets, nbuckets * sizeof(struct sfs_dixbucket));
+	dh->dxh_magic = SFS_DIX_MAGIC;
+	dh->dxh_nbuckets = nbuckets;
+	dh->dxh_freehint = nd;
+
+	for (i=0; i<nd; i++) {
+		if (d[i].sfd_ino == SFS_NOINO) {
+			if (dh->dxh_freehint == nd) {
+				dh->dxh_freehint = i;
+			}
+			continue;
+		}
+		hash = dix_hash(d[i].sfd_name);
+		bucket = hash & (nbuckets - 1);
+		for (n=0; n<nbuckets; n++) {
+			if (dix_bucketadd(&buckets[bucket], hash, i)==0) {
+				break;
+			}
+			bucket = (bucket + 1) & (nbuckets - 1);
+		}
+		if (n == nbuckets) {
+			return -1;
+		}
+		dh->dxh_nentries++;
+	}
+	return 0;
+}
+
+/*
+ * Check the index (if any) of the directory whose inode is SFI and
+ * whose (already checked) entries are D. A broken index is rebuilt in
+ * the blocks it already has, or failing that dropped, in which case
+ * its blocks get freed with any others nobody's using. If blocks of
+ * the directory were missing (SPARSE), we don't know what was in
+ * them, so the index is dropped rather than rebuilt without them.
+ * Returns nonzero if SFI was modified.
+ */
+static
+int
+check_dirindex(struct sfs_inode *sfi, struct sfs_dir *d, uint32_t nd,
+	       int sparse, const char *pathsofar)
+{
+	struct sfs_inode xsfi;
+	struct sfs_dixheader dh;
+	struct sfs_dixbucket *buckets;
+	uint32_t xino = sfi->sfi_dirindex;
+	uint32_t nbuckets, fileblocks, i;
+	const char *why = NULL;
+	int xchanged = 0;
+
+	if (xino == 0) {
+		return 0;
+	}
+	if (sparse) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory /%s: index of sparse directory (dropped)",
+		      pathsofar);
+		sfi->sfi_dirindex = 0;
+		return 1;
+	}
+	if (xino >= nblocks) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory /%s: index inode %lu out of range (dropped)",
+		      pathsofar, (unsigned long) xino);
+		sfi->sfi_dirindex = 0;
+		return 1;
+	}
+
+	diskread(&xsfi, xino);
+	swapinode(&xsfi);
+	if (xsfi.sfi_type != SFS_TYPE_DIRINDEX) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory /%s: index inode %lu has wrong type "
+		      "(dropped)", pathsofar, (unsigned long) xino);
+		sfi->sfi_dirindex = 0;
+		return 1;
+	}
+
+	bitmap_mark(xino, B_INODE, xino);
+	if (xsfi.sfi_dirindex != 0) {
+		xsfi.sfi_dirindex = 0;
+		xchanged = 1;
+	}
+	if (xsfi.sfi_linkcount != 1) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory /%s: index link count %lu should be 1 "
+		      "(fixed)", pathsofar,
+		      (unsigned long) xsfi.sfi_linkcount);
+		xsfi.sfi_linkcount = 1;
+		xchanged = 1;
+	}
+	if (check_inode_blocks(xino, &xsfi, 0)) {
+		xchanged = 1;
+	}
+	fileblocks = SFS_ROUNDUP(xsfi.sfi_size, SFS_BLOCKSIZE)/SFS_BLOCKSIZE;
+
+	/* Read the header, and if it looks sane, the buckets */
+	bzero(&dh, sizeof(dh));
+	if (fileblocks > 0 && dobmap(&xsfi, 0) != 0) {
+		diskread(&dh, dobmap(&xsfi, 0));
+		swapdixheader(&dh);
+	}
+	nbuckets = dh.dxh_nbuckets;
+	if (dh.dxh_magic != SFS_DIX_MAGIC || nbuckets == 0 ||
+	    (nbuckets & (nbuckets-1)) != 0 || nbuckets >= fileblocks) {
+		why = "has a bad header";
+		/* use as many buckets as fit in the file */
+		for (nbuckets = 1; 1 + 2*nbuckets <= fileblocks; ) {
+			nbuckets *= 2;
+		}
+		if (1 + nbuckets > fileblocks) {
+			nbuckets = 0;
+		}
+	}
+	for (i=0; i<1+nbuckets && nbuckets > 0; i++) {
+		if (dobmap(&xsfi, i) == 0) {
+			/* can't fix that in place */
+			nbuckets = 0;
+		}
+	}
+	if (nbuckets == 0) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory /%s: index is unusable (dropped)",
+		      pathsofar);
+		if (xchanged) {
+			swapinode(&xsfi);
+			diskwrite(&xsfi, xino);
+		}
+		sfi->sfi_dirindex = 0;
+		return 1;
+	}
+
+	buckets = domalloc(nbuckets * sizeof(struct sfs_dixbucket));
+	if (why == NULL) {
+		for (i=0; i<nbuckets; i++) {
+			diskread(&buckets[i], dobmap(&xsfi, 1+i));
+			swapdixbucket(&buckets[i]);
+		}
+		why = dix_checkbuckets(&dh, buckets, d, nd);
+	}
+
+	if (why != NULL) {
+		setbadness(EXIT_RECOV);
+		if (dix_build(&dh, buckets, nbuckets, d, nd)) {
+			warnx("Directory /%s: index %s and is too small to "
+			      "rebuild (dropped)", pathsofar, why);
+			sfi->sfi_dirindex = 0;
+			free(buckets);
+			if (xchanged) {
+				swapinode(&xsfi);
+				diskwrite(&xsfi, xino);
+			}
+			return 1;
+		}
+		warnx("Directory /%s: index %s (rebuilt)", pathsofar, why);
+		swapdixheader(&dh);
+		diskwrite(&dh, dobmap(&xsfi, 0));
+		for (i=0; i<nbuckets; i++) {
+			swapdixbucket(&buckets[i]);
+			diskwrite(&buckets[i], dobmap(&xsfi, 1+i));
+		}
+	}
+	free(buckets);
+
+	if (xchanged) {
+		swapinode(&xsfi);
+		diskwrite(&xsfi, xino);
+	}
+	return 0;
+}
+
 static
 int
 check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
@@ -974,7 +1449,7 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	struct sfs_dir *direntries;
 	int *sortvector;
 	uint32_t dirsize, ndirentries, maxdirentries, subdircount, i;
-	int ichanged=0, dchanged=0, dotseen=0, dotdotseen=0;
+	int ichanged=0, dchanged=0, dotseen=0, dotdotseen=0, sparse;
 
 	diskread(&sfi, ino);
 	swapinode(&sfi);
@@ -1007,7 +1482,7 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	direntries = domalloc(dirsize);
 	sortvector = domalloc(ndirentries * sizeof(int));
 
-	dirread(&sfi, direntries, ndirentries);
+	sparse = dirread(&sfi, direntries, ndirentries) > 0;
 	for (i=ndirentries; i<maxdirentries; i++) {
 		direntries[i].sfd_ino = SFS_NOINO;
 		bzero(direntries[i].sfd_name, sizeof(direntries[i].sfd_name));
@@ -1141,6 +1616,7 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		else {
 			char path[strlen(pathsofar)+SFS_NAMELEN+1];
 			struct sfs_inode subsfi;
+			int fchanged = 0;
 
 			diskread(&subsfi, direntries[i].sfd_ino);
 			swapinode(&subsfi);
@@ -1149,8 +1625,18 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 
 			switch (subsfi.sfi_type) {
 			    case SFS_TYPE_FILE:
+				if (subsfi.sfi_dirindex != 0) {
+					setbadness(EXIT_RECOV);
+					warnx("File /%s has a directory index "
+					      "(removed)", path);
+					subsfi.sfi_dirindex = 0;
+					fchanged = 1;
+				}
 				if (check_inode_blocks(direntries[i].sfd_ino,
 						       &subsfi, 0)) {
+					fchanged = 1;
+				}
+				if (fchanged) {
 					swapinode(&subsfi);
 					diskwrite(&subsfi, 
 						  direntries[i].sfd_ino);
@@ -1194,6 +1680,11 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		ichanged = 1;
 	}
 
+	if (check_dirindex(&sfi, direntries, ndirentries, sparse,
+			   pathsofar)) {
+		ichanged = 1;
+	}
+
 	if (dchanged) {
 		dirwrite(&sfi, direntries, ndirentries);
 	}
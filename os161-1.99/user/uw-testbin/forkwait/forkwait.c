@@ -0,0 +1,50 @@
+/*
+ * forkwait - fork and reap many children, one at a time.
+ *
+ *  relies on fork, waitpid and _exit
+ *
+ *  each child exits at once with a status the parent checks; after
+ *  NCYCLES rounds the parent prints "forkwait done". Nothing from the
+ *  children should be left over afterwards, so run it from the kernel
+ *  menu as "lk /uw-testbin/forkwait" to check the kernel heap,
+ *  physical memory and the zombie count don't grow.
+ *
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+#define NCYCLES 10000
+
+int
+main(int argc, char *argv[])
+{
+  (void)argc;
+  (void)argv;
+  pid_t pid;
+  int i, rval;
+
+  for (i = 0; i < NCYCLES; i++) {
+    pid = fork();
+    if (pid < 0) {
+      err(1, "fork %d", i);
+    }
+    else if (pid == 0) {
+      /* child */
+      _exit(i % 256);
+    }
+    if (waitpid(pid, &rval, 0) < 0) {
+      err(1, "waitpid %d", i);
+    }
+    if (!WIFEXITED(rval) || WEXITSTATUS(rval) != i % 256) {
+      errx(1, "child %d: wrong exit status", i);
+    }
+    if (i % 1000 == 999) {
+      printf("%d\n", i + 1);
+    }
+  }
+  printf("forkwait done\n");
+  return(0);
+}
@@ -0,0 +1,149 @@
+/*
+ * proctable - fill the process table, then check pids get reused.
+ *
+ *  relies on fork, waitpid, getpid and _exit
+ *
+ *  fill: each process forks one child and waits for it, so the chain
+ *  grows until fork fails. That has to be with ENPROC, not ENOMEM or
+ *  anything else, and with every slot in use: run it from the kernel
+ *  menu so nothing else holds one. The table is filled twice, to
+ *  check that reaping the chain gave back every slot.
+ *
+ *  A full table needs about 7MB of kernel memory that can't be paged
+ *  out, more than sys161.conf has, so use root/proc161.conf:
+ *
+ *    sys161 -c proc161.conf kernel "p /uw-testbin/proctable;q"
+ *
+ *  reuse: fork and reap one child at a time until the first child's
+ *  pid comes round again. Every pid must be in range.
+ *
+ *  prints "proctable done" if all went well.
+ *
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <err.h>
+
+/* must match PROCTABLE_SIZE in kern/proc/proc.c */
+#define NPROCS 512
+
+/* more than enough fork/waits to go round every pid */
+#define MAXCYCLES (2 * (PID_MAX + 1))
+
+/* exit codes from the end of the chain */
+#define FULL_OK     0
+#define FULL_ERRNO  1
+
+/*
+ * Extend the chain from a process DEPTH deep. The end of the chain
+ * exits FULL_OK if fork failed the way it should; the rest wait for
+ * their child and exit with its status.
+ */
+static
+void
+grow(int depth)
+{
+  pid_t pid;
+  int rval;
+
+  pid = fork();
+  if (pid < 0) {
+    if (errno != ENPROC) {
+      warn("fork at depth %d", depth);
+      _exit(FULL_ERRNO);
+    }
+    /* this process and its ancestors fill the table */
+    if (depth != NPROCS) {
+      warnx("fork failed with %d processes, not %d", depth, NPROCS);
+      _exit(FULL_ERRNO);
+    }
+    _exit(FULL_OK);
+  }
+  else if (pid == 0) {
+    grow(depth + 1);
+    /* NOTREACHED */
+  }
+  if (waitpid(pid, &rval, 0) < 0) {
+    warn("waitpid at depth %d", depth);
+    _exit(FULL_ERRNO);
+  }
+  _exit(WIFEXITED(rval) ? WEXITSTATUS(rval) : FULL_ERRNO);
+}
+
+static
+void
+fill(int pass)
+{
+  pid_t pid;
+  int rval;
+
+  pid = fork();
+  if (pid < 0) {
+    err(1, "fork");
+  }
+  else if (pid == 0) {
+    /* we're the second process in the table */
+    grow(2);
+  }
+  if (waitpid(pid, &rval, 0) < 0) {
+    err(1, "waitpid");
+  }
+  if (!WIFEXITED(rval) || WEXITSTATUS(rval) != FULL_OK) {
+    errx(1, "fill %d failed", pass);
+  }
+  printf("fill %d: table full at %d processes\n", pass, NPROCS);
+}
+
+static
+pid_t
+forkwait(void)
+{
+  pid_t pid;
+  int rval;
+
+  pid = fork();
+  if (pid < 0) {
+    err(1, "fork");
+  }
+  else if (pid == 0) {
+    _exit(0);
+  }
+  if (pid < PID_MIN || pid > PID_MAX) {
+    errx(1, "pid %d out of range", pid);
+  }
+  if (waitpid(pid, &rval, 0) < 0) {
+    err(1, "waitpid %d", pid);
+  }
+  return pid;
+}
+
+int
+main(int argc, char *argv[])
+{
+  (void)argc;
+  (void)argv;
+  pid_t first, pid;
+  int i;
+
+  fill(1);
+  fill(2);
+
+  first = forkwait();
+  for (i = 1; i < MAXCYCLES; i++) {
+    pid = forkwait();
+    if (pid == first) {
+      break;
+    }
+  }
+  if (i == MAXCYCLES) {
+    errx(1, "pid %d not reused in %d forks", first, MAXCYCLES);
+  }
+  printf("pid %d reused after %d forks\n", first, i);
+
+  printf("proctable done\n");
+  return(0);
+}
@@ -0,0 +1,12 @@
+#!/bin/bash
+
+# Run programs that need more memory than swap161.conf provides and
+# show the paging counters the kernel prints at shutdown.
+
+TESTS=${@:-"testbin/triplehuge testbin/triplemat"}
+
+for TEST in ${TESTS}
+do
+    echo "=== ${TEST} ==="
+    sys161 -c swap161.conf kernel "p ${TEST};q" | grep -E "VMSTAT|WARNING|swap:|Fatal|panic"
+done